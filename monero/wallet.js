@@ -39,7 +39,7 @@ class XMRWallet extends Wallet {
 	initViewWallet(address, viewKey) {
 		return this.backoff(async () => {
 			this.log.info(`Loading view wallet for address ${address}`);
-			this.xmr.setCallbacks(this._onTx.bind(this), this._onBlock.bind(this));
+			this.xmr.setCallbacks(this._onTx.bind(this), this._onBlock.bind(this), this._onStore.bind(this));
 			this.xmr.openViewWallet(address, viewKey);
 
 			this.log.debug('Preparing connection');
@@ -107,7 +107,7 @@ class XMRWallet extends Wallet {
 
 			if (!this.lastSaved || (Date.now() - this.lastSaved) > 5 * 60000) {
 				this.lastSaved = Date.now();
-				this.xmr.store();
+				this.xmr.store(true);
 			}
 		}
 	}
@@ -217,7 +217,13 @@ class XMRWallet extends Wallet {
 		return this.height * 10;
 	}
 
-	async createUnsignedTransaction (tx) {
+	/**
+	 * Validates a Tx before it goes to the native wallet, defaulting its priority.
+	 *
+	 * @throws {Wallet.Error} if tx is not a Tx instance or has invalid priority
+	 * @return {Wallet.Error} error the tx cannot be created with, null if it's valid
+	 */
+	validateTx (tx) {
 		if (!(tx instanceof Wallet.Tx)) {
 			throw new Wallet.Error(Wallet.Errors.VALIDATION, 'createUnsignedTransaction argument must be Tx instance');
 		}
@@ -231,7 +237,42 @@ class XMRWallet extends Wallet {
 		}
 
 		if (tx.operations.filter(o => o.amount <= 0).length) {
-			return {error: new Wallet.Error(Wallet.Errors.NOT_ENOUGH_AMOUNT, 'Operation amount must be greater than 0')};
+			return new Wallet.Error(Wallet.Errors.NOT_ENOUGH_AMOUNT, 'Operation amount must be greater than 0');
+		}
+
+		return null;
+	}
+
+	/**
+	 * Converts a validated Tx into the object native createUnsignedTransaction(s) takes.
+	 *
+	 * @throws {Wallet.Error} if operations have different payment ids
+	 */
+	txToNative (tx) {
+		let json = tx.toJSON();
+		json.destinations = json.operations.map(op => {
+			if (op.paymentId && json.paymentId && op.paymentId !== json.paymentId) {
+				throw new Wallet.Error(Wallet.Errors.EXCEPTION, 'Multiple paymentIds in operations');
+			} 
+			json.paymentId = op.paymentId;
+			return ['' + op.amount, op.to];
+		});
+		delete json.operations;
+		return json;
+	}
+
+	nativeError (error) {
+		if (error in Wallet.Errors) {
+			return new Wallet.Error(Wallet.Errors[error]);
+		} else {
+			return new Wallet.Error(Wallet.Errors.EXCEPTION, error);
+		}
+	}
+
+	async createUnsignedTransaction (tx) {
+		let error = this.validateTx(tx);
+		if (error) {
+			return {error: error};
 		}
 
 		try {
@@ -239,36 +280,14 @@ class XMRWallet extends Wallet {
 				return {error: new Wallet.Error(Wallet.Errors.NOT_ENOUGH_FUNDS)};
 			}
 
-			let json = tx.toJSON();
-			json.destinations = json.operations.map(op => {
-				if (op.paymentId && json.paymentId && op.paymentId !== json.paymentId) {
-					throw new Wallet.Error(Wallet.Errors.EXCEPTION, 'Multiple paymentIds in operations');
-				} 
-				json.paymentId = op.paymentId;
-				return ['' + op.amount, op.to];
-			});
-			delete json.operations;
-
-			// let hasPid = false;
-			// json.operations.forEach(op => {
-			// 	if (hasPid) {
-			// 		throw new Wallet.Error(Wallet.Errors.VALIDATION, 'Cannot have more than 1 paymentId in 1 transaction');
-			// 	} else if (op.paymentId) {
-			// 		hasPid = true;
-			// 		json.
-			// 	}
-			// });
+			let json = this.txToNative(tx);
 
 			this.log.debug(`Creating tx ${tx._id} in ${this.address()}: ${JSON.stringify(json)}`);
 			let result = this.xmr.createUnsignedTransaction(json, true);
 			this.log.debug(`Transaction creation returned ${Object.keys(result)}`);
 
 			if (result.error) {
-				if (result.error in Wallet.Errors) {
-					result.error = new Wallet.Error(Wallet.Errors[result.error]);
-				} else {
-					result.error = new Wallet.Error(Wallet.Errors.EXCEPTION, result.error);
-				}
+				result.error = this.nativeError(result.error);
 			}
 			return result;
 		} catch (e) {
@@ -277,6 +296,61 @@ class XMRWallet extends Wallet {
 		}
 	}
 
+	/**
+	 * Plans many payouts into one unsigned bundle, see createUnsignedTransaction for each Tx requirements.
+	 * Payouts over the unlocked balance (in array order) fail with NOT_ENOUGH_FUNDS without reaching native code.
+	 *
+	 * @param {Array} txs array of Tx instances
+	 * @return {Object} {unsigned, errors} or {error, errors}, errors has one entry per tx: null or Wallet.Error
+	 */
+	async createUnsignedTransactions (txs) {
+		if (!Array.isArray(txs) || txs.filter(tx => !(tx instanceof Wallet.Tx)).length) {
+			throw new Wallet.Error(Wallet.Errors.VALIDATION, 'createUnsignedTransactions argument must be an array of Tx instances');
+		}
+
+		let errors = txs.map(tx => this.validateTx(tx));
+
+		try {
+			let balance = await this.currentBalance(), planned = 0, jsons = [], indexes = [];
+			txs.forEach((tx, i) => {
+				if (errors[i]) {
+					return;
+				}
+				if (planned + tx.amount > balance) {
+					errors[i] = new Wallet.Error(Wallet.Errors.NOT_ENOUGH_FUNDS);
+					return;
+				}
+				try {
+					jsons.push(this.txToNative(tx));
+					indexes.push(i);
+					planned += tx.amount;
+				} catch (e) {
+					errors[i] = e;
+				}
+			});
+
+			if (!jsons.length) {
+				return {error: errors.find(e => !!e) || new Wallet.Error(Wallet.Errors.VALIDATION, 'No transactions to create'), errors: errors};
+			}
+
+			this.log.debug(`Creating ${jsons.length} of ${txs.length} txs in ${this.address()}`);
+			let result = this.xmr.createUnsignedTransactions(jsons, true);
+			this.log.debug(`Batch transaction creation returned ${Object.keys(result)}`);
+
+			if (result.error) {
+				result.error = this.nativeError(result.error);
+			}
+			result.errors.forEach((error, n) => {
+				errors[indexes[n]] = error ? this.nativeError(error) : null;
+			});
+			result.errors = errors;
+			return result;
+		} catch (e) {
+			this.log.error(e, 'Error in batch tx creation');
+			throw new Wallet.Error(Wallet.Errors.EXCEPTION, e.message);
+		}
+	}
+
 	signTransaction (data) {
 		if (typeof data !== 'string') {
 			throw new Wallet.Error(Wallet.Errors.VALIDATION, 'signTransaction argument must be a string');
@@ -287,11 +361,10 @@ class XMRWallet extends Wallet {
 			this.log.debug(`Transaction signing returned ${Object.keys(result)}`);
 
 			if (result.error) {
-				if (result.error in Wallet.Errors) {
-					result.error = new Wallet.Error(Wallet.Errors[result.error]);
-				} else {
-					result.error = new Wallet.Error(Wallet.Errors.EXCEPTION, result.error);
-				}
+				result.error = this.nativeError(result.error);
+			}
+			if (result.errors) {
+				result.errors = result.errors.map(error => error ? this.nativeError(error) : null);
 			}
 			return result;
 		} catch (e) {
@@ -450,6 +523,12 @@ class XMRWallet extends Wallet {
 		this.height = height;
 	}
 
+	_onStore (error) {
+		if (error) {
+			this.log.error(`Background store failed: ${error}`);
+		}
+	}
+
 
 	/**
 	 * Just create random wallet
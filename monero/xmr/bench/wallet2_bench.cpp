@@ -0,0 +1,244 @@
+// Timing driver for wallet2 hot paths on synthetic wallets, no daemon needed.
+//
+//   xmr_bench reorg [transfers] [depth]
+//   xmr_bench select [transfers] [inputs]
+//   xmr_bench store [transfers]
+//   xmr_bench load [transfers]
+//   xmr_bench blob [megabytes]
+
+#include <chrono>
+#include <iostream>
+#include <list>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "wallet/wallet2.h"
+#include "xmrwallet.h"
+
+namespace tools {
+
+	// wallet2 with a fabricated history, protected state is filled directly as load() would
+	class BenchWallet : public wallet2 {
+		public:
+			BenchWallet() : wallet2(true) {}
+
+			// transfers spread over blocks, every 4th one spent, every 8th paid to the null payment id
+			void fill(size_t transfers, size_t per_block) {
+				clear();
+				size_t blocks = transfers / per_block + 2;
+				for (size_t h = 0; h < blocks; h++) {
+					m_blockchain.push_back(crypto::rand<crypto::hash>());
+				}
+				m_local_bc_height = m_blockchain.size();
+
+				for (size_t i = 0; i < transfers; i++) {
+					std::shared_ptr<cryptonote::transaction_prefix> tx = std::make_shared<cryptonote::transaction_prefix>();
+					tx->vout.resize(1);
+					tx->vout[0].target = cryptonote::txout_to_key(crypto::rand<crypto::public_key>());
+
+					transfer_details td = AUTO_VAL_INIT(td);
+					td.m_block_height = 1 + i / per_block;
+					td.m_txid = crypto::rand<crypto::hash>();
+					td.m_internal_output_index = 0;
+					td.set_tx(tx);
+					td.m_global_output_index = i;
+					td.m_key_image = crypto::rand<crypto::key_image>();
+					td.m_key_image_known = true;
+					td.m_mask = rct::identity();
+					td.m_amount = 1000000 + i;
+					td.m_rct = true;
+					td.m_spent = i % 4 == 0;
+					td.m_spent_height = td.m_spent ? td.m_block_height + 1 : 0;
+
+					m_key_images[td.m_key_image] = i;
+					m_pub_keys[td.get_public_key()] = i;
+					m_transfers.push_back(td);
+
+					payment_details pd = AUTO_VAL_INIT(pd);
+					pd.m_tx_hash = td.m_txid;
+					pd.m_amount = td.m_amount;
+					pd.m_block_height = td.m_block_height;
+					m_payments.emplace(i % 8 == 0 ? crypto::null_hash : crypto::rand<crypto::hash>(), pd);
+				}
+				rebuild_indexes();
+			}
+
+			void detach(uint64_t height) { detach_blockchain(height); }
+
+			// the way transfer_selected picks inputs: one pop_best_value_from per input, against those picked so far
+			size_t select(size_t inputs, bool smallest) {
+				std::vector<size_t> unused;
+				for (size_t i = 0; i < m_transfers.size(); i++) {
+					if (!m_transfers[i].m_spent) {
+						unused.push_back(i);
+					}
+				}
+				std::list<size_t> selected;
+				while (selected.size() < inputs && !unused.empty()) {
+					selected.push_back(pop_best_value_from(m_transfers, unused, selected, smallest));
+				}
+				return selected.size();
+			}
+
+			uint64_t height() const { return m_blockchain.size(); }
+			size_t transfers() const { return m_transfers.size(); }
+
+			// the cache file as store() rewrites it when compacting, file size in bytes
+			size_t save(const std::string &file) {
+				std::vector<std::pair<cache_chunk, std::string>> chunks;
+				capture_cache(chunks);
+				write_cache_file(chunks, file, false);
+				return boost::filesystem::file_size(file);
+			}
+
+			// and back the way load() reads it, keys file and journal aside
+			void open(const std::string &file) {
+				clear();
+				crypto::chacha8_key key;
+				generate_chacha8_key_from_secret_keys(key);
+				load_cache_file(std::make_shared<boost::iostreams::mapped_file_source>(file), key);
+				m_local_bc_height = m_blockchain.size();
+				rebuild_indexes();
+				share_tx_prefixes();
+			}
+	};
+}
+
+namespace {
+
+	typedef std::chrono::steady_clock bench_clock;
+
+	double ms_since(bench_clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+	}
+
+	size_t arg(int argc, char **argv, int i, size_t def) {
+		return argc > i ? std::stoul(argv[i]) : def;
+	}
+
+	// detach_blockchain of the last `depth` blocks, which should cost the same on a small and a big wallet
+	void bench_reorg(size_t transfers, size_t depth) {
+		tools::BenchWallet wallet;
+		const size_t rounds = 20;
+		double total = 0;
+		for (size_t r = 0; r < rounds; r++) {
+			wallet.fill(transfers, 4);
+			bench_clock::time_point start = bench_clock::now();
+			wallet.detach(wallet.height() - depth);
+			total += ms_since(start);
+		}
+		std::cout << "reorg: " << transfers << " transfers, depth " << depth << ": " << total / rounds << " ms per detach" << std::endl;
+	}
+
+	// input selection over a big history, random picks (the default) and smallest first
+	void bench_select(size_t transfers, size_t inputs) {
+		tools::BenchWallet wallet;
+		wallet.fill(transfers, 4);
+		for (bool smallest: {false, true}) {
+			bench_clock::time_point start = bench_clock::now();
+			size_t picked = wallet.select(inputs, smallest);
+			double ms = ms_since(start);
+			std::cout << "select" << (smallest ? " smallest" : "") << ": " << transfers << " transfers, " << picked << " inputs: "
+				<< ms << " ms, " << ms / std::max<size_t>(picked, 1) << " ms per input" << std::endl;
+		}
+	}
+
+	std::string bench_file() {
+		return (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("xmr-bench-%%%%%%%%")).string();
+	}
+
+	// full cache rewrite: snapshot, compression and encryption of every chunk, file write without fsync
+	void bench_store(size_t transfers) {
+		tools::BenchWallet wallet;
+		wallet.fill(transfers, 4);
+		const std::string file = bench_file();
+		const size_t rounds = 10;
+		double total = 0;
+		size_t size = 0;
+		for (size_t r = 0; r < rounds; r++) {
+			bench_clock::time_point start = bench_clock::now();
+			size = wallet.save(file);
+			total += ms_since(start);
+		}
+		boost::filesystem::remove(file);
+		std::cout << "store: " << transfers << " transfers, " << size / 1024 << " KB: " << total / rounds << " ms per store" << std::endl;
+	}
+
+	// cache load: mapping, parallel chunk decoding and the indexes rebuilt after it
+	void bench_load(size_t transfers) {
+		tools::BenchWallet wallet;
+		wallet.fill(transfers, 4);
+		const std::string file = bench_file();
+		size_t size = wallet.save(file);
+		const size_t rounds = 10;
+		double total = 0;
+		for (size_t r = 0; r < rounds; r++) {
+			bench_clock::time_point start = bench_clock::now();
+			wallet.open(file);
+			total += ms_since(start);
+		}
+		boost::filesystem::remove(file);
+		if (wallet.transfers() != transfers) {
+			std::cerr << "load: " << wallet.transfers() << " transfers loaded out of " << transfers << std::endl;
+		}
+		std::cout << "load: " << transfers << " transfers, " << size / 1024 << " KB: " << total / rounds << " ms per load" << std::endl;
+	}
+
+	// blob encoding and decoding throughput, legacy gzip chain against framed blobs with every codec
+	void bench_blob(size_t megabytes) {
+		// half counters, half random words: roughly as compressible as serialized transfers
+		std::vector<uint64_t> payload(megabytes * 1024 * 1024 / sizeof(uint64_t));
+		for (size_t i = 0; i < payload.size(); i++) {
+			payload[i] = i % 2 ? i : crypto::rand<uint64_t>();
+		}
+
+		auto report = [&](const std::string &name, double save_ms, double load_ms, size_t chars) {
+			std::cout << "blob " << name << ": " << megabytes << " MB to " << chars / 1024 << " KB: "
+				<< megabytes * 1000 / save_ms << " MB/s save, " << megabytes * 1000 / load_ms << " MB/s load" << std::endl;
+		};
+
+		uint32_t type;
+		std::vector<uint64_t> loaded;
+
+		bench_clock::time_point start = bench_clock::now();
+		std::string blob = tools::saveGZBase64String(XMR_DATA_OUTPUTS, payload);
+		double save_ms = ms_since(start);
+		start = bench_clock::now();
+		tools::loadGZBase64String(type, loaded, blob);
+		report("legacy", save_ms, ms_since(start), blob.size());
+
+		for (uint16_t codec: {XMR_CODEC_NONE, XMR_CODEC_ZLIB_FAST, XMR_CODEC_GZIP_BEST}) {
+			loaded.clear();
+			start = bench_clock::now();
+			blob = tools::saveBlobString(XMR_DATA_OUTPUTS, payload, codec);
+			save_ms = ms_since(start);
+			start = bench_clock::now();
+			tools::loadBlobString(type, loaded, blob);
+			report("codec " + std::to_string(codec), save_ms, ms_since(start), blob.size());
+			if (loaded != payload) {
+				std::cerr << "blob codec " << codec << ": round trip mismatch" << std::endl;
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string what = argc > 1 ? argv[1] : "";
+	if (what == "reorg") {
+		bench_reorg(arg(argc, argv, 2, 100000), arg(argc, argv, 3, 3));
+	} else if (what == "select") {
+		bench_select(arg(argc, argv, 2, 100000), arg(argc, argv, 3, 100));
+	} else if (what == "store") {
+		bench_store(arg(argc, argv, 2, 100000));
+	} else if (what == "load") {
+		bench_load(arg(argc, argv, 2, 100000));
+	} else if (what == "blob") {
+		bench_blob(arg(argc, argv, 2, 64));
+	} else {
+		std::cerr << "Usage: xmr_bench reorg [transfers] [depth] | select [transfers] [inputs] | store [transfers] | load [transfers] | blob [megabytes]" << std::endl;
+		return 1;
+	}
+	return 0;
+}
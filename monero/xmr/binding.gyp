@@ -1,7 +1,5 @@
 {
-	"targets": [{
-		"target_name": "xmr",
-		"sources": [ "wallet/wallet2.cpp", "index.cc", "xmrwallet.cc", "xmr.cc" ],
+	"target_defaults": {
 		"libraries": [ 
 			# "/usr/local/monero/monero-src/lib/libwallet_merged.a", 
 		],
@@ -9,6 +7,7 @@
 			"/usr/local/monero/src/",
 			"/usr/local/monero/src/wallet/",
 			"/usr/local/monero/external/",
+			"/usr/local/monero/external/db_drivers/liblmdb",
 			"/usr/local/monero/contrib/epee/include",
 			"/usr/local/monero/external/easylogging++"
 		],
@@ -36,8 +35,18 @@
 				# "/usr/local/monero/src/crypto/libcncrypto.so",
 				# "/usr/local/monero/external/easylogging++/libeasylogging.so",
 				# "/usr/local/monero/src/blockchain_db/libblockchain_db.so",
-				# "/usr/local/monero/external/db_drivers/liblmdb/liblmdb.so",
+				"/usr/local/monero/external/db_drivers/liblmdb/liblmdb.so",
 			]
 		}
+	},
+	"targets": [{
+		"target_name": "xmr",
+		"sources": [ "wallet/wallet2.cpp", "index.cc", "xmrwallet.cc", "xmr.cc" ]
+	}, {
+		# timing driver, build/Release/xmr_bench <what>
+		"target_name": "xmr_bench",
+		"type": "executable",
+		"include_dirs": [ "." ],
+		"sources": [ "wallet/wallet2.cpp", "bench/wallet2_bench.cpp" ]
 	}]
 }
\ No newline at end of file
@@ -0,0 +1,406 @@
+/* eslint-env mocha */
+
+const should = require('should'),
+	fs = require('fs'),
+	os = require('os'),
+	path = require('path'),
+	xmr = require('./index.js'),
+	config = require('../../core/config.js');
+
+// behaviour of the native addon API, offline where possible, against CFG.node otherwise
+var CFG;
+
+function viewWallet () {
+	let wallet = new xmr.XMR(CFG.testnet, CFG.node, false);
+	wallet.openViewWallet(CFG.monero.address, CFG.monero.viewKey);
+	return wallet;
+}
+
+describe('XMR addon', () => {
+	before('should load config', async () => {
+		CFG = await config.load(__dirname + '/test-config.json');
+	});
+
+	describe('refresh', () => {
+		it('should start with zero refresh counters', () => {
+			let offline = new xmr.XMR(CFG.testnet, '', false);
+			offline.openViewWalletOffline(CFG.monero.address, CFG.monero.viewKey);
+			offline.refreshStats().should.eql({refreshes: '0', noop: '0'});
+		});
+	});
+
+	// these follow a live daemon whose tip and pool move on their own, npm run test:integration
+	describe('refresh @integration', () => {
+		var wallet;
+
+		after(() => {
+			if (wallet) { wallet.cleanup(); }
+		});
+
+		it('should skip refresh while daemon tip is the same', () => {
+			wallet = viewWallet();
+			wallet.connect().should.be.true();
+			wallet.refresh_and_store().should.be.true();
+
+			// a block or pool tx between two calls makes the second one a real refresh, which is counted too
+			let skipped = 0;
+			for (let attempt = 0; attempt < 5 && !skipped; attempt++) {
+				wallet.refresh();
+				let before = wallet.refreshStats(),
+					refreshed = wallet.refresh(),
+					after = wallet.refreshStats();
+
+				parseInt(after.refreshes).should.equal(parseInt(before.refreshes) + 1);
+				parseInt(after.noop).should.equal(parseInt(before.noop) + (refreshed ? 0 : 1));
+				skipped += refreshed ? 0 : 1;
+			}
+			skipped.should.equal(1);
+		}).timeout(10 * 60000);
+
+		it('should refresh again after wallet is closed and reopened', () => {
+			wallet.close().should.be.true();
+			wallet.openViewWallet(CFG.monero.address, CFG.monero.viewKey);
+			wallet.connect().should.be.true();
+
+			let before = wallet.refreshStats();
+			wallet.refresh().should.be.true();
+			let after = wallet.refreshStats();
+			parseInt(after.refreshes).should.equal(parseInt(before.refreshes) + 1);
+			after.noop.should.equal(before.noop);
+		}).timeout(10 * 60000);
+	});
+
+	describe('store', () => {
+		var wallet;
+
+		after(() => {
+			if (wallet) { wallet.cleanup(); }
+		});
+
+		it('should have nothing pending before first store', () => {
+			let offline = new xmr.XMR(CFG.testnet, '', false);
+			offline.openViewWalletOffline(CFG.monero.address, CFG.monero.viewKey);
+			let status = offline.storeStatus();
+			status.pending.should.be.false();
+			should.not.exist(status.error);
+			offline.cleanup();
+		});
+
+		it('should report background store completion to onStore', async () => {
+			let keys = xmr.XMR.createPaperWallet('English', CFG.testnet),
+				offline = new xmr.XMR(CFG.testnet, '', false);
+			let stored = new Promise(resolve => offline.setCallbacks(() => {}, () => {}, resolve));
+			offline.openViewWallet(keys[2], keys[1]);
+			offline.fabricateOutputs(2, '1000000000');
+			offline.store(true).should.be.true();
+
+			should.not.exist(await stored);
+			offline.storeStatus().pending.should.be.false();
+			offline.cleanup();
+		});
+
+		it('should throw on wrong callbacks', () => {
+			let offline = new xmr.XMR(CFG.testnet, '', false);
+			(() => offline.setCallbacks(() => {})).should.throw(TypeError);
+			(() => offline.setCallbacks(() => {}, () => {}, 'onStore')).should.throw(TypeError);
+		});
+
+		it('should finish background store without error', async () => {
+			wallet = viewWallet();
+			wallet.connect().should.be.true();
+			wallet.refresh_and_store().should.be.true();
+
+			while (wallet.storeStatus().pending) {
+				await new Promise(resolve => setTimeout(resolve, 100));
+			}
+			should.not.exist(wallet.storeStatus().error);
+
+			// nothing changed since, so there's nothing to queue either
+			wallet.store(true).should.be.true();
+			wallet.storeStatus().pending.should.be.false();
+		}).timeout(10 * 60000);
+	});
+
+	describe('setStorage', () => {
+		const CONTAINER = path.join(os.tmpdir(), 'xmr-addon-test-' + process.pid + '.mdb');
+
+		function paperWallets (count) {
+			let wallets = [];
+			for (let i = 0; i < count; i++) {
+				let keys = xmr.XMR.createPaperWallet('English', CFG.testnet),
+					wallet = new xmr.XMR(CFG.testnet, '', false);
+				wallet.setStorage('lmdb', CONTAINER).should.be.true();
+				wallets.push({wallet: wallet, address: keys[2], viewKey: keys[1]});
+			}
+			return wallets;
+		}
+
+		after(() => {
+			[CONTAINER, CONTAINER + '-lock'].forEach(file => {
+				if (fs.existsSync(file)) { fs.unlinkSync(file); }
+			});
+		});
+
+		it('should accept known backends only', () => {
+			let wallet = new xmr.XMR(CFG.testnet, '', false);
+			wallet.setStorage('file').should.be.true();
+			wallet.setStorage('file', CONTAINER).should.be.false();
+			wallet.setStorage('sqlite').should.be.false();
+			(() => wallet.setStorage()).should.throw(TypeError);
+		});
+
+		it('should keep wallet files in the container', () => {
+			let [opened] = paperWallets(1);
+			opened.wallet.openViewWallet(opened.address, opened.viewKey);
+			fs.existsSync(opened.address + '.keys').should.be.false();
+
+			let reopened = new xmr.XMR(CFG.testnet, '', false);
+			reopened.setStorage('lmdb', CONTAINER).should.be.true();
+			reopened.openViewWallet(opened.address, opened.viewKey);
+			reopened.address().should.equal(opened.address);
+			reopened.cleanup();
+		});
+
+		it('should open many wallets at once', () => {
+			let wallets = paperWallets(4);
+			xmr.XMR.openViewWallets(wallets).should.eql([null, null, null, null]);
+
+			let reopened = wallets.map(w => ({wallet: new xmr.XMR(CFG.testnet, '', false), address: w.address, viewKey: w.viewKey}));
+			reopened.forEach(w => w.wallet.setStorage('lmdb', CONTAINER).should.be.true());
+			xmr.XMR.openViewWallets(reopened).should.eql([null, null, null, null]);
+			reopened.forEach((w, i) => w.wallet.address().should.equal(wallets[i].address));
+
+			reopened.forEach(w => w.wallet.cleanup());
+		});
+
+		it('should report an error per wallet', () => {
+			let [good, bad] = paperWallets(2);
+			bad.address = 'wrong';
+			xmr.XMR.openViewWallets([good, bad]).should.eql([null, 'Invalid address']);
+			good.wallet.cleanup();
+		});
+
+		it('should throw on wrong arguments', () => {
+			let [opened] = paperWallets(1);
+			(() => xmr.XMR.openViewWallets(opened)).should.throw(TypeError);
+			(() => xmr.XMR.openViewWallets([{wallet: {}, address: opened.address, viewKey: opened.viewKey}])).should.throw(TypeError);
+			(() => xmr.XMR.openViewWallets([opened, opened])).should.throw(TypeError);
+		});
+	});
+
+	describe('key derivations', () => {
+		const CONTAINER = path.join(os.tmpdir(), 'xmr-addon-keys-' + process.pid + '.mdb');
+		var wallet, keys;
+
+		before(() => {
+			keys = xmr.XMR.createPaperWallet('English', CFG.testnet);
+			wallet = new xmr.XMR(CFG.testnet, '', false);
+			wallet.setStorage('lmdb', CONTAINER).should.be.true();
+		});
+
+		after(() => {
+			wallet.cleanup();
+			[CONTAINER, CONTAINER + '-lock'].forEach(file => {
+				if (fs.existsSync(file)) { fs.unlinkSync(file); }
+			});
+		});
+
+		it('should start with no derivations', () => {
+			let stats = wallet.keyStats();
+			stats.derivations.should.equal('0');
+			stats.total.should.be.a.String();
+		});
+
+		it('should derive keys once for repeated opens', () => {
+			wallet.openViewWallet(keys[2], keys[1]);
+			let opened = parseInt(wallet.keyStats().derivations);
+			opened.should.be.above(0);
+
+			wallet.openViewWallet(keys[2], keys[1]);
+			parseInt(wallet.keyStats().derivations).should.equal(opened);
+		});
+
+		it('should derive keys again after they are wiped', () => {
+			let before = wallet.keyStats();
+			wallet.wipeDerivedKeys();
+			wallet.openViewWallet(keys[2], keys[1]);
+
+			let after = wallet.keyStats();
+			parseInt(after.derivations).should.be.above(parseInt(before.derivations));
+			parseInt(after.total).should.be.above(parseInt(before.total));
+		});
+
+		it('should wipe signer cache', () => {
+			(() => xmr.XMR.wipeSignerCache()).should.not.throw();
+			wallet.address().should.equal(keys[2]);
+		});
+	});
+
+	describe('output sync', () => {
+		var keys, view;
+
+		before(() => {
+			keys = xmr.XMR.createPaperWallet('English', CFG.testnet);
+			view = new xmr.XMR(CFG.testnet, '', false);
+			view.openViewWalletOffline(keys[2], keys[1]);
+			view.fabricateOutputs(3, '1000000000');
+		});
+
+		after(() => {
+			view.cleanup();
+		});
+
+		it('should export all outputs before the first key images import', () => {
+			let full = view.exportOutputs(true);
+			should.not.exist(full.error);
+			full.outputs.length.should.equal(view.exportOutputs().outputs.length);
+		});
+
+		it('should derive key images of exported outputs on the signer', () => {
+			let signer = new xmr.XMR(CFG.testnet, '', false);
+			signer.openPaperWallet(keys[2], keys[0]);
+			let result = signer.signTransaction(view.exportOutputs(true).outputs);
+			should.not.exist(result.error);
+			should.exist(result.keyImages);
+		});
+
+		it('should throw on wrong arguments', () => {
+			(() => view.fabricateOutputs(1)).should.throw(TypeError);
+		});
+	});
+
+	// key images import asks CFG.node whether fabricated outputs are spent, which they never are
+	describe('output sync @integration', () => {
+		const AMOUNT = '1000000000';
+		var keys, view;
+
+		// a new signer for every request, as the signing service opens it
+		function sign (outputs) {
+			let signer = new xmr.XMR(CFG.testnet, '', false);
+			signer.openPaperWallet(keys[2], keys[0]);
+			let result = signer.signTransaction(outputs);
+			should.not.exist(result.error);
+			return result.keyImages;
+		}
+
+		before(() => {
+			keys = xmr.XMR.createPaperWallet('English', CFG.testnet);
+			view = new xmr.XMR(CFG.testnet, CFG.node, false);
+			view.openViewWalletOffline(keys[2], keys[1]);
+			view.connect().should.be.true();
+			view.fabricateOutputs(3, AMOUNT);
+		});
+
+		after(() => {
+			view.cleanup();
+		});
+
+		it('should sync all outputs first', () => {
+			let result = view.submitSignedTransaction(sign(view.exportOutputs(true).outputs));
+			should.not.exist(result.error);
+			result.status.should.equal('Imported 0 spent, 3000000000 unspent');
+		});
+
+		it('should sync an empty delta when nothing is new', () => {
+			let delta = view.exportOutputs(true).outputs;
+			delta.length.should.be.below(view.exportOutputs().outputs.length);
+
+			let result = view.submitSignedTransaction(sign(delta));
+			should.not.exist(result.error);
+			result.status.should.equal('Imported 0 spent, 0 unspent');
+		});
+
+		it('should sync only outputs received since', () => {
+			view.fabricateOutputs(2, AMOUNT);
+			let result = view.submitSignedTransaction(sign(view.exportOutputs(true).outputs));
+			should.not.exist(result.error);
+			result.status.should.equal('Imported 0 spent, 2000000000 unspent');
+
+			result = view.submitSignedTransaction(sign(view.exportOutputs(true).outputs));
+			result.status.should.equal('Imported 0 spent, 0 unspent');
+		});
+	});
+
+	describe('createUnsignedTransactions', () => {
+		// more than any wallet has, so that a payout which reaches input selection fails the same way everywhere
+		const TOO_MUCH = '10000000000000000000';
+		var offline;
+
+		function payout (amount, address) {
+			return {priority: 1, mixins: 4, unlock: 0, destinations: [[amount, address || CFG.monero.address]]};
+		}
+
+		before(() => {
+			offline = new xmr.XMR(CFG.testnet, '', false);
+			offline.openViewWalletOffline(CFG.monero.address, CFG.monero.viewKey);
+		});
+
+		after(() => {
+			offline.cleanup();
+		});
+
+		it('should report one error per payout', () => {
+			let result = offline.createUnsignedTransactions([payout(TOO_MUCH, 'wrong'), payout(TOO_MUCH)], true);
+			result.errors.length.should.equal(2);
+			result.errors[0].should.startWith('Wrong address');
+			result.errors[1].should.equal('NOT_ENOUGH_FUNDS');
+			should.exist(result.error);
+			should.not.exist(result.unsigned);
+		});
+
+		it('should not fail a whole group because of one payout', () => {
+			let result = offline.createUnsignedTransactions([payout('0'), payout(TOO_MUCH)], true);
+			result.errors.should.eql(['NOT_ENOUGH_AMOUNT', 'NOT_ENOUGH_FUNDS']);
+		});
+
+		it('should throw on wrong arguments', () => {
+			(() => offline.createUnsignedTransactions(payout(TOO_MUCH), true)).should.throw(TypeError);
+		});
+	});
+
+	describe('convertBlob', () => {
+		var keys, offline;
+
+		before(() => {
+			keys = xmr.XMR.createPaperWallet('English', CFG.testnet);
+			offline = new xmr.XMR(CFG.testnet, '', false);
+			offline.openViewWalletOffline(keys[2], keys[1]);
+		});
+
+		after(() => {
+			offline.cleanup();
+		});
+
+		it('should round-trip an empty outputs blob', () => {
+			let compact = offline.exportOutputs().outputs;
+			offline.convertBlob(offline.convertBlob(compact).data).should.eql({data: compact});
+		});
+
+		it('should round-trip compact outputs through legacy outputs blob', () => {
+			let empty = offline.exportOutputs().outputs;
+			offline.fabricateOutputs(3, '1000000000');
+
+			let compact = offline.exportOutputs().outputs;
+			compact.length.should.be.above(empty.length);
+
+			// expandOutput for each output, then compactOutput of what it expanded to
+			let legacy = offline.convertBlob(compact);
+			should.not.exist(legacy.error);
+			legacy.data.should.not.equal(compact);
+
+			offline.convertBlob(legacy.data).should.eql({data: compact});
+		});
+
+		it('should sign key images of expanded outputs', () => {
+			let signer = new xmr.XMR(CFG.testnet, '', false);
+			signer.openPaperWallet(keys[2], keys[0]);
+			let result = signer.signTransaction(offline.convertBlob(offline.exportOutputs().outputs).data);
+			should.not.exist(result.error);
+			should.exist(result.keyImages);
+		});
+
+		it('should throw on wrong arguments', () => {
+			(() => offline.convertBlob()).should.throw(TypeError);
+		});
+	});
+});
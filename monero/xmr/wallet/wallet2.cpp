@@ -33,6 +33,20 @@
 #include <boost/format.hpp>
 #include <boost/optional/optional.hpp>
 #include <boost/utility/value_init.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/serialization/array.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <lmdb.h>
 #include "include_base_utils.h"
 using namespace epee;
 
@@ -52,6 +66,7 @@ using namespace epee;
 #include "mnemonics/electrum-words.h"
 #include "common/i18n.h"
 #include "common/util.h"
+#include "common/int-util.h"
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
@@ -89,6 +104,27 @@ using namespace cryptonote;
 
 #define SECOND_OUTPUT_RELATEDNESS_THRESHOLD 0.0f
 
+#define RELATED_OUTPUTS_HEIGHT_DELTA 10 // outputs at least that many blocks apart are considered unrelated
+#define POP_BEST_VALUE_RANDOM_ATTEMPTS 32 // random draws tried before ranking all candidates
+
+#define DECOY_HISTOGRAM_TTL 60 // seconds an output histogram, and the decoys drawn with it, stay valid
+#define DECOY_POOL_PREFETCH_FACTOR 4 // decoys fetched per top-up, in multiples of what the current tx needs
+
+#define WALLET_JOURNAL_MAX_RECORDS 256 // records appended to the cache journal before the cache file is rewritten
+#define WALLET_JOURNAL_COMPACT_RATIO 2 // the cache file is also rewritten once the journal is 1/N of its size
+
+#define CACHE_FILE_MAGIC "Monero wallet cache\001"
+#define CACHE_CHUNK_BLOCKS 65536 // block hashes per cache file chunk
+#define CACHE_CHUNK_TRANSFERS 1024 // transfers per cache file chunk, chunks are decrypted and decoded in parallel on load
+#define CACHE_CHUNK_PREFIXES 256 // tx prefixes per cache file chunk, decoded one chunk at a time when first needed
+#define CACHE_COLUMNS_VERSION 2 // version of the columnar encoding of transfer and payment chunks, 1 is still read
+
+#define WALLET_LMDB_MAP_SIZE (64 << 20) // initial map size of <wallet>.mdb, doubled whenever a store may not fit
+#define WALLET_LMDB_MAP_SLACK 3 // map space reserved per byte written, old pages are only freed after commit
+
+#define WALLET_DERIVED_KEYS 3 // slow hash derived keys cached per wallet: password, secret keys, export view key
+#define DERIVED_KEY_PAGE_SIZE 4096 // derived keys are held in locked pages of this size, shared by all wallets
+
 #define KILL_IOSERVICE()  \
     do { \
       work.reset(); \
@@ -572,16 +608,356 @@ void wallet2::set_spent(size_t idx, uint64_t height)
 {
   transfer_details &td = m_transfers[idx];
   LOG_PRINT_L2("Setting SPENT at " << height << ": ki " << td.m_key_image << ", amount " << print_money(td.m_amount));
+  if (td.m_spent)
+    unindex_spent(idx);
+  else
+    unaccount_transfer(idx);
   td.m_spent = true;
   td.m_spent_height = height;
+  m_spent_by_height[height].insert(idx);
+  journal_touch(idx);
 }
 //----------------------------------------------------------------------------------------------------
 void wallet2::set_unspent(size_t idx)
 {
   transfer_details &td = m_transfers[idx];
   LOG_PRINT_L2("Setting UNSPENT: ki " << td.m_key_image << ", amount " << print_money(td.m_amount));
-  td.m_spent = false;
+  if (td.m_spent)
+  {
+    unindex_spent(idx);
+    td.m_spent = false;
+    account_transfer(idx);
+  }
   td.m_spent_height = 0;
+  journal_touch(idx);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::set_key_image(size_t idx, const crypto::key_image &key_image)
+{
+  transfer_details &td = m_transfers[idx];
+  if (td.m_key_image_known && td.m_key_image != key_image)
+    LOG_PRINT_L0("WARNING: imported key image differs from previously known key image at index " << idx << ": trusting imported one");
+  td.m_key_image = key_image;
+  m_key_images[key_image] = idx;
+  td.m_key_image_known = true;
+  m_pub_keys[td.get_public_key()] = idx;
+  journal_touch(idx);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::unindex_spent(size_t idx)
+{
+  auto it = m_spent_by_height.find(m_transfers[idx].m_spent_height);
+  if (it == m_spent_by_height.end())
+    return;
+  it->second.erase(idx);
+  if (it->second.empty())
+    m_spent_by_height.erase(it);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::unindex_payment(payment_txid_index &index, const payment_container::value_type *payment)
+{
+  auto range = index.equal_range(payment->second.m_tx_hash);
+  for (auto it = range.first; it != range.second; ++it)
+  {
+    if (it->second == payment)
+    {
+      index.erase(it);
+      return;
+    }
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::account_transfer(size_t idx)
+{
+  uint64_t height, unlock_ts;
+  transfer_unlock_requirements(m_transfers[idx], height, unlock_ts);
+  m_unspent_amount += m_transfers[idx].amount();
+  m_locked_by_height.insert(std::make_pair(height, idx));
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::unaccount_transfer(size_t idx)
+{
+  const uint64_t amount = m_transfers[idx].amount();
+  uint64_t height, unlock_ts;
+  transfer_unlock_requirements(m_transfers[idx], height, unlock_ts);
+  m_unspent_amount -= amount;
+  if (m_unlocked_by_height.erase(std::make_pair(height, idx)))
+  {
+    m_unlocked_amount -= amount;
+    index_spendable(idx, false);
+  }
+  else if (!m_locked_by_height.erase(std::make_pair(height, idx)))
+    m_locked_by_time.erase(std::make_pair(unlock_ts, idx));
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::transfer_unlock_requirements(const transfer_details& td, uint64_t &height, uint64_t &unlock_ts) const
+{
+  // chain height / time from which is_transfer_unlocked(td) holds
+  const uint64_t unlock_time = td.m_unlock_time;
+  height = td.m_block_height + CRYPTONOTE_DEFAULT_TX_SPENDABLE_AGE;
+  unlock_ts = 0;
+  if(unlock_time < CRYPTONOTE_MAX_BLOCK_NUMBER)
+  {
+    if (unlock_time + 1 > CRYPTONOTE_LOCKED_TX_ALLOWED_DELTA_BLOCKS)
+      height = std::max<uint64_t>(height, unlock_time + 1 - CRYPTONOTE_LOCKED_TX_ALLOWED_DELTA_BLOCKS);
+  }
+  else
+  {
+    uint64_t v2height = m_testnet ? 624634 : 1009827;
+    uint64_t leeway = td.m_block_height < v2height ? CRYPTONOTE_LOCKED_TX_ALLOWED_DELTA_SECONDS_V1 : CRYPTONOTE_LOCKED_TX_ALLOWED_DELTA_SECONDS_V2;
+    unlock_ts = unlock_time > leeway ? unlock_time - leeway : 0;
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::index_spendable(size_t idx, bool spendable)
+{
+  const transfer_details& td = m_transfers[idx];
+  const std::pair<uint64_t, size_t> key = std::make_pair(td.amount(), idx);
+  if (td.is_rct())
+  {
+    if (spendable)
+      m_spendable_rct.insert(key);
+    else
+      m_spendable_rct.erase(key);
+    // saturating, an unusable amount anyway
+    m_spendable_rct_by_index.set(idx, spendable ? std::max(td.amount() + 1, td.amount()) : 0);
+    return;
+  }
+  std::set<std::pair<uint64_t, size_t>> &set = is_valid_decomposed_amount(td.amount()) ? m_spendable_plain : m_spendable_dust;
+  if (spendable)
+    set.insert(key);
+  else
+    set.erase(key);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::mark_unlocked(uint64_t height, size_t idx)
+{
+  const transfer_details& td = m_transfers[idx];
+  m_unlocked_by_height.insert(std::make_pair(height, idx));
+  m_unlocked_amount += td.amount();
+  index_spendable(idx, true);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::update_unlock_schedule()
+{
+  const uint64_t chain_height = m_blockchain.size();
+  const uint64_t now = static_cast<uint64_t>(time(NULL));
+
+  // a reorg may have lowered the chain height
+  while (!m_unlocked_by_height.empty() && m_unlocked_by_height.rbegin()->first > chain_height)
+  {
+    auto it = std::prev(m_unlocked_by_height.end());
+    const uint64_t amount = m_transfers[it->second].amount();
+    m_unlocked_amount -= amount;
+    index_spendable(it->second, false);
+    m_locked_by_height.insert(*it);
+    m_unlocked_by_height.erase(it);
+  }
+
+  while (!m_locked_by_height.empty() && m_locked_by_height.begin()->first <= chain_height)
+  {
+    auto it = m_locked_by_height.begin();
+    uint64_t height, unlock_ts;
+    transfer_unlock_requirements(m_transfers[it->second], height, unlock_ts);
+    if (unlock_ts > now)
+    {
+      m_locked_by_time.insert(std::make_pair(unlock_ts, it->second));
+    }
+    else
+    {
+      mark_unlocked(it->first, it->second);
+    }
+    m_locked_by_height.erase(it);
+  }
+
+  while (!m_locked_by_time.empty() && m_locked_by_time.begin()->first <= now)
+  {
+    auto it = m_locked_by_time.begin();
+    uint64_t height, unlock_ts;
+    transfer_unlock_requirements(m_transfers[it->second], height, unlock_ts);
+    if (height > chain_height)
+      m_locked_by_height.insert(std::make_pair(height, it->second));
+    else
+    {
+      mark_unlocked(height, it->second);
+    }
+    m_locked_by_time.erase(it);
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::get_spendable_transfers(bool use_rct, uint64_t below, std::vector<size_t> &transfers, std::vector<size_t> &dust, const std::unordered_set<size_t> &excluded)
+{
+  update_unlock_schedule();
+  auto gather = [below, &excluded](const std::set<std::pair<uint64_t, size_t>> &spendable, std::vector<size_t> &indices) {
+    for (const auto &e: spendable)
+    {
+      if (below != 0 && e.first >= below)
+        break;
+      if (!excluded.empty() && excluded.count(e.second))
+        continue;
+      indices.push_back(e.second);
+    }
+  };
+  if (use_rct)
+    gather(m_spendable_rct, transfers);
+  gather(m_spendable_plain, transfers);
+  gather(m_spendable_dust, dust);
+}
+//----------------------------------------------------------------------------------------------------
+struct tx_prefix_ref::cell
+{
+  boost::mutex mutex;
+  std::shared_ptr<const cryptonote::transaction_prefix> tx;   // decoded, or in memory from the start
+  std::shared_ptr<tx_prefix_source> source;
+  uint64_t id;
+};
+//----------------------------------------------------------------------------------------------------
+tx_prefix_ref::tx_prefix_ref(std::shared_ptr<const cryptonote::transaction_prefix> tx)
+{
+  if (!tx)
+    return;
+  m_cell = std::make_shared<cell>();
+  m_cell->tx = std::move(tx);
+  m_cell->id = 0;
+}
+//----------------------------------------------------------------------------------------------------
+const cryptonote::transaction_prefix *tx_prefix_ref::get() const
+{
+  if (!m_cell)
+    return NULL;
+  boost::lock_guard<boost::mutex> lock(m_cell->mutex);
+  if (!m_cell->tx)
+  {
+    const std::string blob = m_cell->source->blob(m_cell->id);
+    std::shared_ptr<cryptonote::transaction_prefix> tx = std::make_shared<cryptonote::transaction_prefix>();
+    THROW_WALLET_EXCEPTION_IF(!::serialization::parse_binary(blob, *tx), error::wallet_internal_error, "Failed to parse cold tx prefix");
+    m_cell->tx = tx;
+  }
+  return m_cell->tx.get();
+}
+//----------------------------------------------------------------------------------------------------
+bool tx_prefix_ref::loaded() const
+{
+  if (!m_cell)
+    return false;
+  boost::lock_guard<boost::mutex> lock(m_cell->mutex);
+  return (bool)m_cell->tx;
+}
+//----------------------------------------------------------------------------------------------------
+std::string tx_prefix_ref::blob() const
+{
+  THROW_WALLET_EXCEPTION_IF(!m_cell, error::wallet_internal_error, "No tx prefix");
+  std::shared_ptr<const cryptonote::transaction_prefix> tx;
+  {
+    boost::lock_guard<boost::mutex> lock(m_cell->mutex);
+    if (!m_cell->tx)
+      return m_cell->source->blob(m_cell->id);
+    tx = m_cell->tx;
+  }
+  std::string blob;
+  THROW_WALLET_EXCEPTION_IF(!::serialization::dump_binary(const_cast<cryptonote::transaction_prefix&>(*tx), blob),
+      error::wallet_internal_error, "Failed to serialize tx prefix");
+  return blob;
+}
+//----------------------------------------------------------------------------------------------------
+tx_prefix_ref tx_prefix_source::ref(uint64_t id)
+{
+  boost::lock_guard<boost::mutex> lock(m_refs_mutex);
+  std::weak_ptr<void> &known = m_refs[id];
+  std::shared_ptr<tx_prefix_ref::cell> c = std::static_pointer_cast<tx_prefix_ref::cell>(known.lock());
+  if (!c)
+  {
+    c = std::make_shared<tx_prefix_ref::cell>();
+    c->source = shared_from_this();
+    c->id = id;
+    known = c;
+  }
+  return tx_prefix_ref(c);
+}
+//----------------------------------------------------------------------------------------------------
+void tx_prefix_source::release_refs()
+{
+  boost::lock_guard<boost::mutex> lock(m_refs_mutex);
+  std::unordered_map<uint64_t, std::weak_ptr<void>>().swap(m_refs);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::share_tx_prefixes()
+{
+  // cache chunks, journal records and LMDB rows each bring their own copy of a tx prefix; outputs of
+  // the same tx are pointed at one of them, unless the prefixes differ (outputs imported one by one)
+  std::unordered_map<crypto::hash, std::pair<const transfer_details*, crypto::hash>> shared;
+  size_t copies = 0;
+  for (transfer_details &td: m_transfers)
+  {
+    // cold prefixes are shared by their source already
+    if (!td.m_tx.loaded())
+      continue;
+    auto it = shared.emplace(td.m_txid, std::make_pair(&td, crypto::null_hash));
+    if (it.second || it.first->second.first->m_tx == td.m_tx)
+      continue;
+    std::pair<const transfer_details*, crypto::hash> &first = it.first->second;
+    if (first.second == crypto::null_hash)
+      first.second = cryptonote::get_transaction_prefix_hash(*first.first->m_tx);
+    if (cryptonote::get_transaction_prefix_hash(*td.m_tx) != first.second)
+      continue;
+    td.m_tx = first.first->m_tx;
+    ++copies;
+  }
+  if (copies)
+    LOG_PRINT_L2("Shared " << copies << " duplicate tx prefixes");
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::rebuild_indexes()
+{
+  m_spent_by_height.clear();
+  for (size_t i = 0; i < m_transfers.size(); ++i)
+  {
+    if (m_transfers[i].m_spent)
+      m_spent_by_height[m_transfers[i].m_spent_height].insert(i);
+  }
+
+  index_payments();
+
+  m_unconfirmed_payments_by_txid.clear();
+  for (const auto &p: m_unconfirmed_payments)
+    m_unconfirmed_payments_by_txid.emplace(p.second.m_tx_hash, &p);
+
+  m_unspent_amount = 0;
+  m_unlocked_amount = 0;
+  m_locked_by_height.clear();
+  m_locked_by_time.clear();
+  m_unlocked_by_height.clear();
+  m_spendable_rct.clear();
+  m_spendable_rct_by_index.clear();
+  m_spendable_plain.clear();
+  m_spendable_dust.clear();
+  for (size_t i = 0; i < m_transfers.size(); ++i)
+  {
+    if (!m_transfers[i].m_spent)
+      account_transfer(i);
+  }
+
+  m_pending_change = 0;
+  for (const auto &utx: m_unconfirmed_txs)
+  {
+    if (utx.second.m_state != wallet2::unconfirmed_transfer_details::failed)
+      m_pending_change += utx.second.m_change;
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::index_payments()
+{
+  m_payments_by_height.clear();
+  m_payments_by_txid.clear();
+  for (const auto &p: m_payments)
+  {
+    m_payments_by_height.emplace(p.second.m_block_height, p.first);
+    m_payments_by_txid.emplace(p.second.m_tx_hash, &p);
+  }
+
+  m_confirmed_txs_by_height.clear();
+  for (const auto &c: m_confirmed_txs)
+    m_confirmed_txs_by_height.emplace(c.second.m_block_height, c.first);
 }
 //----------------------------------------------------------------------------------------------------
 void wallet2::check_acc_out_precomp(const crypto::public_key &spend_public_key, const tx_out &o, const crypto::key_derivation &derivation, size_t i, bool &received, uint64_t &money_transfered, bool &error) const
@@ -853,6 +1229,11 @@ void wallet2::process_new_transaction(const crypto::hash &txid, const cryptonote
             " not match with daemon response size=" + std::to_string(o_indices.size()));
       }
 
+      // one copy of the prefix, shared by all our outputs in this tx
+      std::shared_ptr<const cryptonote::transaction_prefix> tx_prefix;
+      if (!pool)
+        tx_prefix = std::make_shared<const cryptonote::transaction_prefix>((const cryptonote::transaction_prefix&)tx);
+
       for(size_t o: outs)
       {
   THROW_WALLET_EXCEPTION_IF(tx.vout.size() <= o, error::wallet_internal_error, "wrong out in transaction: internal index=" +
@@ -872,7 +1253,7 @@ void wallet2::process_new_transaction(const crypto::hash &txid, const cryptonote
       td.m_block_height = height;
       td.m_internal_output_index = o;
       td.m_global_output_index = o_indices[o];
-      td.m_tx = (const cryptonote::transaction_prefix&)tx;
+      td.set_tx(tx_prefix);
       td.m_txid = txid;
             td.m_key_image = ki[o];
             td.m_key_image_known = !m_watch_only;
@@ -895,6 +1276,7 @@ void wallet2::process_new_transaction(const crypto::hash &txid, const cryptonote
               td.m_rct = false;
             }
       set_unspent(m_transfers.size()-1);
+      account_transfer(m_transfers.size()-1);
       m_key_images[td.m_key_image] = m_transfers.size()-1;
       m_pub_keys[in_ephemeral[o].pub] = m_transfers.size()-1;
       LOG_PRINT_L0("Received money: " << print_money(td.amount()) << ", with tx: " << txid);
@@ -920,10 +1302,14 @@ void wallet2::process_new_transaction(const crypto::hash &txid, const cryptonote
           if (!pool)
           {
             transfer_details &td = m_transfers[kit->second];
+      THROW_WALLET_EXCEPTION_IF(td.m_spent, error::wallet_internal_error, "Inconsistent spent status");
+            // only unspent transfers are in the running totals
+            unaccount_transfer(kit->second);
+            journal_truncate(m_blockchain.size(), kit->second);
       td.m_block_height = height;
       td.m_internal_output_index = o;
       td.m_global_output_index = o_indices[o];
-      td.m_tx = (const cryptonote::transaction_prefix&)tx;
+      td.set_tx(tx_prefix);
       td.m_txid = txid;
             td.m_amount = tx.vout[o].amount;
             td.m_pk_index = pk_index - 1;
@@ -944,7 +1330,7 @@ void wallet2::process_new_transaction(const crypto::hash &txid, const cryptonote
               td.m_rct = false;
             }
             THROW_WALLET_EXCEPTION_IF(td.get_public_key() != in_ephemeral[o].pub, error::wallet_internal_error, "Inconsistent public keys");
-      THROW_WALLET_EXCEPTION_IF(td.m_spent, error::wallet_internal_error, "Inconsistent spent status");
+            account_transfer(kit->second);
 
       LOG_PRINT_L0("Received money: " << print_money(td.amount()) << ", with tx: " << txid);
       if (0 != m_callback)
@@ -1038,12 +1424,18 @@ void wallet2::process_new_transaction(const crypto::hash &txid, const cryptonote
     payment.m_unlock_time  = tx.unlock_time;
     payment.m_timestamp    = ts;
     if (pool) {
-      m_unconfirmed_payments.emplace(payment_id, payment);
+      auto it = m_unconfirmed_payments.emplace(payment_id, payment);
+      m_unconfirmed_payments_by_txid.emplace(txid, &*it);
+      m_journal_misc_dirty = true;
       if (0 != m_callback)
         m_callback->on_unconfirmed_money_received(height, txid, tx, payment.m_amount);
     }
     else
-      m_payments.emplace(payment_id, payment);
+    {
+      auto it = m_payments.emplace(payment_id, payment);
+      m_payments_by_height.emplace(height, payment_id);
+      m_payments_by_txid.emplace(txid, &*it);
+    }
     LOG_PRINT_L2("Payment found in " << (pool ? "pool" : "block") << ": " << payment_id << " / " << payment.m_tx_hash << " / " << payment.m_amount);
   }
 }
@@ -1058,13 +1450,17 @@ void wallet2::process_unconfirmed(const crypto::hash &txid, const cryptonote::tr
     if (store_tx_info()) {
       try {
         m_confirmed_txs.insert(std::make_pair(txid, confirmed_transfer_details(unconf_it->second, height)));
+        m_confirmed_txs_by_height.emplace(height, txid);
       }
       catch (...) {
         // can fail if the tx has unexpected input types
         LOG_PRINT_L0("Failed to add outgoing transaction to confirmed transaction map");
       }
     }
+    if (unconf_it->second.m_state != wallet2::unconfirmed_transfer_details::failed)
+      m_pending_change -= unconf_it->second.m_change;
     m_unconfirmed_txs.erase(unconf_it);
+    m_journal_misc_dirty = true;
   }
 }
 //----------------------------------------------------------------------------------------------------
@@ -1098,6 +1494,7 @@ void wallet2::process_outgoing(const crypto::hash &txid, const cryptonote::trans
   entry.first->second.m_block_height = height;
   entry.first->second.m_timestamp = ts;
   entry.first->second.m_unlock_time = tx.unlock_time;
+  m_confirmed_txs_by_height.emplace(height, txid);
 }
 //----------------------------------------------------------------------------------------------------
 void wallet2::process_new_blockchain_entry(const cryptonote::block& b, const cryptonote::block_complete_entry& bche, const crypto::hash& bl_id, uint64_t height, const cryptonote::COMMAND_RPC_GET_BLOCKS_FAST::block_output_indices &o_indices)
@@ -1431,11 +1828,14 @@ void wallet2::update_pool_state(bool refreshed)
       {
         LOG_PRINT_L1("Pending txid " << txid << " not in pool, marking as not in pool");
         pit->second.m_state = wallet2::unconfirmed_transfer_details::pending_not_in_pool;
+        m_journal_misc_dirty = true;
       }
       else if (pit->second.m_state == wallet2::unconfirmed_transfer_details::pending_not_in_pool && refreshed)
       {
         LOG_PRINT_L1("Pending txid " << txid << " not in pool, marking as failed");
         pit->second.m_state = wallet2::unconfirmed_transfer_details::failed;
+        m_pending_change -= pit->second.m_change;
+        m_journal_misc_dirty = true;
 
         // the inputs aren't spent anymore, since the tx failed
         for (size_t vini = 0; vini < pit->second.m_tx.vin.size(); ++vini)
@@ -1483,7 +1883,9 @@ void wallet2::update_pool_state(bool refreshed)
       if (!found)
       {
         MDEBUG("Removing " << txid << " from unconfirmed payments, not found in pool");
+        unindex_payment(m_unconfirmed_payments_by_txid, &*pit);
         m_unconfirmed_payments.erase(pit);
+        m_journal_misc_dirty = true;
       }
     }
   }
@@ -1498,15 +1900,7 @@ void wallet2::update_pool_state(bool refreshed)
       LOG_PRINT_L2("Already seen " << txid << ", skipped");
       continue;
     }
-    bool txid_found_in_up = false;
-    for (const auto &up: m_unconfirmed_payments)
-    {
-      if (up.second.m_tx_hash == txid)
-      {
-        txid_found_in_up = true;
-        break;
-      }
-    }
+    bool txid_found_in_up = m_unconfirmed_payments_by_txid.find(txid) != m_unconfirmed_payments_by_txid.end();
     if (!txid_found_in_up)
     {
       LOG_PRINT_L1("Found new pool tx: " << txid);
@@ -1569,6 +1963,7 @@ void wallet2::update_pool_state(bool refreshed)
                 {
                   process_new_transaction(txid, tx, std::vector<uint64_t>(), 0, time(NULL), false, true);
                   m_scanned_pool_txs[0].insert(txid);
+                  m_journal_misc_dirty = true;
                   if (m_scanned_pool_txs[0].size() > 5000)
                   {
                     std::swap(m_scanned_pool_txs[0], m_scanned_pool_txs[1]);
@@ -1675,6 +2070,7 @@ bool wallet2::add_address_book_row(const cryptonote::account_public_address &add
   
   auto old_size = m_address_book.size();
   m_address_book.push_back(a);
+  m_journal_misc_dirty = true;
   if(m_address_book.size() == old_size+1)
     return true;
   return false;
@@ -1685,6 +2081,7 @@ bool wallet2::delete_address_book_row(std::size_t row_id) {
     return false;
   
   m_address_book.erase(m_address_book.begin()+row_id);
+  m_journal_misc_dirty = true;
 
   return true;
 }
@@ -1812,18 +2209,19 @@ void wallet2::detach_blockchain(uint64_t height)
   LOG_PRINT_L0("Detaching blockchain on height " << height);
   size_t transfers_detached = 0;
 
-  for (size_t i = 0; i < m_transfers.size(); ++i)
+  std::vector<size_t> spent;
+  for (auto it = m_spent_by_height.lower_bound(height); it != m_spent_by_height.end(); ++it)
+    spent.insert(spent.end(), it->second.begin(), it->second.end());
+  for (size_t i: spent)
   {
-    wallet2::transfer_details &td = m_transfers[i];
-    if (td.m_spent && td.m_spent_height >= height)
-    {
-      LOG_PRINT_L1("Resetting spent status for output " << i << ": " << td.m_key_image);
-      set_unspent(i);
-    }
+    LOG_PRINT_L1("Resetting spent status for output " << i << ": " << m_transfers[i].m_key_image);
+    set_unspent(i);
   }
 
-  auto it = std::find_if(m_transfers.begin(), m_transfers.end(), [&](const transfer_details& td){return td.m_block_height >= height;});
-  size_t i_start = it - m_transfers.begin();
+  // transfers are appended in block order, so the detached ones are the tail of m_transfers
+  size_t i_start = m_transfers.size();
+  while (i_start > 0 && m_transfers[i_start - 1].m_block_height >= height)
+    --i_start;
 
   for(size_t i = i_start; i!= m_transfers.size();i++)
   {
@@ -1837,30 +2235,55 @@ void wallet2::detach_blockchain(uint64_t height)
     auto it_pk = m_pub_keys.find(m_transfers[i].get_public_key());
     THROW_WALLET_EXCEPTION_IF(it_pk == m_pub_keys.end(), error::wallet_internal_error, "public key not found");
     m_pub_keys.erase(it_pk);
+    if (m_transfers[i].m_spent)
+      unindex_spent(i);
+    else
+      unaccount_transfer(i);
   }
-  m_transfers.erase(it, m_transfers.end());
+  transfers_detached = m_transfers.size() - i_start;
+  m_transfers.erase(m_transfers.begin() + i_start, m_transfers.end());
+  journal_truncate(height, i_start);
 
   size_t blocks_detached = m_blockchain.end() - (m_blockchain.begin()+height);
   m_blockchain.erase(m_blockchain.begin()+height, m_blockchain.end());
   m_local_bc_height -= blocks_detached;
+  detach_payments(height);
 
-  for (auto it = m_payments.begin(); it != m_payments.end(); )
-  {
-    if(height <= it->second.m_block_height)
-      it = m_payments.erase(it);
-    else
-      ++it;
+  LOG_PRINT_L0("Detached blockchain on height " << height << ", transfers detached " << transfers_detached << ", blocks detached " << blocks_detached);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::detach_payments(uint64_t height)
+{
+  // each payment id is walked once, however many of its payments are detached, so a shared
+  // (or null) payment id costs no more than one pass over its payments
+  auto payments_start = m_payments_by_height.lower_bound(height);
+  std::unordered_set<crypto::hash> detached_payment_ids;
+  for (auto it = payments_start; it != m_payments_by_height.end(); ++it)
+    detached_payment_ids.insert(it->second);
+  for (const crypto::hash &payment_id: detached_payment_ids)
+  {
+    auto range = m_payments.equal_range(payment_id);
+    for (auto pit = range.first; pit != range.second; )
+    {
+      if(height <= pit->second.m_block_height)
+      {
+        unindex_payment(m_payments_by_txid, &*pit);
+        pit = m_payments.erase(pit);
+      }
+      else
+        ++pit;
+    }
   }
+  m_payments_by_height.erase(payments_start, m_payments_by_height.end());
 
-  for (auto it = m_confirmed_txs.begin(); it != m_confirmed_txs.end(); )
+  auto confirmed_start = m_confirmed_txs_by_height.lower_bound(height);
+  for (auto it = confirmed_start; it != m_confirmed_txs_by_height.end(); ++it)
   {
-    if(height <= it->second.m_block_height)
-      it = m_confirmed_txs.erase(it);
-    else
-      ++it;
+    auto cit = m_confirmed_txs.find(it->second);
+    if (cit != m_confirmed_txs.end() && height <= cit->second.m_block_height)
+      m_confirmed_txs.erase(cit);
   }
-
-  LOG_PRINT_L0("Detached blockchain on height " << height << ", transfers detached " << transfers_detached << ", blocks detached " << blocks_detached);
+  m_confirmed_txs_by_height.erase(confirmed_start, m_confirmed_txs_by_height.end());
 }
 //----------------------------------------------------------------------------------------------------
 bool wallet2::deinit()
@@ -1871,6 +2294,9 @@ bool wallet2::deinit()
 //----------------------------------------------------------------------------------------------------
 bool wallet2::clear()
 {
+  // a background store still reads what is cleared here, and the next account must not be
+  // mistaken for the one it writes
+  drain_store();
   m_blockchain.clear();
   m_transfers.clear();
   m_key_images.clear();
@@ -1878,11 +2304,39 @@ bool wallet2::clear()
   m_unconfirmed_txs.clear();
   m_payments.clear();
   m_tx_keys.clear();
+  m_tx_notes.clear();
   m_confirmed_txs.clear();
   m_unconfirmed_payments.clear();
   m_scanned_pool_txs[0].clear();
   m_scanned_pool_txs[1].clear();
   m_address_book.clear();
+  m_spent_by_height.clear();
+  m_payments_by_height.clear();
+  m_confirmed_txs_by_height.clear();
+  m_payments_by_txid.clear();
+  m_unconfirmed_payments_by_txid.clear();
+  m_unspent_amount = 0;
+  m_pending_change = 0;
+  m_unlocked_amount = 0;
+  m_locked_by_height.clear();
+  m_locked_by_time.clear();
+  m_unlocked_by_height.clear();
+  m_spendable_rct.clear();
+  m_spendable_rct_by_index.clear();
+  m_spendable_plain.clear();
+  m_spendable_dust.clear();
+  m_decoy_pools.clear();
+  m_journal_generation = 0;
+  m_journal_touched.clear();
+  m_journal_misc_dirty = false;
+  m_journal_tx_keys.clear();
+  m_journal_tx_notes.clear();
+  m_lmdb_tx_deltas = 0;
+  m_journal_dirty = false;
+  m_journal_full = true;
+  m_journal_records = 0;
+  m_journal_bytes = 0;
+  m_lmdb.reset();
   m_local_bc_height = 1;
   return true;
 }
@@ -1977,7 +2431,7 @@ bool wallet2::store_keys(const std::string& keys_file_name, const std::string& p
 
   // Encrypt the entire JSON object.
   crypto::chacha8_key key;
-  crypto::generate_chacha8_key(password, key);
+  derive_chacha8_key(password.data(), password.size(), key);
   std::string cipher;
   cipher.resize(account_data.size());
   keys_file_data.iv = crypto::rand<crypto::chacha8_iv>();
@@ -1986,6 +2440,8 @@ bool wallet2::store_keys(const std::string& keys_file_name, const std::string& p
 
   std::string buf;
   r = ::serialization::dump_binary(keys_file_data, buf);
+  if (r && lmdb_container())
+    return lmdb_put_keys(buf);
   r = r && epee::file_io_utils::save_string_to_file(keys_file_name, buf); //and never touch wallet_keys_file again, only read
   CHECK_AND_ASSERT_MES(r, false, "failed to generate wallet keys file " << keys_file_name);
 
@@ -2011,14 +2467,16 @@ bool wallet2::load_keys(const std::string& keys_file_name, const std::string& pa
 {
   wallet2::keys_file_data keys_file_data;
   std::string buf;
-  bool r = epee::file_io_utils::load_file_to_string(keys_file_name, buf);
+  // wallets in a container keep their keys there
+  bool r = lmdb_container() && lmdb_get("keys", buf);
+  r = r || epee::file_io_utils::load_file_to_string(keys_file_name, buf);
   THROW_WALLET_EXCEPTION_IF(!r, error::file_read_error, keys_file_name);
 
   // Decrypt the contents
   r = ::serialization::parse_binary(buf, keys_file_data);
   THROW_WALLET_EXCEPTION_IF(!r, error::wallet_internal_error, "internal error: failed to deserialize \"" + keys_file_name + '\"');
   crypto::chacha8_key key;
-  crypto::generate_chacha8_key(password, key);
+  derive_chacha8_key(password.data(), password.size(), key);
   std::string account_data;
   account_data.resize(keys_file_data.account_data.size());
   crypto::chacha8(keys_file_data.account_data.data(), keys_file_data.account_data.size(), key, keys_file_data.iv, &account_data[0]);
@@ -2484,19 +2942,18 @@ bool wallet2::generate_chacha8_key_from_secret_keys(crypto::chacha8_key &key) co
   memcpy(data, &view_key, sizeof(view_key));
   memcpy(data + sizeof(view_key), &spend_key, sizeof(spend_key));
   data[sizeof(data) - 1] = CHACHA8_KEY_TAIL;
-  crypto::generate_chacha8_key(data, sizeof(data), key);
+  derive_chacha8_key(data, sizeof(data), key);
   memset(data, 0, sizeof(data));
   return true;
 }
 //----------------------------------------------------------------------------------------------------
 void wallet2::load(const std::string& wallet_, const std::string& password)
 {
+  drain_store();
   clear();
   prepare_file_names(wallet_);
 
-  boost::system::error_code e;
-  bool exists = boost::filesystem::exists(m_keys_file, e);
-  THROW_WALLET_EXCEPTION_IF(e || !exists, error::file_not_found, m_keys_file);
+  THROW_WALLET_EXCEPTION_IF(!stored_keys_exist(), error::file_not_found, m_keys_file);
 
   if (!load_keys(m_keys_file, password))
   {
@@ -2506,70 +2963,122 @@ void wallet2::load(const std::string& wallet_, const std::string& password)
 
   //keys loaded ok!
   //try to load wallet file. but even if we failed, it is not big problem
-  if(!boost::filesystem::exists(m_wallet_file, e) || e)
+  // the state is in the container, the wallet's own environment or the cache file, whichever is found first
+  boost::system::error_code e;
+  std::string lmdb_source, unused;
+  bool lmdb_rewrite = false;
+  if (lmdb_container() && lmdb_get("address", unused))
+    lmdb_source = m_container;
+  else if (boost::filesystem::exists(m_wallet_file + ".mdb", e) && !e)
+    lmdb_source = m_wallet_file + ".mdb";
+  const bool lmdb = !lmdb_source.empty();
+  if(!lmdb && (!boost::filesystem::exists(m_wallet_file, e) || e))
   {
     LOG_PRINT_L0("file not found: " << m_wallet_file << ", starting with empty blockchain");
     m_account_public_address = m_account.get_keys().m_account_address;
   }
   else
   {
-    wallet2::cache_file_data cache_file_data;
-    std::string buf;
-    bool r = epee::file_io_utils::load_file_to_string(m_wallet_file, buf);
-    THROW_WALLET_EXCEPTION_IF(!r, error::file_read_error, m_wallet_file);
-
-    // try to read it as an encrypted cache
-    try
+    crypto::chacha8_key key;
+    generate_chacha8_key_from_secret_keys(key);
+    if (lmdb)
     {
-      LOG_PRINT_L1("Trying to decrypt cache data");
-
-      r = ::serialization::parse_binary(buf, cache_file_data);
-      THROW_WALLET_EXCEPTION_IF(!r, error::wallet_internal_error, "internal error: failed to deserialize \"" + m_wallet_file + '\"');
-      crypto::chacha8_key key;
-      generate_chacha8_key_from_secret_keys(key);
-      std::string cache_data;
-      cache_data.resize(cache_file_data.cache_data.size());
-      crypto::chacha8(cache_file_data.cache_data.data(), cache_file_data.cache_data.size(), key, cache_file_data.iv, &cache_data[0]);
-
-      std::stringstream iss;
-      iss << cache_data;
-      try {
-        boost::archive::portable_binary_iarchive ar(iss);
-        ar >> *this;
+      lmdb_rewrite = load_lmdb(key, lmdb_source);
+    }
+    else
+    {
+      std::shared_ptr<boost::iostreams::mapped_file_source> cache_file = std::make_shared<boost::iostreams::mapped_file_source>();
+      try
+      {
+        cache_file->open(m_wallet_file);
       }
-      catch (...)
+      catch (const std::exception &e)
       {
-        LOG_PRINT_L0("Failed to open portable binary, trying unportable");
-        boost::filesystem::copy_file(m_wallet_file, m_wallet_file + ".unportable", boost::filesystem::copy_option::overwrite_if_exists);
-        iss.str("");
-        iss << cache_data;
-        boost::archive::binary_iarchive ar(iss);
-        ar >> *this;
+        LOG_ERROR("Failed to map " << m_wallet_file << ": " << e.what());
+        THROW_WALLET_EXCEPTION_IF(true, error::file_read_error, m_wallet_file);
       }
-    }
-    catch (...)
-    {
-      LOG_PRINT_L1("Failed to load encrypted cache, trying unencrypted");
-      std::stringstream iss;
-      iss << buf;
-      try {
-        boost::archive::portable_binary_iarchive ar(iss);
-        ar >> *this;
+      m_journal_base_bytes = cache_file->size();
+
+      const size_t magic_size = strlen(CACHE_FILE_MAGIC);
+      if (cache_file->size() >= magic_size && !memcmp(cache_file->data(), CACHE_FILE_MAGIC, magic_size))
+      {
+        LOG_PRINT_L1("Loading sectioned cache data");
+        // the mapping stays open for as long as a transfer still has its tx prefix in it
+        load_cache_file(cache_file, key);
       }
-      catch (...)
+      else
       {
-        LOG_PRINT_L0("Failed to open portable binary, trying unportable");
-        boost::filesystem::copy_file(m_wallet_file, m_wallet_file + ".unportable", boost::filesystem::copy_option::overwrite_if_exists);
-        iss.str("");
-        iss << buf;
-        boost::archive::binary_iarchive ar(iss);
-        ar >> *this;
+        wallet2::cache_file_data cache_file_data;
+        std::string buf(cache_file->data(), cache_file->size());
+        cache_file->close();
+        bool r;
+
+        // try to read it as an encrypted cache
+        try
+        {
+          LOG_PRINT_L1("Trying to decrypt cache data");
+
+          r = ::serialization::parse_binary(buf, cache_file_data);
+          THROW_WALLET_EXCEPTION_IF(!r, error::wallet_internal_error, "internal error: failed to deserialize \"" + m_wallet_file + '\"');
+          std::string cache_data;
+          cache_data.resize(cache_file_data.cache_data.size());
+          crypto::chacha8(cache_file_data.cache_data.data(), cache_file_data.cache_data.size(), key, cache_file_data.iv, &cache_data[0]);
+
+          std::stringstream iss;
+          iss << cache_data;
+          try {
+            boost::archive::portable_binary_iarchive ar(iss);
+            ar >> *this;
+          }
+          catch (...)
+          {
+            LOG_PRINT_L0("Failed to open portable binary, trying unportable");
+            boost::filesystem::copy_file(m_wallet_file, m_wallet_file + ".unportable", boost::filesystem::copy_option::overwrite_if_exists);
+            iss.str("");
+            iss << cache_data;
+            boost::archive::binary_iarchive ar(iss);
+            ar >> *this;
+          }
+        }
+        catch (...)
+        {
+          LOG_PRINT_L1("Failed to load encrypted cache, trying unencrypted");
+          std::stringstream iss;
+          iss << buf;
+          try {
+            boost::archive::portable_binary_iarchive ar(iss);
+            ar >> *this;
+          }
+          catch (...)
+          {
+            LOG_PRINT_L0("Failed to open portable binary, trying unportable");
+            boost::filesystem::copy_file(m_wallet_file, m_wallet_file + ".unportable", boost::filesystem::copy_option::overwrite_if_exists);
+            iss.str("");
+            iss << buf;
+            try
+            {
+              boost::archive::binary_iarchive ar(iss);
+              ar >> *this;
+            }
+            catch (const std::exception &e)
+            {
+              // none of the formats it could be in
+              THROW_WALLET_EXCEPTION_IF(true, error::wallet_state_corrupt, "Failed to decode " + m_wallet_file + ": " + e.what());
+            }
+          }
+        }
       }
     }
     THROW_WALLET_EXCEPTION_IF(
       m_account_public_address.m_spend_public_key != m_account.get_keys().m_account_address.m_spend_public_key ||
       m_account_public_address.m_view_public_key  != m_account.get_keys().m_account_address.m_view_public_key,
       error::wallet_files_doesnt_correspond, m_keys_file, m_wallet_file);
+
+    if (!lmdb)
+      replay_journal(key);
+    journal_checkpoint();
+    // stored where storage_backend() says from the next store on
+    m_journal_full = lmdb_rewrite || lmdb_source != (m_storage == StorageLmdb ? lmdb_file() : std::string());
   }
 
   cryptonote::block genesis;
@@ -2586,6 +3095,8 @@ void wallet2::load(const std::string& wallet_, const std::string& password)
   }
 
   m_local_bc_height = m_blockchain.size();
+  rebuild_indexes();
+  share_tx_prefixes();
 }
 //----------------------------------------------------------------------------------------------------
 void wallet2::check_genesis(const crypto::hash& genesis_hash) const {
@@ -2599,125 +3110,2547 @@ std::string wallet2::path() const
   return m_wallet_file;
 }
 //----------------------------------------------------------------------------------------------------
-void wallet2::store()
-{
-  store_to("", "");
-}
-//----------------------------------------------------------------------------------------------------
-void wallet2::store_to(const std::string &path, const std::string &password)
+namespace
 {
-  // if file is the same, we do:
-  // 1. save wallet to the *.new file
-  // 2. remove old wallet file
-  // 3. rename *.new to wallet_name
+  // one thread writes the files of all the wallets in the process, in the order their stores were
+  // requested; never torn down, background stores may still be queued when the process exits
+  boost::asio::io_service &store_service()
+  {
+    static boost::asio::io_service *ioservice = new boost::asio::io_service();
+    static boost::asio::io_service::work *work = new boost::asio::io_service::work(*ioservice);
+    static boost::thread *thread = new boost::thread(boost::bind(&boost::asio::io_service::run, ioservice));
+    (void)work;
+    (void)thread;
+    return *ioservice;
+  }
+
+  // the section also tells how a chunk is encoded: CHAIN, TRANSFERS and PAYMENTS are boost archives,
+  // only read from cache files written before the columnar encoding
+  enum
+  {
+    CACHE_SECTION_STATE,
+    CACHE_SECTION_CHAIN,
+    CACHE_SECTION_TRANSFERS,
+    CACHE_SECTION_PAYMENTS,
+    CACHE_SECTION_CONFIRMED_TXS,
+    CACHE_SECTION_MISC,
+    CACHE_SECTION_CHAIN_HASHES,
+    CACHE_SECTION_TRANSFER_COLUMNS,
+    CACHE_SECTION_PAYMENT_COLUMNS,
+    CACHE_SECTION_TX_PREFIXES,
+  };
 
-  // handle if we want just store wallet state to current files (ex store() replacement);
-  bool same_file = true;
-  if (!path.empty())
+  // columnar encoding of the sections holding most of a wallet: each fixed size field is one
+  // contiguous little endian column, copied in bulk instead of going through an archive per element
+  class column_writer
   {
-    std::string canonical_path = boost::filesystem::canonical(m_wallet_file).string();
-    size_t pos = canonical_path.find(path);
-    same_file = pos != std::string::npos;
-  }
+  public:
+    column_writer(std::string &out): m_out(out) {}
 
+    void varint(uint64_t v)
+    {
+      while (v >= 0x80)
+      {
+        m_out.push_back((char)(v | 0x80));
+        v >>= 7;
+      }
+      m_out.push_back((char)v);
+    }
 
-  if (!same_file)
-  {
-    // check if we want to store to directory which doesn't exists yet
-    boost::filesystem::path parent_path = boost::filesystem::path(path).parent_path();
+    void bytes(const void *data, size_t size)
+    {
+      m_out.append((const char*)data, size);
+    }
 
-    // if path is not exists, try to create it
-    if (!parent_path.empty() &&  !boost::filesystem::exists(parent_path))
+    void u64s(const std::vector<uint64_t> &column)
     {
-      boost::system::error_code ec;
-      if (!boost::filesystem::create_directories(parent_path, ec))
+      size_t offset = m_out.size();
+      m_out.resize(offset + column.size() * sizeof(uint64_t));
+      for (size_t i = 0; i < column.size(); ++i)
       {
-        throw std::logic_error(ec.message());
+        uint64_t v = SWAP64LE(column[i]);
+        memcpy(&m_out[offset + i * sizeof(uint64_t)], &v, sizeof(v));
       }
     }
-  }
-  // preparing wallet data
-  std::stringstream oss;
-  boost::archive::portable_binary_oarchive ar(oss);
-  ar << *this;
 
-  wallet2::cache_file_data cache_file_data = boost::value_initialized<wallet2::cache_file_data>();
-  cache_file_data.cache_data = oss.str();
-  crypto::chacha8_key key;
-  generate_chacha8_key_from_secret_keys(key);
-  std::string cipher;
-  cipher.resize(cache_file_data.cache_data.size());
-  cache_file_data.iv = crypto::rand<crypto::chacha8_iv>();
-  crypto::chacha8(cache_file_data.cache_data.data(), cache_file_data.cache_data.size(), key, cache_file_data.iv, &cipher[0]);
-  cache_file_data.cache_data = cipher;
+  private:
+    std::string &m_out;
+  };
 
-  const std::string new_file = same_file ? m_wallet_file + ".new" : path;
-  const std::string old_file = m_wallet_file;
-  const std::string old_keys_file = m_keys_file;
-  const std::string old_address_file = m_wallet_file + ".address.txt";
+  class column_reader
+  {
+  public:
+    column_reader(const std::string &in): m_data(in.data()), m_end(in.data() + in.size()) {}
 
-  // save to new file
-  std::ofstream ostr;
-  ostr.open(new_file, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
-  binary_archive<true> oar(ostr);
-  bool success = ::serialization::serialize(oar, cache_file_data);
-  ostr.close();
-  THROW_WALLET_EXCEPTION_IF(!success || !ostr.good(), error::file_save_error, new_file);
+    uint64_t varint()
+    {
+      uint64_t v = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+        need(1);
+        unsigned char c = *m_data++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+          return v;
+      }
+      throw std::runtime_error("invalid varint in cache file chunk");
+    }
+
+    void bytes(void *data, size_t size)
+    {
+      need(size);
+      memcpy(data, m_data, size);
+      m_data += size;
+    }
+
+    void u64s(std::vector<uint64_t> &column, size_t count)
+    {
+      need(count * sizeof(uint64_t));
+      column.resize(count);
+      for (size_t i = 0; i < count; ++i)
+      {
+        memcpy(&column[i], m_data, sizeof(uint64_t));
+        column[i] = SWAP64LE(column[i]);
+        m_data += sizeof(uint64_t);
+      }
+    }
+
+    const char *take(size_t size)
+    {
+      need(size);
+      const char *data = m_data;
+      m_data += size;
+      return data;
+    }
+
+    size_t left() const { return m_end - m_data; }
+
+  private:
+    void need(size_t size)
+    {
+      if ((size_t)(m_end - m_data) < size)
+        throw std::runtime_error("truncated cache file chunk");
+    }
+
+    const char *m_data;
+    const char *m_end;
+  };
+
+  template<typename T, typename F>
+  void put_column(column_writer &w, const T *items, size_t count, F get)
+  {
+    std::vector<uint64_t> column(count);
+    for (size_t i = 0; i < count; ++i)
+      column[i] = get(items[i]);
+    w.u64s(column);
+  }
+
+  template<typename T, typename F>
+  void get_column(column_reader &r, T *items, size_t count, F set)
+  {
+    std::vector<uint64_t> column;
+    r.u64s(column, count);
+    for (size_t i = 0; i < count; ++i)
+      set(items[i], column[i]);
+  }
+
+  enum
+  {
+    TRANSFER_SPENT = 1,
+    TRANSFER_RCT = 2,
+    TRANSFER_KEY_IMAGE_KNOWN = 4,
+  };
+
+  // tx prefixes of a whole cache file, written apart from the transfers (CACHE_SECTION_TX_PREFIXES)
+  struct prefix_table
+  {
+    std::unordered_map<const void*, uint64_t> index;   // tx_prefix_ref::id() -> position in refs
+    std::vector<tools::tx_prefix_ref> refs;
+  };
+
+  // tx prefixes go inline, each once per chunk, or to the table, each once per cache file
+  std::string encode_transfers(const tools::wallet2::transfer_details *tds, size_t count, prefix_table *table = NULL)
+  {
+    typedef tools::wallet2::transfer_details td_t;
+    std::string out;
+    column_writer w(out);
+    w.varint(CACHE_COLUMNS_VERSION);
+    w.varint(count);
+    w.varint(table ? 1 : 0);
+    put_column(w, tds, count, [](const td_t &td) { return td.m_block_height; });
+    put_column(w, tds, count, [](const td_t &td) { return td.m_global_output_index; });
+    put_column(w, tds, count, [](const td_t &td) { return (uint64_t)td.m_internal_output_index; });
+    put_column(w, tds, count, [](const td_t &td) { return td.m_amount; });
+    put_column(w, tds, count, [](const td_t &td) { return td.m_spent_height; });
+    put_column(w, tds, count, [](const td_t &td) { return (uint64_t)td.m_pk_index; });
+    put_column(w, tds, count, [](const td_t &td) { return td.m_unlock_time; });
+    for (size_t i = 0; i < count; ++i)
+    {
+      const td_t &td = tds[i];
+      uint8_t flags = (td.m_spent ? TRANSFER_SPENT : 0) | (td.m_rct ? TRANSFER_RCT : 0) | (td.m_key_image_known ? TRANSFER_KEY_IMAGE_KNOWN : 0);
+      w.bytes(&flags, 1);
+    }
+    for (size_t i = 0; i < count; ++i)
+      w.bytes(&tds[i].m_txid, sizeof(crypto::hash));
+    for (size_t i = 0; i < count; ++i)
+      w.bytes(&tds[i].m_key_image, sizeof(crypto::key_image));
+    for (size_t i = 0; i < count; ++i)
+      w.bytes(&tds[i].m_mask, sizeof(rct::key));
+    for (size_t i = 0; i < count; ++i)
+      w.bytes(&tds[i].m_public_key, sizeof(crypto::public_key));
+
+    // outputs of the same tx share its prefix, which is written once
+    prefix_table local;
+    prefix_table &prefixes = table ? *table : local;
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (!tds[i].m_tx)
+        throw std::runtime_error("transfer without tx prefix");
+      auto it = prefixes.index.emplace(tds[i].m_tx.id(), prefixes.refs.size());
+      if (it.second)
+        prefixes.refs.push_back(tds[i].m_tx);
+      w.varint(it.first->second);
+    }
+    if (table)
+      return out;
+    w.varint(local.refs.size());
+    for (const tools::tx_prefix_ref &prefix: local.refs)
+    {
+      const std::string blob = prefix.blob();
+      w.varint(blob.size());
+      w.bytes(blob.data(), blob.size());
+    }
+    return out;
+  }
+
+  std::shared_ptr<const cryptonote::transaction_prefix> parse_tx_prefix(const char *blob, size_t size)
+  {
+    std::shared_ptr<cryptonote::transaction_prefix> parsed = std::make_shared<cryptonote::transaction_prefix>();
+    if (!::serialization::parse_binary(std::string(blob, size), *parsed))
+      throw std::runtime_error("failed to parse tx prefix");
+    return parsed;
+  }
+
+  // prefixes written to a table are taken from source, as cold refs, their ids offset by first_id
+  void decode_transfers(const std::string &in, tools::wallet2::transfer_details *tds, size_t count, const std::shared_ptr<tools::tx_prefix_source> &source = std::shared_ptr<tools::tx_prefix_source>(),
+      uint64_t first_id = 0)
+  {
+    typedef tools::wallet2::transfer_details td_t;
+    column_reader r(in);
+    const uint64_t version = r.varint();
+    if (version != 1 && version != CACHE_COLUMNS_VERSION)
+      throw std::runtime_error("unsupported transfers encoding");
+    if (r.varint() != count)
+      throw std::runtime_error("transfer count mismatch");
+    // version 1 has neither the fields out of the prefixes nor prefixes apart
+    const bool external = version > 1 && r.varint() != 0;
+    if (external && !source)
+      throw std::runtime_error("transfers without tx prefixes");
+    get_column(r, tds, count, [](td_t &td, uint64_t v) { td.m_block_height = v; });
+    get_column(r, tds, count, [](td_t &td, uint64_t v) { td.m_global_output_index = v; });
+    get_column(r, tds, count, [](td_t &td, uint64_t v) { td.m_internal_output_index = v; });
+    get_column(r, tds, count, [](td_t &td, uint64_t v) { td.m_amount = v; });
+    get_column(r, tds, count, [](td_t &td, uint64_t v) { td.m_spent_height = v; });
+    get_column(r, tds, count, [](td_t &td, uint64_t v) { td.m_pk_index = v; });
+    if (version > 1)
+      get_column(r, tds, count, [](td_t &td, uint64_t v) { td.m_unlock_time = v; });
+    const char *flags = r.take(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      tds[i].m_spent = flags[i] & TRANSFER_SPENT;
+      tds[i].m_rct = flags[i] & TRANSFER_RCT;
+      tds[i].m_key_image_known = flags[i] & TRANSFER_KEY_IMAGE_KNOWN;
+    }
+    for (size_t i = 0; i < count; ++i)
+      r.bytes(&tds[i].m_txid, sizeof(crypto::hash));
+    for (size_t i = 0; i < count; ++i)
+      r.bytes(&tds[i].m_key_image, sizeof(crypto::key_image));
+    for (size_t i = 0; i < count; ++i)
+      r.bytes(&tds[i].m_mask, sizeof(rct::key));
+    if (version > 1)
+      for (size_t i = 0; i < count; ++i)
+        r.bytes(&tds[i].m_public_key, sizeof(crypto::public_key));
+
+    std::vector<uint64_t> prefix_index(count);
+    for (size_t i = 0; i < count; ++i)
+      prefix_index[i] = r.varint();
+    if (external)
+    {
+      for (size_t i = 0; i < count; ++i)
+      {
+        if (prefix_index[i] >= source->size() - first_id)
+          throw std::runtime_error("invalid tx prefix index");
+        tds[i].m_tx = source->ref(first_id + prefix_index[i]);
+      }
+      return;
+    }
+
+    std::vector<std::shared_ptr<const cryptonote::transaction_prefix>> prefixes(r.varint());
+    for (std::shared_ptr<const cryptonote::transaction_prefix> &prefix: prefixes)
+    {
+      size_t size = r.varint();
+      prefix = parse_tx_prefix(r.take(size), size);
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (prefix_index[i] >= prefixes.size())
+        throw std::runtime_error("invalid tx prefix index");
+      if (prefixes[prefix_index[i]]->vout.size() <= tds[i].m_internal_output_index)
+        throw std::runtime_error("transfer output index past the tx outputs");
+      if (version > 1)
+        tds[i].m_tx = prefixes[prefix_index[i]];
+      else
+        tds[i].set_tx(prefixes[prefix_index[i]]);
+    }
+  }
+
+  // a chunk of CACHE_SECTION_TX_PREFIXES: the serialized prefixes, each prefixed by its size
+  std::string encode_prefixes(const std::vector<tools::tx_prefix_ref> &refs, size_t start, size_t count)
+  {
+    std::string out;
+    column_writer w(out);
+    w.varint(count);
+    for (size_t i = start; i < start + count; ++i)
+    {
+      const std::string blob = refs[i].blob();
+      w.varint(blob.size());
+      w.bytes(blob.data(), blob.size());
+    }
+    return out;
+  }
+
+  void decode_prefixes(const std::string &in, std::vector<std::string> &blobs)
+  {
+    column_reader r(in);
+    uint64_t count = r.varint();
+    if (count > in.size())
+      throw std::runtime_error("invalid tx prefix count");
+    blobs.resize(count);
+    for (std::string &blob: blobs)
+    {
+      size_t size = r.varint();
+      blob.assign(r.take(size), size);
+    }
+  }
+
+  void wipe(void *data, size_t size)
+  {
+    volatile char *p = (volatile char*)data;
+    while (size--)
+      *p++ = 0;
+  }
+
+  // decrypts, checks and decompresses one chunk of a cache file body
+  std::string open_cache_chunk(const tools::wallet2::cache_chunk &chunk, const char *body, const crypto::chacha8_key &key)
+  {
+    std::string compressed;
+    compressed.resize(chunk.size);
+    crypto::chacha8(body + chunk.offset, chunk.size, key, chunk.iv, &compressed[0]);
+    if (crypto::cn_fast_hash(compressed.data(), compressed.size()) != chunk.checksum)
+      throw std::runtime_error("corrupt cache file chunk at offset " + std::to_string(chunk.offset));
+
+    std::string plaintext;
+    boost::iostreams::filtering_istream is;
+    is.push(boost::iostreams::zlib_decompressor());
+    is.push(boost::iostreams::array_source(compressed.data(), compressed.size()));
+    boost::iostreams::copy(is, boost::iostreams::back_inserter(plaintext));
+    return plaintext;
+  }
+
+  /*!
+   * Tx prefixes of a loaded cache file, left in its mapping and decoded a chunk at a time when a transfer
+   * needs one. The mapping outlives a rewrite of the file, the old one is freed with the last cold prefix.
+   */
+  class cache_file_prefixes: public tools::tx_prefix_source
+  {
+  public:
+    cache_file_prefixes(const std::shared_ptr<boost::iostreams::mapped_file_source> &file, const char *body, const crypto::chacha8_key &key, const std::string &name):
+      m_file(file), m_body(body), m_key(key), m_name(name), m_size(0), m_last((size_t)-1) {}
+
+    ~cache_file_prefixes()
+    {
+      wipe(&m_key, sizeof(m_key));
+    }
+
+    // chunks are added in the order of their start
+    void add(const tools::wallet2::cache_chunk &chunk)
+    {
+      THROW_WALLET_EXCEPTION_IF(chunk.start != m_size || chunk.count > CACHE_CHUNK_PREFIXES, tools::error::wallet_state_corrupt,
+          "Invalid tx prefix chunk in " + m_name);
+      m_chunks.push_back(chunk);
+      m_size += chunk.count;
+    }
+
+    uint64_t size() const { return m_size; }
+
+    std::string blob(uint64_t id)
+    {
+      THROW_WALLET_EXCEPTION_IF(id >= m_size, tools::error::wallet_internal_error, "No tx prefix " + std::to_string(id) + " in " + m_name);
+      const size_t n = id / CACHE_CHUNK_PREFIXES;
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      // exports and signing walk transfers in order, so the chunk decoded last is kept
+      if (n != m_last)
+      {
+        try
+        {
+          decode_prefixes(open_cache_chunk(m_chunks[n], m_body, m_key), m_blobs);
+        }
+        catch (const std::exception &e)
+        {
+          m_last = (size_t)-1;
+          THROW_WALLET_EXCEPTION_IF(true, tools::error::wallet_internal_error, std::string("Failed to decode tx prefixes of ") + m_name + ": " + e.what());
+        }
+        THROW_WALLET_EXCEPTION_IF(m_blobs.size() != m_chunks[n].count, tools::error::wallet_internal_error, "Tx prefix count mismatch in " + m_name);
+        m_last = n;
+      }
+      return m_blobs[id - m_chunks[n].start];
+    }
+
+  private:
+    std::shared_ptr<boost::iostreams::mapped_file_source> m_file;
+    const char *m_body;
+    crypto::chacha8_key m_key;
+    const std::string m_name;
+    std::vector<tools::wallet2::cache_chunk> m_chunks;
+    uint64_t m_size;
+    boost::mutex m_mutex;
+    size_t m_last;
+    std::vector<std::string> m_blobs;
+  };
+
+  // of a payment_container, or of a range of one in a vector of pairs
+  template<typename C>
+  std::string encode_payments(const C &payments)
+  {
+    typedef typename C::value_type p_t;
+    std::vector<const p_t*> items;
+    items.reserve(payments.size());
+    for (const p_t &p: payments)
+      items.push_back(&p);
+
+    std::string out;
+    column_writer w(out);
+    w.varint(CACHE_COLUMNS_VERSION);
+    w.varint(items.size());
+    for (const p_t *p: items)
+      w.bytes(&p->first, sizeof(crypto::hash));
+    for (const p_t *p: items)
+      w.bytes(&p->second.m_tx_hash, sizeof(crypto::hash));
+    put_column(w, items.data(), items.size(), [](const p_t *p) { return p->second.m_amount; });
+    put_column(w, items.data(), items.size(), [](const p_t *p) { return p->second.m_block_height; });
+    put_column(w, items.data(), items.size(), [](const p_t *p) { return p->second.m_unlock_time; });
+    put_column(w, items.data(), items.size(), [](const p_t *p) { return p->second.m_timestamp; });
+    return out;
+  }
+
+  void decode_payments(const std::string &in, std::vector<std::pair<crypto::hash, tools::wallet2::payment_details>> &payments)
+  {
+    typedef std::pair<crypto::hash, tools::wallet2::payment_details> p_t;
+    column_reader r(in);
+    if (r.varint() != CACHE_COLUMNS_VERSION)
+      throw std::runtime_error("unsupported payments encoding");
+    uint64_t count = r.varint();
+    if (count > in.size())
+      throw std::runtime_error("invalid payment count");
+    std::vector<p_t> items(count);
+    for (p_t &p: items)
+      r.bytes(&p.first, sizeof(crypto::hash));
+    for (p_t &p: items)
+      r.bytes(&p.second.m_tx_hash, sizeof(crypto::hash));
+    get_column(r, items.data(), items.size(), [](p_t &p, uint64_t v) { p.second.m_amount = v; });
+    get_column(r, items.data(), items.size(), [](p_t &p, uint64_t v) { p.second.m_block_height = v; });
+    get_column(r, items.data(), items.size(), [](p_t &p, uint64_t v) { p.second.m_unlock_time = v; });
+    get_column(r, items.data(), items.size(), [](p_t &p, uint64_t v) { p.second.m_timestamp = v; });
+    payments.insert(payments.end(), items.begin(), items.end());
+  }
+
+  // little endian size prefix of journal records and of the cache file index
+  void write_size(std::ostream &os, size_t size)
+  {
+    char buf[4];
+    for (size_t n = 0; n < sizeof(buf); ++n)
+      buf[n] = (char)(size >> (8 * n));
+    os.write(buf, sizeof(buf));
+  }
+
+  size_t read_size(const char *buf)
+  {
+    size_t size = 0;
+    for (size_t n = 0; n < 4; ++n)
+      size |= (size_t)(unsigned char)buf[n] << (8 * n);
+    return size;
+  }
+
+  bool sync_file(const std::string &path)
+  {
+#ifdef WIN32
+    return true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    int r = ::fsync(fd);
+    ::close(fd);
+    return r == 0;
+#endif
+  }
+
+  struct lmdb_txn
+  {
+    boost::shared_lock<boost::shared_mutex> lock;   // see wallet_lmdb::begin
+    MDB_txn *txn;
+
+    lmdb_txn(): txn(NULL) {}
+    ~lmdb_txn() { if (txn) mdb_txn_abort(txn); }
+    int commit() { int r = mdb_txn_commit(txn); txn = NULL; return r; }
+  };
+
+  // values of <wallet>.mdb are the iv followed by the encrypted plaintext
+  std::string seal_value(const crypto::chacha8_key &key, const std::string &plaintext)
+  {
+    const crypto::chacha8_iv iv = crypto::rand<crypto::chacha8_iv>();
+    std::string value(sizeof(iv) + plaintext.size(), '\0');
+    memcpy(&value[0], &iv, sizeof(iv));
+    crypto::chacha8(plaintext.data(), plaintext.size(), key, iv, &value[sizeof(iv)]);
+    return value;
+  }
+
+  std::string open_value(const crypto::chacha8_key &key, const MDB_val &value)
+  {
+    crypto::chacha8_iv iv;
+    if (value.mv_size < sizeof(iv))
+      throw std::runtime_error("truncated wallet database value");
+    memcpy(&iv, value.mv_data, sizeof(iv));
+    std::string plaintext(value.mv_size - sizeof(iv), '\0');
+    crypto::chacha8((const char*)value.mv_data + sizeof(iv), plaintext.size(), key, iv, &plaintext[0]);
+    return plaintext;
+  }
+
+  // state rows named this and a big endian sequence number hold the tx keys and notes added by one
+  // store each, in order; a full store writes them all under 0
+  const std::string LMDB_STATE_TX_DELTAS = "tx keys ";
+
+  std::string lmdb_tx_delta_name(uint64_t seq)
+  {
+    const uint64_t be = SWAP64BE(seq);
+    return LMDB_STATE_TX_DELTAS + std::string((const char*)&be, sizeof(be));
+  }
+
+  // what a row key is hashed with, along with its height or transfer index
+  enum : char
+  {
+    LMDB_ROW_BLOCK = 'b',
+    LMDB_ROW_TRANSFER = 't',
+    LMDB_ROW_PAYMENTS = 'p',
+    LMDB_ROW_CONFIRMED_TXS = 'c',
+  };
+
+  /*!
+   * Keys and values of one wallet's rows. A row is keyed by a hash of its table and height or transfer index
+   * under a secret out of the cache key, and the height or index goes first in its encrypted value, so that
+   * keys tell nothing of the wallet's history but the number of rows.
+   */
+  class lmdb_row_codec
+  {
+  public:
+    explicit lmdb_row_codec(const crypto::chacha8_key &key): m_key(key)
+    {
+      static const char tag[] = "wallet lmdb row keys";
+      char data[sizeof(tag) + sizeof(crypto::chacha8_key)];
+      memcpy(data, tag, sizeof(tag));
+      memcpy(data + sizeof(tag), &key, sizeof(key));
+      m_secret = crypto::cn_fast_hash(data, sizeof(data));
+      wipe(data, sizeof(data));
+    }
+
+    ~lmdb_row_codec()
+    {
+      wipe(&m_key, sizeof(m_key));
+      wipe(&m_secret, sizeof(m_secret));
+    }
+
+    std::string key(char table, uint64_t idx) const
+    {
+      char data[sizeof(crypto::hash) + 1 + sizeof(uint64_t)];
+      memcpy(data, &m_secret, sizeof(m_secret));
+      data[sizeof(m_secret)] = table;
+      const uint64_t le = SWAP64LE(idx);
+      memcpy(data + sizeof(m_secret) + 1, &le, sizeof(le));
+      const crypto::hash hash = crypto::cn_fast_hash(data, sizeof(data));
+      wipe(data, sizeof(data));
+      return std::string((const char*)&hash, sizeof(hash));
+    }
+
+    std::string seal(uint64_t idx, const std::string &payload) const
+    {
+      const uint64_t le = SWAP64LE(idx);
+      std::string plaintext((const char*)&le, sizeof(le));
+      plaintext += payload;
+      return seal_value(m_key, plaintext);
+    }
+
+    // the row's height or index
+    uint64_t open(const MDB_val &value, std::string &payload) const
+    {
+      payload = open_value(m_key, value);
+      uint64_t le;
+      if (payload.size() < sizeof(le))
+        throw std::runtime_error("truncated wallet database row");
+      memcpy(&le, payload.data(), sizeof(le));
+      payload.erase(0, sizeof(le));
+      return SWAP64LE(le);
+    }
+
+    // rows keyed by their plain height or index, before keys were hashed, have the value only
+    std::string open_legacy(const MDB_val &value) const { return open_value(m_key, value); }
+
+  private:
+    crypto::chacha8_key m_key;
+    crypto::hash m_secret;
+  };
+
+  // a transfer row: the transfer with its tx prefix in a table of its own, then the serialized prefix,
+  // so that the transfer is decoded without it
+  std::string encode_transfer_row(const tools::wallet2::transfer_details &td)
+  {
+    prefix_table table;
+    const std::string transfer = encode_transfers(&td, 1, &table);
+    const std::string blob = table.refs[0].blob();
+    std::string out;
+    column_writer w(out);
+    w.varint(transfer.size());
+    w.bytes(transfer.data(), transfer.size());
+    w.bytes(blob.data(), blob.size());
+    return out;
+  }
+
+  // the transfer of row idx, its prefix left cold in source; prefix_hash is the hash of the prefix
+  void decode_transfer_row(const std::string &in, tools::wallet2::transfer_details &td, const std::shared_ptr<tools::tx_prefix_source> &source, uint64_t idx, crypto::hash &prefix_hash)
+  {
+    column_reader r(in);
+    const size_t size = r.varint();
+    decode_transfers(std::string(r.take(size), size), &td, 1, source, idx);
+    const size_t left = r.left();
+    prefix_hash = crypto::cn_fast_hash(r.take(left), left);
+  }
+
+  std::string transfer_row_prefix(const std::string &in)
+  {
+    column_reader r(in);
+    const size_t size = r.varint();
+    r.take(size);
+    const size_t left = r.left();
+    return std::string(r.take(left), left);
+  }
+}
+
+typedef std::vector<std::pair<std::string, std::string>> lmdb_rows;   // row key (see lmdb_row_codec) -> encrypted value, empty to delete
+
+// what one store of a wallet writes to its wallet_lmdb, encoded and encrypted ahead of the transaction
+struct wallet_lmdb_batch
+{
+  std::string m_prefix;
+  bool m_replace;                // the wallet's chain, transfer, payment and confirmed tx rows are all rewritten
+  lmdb_rows m_blocks;
+  lmdb_rows m_transfers;
+  lmdb_rows m_payments;
+  lmdb_rows m_confirmed_txs;
+  std::vector<std::pair<std::string, std::string>> m_state;
+  bool m_full;
+  wallet2::FsyncPolicy m_fsync;
+  std::function<void(std::exception_ptr)> m_done;
+};
+
+/*!
+ * LMDB environment holding the state of StorageLmdb wallets: the <wallet>.mdb of one wallet, or a container
+ * shared by many, where each wallet's keys start with its prefix (see wallet2::lmdb_prefix) and its keys
+ * file is the "keys" state row. An environment is open once per process (see open), and the batches queued
+ * on it by any number of wallets go to disk as one transaction with one sync (see commit_async).
+ *
+ * Under the prefix, the chain, transfers, payments and confirmed txs are keyed by opaque row keys (see
+ * lmdb_row_codec), with the height or transfer index in the value, encrypted with the wallet's cache key.
+ * The rows cut off by a detach are deleted by key, the wallet knowing how many it wrote (see lmdb_batch).
+ *
+ * LMDB only lets the map grow with no transaction live in the process, while the environment may be
+ * read by any number of wallets: every transaction holds m_txn_mutex shared, a resize holds it exclusive.
+ */
+class wallet_lmdb: public std::enable_shared_from_this<wallet_lmdb>
+{
+public:
+  explicit wallet_lmdb(const std::string &file);
+  ~wallet_lmdb();
+
+  static std::shared_ptr<wallet_lmdb> open(const std::string &file);
+
+  // applies the batch, with whatever else is queued, before returning
+  void commit(const std::shared_ptr<wallet_lmdb_batch> &batch);
+  // queues the batch for a commit on the store thread, batch.m_done is called once it is on disk
+  void commit_async(const std::shared_ptr<wallet_lmdb_batch> &batch);
+  bool get(const std::string &prefix, const std::string &name, std::string &value);
+  // transfers come with their tx prefixes cold, read back from here when needed; returns true if the rows
+  // are still keyed by plain height or index, and need a full store to be rewritten
+  bool read(const std::string &prefix, const crypto::chacha8_key &key, cryptonote::account_public_address &address, wallet2::journal_record &record,
+      uint64_t &tx_deltas);
+  std::string transfer_prefix(const std::string &prefix, const lmdb_row_codec &codec, uint64_t idx);
+  void erase(const std::string &prefix);
+  void copy(const std::string &file);
+
+private:
+  void flush();
+  void apply(const std::vector<std::shared_ptr<wallet_lmdb_batch>> &batches);
+  void check(int r, const char *what) const;
+  void begin(lmdb_txn &txn, unsigned int flags);
+  uint64_t map_size_for(uint64_t bytes) const;
+  void reserve(uint64_t bytes);
+  void put(MDB_txn *txn, MDB_dbi dbi, const std::string &prefix, const lmdb_rows &rows);
+  void clear(MDB_txn *txn, MDB_dbi dbi, const std::string &prefix);
+  void walk(MDB_txn *txn, MDB_dbi dbi, const std::string &prefix, char table, const lmdb_row_codec &codec, bool &legacy,
+      const std::function<void(uint64_t, const std::string&)> &f);
+  uint64_t read_tx_deltas(MDB_txn *txn, const std::string &prefix, const crypto::chacha8_key &key, wallet2::journal_record &record);
+  uint64_t count_rows(MDB_txn *txn, MDB_dbi dbi, const std::string &prefix);
+
+  std::string m_file;
+  MDB_env *m_env;
+  MDB_dbi m_state;          // "address", "misc" (see journal_misc), "keys", tx key and note rows (see lmdb_tx_delta_name)
+  MDB_dbi m_blocks;         // row key -> height, block hash
+  MDB_dbi m_transfers;      // row key -> m_transfers index, columnar transfer and its tx prefix
+  MDB_dbi m_payments;       // row key -> height, columnar payments
+  MDB_dbi m_confirmed_txs;  // row key -> height, confirmed txs
+  boost::shared_mutex m_txn_mutex;                           // shared by every transaction, exclusive to resize the map
+  boost::mutex m_commit_mutex;                               // held by the one flush writing
+  boost::mutex m_queue_mutex;
+  std::vector<std::shared_ptr<wallet_lmdb_batch>> m_queue;
+  bool m_flush_posted;
+};
+
+namespace
+{
+  /*!
+   * Tx prefixes of the transfers read from a wallet_lmdb, left in their rows; a prefix is read back by the
+   * index of the transfer whose row has it. Rows are rewritten with the same prefix or not at all while
+   * the transfer is in the wallet.
+   */
+  class lmdb_tx_prefixes: public tools::tx_prefix_source
+  {
+  public:
+    lmdb_tx_prefixes(const std::shared_ptr<wallet_lmdb> &lmdb, const std::string &prefix, const lmdb_row_codec &codec, uint64_t rows):
+      m_lmdb(lmdb), m_prefix(prefix), m_codec(codec), m_rows(rows) {}
+
+    // the transfer rows there were when the wallet was read, the transfers with a cold prefix
+    uint64_t size() const { return m_rows; }
+    std::string blob(uint64_t id)
+    {
+      THROW_WALLET_EXCEPTION_IF(id >= m_rows, tools::error::wallet_internal_error, "No tx prefix " + std::to_string(id));
+      return m_lmdb->transfer_prefix(m_prefix, m_codec, id);
+    }
+
+  private:
+    std::shared_ptr<wallet_lmdb> m_lmdb;
+    const std::string m_prefix;
+    const lmdb_row_codec m_codec;
+    const uint64_t m_rows;
+  };
+}
+//----------------------------------------------------------------------------------------------------
+wallet_lmdb::wallet_lmdb(const std::string &file): m_file(file), m_env(NULL), m_flush_posted(false)
+{
+  check(mdb_env_create(&m_env), "create environment");
+  try
+  {
+    check(mdb_env_set_maxdbs(m_env, 5), "set max databases");
+    check(mdb_env_set_mapsize(m_env, WALLET_LMDB_MAP_SIZE), "set map size");
+    check(mdb_env_open(m_env, file.c_str(), MDB_NOSUBDIR | MDB_NOTLS, 0600), "open environment");
+
+    lmdb_txn txn;
+    begin(txn, 0);
+    check(mdb_dbi_open(txn.txn, "state", MDB_CREATE, &m_state), "open database");
+    check(mdb_dbi_open(txn.txn, "blocks", MDB_CREATE, &m_blocks), "open database");
+    check(mdb_dbi_open(txn.txn, "transfers", MDB_CREATE, &m_transfers), "open database");
+    check(mdb_dbi_open(txn.txn, "payments", MDB_CREATE, &m_payments), "open database");
+    check(mdb_dbi_open(txn.txn, "confirmed_txs", MDB_CREATE, &m_confirmed_txs), "open database");
+    check(txn.commit(), "commit transaction");
+  }
+  catch (...)
+  {
+    mdb_env_close(m_env);
+    throw;
+  }
+}
+//----------------------------------------------------------------------------------------------------
+wallet_lmdb::~wallet_lmdb()
+{
+  mdb_env_close(m_env);
+}
+//----------------------------------------------------------------------------------------------------
+std::shared_ptr<wallet_lmdb> wallet_lmdb::open(const std::string &file)
+{
+  // LMDB allows one environment per file in a process, wallets sharing a container share it
+  static boost::mutex mutex;
+  static std::map<std::string, std::weak_ptr<wallet_lmdb>> envs;
+
+  const std::string path = boost::filesystem::absolute(file).string();
+  boost::lock_guard<boost::mutex> lock(mutex);
+  std::shared_ptr<wallet_lmdb> env = envs[path].lock();
+  if (!env)
+  {
+    env = std::make_shared<wallet_lmdb>(path);
+    envs[path] = env;
+  }
+  return env;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::check(int r, const char *what) const
+{
+  if (!r)
+    return;
+  const std::string message = std::string("Failed to ") + what + " of " + m_file + ": " + mdb_strerror(r);
+  THROW_WALLET_EXCEPTION_IF(r == MDB_CORRUPTED || r == MDB_PAGE_NOTFOUND || r == MDB_INVALID || r == MDB_VERSION_MISMATCH,
+      error::wallet_state_corrupt, message);
+  THROW_WALLET_EXCEPTION_IF(true, error::wallet_internal_error, message);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::begin(lmdb_txn &txn, unsigned int flags)
+{
+  txn.lock = boost::shared_lock<boost::shared_mutex>(m_txn_mutex);
+  int r = mdb_txn_begin(m_env, NULL, flags, &txn.txn);
+  if (r == MDB_MAP_RESIZED)
+  {
+    // grown by another process, taken up once no transaction is live here
+    txn.lock.unlock();
+    {
+      boost::unique_lock<boost::shared_mutex> lock(m_txn_mutex);
+      check(mdb_env_set_mapsize(m_env, 0), "adopt map size");
+    }
+    txn.lock.lock();
+    r = mdb_txn_begin(m_env, NULL, flags, &txn.txn);
+  }
+  check(r, "begin transaction");
+}
+//----------------------------------------------------------------------------------------------------
+uint64_t wallet_lmdb::map_size_for(uint64_t bytes) const
+{
+  MDB_envinfo info;
+  MDB_stat stat;
+  check(mdb_env_info(m_env, &info), "read environment info");
+  check(mdb_env_stat(m_env, &stat), "read environment stats");
+  const uint64_t needed = (uint64_t)stat.ms_psize * info.me_last_pgno + bytes * WALLET_LMDB_MAP_SLACK;
+  if (needed <= info.me_mapsize)
+    return 0;
+
+  uint64_t size = info.me_mapsize;
+  while (size < needed)
+    size *= 2;
+  return size;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::reserve(uint64_t bytes)
+{
+  {
+    boost::shared_lock<boost::shared_mutex> lock(m_txn_mutex);
+    if (!map_size_for(bytes))
+      return;
+  }
+
+  // waits for the readers of every wallet in the environment, and holds new ones off meanwhile
+  boost::unique_lock<boost::shared_mutex> lock(m_txn_mutex);
+  const uint64_t size = map_size_for(bytes);
+  if (!size)
+    return;
+  LOG_PRINT_L1("Growing " << m_file << " map to " << size << " bytes");
+  check(mdb_env_set_mapsize(m_env, size), "grow map");
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::put(MDB_txn *txn, MDB_dbi dbi, const std::string &prefix, const lmdb_rows &rows)
+{
+  for (const auto &e: rows)
+  {
+    const std::string k = prefix + e.first;
+    MDB_val key = {k.size(), (void*)k.data()};
+    if (e.second.empty())
+    {
+      int r = mdb_del(txn, dbi, &key, NULL);
+      if (r != MDB_NOTFOUND)
+        check(r, "delete");
+      continue;
+    }
+    MDB_val value = {e.second.size(), (void*)e.second.data()};
+    check(mdb_put(txn, dbi, &key, &value, 0), "write");
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::clear(MDB_txn *txn, MDB_dbi dbi, const std::string &prefix)
+{
+  MDB_cursor *cursor;
+  check(mdb_cursor_open(txn, dbi, &cursor), "open cursor");
+  MDB_val key = {prefix.size(), (void*)prefix.data()}, value;
+  int r = mdb_cursor_get(cursor, &key, &value, MDB_SET_RANGE);
+  while (!r && key.mv_size >= prefix.size() && !memcmp(key.mv_data, prefix.data(), prefix.size()))
+  {
+    r = mdb_cursor_del(cursor, 0);
+    if (!r)
+      r = mdb_cursor_get(cursor, &key, &value, MDB_NEXT);
+  }
+  mdb_cursor_close(cursor);
+  if (r && r != MDB_NOTFOUND)
+    check(r, "delete");
+}
+//----------------------------------------------------------------------------------------------------
+uint64_t wallet_lmdb::count_rows(MDB_txn *txn, MDB_dbi dbi, const std::string &prefix)
+{
+  // a wallet of its own has the whole table, in a container only the keys under its prefix are its rows
+  if (prefix.empty())
+  {
+    MDB_stat stat;
+    check(mdb_stat(txn, dbi, &stat), "stat database");
+    return stat.ms_entries;
+  }
+  uint64_t count = 0;
+  MDB_cursor *cursor;
+  check(mdb_cursor_open(txn, dbi, &cursor), "open cursor");
+  MDB_val key = {prefix.size(), (void*)prefix.data()}, value;
+  int r;
+  for (r = mdb_cursor_get(cursor, &key, &value, MDB_SET_RANGE); !r; r = mdb_cursor_get(cursor, &key, &value, MDB_NEXT))
+  {
+    if (key.mv_size < prefix.size() || memcmp(key.mv_data, prefix.data(), prefix.size()))
+      break;
+    ++count;
+  }
+  mdb_cursor_close(cursor);
+  if (r && r != MDB_NOTFOUND)
+    check(r, "read");
+  return count;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::walk(MDB_txn *txn, MDB_dbi dbi, const std::string &prefix, char table, const lmdb_row_codec &codec, bool &legacy,
+    const std::function<void(uint64_t, const std::string&)> &f)
+{
+  MDB_cursor *cursor;
+  check(mdb_cursor_open(txn, dbi, &cursor), "open cursor");
+  try
+  {
+    MDB_val k = {prefix.size(), (void*)prefix.data()}, value;
+    int r;
+    for (r = mdb_cursor_get(cursor, &k, &value, MDB_SET_RANGE); !r; r = mdb_cursor_get(cursor, &k, &value, MDB_NEXT))
+    {
+      if (k.mv_size < prefix.size() || memcmp(k.mv_data, prefix.data(), prefix.size()))
+        break;
+      // rows are read whole, one that fails to decode is corrupt
+      try
+      {
+        uint64_t idx;
+        if (k.mv_size == prefix.size() + sizeof(idx))
+        {
+          memcpy(&idx, (const char*)k.mv_data + prefix.size(), sizeof(idx));
+          legacy = true;
+          f(SWAP64BE(idx), codec.open_legacy(value));
+          continue;
+        }
+        THROW_WALLET_EXCEPTION_IF(k.mv_size != prefix.size() + sizeof(crypto::hash), error::wallet_state_corrupt, "Invalid key in " + m_file);
+        std::string payload;
+        idx = codec.open(value, payload);
+        // a row moved under another key would decrypt all the same
+        THROW_WALLET_EXCEPTION_IF(memcmp((const char*)k.mv_data + prefix.size(), codec.key(table, idx).data(), sizeof(crypto::hash)),
+            error::wallet_state_corrupt, "Row key mismatch in " + m_file);
+        f(idx, payload);
+      }
+      catch (const error::wallet_state_corrupt &)
+      {
+        throw;
+      }
+      catch (const std::bad_alloc &)
+      {
+        throw;
+      }
+      catch (const std::exception &e)
+      {
+        THROW_WALLET_EXCEPTION_IF(true, error::wallet_state_corrupt, std::string("Failed to decode a row of ") + m_file + ": " + e.what());
+      }
+    }
+    if (r && r != MDB_NOTFOUND)
+      check(r, "read");
+  }
+  catch (...)
+  {
+    mdb_cursor_close(cursor);
+    throw;
+  }
+  mdb_cursor_close(cursor);
+}
+//----------------------------------------------------------------------------------------------------
+uint64_t wallet_lmdb::read_tx_deltas(MDB_txn *txn, const std::string &prefix, const crypto::chacha8_key &key, wallet2::journal_record &record)
+{
+  const std::string start = prefix + LMDB_STATE_TX_DELTAS;
+  uint64_t rows = 0;
+  MDB_cursor *cursor;
+  check(mdb_cursor_open(txn, m_state, &cursor), "open cursor");
+  try
+  {
+    MDB_val k = {start.size(), (void*)start.data()}, value;
+    int r;
+    for (r = mdb_cursor_get(cursor, &k, &value, MDB_SET_RANGE); !r; r = mdb_cursor_get(cursor, &k, &value, MDB_NEXT))
+    {
+      if (k.mv_size < start.size() || memcmp(k.mv_data, start.data(), start.size()))
+        break;
+      try
+      {
+        std::vector<std::pair<crypto::hash, crypto::secret_key>> tx_keys;
+        std::vector<std::pair<crypto::hash, std::string>> tx_notes;
+        std::stringstream iss;
+        iss << open_value(key, value);
+        boost::archive::portable_binary_iarchive ar(iss);
+        ar >> tx_keys;
+        ar >> tx_notes;
+        record.m_tx_keys.insert(record.m_tx_keys.end(), tx_keys.begin(), tx_keys.end());
+        record.m_tx_notes.insert(record.m_tx_notes.end(), tx_notes.begin(), tx_notes.end());
+      }
+      catch (const std::bad_alloc &)
+      {
+        throw;
+      }
+      catch (const std::exception &e)
+      {
+        THROW_WALLET_EXCEPTION_IF(true, error::wallet_state_corrupt, std::string("Failed to decode the tx keys in ") + m_file + ": " + e.what());
+      }
+      ++rows;
+    }
+    if (r && r != MDB_NOTFOUND)
+      check(r, "read");
+  }
+  catch (...)
+  {
+    mdb_cursor_close(cursor);
+    throw;
+  }
+  mdb_cursor_close(cursor);
+  return rows;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::commit(const std::shared_ptr<wallet_lmdb_batch> &batch)
+{
+  std::exception_ptr error;
+  batch->m_done = [&error](std::exception_ptr e) { error = e; };
+  {
+    boost::lock_guard<boost::mutex> lock(m_queue_mutex);
+    m_queue.push_back(batch);
+  }
+  // if a flush on the store thread took it first, this one waits for that flush to finish
+  flush();
+  if (error)
+    std::rethrow_exception(error);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::commit_async(const std::shared_ptr<wallet_lmdb_batch> &batch)
+{
+  boost::lock_guard<boost::mutex> lock(m_queue_mutex);
+  m_queue.push_back(batch);
+  // the flush runs after the stores already queued on the store thread, and takes all of their batches
+  if (!m_flush_posted)
+  {
+    m_flush_posted = true;
+    std::shared_ptr<wallet_lmdb> self = shared_from_this();
+    store_service().post([self]() { self->flush(); });
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::flush()
+{
+  boost::lock_guard<boost::mutex> commit_lock(m_commit_mutex);
+  std::vector<std::shared_ptr<wallet_lmdb_batch>> batches;
+  {
+    boost::lock_guard<boost::mutex> lock(m_queue_mutex);
+    batches.swap(m_queue);
+    m_flush_posted = false;
+  }
+  if (batches.empty())
+    return;
+
+  std::exception_ptr error;
+  try
+  {
+    apply(batches);
+  }
+  catch (...)
+  {
+    error = std::current_exception();
+  }
+  for (const auto &batch: batches)
+    batch->m_done(error);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::apply(const std::vector<std::shared_ptr<wallet_lmdb_batch>> &batches)
+{
+  uint64_t bytes = 0;
+  bool sync = false, never = true;
+  for (const auto &batch: batches)
+  {
+    for (const lmdb_rows *rows: {&batch->m_blocks, &batch->m_transfers, &batch->m_payments, &batch->m_confirmed_txs})
+      for (const auto &e: *rows)
+        bytes += batch->m_prefix.size() + e.first.size() + e.second.size();
+    for (const auto &e: batch->m_state)
+      bytes += batch->m_prefix.size() + e.first.size() + e.second.size();
+    // the strictest policy of the group goes; FsyncCache: a system crash loses at most the last
+    // commit, but never leaves the environment corrupt
+    sync |= batch->m_fsync == wallet2::FsyncAlways || (batch->m_fsync == wallet2::FsyncCache && batch->m_full);
+    never &= batch->m_fsync == wallet2::FsyncNever;
+  }
+
+  reserve(bytes);
+  check(mdb_env_set_flags(m_env, MDB_NOSYNC | MDB_NOMETASYNC, 0), "set flags");
+  if (!sync)
+    check(mdb_env_set_flags(m_env, never ? MDB_NOSYNC : MDB_NOMETASYNC, 1), "set flags");
+
+  lmdb_txn txn;
+  begin(txn, 0);
+  for (const auto &batch: batches)
+  {
+    if (batch->m_replace)
+      for (MDB_dbi dbi: {m_blocks, m_transfers, m_payments, m_confirmed_txs})
+        clear(txn.txn, dbi, batch->m_prefix);
+    put(txn.txn, m_blocks, batch->m_prefix, batch->m_blocks);
+    put(txn.txn, m_transfers, batch->m_prefix, batch->m_transfers);
+    put(txn.txn, m_payments, batch->m_prefix, batch->m_payments);
+    put(txn.txn, m_confirmed_txs, batch->m_prefix, batch->m_confirmed_txs);
+    if (batch->m_full)
+      clear(txn.txn, m_state, batch->m_prefix + LMDB_STATE_TX_DELTAS);
+    for (const auto &e: batch->m_state)
+    {
+      const std::string k = batch->m_prefix + e.first;
+      MDB_val key = {k.size(), (void*)k.data()};
+      MDB_val value = {e.second.size(), (void*)e.second.data()};
+      check(mdb_put(txn.txn, m_state, &key, &value, 0), "write");
+    }
+  }
+  check(txn.commit(), "commit transaction");
+  LOG_PRINT_L2("Committed " << bytes << " bytes of " << batches.size() << " wallets to " << m_file);
+}
+//----------------------------------------------------------------------------------------------------
+bool wallet_lmdb::get(const std::string &prefix, const std::string &name, std::string &value)
+{
+  lmdb_txn txn;
+  begin(txn, MDB_RDONLY);
+  const std::string k = prefix + name;
+  MDB_val key = {k.size(), (void*)k.data()}, val;
+  int r = mdb_get(txn.txn, m_state, &key, &val);
+  if (r == MDB_NOTFOUND)
+    return false;
+  check(r, "read");
+  value.assign((const char*)val.mv_data, val.mv_size);
+  return true;
+}
+//----------------------------------------------------------------------------------------------------
+bool wallet_lmdb::read(const std::string &prefix, const crypto::chacha8_key &key, cryptonote::account_public_address &address, wallet2::journal_record &record,
+    uint64_t &tx_deltas)
+{
+  record = boost::value_initialized<wallet2::journal_record>();
+  const lmdb_row_codec codec(key);
+
+  lmdb_txn txn;
+  begin(txn, MDB_RDONLY);
+  std::shared_ptr<lmdb_tx_prefixes> prefixes = std::make_shared<lmdb_tx_prefixes>(shared_from_this(), prefix, codec, count_rows(txn.txn, m_transfers, prefix));
+  MDB_val k, value;
+  std::string name = prefix + "address";
+  k = {name.size(), (void*)name.data()};
+  int r = mdb_get(txn.txn, m_state, &k, &value);
+  THROW_WALLET_EXCEPTION_IF(r == MDB_NOTFOUND, error::file_not_found, m_file);
+  check(r, "read");
+  try
+  {
+    std::stringstream iss;
+    iss << open_value(key, value);
+    boost::archive::portable_binary_iarchive ar(iss);
+    ar >> address;
+  }
+  catch (const std::exception &e)
+  {
+    THROW_WALLET_EXCEPTION_IF(true, error::wallet_state_corrupt, std::string("Failed to decode the wallet state in ") + m_file + ": " + e.what());
+  }
+  name = prefix + "misc";
+  k = {name.size(), (void*)name.data()};
+  r = mdb_get(txn.txn, m_state, &k, &value);
+  if (r != MDB_NOTFOUND)
+  {
+    check(r, "read");
+    record.m_misc = open_value(key, value);
+  }
+  tx_deltas = read_tx_deltas(txn.txn, prefix, key, record);
+
+  // rows come in key order, each goes to the slot of its height or index
+  bool legacy = false;
+  size_t rows = 0;
+  walk(txn.txn, m_blocks, prefix, LMDB_ROW_BLOCK, codec, legacy, [this, &record, &rows](uint64_t idx, const std::string &plaintext) {
+    THROW_WALLET_EXCEPTION_IF(idx >= CRYPTONOTE_MAX_BLOCK_NUMBER || plaintext.size() != sizeof(crypto::hash),
+        error::wallet_state_corrupt, "Invalid block hash in " + m_file);
+    if (idx >= record.m_blocks.size())
+      record.m_blocks.resize(idx + 1, crypto::null_hash);
+    record.m_blocks[idx] = *reinterpret_cast<const crypto::hash*>(plaintext.data());
+    ++rows;
+  });
+  THROW_WALLET_EXCEPTION_IF(rows != record.m_blocks.size(), error::wallet_state_corrupt, "Missing block hash in " + m_file);
+
+  rows = 0;
+  std::vector<crypto::hash> prefix_hashes;
+  walk(txn.txn, m_transfers, prefix, LMDB_ROW_TRANSFER, codec, legacy, [this, &record, &rows, &prefix_hashes, &prefixes](uint64_t idx, const std::string &plaintext) {
+    if (idx >= record.m_transfers.size())
+    {
+      record.m_transfers.resize(idx + 1, boost::value_initialized<wallet2::transfer_details>());
+      prefix_hashes.resize(idx + 1, crypto::null_hash);
+    }
+    // before the keys were hashed, rows had their tx prefix inline; a wallet's rows are all of one
+    // layout, the full store after loading old ones replaces them all
+    if (legacy)
+      decode_transfers(plaintext, &record.m_transfers[idx], 1);
+    else
+      decode_transfer_row(plaintext, record.m_transfers[idx], prefixes, idx, prefix_hashes[idx]);
+    ++rows;
+  });
+  THROW_WALLET_EXCEPTION_IF(rows != record.m_transfers.size(), error::wallet_state_corrupt, "Missing transfer in " + m_file);
+  // outputs of one tx share the cold prefix of the first of them
+  std::unordered_map<crypto::hash, tools::tx_prefix_ref> shared;
+  for (size_t i = 0; i < record.m_transfers.size(); ++i)
+  {
+    if (prefix_hashes[i] == crypto::null_hash)
+      continue;
+    auto it = shared.emplace(prefix_hashes[i], record.m_transfers[i].m_tx);
+    if (!it.second)
+      record.m_transfers[i].m_tx = it.first->second;
+  }
+  prefixes->release_refs();
+
+  walk(txn.txn, m_payments, prefix, LMDB_ROW_PAYMENTS, codec, legacy, [&record](uint64_t idx, const std::string &plaintext) {
+    decode_payments(plaintext, record.m_payments);
+  });
+  walk(txn.txn, m_confirmed_txs, prefix, LMDB_ROW_CONFIRMED_TXS, codec, legacy, [&record](uint64_t idx, const std::string &plaintext) {
+    std::vector<std::pair<crypto::hash, wallet2::confirmed_transfer_details>> confirmed_txs;
+    std::stringstream iss;
+    iss << plaintext;
+    boost::archive::portable_binary_iarchive ar(iss);
+    ar >> confirmed_txs;
+    record.m_confirmed_txs.insert(record.m_confirmed_txs.end(), confirmed_txs.begin(), confirmed_txs.end());
+  });
+  return legacy;
+}
+//----------------------------------------------------------------------------------------------------
+std::string wallet_lmdb::transfer_prefix(const std::string &prefix, const lmdb_row_codec &codec, uint64_t idx)
+{
+  lmdb_txn txn;
+  begin(txn, MDB_RDONLY);
+  const std::string k = prefix + codec.key(LMDB_ROW_TRANSFER, idx);
+  MDB_val key = {k.size(), (void*)k.data()}, value;
+  int r = mdb_get(txn.txn, m_transfers, &key, &value);
+  THROW_WALLET_EXCEPTION_IF(r == MDB_NOTFOUND, error::wallet_internal_error, "No transfer " + std::to_string(idx) + " in " + m_file);
+  check(r, "read");
+  std::string payload;
+  THROW_WALLET_EXCEPTION_IF(codec.open(value, payload) != idx, error::wallet_internal_error, "Row key mismatch in " + m_file);
+  return transfer_row_prefix(payload);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::erase(const std::string &prefix)
+{
+  boost::lock_guard<boost::mutex> commit_lock(m_commit_mutex);
+  lmdb_txn txn;
+  begin(txn, 0);
+  for (MDB_dbi dbi: {m_blocks, m_transfers, m_payments, m_confirmed_txs})
+    clear(txn.txn, dbi, prefix);
+  clear(txn.txn, m_state, prefix + LMDB_STATE_TX_DELTAS);
+  for (const char *name: {"address", "misc", "keys"})
+  {
+    const std::string k = prefix + name;
+    MDB_val key = {k.size(), (void*)k.data()};
+    int r = mdb_del(txn.txn, m_state, &key, NULL);
+    if (r != MDB_NOTFOUND)
+      check(r, "delete");
+  }
+  check(txn.commit(), "commit transaction");
+}
+//----------------------------------------------------------------------------------------------------
+void wallet_lmdb::copy(const std::string &file)
+{
+  boost::shared_lock<boost::shared_mutex> lock(m_txn_mutex);
+  check(mdb_env_copy2(m_env, file.c_str(), MDB_CP_COMPACT), "copy environment");
+}
+//----------------------------------------------------------------------------------------------------
+// a key derived with the slow hash, along with the fast hash of what it was derived from
+struct wallet_derived_key
+{
+  crypto::hash m_tag;
+  crypto::chacha8_key m_key;
+  uint64_t m_used;               // for replacing the least recently used one, 0 if empty
+};
+
+namespace
+{
+  // hands out WALLET_DERIVED_KEYS keys at a time from pages kept out of swap
+  class derived_key_pool
+  {
+  public:
+    wallet_derived_key *acquire()
+    {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      if (m_free.empty())
+        grow();
+      wallet_derived_key *keys = m_free.back();
+      m_free.pop_back();
+      return keys;
+    }
+
+    void release(wallet_derived_key *keys)
+    {
+      wipe(keys, sizeof(wallet_derived_key) * WALLET_DERIVED_KEYS);
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_free.push_back(keys);
+    }
+
+  private:
+    void grow()
+    {
+      char *page;
+#ifdef WIN32
+      page = new char[DERIVED_KEY_PAGE_SIZE];
+#else
+      void *p = NULL;
+      if (posix_memalign(&p, DERIVED_KEY_PAGE_SIZE, DERIVED_KEY_PAGE_SIZE))
+        throw std::bad_alloc();
+      page = (char*)p;
+      // keys are still cached when the memlock limit is reached, only no longer kept out of swap
+      if (mlock(page, DERIVED_KEY_PAGE_SIZE))
+        LOG_PRINT_L1("Failed to lock memory for derived wallet keys: " << strerror(errno));
+#endif
+      memset(page, 0, DERIVED_KEY_PAGE_SIZE);
+      const size_t group = sizeof(wallet_derived_key) * WALLET_DERIVED_KEYS;
+      for (size_t offset = 0; offset + group <= DERIVED_KEY_PAGE_SIZE; offset += group)
+        m_free.push_back((wallet_derived_key*)(page + offset));
+    }
+
+    boost::mutex m_mutex;
+    std::vector<wallet_derived_key*> m_free;
+  };
+
+  // pages are never returned, as with store_service()
+  derived_key_pool &key_pool()
+  {
+    static derived_key_pool *pool = new derived_key_pool();
+    return *pool;
+  }
+
+  std::atomic<uint64_t> g_key_derivations(0);
+}
+//----------------------------------------------------------------------------------------------------
+wallet2::~wallet2()
+{
+  {
+    boost::unique_lock<boost::mutex> lock(m_store_mutex);
+    while (m_store_pending)
+      m_store_cond.wait(lock);
+  }
+  wipe_derived_keys();
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::derive_chacha8_key(const void *data, size_t size, crypto::chacha8_key &key) const
+{
+  // the slow hash is run once per distinct input, the tag tells which input a cached key is for
+  const crypto::hash tag = crypto::cn_fast_hash(data, size);
+  boost::lock_guard<boost::mutex> lock(m_derived_keys_mutex);
+  if (!m_derived_keys)
+    m_derived_keys = key_pool().acquire();
+
+  wallet_derived_key *slot = m_derived_keys;
+  for (size_t i = 0; i < WALLET_DERIVED_KEYS; ++i)
+  {
+    wallet_derived_key &k = m_derived_keys[i];
+    if (k.m_used && k.m_tag == tag)
+    {
+      k.m_used = ++m_derived_keys_clock;
+      key = k.m_key;
+      return;
+    }
+    if (k.m_used < slot->m_used)
+      slot = &k;
+  }
+
+  crypto::generate_chacha8_key(data, size, key);
+  ++m_key_derivations;
+  ++g_key_derivations;
+  slot->m_tag = tag;
+  slot->m_key = key;
+  slot->m_used = ++m_derived_keys_clock;
+  LOG_PRINT_L2("Derived wallet key, " << m_key_derivations << " derivations so far");
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::wipe_derived_keys()
+{
+  boost::lock_guard<boost::mutex> lock(m_derived_keys_mutex);
+  if (m_derived_keys)
+    key_pool().release(m_derived_keys);
+  m_derived_keys = NULL;
+}
+//----------------------------------------------------------------------------------------------------
+uint64_t wallet2::key_derivations() const
+{
+  boost::lock_guard<boost::mutex> lock(m_derived_keys_mutex);
+  return m_key_derivations;
+}
+//----------------------------------------------------------------------------------------------------
+uint64_t wallet2::total_key_derivations()
+{
+  return g_key_derivations;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::store()
+{
+  drain_store();
+
+  std::shared_ptr<store_job> job = prepare_store();
+  if (job)
+    run_store(*job);
+}
+//----------------------------------------------------------------------------------------------------
+bool wallet2::store_async()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(m_store_mutex);
+    if (m_store_pending)
+      return false;
+    // left for store_status to report, but what it failed to write has to be written again
+    if (m_store_error)
+      m_journal_full = true;
+  }
+
+  std::shared_ptr<store_job> job = prepare_store();
+  if (!job)
+    return true;
+
+  {
+    boost::lock_guard<boost::mutex> lock(m_store_mutex);
+    m_store_pending = true;
+  }
+  store_service().post([this, job]() {
+    std::exception_ptr error;
+    try
+    {
+      if (job->m_lmdb)
+      {
+        // finished by the group commit it joins
+        std::shared_ptr<wallet_lmdb_batch> batch = lmdb_batch(*job);
+        batch->m_done = [this, job](std::exception_ptr error) {
+          if (!error)
+            lmdb_committed(*job);
+          finish_store(error);
+        };
+        job->m_lmdb->commit_async(batch);
+        return;
+      }
+      write_store(*job);
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    finish_store(error);
+  });
+  return true;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::finish_store(std::exception_ptr error)
+{
+  boost::lock_guard<boost::mutex> lock(m_store_mutex);
+  m_store_pending = false;
+  if (error)
+    m_store_error = error;
+  if (m_callback)
+    m_callback->on_store_finished();
+  m_store_cond.notify_all();
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::wait_store()
+{
+  std::exception_ptr error;
+  {
+    boost::unique_lock<boost::mutex> lock(m_store_mutex);
+    while (m_store_pending)
+      m_store_cond.wait(lock);
+    std::swap(error, m_store_error);
+  }
+  if (error)
+  {
+    m_journal_full = true;
+    std::rethrow_exception(error);
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::drain_store()
+{
+  // a failed background store only leaves the next one to rewrite the cache file
+  try
+  {
+    wait_store();
+  }
+  catch (const std::exception &e)
+  {
+    LOG_ERROR("Background store of " << m_wallet_file << " failed: " << e.what());
+  }
+}
+//----------------------------------------------------------------------------------------------------
+bool wallet2::store_status(std::string &error)
+{
+  std::exception_ptr e;
+  {
+    boost::lock_guard<boost::mutex> lock(m_store_mutex);
+    if (m_store_pending)
+      return true;
+    std::swap(e, m_store_error);
+  }
+  if (e)
+  {
+    m_journal_full = true;
+    try
+    {
+      std::rethrow_exception(e);
+    }
+    catch (const std::exception &ex)
+    {
+      error = ex.what();
+    }
+    catch (...)
+    {
+      error = "unknown error";
+    }
+  }
+  return false;
+}
+//----------------------------------------------------------------------------------------------------
+std::shared_ptr<wallet2::store_job> wallet2::prepare_store()
+{
+  if (!m_journal_full && !m_journal_dirty && m_blockchain.size() == m_journal_blocks && m_transfers.size() == m_journal_transfers &&
+      !m_journal_misc_dirty && m_journal_tx_keys.empty() && m_journal_tx_notes.empty())
+  {
+    LOG_PRINT_L2("Nothing changed since the last store, " << m_wallet_file << " left as is");
+    return std::shared_ptr<store_job>();
+  }
+
+  std::shared_ptr<store_job> job = std::make_shared<store_job>();
+  job->m_fsync = m_fsync_policy;
+  // the account may be replaced (see clear) before the job is written
+  generate_chacha8_key_from_secret_keys(job->m_key);
+  job->m_address = m_account_public_address;
+  if (m_storage == StorageLmdb)
+  {
+    job->m_cache = m_journal_full;
+    job->m_file = m_wallet_file;
+    job->m_lmdb = open_lmdb();
+    job->m_prefix = lmdb_prefix();
+    capture_lmdb(*job);
+    // a wallet moving into a container takes its keys file along
+    boost::system::error_code e;
+    if (job->m_cache && lmdb_container() && boost::filesystem::exists(m_keys_file, e) && !e &&
+        epee::file_io_utils::load_file_to_string(m_keys_file, job->m_keys))
+      job->m_keys_file = m_keys_file;
+  }
+  else if (m_journal_full || m_journal_records >= WALLET_JOURNAL_MAX_RECORDS ||
+      m_journal_bytes * WALLET_JOURNAL_COMPACT_RATIO >= m_journal_base_bytes)
+  {
+    // closed, the cache file replaces it
+    m_lmdb.reset();
+    job->m_cache = true;
+    job->m_file = m_wallet_file;
+    capture_cache(job->m_chunks);
+  }
+  else
+  {
+    job->m_cache = false;
+    job->m_file = journal_file();
+    job->m_plaintext = capture_journal();
+  }
+  return job;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::capture_cache(std::vector<std::pair<cache_chunk, std::string>> &chunks)
+{
+  // under a new generation, so that the current journal is never replayed over it
+  m_journal_full = true;
+  m_journal_generation = crypto::rand<uint64_t>();
+
+  chunks.clear();
+  auto add = [&chunks](uint8_t section, uint64_t start, uint64_t count, std::string plaintext) {
+    cache_chunk chunk = boost::value_initialized<cache_chunk>();
+    chunk.section = section;
+    chunk.start = start;
+    chunk.count = count;
+    chunks.push_back(std::make_pair(chunk, std::move(plaintext)));
+  };
+  {
+    std::stringstream oss;
+    boost::archive::portable_binary_oarchive ar(oss);
+    ar << m_account_public_address;
+    ar << m_journal_generation;
+    add(CACHE_SECTION_STATE, 0, 1, oss.str());
+  }
+  // the chain and transfers are what grows, they go in chunks which load in parallel
+  for (size_t start = 0; start < m_blockchain.size(); start += CACHE_CHUNK_BLOCKS)
+  {
+    size_t count = std::min<size_t>(CACHE_CHUNK_BLOCKS, m_blockchain.size() - start);
+    add(CACHE_SECTION_CHAIN_HASHES, start, count, std::string((const char*)&m_blockchain[start], count * sizeof(crypto::hash)));
+  }
+  // tx prefixes are cold, they go in chunks of their own which are only decoded when needed
+  prefix_table prefixes;
+  for (size_t start = 0; start < m_transfers.size(); start += CACHE_CHUNK_TRANSFERS)
+  {
+    size_t count = std::min<size_t>(CACHE_CHUNK_TRANSFERS, m_transfers.size() - start);
+    add(CACHE_SECTION_TRANSFER_COLUMNS, start, count, encode_transfers(&m_transfers[start], count, &prefixes));
+  }
+  for (size_t start = 0; start < prefixes.refs.size(); start += CACHE_CHUNK_PREFIXES)
+  {
+    size_t count = std::min<size_t>(CACHE_CHUNK_PREFIXES, prefixes.refs.size() - start);
+    add(CACHE_SECTION_TX_PREFIXES, start, count, encode_prefixes(prefixes.refs, start, count));
+  }
+  add(CACHE_SECTION_PAYMENT_COLUMNS, 0, m_payments.size(), encode_payments(m_payments));
+  {
+    std::stringstream oss;
+    boost::archive::portable_binary_oarchive ar(oss);
+    ar << m_confirmed_txs;
+    add(CACHE_SECTION_CONFIRMED_TXS, 0, m_confirmed_txs.size(), oss.str());
+  }
+  add(CACHE_SECTION_MISC, 0, 1, journal_misc(true));
+
+  m_journal_records = 0;
+  m_journal_bytes = 0;
+  m_journal_base_bytes = 0;
+  for (const auto &chunk: chunks)
+    m_journal_base_bytes += chunk.second.size();
+  journal_checkpoint();
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::run_store(const store_job &job)
+{
+  try
+  {
+    write_store(job);
+  }
+  catch (...)
+  {
+    // the snapshot was taken, but never made it to disk
+    m_journal_full = true;
+    throw;
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::write_store(const store_job &job) const
+{
+  if (job.m_lmdb)
+  {
+    job.m_lmdb->commit(lmdb_batch(job));
+    lmdb_committed(job);
+    return;
+  }
+
+  if (job.m_cache)
+  {
+    // save to the *.new file, rename it over the cache file, and start the journal over
+    const std::string new_file = job.m_file + ".new";
+    write_cache_file(job.m_chunks, job.m_key, new_file, job.m_fsync != FsyncNever);
+    std::error_code e = tools::replace_file(new_file, job.m_file);
+    THROW_WALLET_EXCEPTION_IF(e, error::file_save_error, job.m_file, e);
+
+    boost::system::error_code ec;
+    boost::filesystem::remove(job.m_file + ".journal", ec);
+    if (ec)
+      LOG_ERROR("error removing file: " << job.m_file + ".journal");
+    boost::filesystem::remove(job.m_file + ".mdb", ec);
+    boost::filesystem::remove(job.m_file + ".mdb-lock", ec);
+    if (job.m_fsync != FsyncNever)
+    {
+      boost::filesystem::path parent_path = boost::filesystem::path(job.m_file).parent_path();
+      const std::string dir = parent_path.empty() ? "." : parent_path.string();
+      if (!sync_file(dir))
+        LOG_ERROR("error syncing directory: " << dir);
+    }
+    return;
+  }
+
+  wallet2::journal_file_data journal_file_data = boost::value_initialized<wallet2::journal_file_data>();
+  journal_file_data.iv = crypto::rand<crypto::chacha8_iv>();
+  journal_file_data.checksum = crypto::cn_fast_hash(job.m_plaintext.data(), job.m_plaintext.size());
+  journal_file_data.journal_data.resize(job.m_plaintext.size());
+  crypto::chacha8(job.m_plaintext.data(), job.m_plaintext.size(), job.m_key, journal_file_data.iv, &journal_file_data.journal_data[0]);
+
+  std::string blob;
+  bool r = ::serialization::dump_binary(journal_file_data, blob);
+  THROW_WALLET_EXCEPTION_IF(!r, error::wallet_internal_error, "Failed to serialize journal record");
+  THROW_WALLET_EXCEPTION_IF(blob.size() > (uint32_t)-1, error::wallet_internal_error, "Journal record too large");
+
+  // size prefixed, so a torn tail is detected on replay
+  std::ofstream ostr;
+  ostr.open(job.m_file, std::ios_base::binary | std::ios_base::out | std::ios_base::app);
+  write_size(ostr, blob.size());
+  ostr.write(blob.data(), blob.size());
+  ostr.close();
+  THROW_WALLET_EXCEPTION_IF(!ostr.good(), error::file_save_error, job.m_file);
+  THROW_WALLET_EXCEPTION_IF(job.m_fsync == FsyncAlways && !sync_file(job.m_file), error::file_save_error, job.m_file);
+  LOG_PRINT_L2("Appended " << blob.size() << " bytes to " << job.m_file);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::write_cache_file(const std::vector<std::pair<cache_chunk, std::string>> &chunks, const crypto::chacha8_key &key, const std::string &file, bool sync) const
+{
+  cache_index index;
+  std::string body;
+  for (const auto &c: chunks)
+  {
+    std::string compressed;
+    {
+      boost::iostreams::filtering_ostream os;
+      os.push(boost::iostreams::zlib_compressor(boost::iostreams::zlib_params(boost::iostreams::zlib::best_speed)));
+      os.push(boost::iostreams::back_inserter(compressed));
+      os.write(c.second.data(), c.second.size());
+      os.reset();
+    }
+
+    cache_chunk chunk = c.first;
+    chunk.offset = body.size();
+    chunk.size = compressed.size();
+    chunk.iv = crypto::rand<crypto::chacha8_iv>();
+    chunk.checksum = crypto::cn_fast_hash(compressed.data(), compressed.size());
+    body.resize(body.size() + compressed.size());
+    crypto::chacha8(compressed.data(), compressed.size(), key, chunk.iv, &body[chunk.offset]);
+    index.chunks.push_back(chunk);
+  }
+
+  // the index is encrypted too, chunk sizes and counts would tell how many transfers the wallet has
+  std::string index_blob;
+  bool r = ::serialization::dump_binary(index, index_blob);
+  THROW_WALLET_EXCEPTION_IF(!r, error::wallet_internal_error, "Failed to serialize cache index");
+  wallet2::cache_index_data cache_index_data = boost::value_initialized<wallet2::cache_index_data>();
+  cache_index_data.iv = crypto::rand<crypto::chacha8_iv>();
+  cache_index_data.checksum = crypto::cn_fast_hash(index_blob.data(), index_blob.size());
+  cache_index_data.index_data.resize(index_blob.size());
+  crypto::chacha8(index_blob.data(), index_blob.size(), key, cache_index_data.iv, &cache_index_data.index_data[0]);
+  std::string blob;
+  r = ::serialization::dump_binary(cache_index_data, blob);
+  THROW_WALLET_EXCEPTION_IF(!r, error::wallet_internal_error, "Failed to serialize cache index");
+  THROW_WALLET_EXCEPTION_IF(blob.size() > (uint32_t)-1, error::wallet_internal_error, "Cache index too large");
+
+  std::ofstream ostr;
+  ostr.open(file, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+  ostr.write(CACHE_FILE_MAGIC, strlen(CACHE_FILE_MAGIC));
+  write_size(ostr, blob.size());
+  ostr.write(blob.data(), blob.size());
+  ostr.write(body.data(), body.size());
+  ostr.close();
+  THROW_WALLET_EXCEPTION_IF(!ostr.good(), error::file_save_error, file);
+  THROW_WALLET_EXCEPTION_IF(sync && !sync_file(file), error::file_save_error, file);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::load_cache_file(const std::shared_ptr<boost::iostreams::mapped_file_source> &file, const crypto::chacha8_key &key)
+{
+  const char *data = file->data();
+  const size_t size = file->size();
+  const size_t header_size = strlen(CACHE_FILE_MAGIC) + 4;
+  THROW_WALLET_EXCEPTION_IF(size < header_size, error::wallet_state_corrupt, "Truncated cache file " + m_wallet_file);
+  const size_t index_size = read_size(data + header_size - 4);
+  THROW_WALLET_EXCEPTION_IF(index_size > size - header_size, error::wallet_state_corrupt, "Truncated cache file " + m_wallet_file);
+
+  wallet2::cache_index_data cache_index_data;
+  bool r = ::serialization::parse_binary(std::string(data + header_size, index_size), cache_index_data);
+  THROW_WALLET_EXCEPTION_IF(!r, error::wallet_state_corrupt, "Failed to deserialize cache index of " + m_wallet_file);
+  std::string index_blob;
+  index_blob.resize(cache_index_data.index_data.size());
+  crypto::chacha8(cache_index_data.index_data.data(), cache_index_data.index_data.size(), key, cache_index_data.iv, &index_blob[0]);
+  THROW_WALLET_EXCEPTION_IF(crypto::cn_fast_hash(index_blob.data(), index_blob.size()) != cache_index_data.checksum,
+      error::wallet_state_corrupt, "Failed to decrypt cache index of " + m_wallet_file);
+  cache_index index;
+  r = ::serialization::parse_binary(index_blob, index);
+  THROW_WALLET_EXCEPTION_IF(!r, error::wallet_state_corrupt, "Failed to deserialize cache index of " + m_wallet_file);
+
+  const char *body = data + header_size + index_size;
+  const size_t body_size = size - header_size - index_size;
+  size_t blocks = 0, transfers = 0;
+  std::vector<cache_chunk> prefix_chunks;
+  for (const cache_chunk &chunk: index.chunks)
+  {
+    THROW_WALLET_EXCEPTION_IF(chunk.offset > body_size || chunk.size > body_size - chunk.offset,
+        error::wallet_state_corrupt, "Cache file chunk past the end of " + m_wallet_file);
+    if (chunk.section == CACHE_SECTION_CHAIN || chunk.section == CACHE_SECTION_CHAIN_HASHES)
+    {
+      THROW_WALLET_EXCEPTION_IF(chunk.count > CACHE_CHUNK_BLOCKS || chunk.start > (uint64_t)-1 - CACHE_CHUNK_BLOCKS,
+          error::wallet_state_corrupt, "Invalid cache file chunk in " + m_wallet_file);
+      blocks = std::max<size_t>(blocks, chunk.start + chunk.count);
+    }
+    else if (chunk.section == CACHE_SECTION_TRANSFERS || chunk.section == CACHE_SECTION_TRANSFER_COLUMNS)
+    {
+      THROW_WALLET_EXCEPTION_IF(chunk.count > CACHE_CHUNK_TRANSFERS || chunk.start > (uint64_t)-1 - CACHE_CHUNK_TRANSFERS,
+          error::wallet_state_corrupt, "Invalid cache file chunk in " + m_wallet_file);
+      transfers = std::max<size_t>(transfers, chunk.start + chunk.count);
+    }
+    else if (chunk.section == CACHE_SECTION_TX_PREFIXES)
+    {
+      prefix_chunks.push_back(chunk);
+    }
+  }
+
+  // tx prefixes are not decoded here, transfers refer to them in the mapping
+  std::sort(prefix_chunks.begin(), prefix_chunks.end(), [](const cache_chunk &a, const cache_chunk &b) { return a.start < b.start; });
+  std::shared_ptr<cache_file_prefixes> prefixes = std::make_shared<cache_file_prefixes>(file, body, key, m_wallet_file);
+  for (const cache_chunk &chunk: prefix_chunks)
+    prefixes->add(chunk);
+
+  // chunks decode straight from the mapping into their own slots, or their own containers
+  m_blockchain.resize(blocks);
+  m_transfers.resize(transfers);
+  std::vector<std::string> errors(index.chunks.size());
+  size_t threads = std::min<size_t>(std::max(tools::get_max_concurrency(), 1u), index.chunks.size());
+  if (threads > 1)
+  {
+    boost::asio::io_service ioservice;
+    boost::thread_group threadpool;
+    std::unique_ptr < boost::asio::io_service::work > work(new boost::asio::io_service::work(ioservice));
+    for (size_t i = 0; i < threads; i++)
+    {
+      threadpool.create_thread(boost::bind(&boost::asio::io_service::run, &ioservice));
+    }
+    for (size_t i = 0; i < index.chunks.size(); i++)
+    {
+      ioservice.dispatch(boost::bind(&wallet2::load_cache_chunk, this, std::cref(index.chunks[i]), body, std::cref(key), prefixes, std::ref(errors[i])));
+    }
+    KILL_IOSERVICE();
+  }
+  else
+  {
+    for (size_t i = 0; i < index.chunks.size(); i++)
+      load_cache_chunk(index.chunks[i], body, key, prefixes, errors[i]);
+  }
+  prefixes->release_refs();
+  for (const std::string &error: errors)
+    THROW_WALLET_EXCEPTION_IF(!error.empty(), error::wallet_state_corrupt, error + " in " + m_wallet_file);
+
+  rebuild_transfer_maps();
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::load_cache_chunk(const cache_chunk &chunk, const char *data, const crypto::chacha8_key &key, const std::shared_ptr<tx_prefix_source> &prefixes, std::string &error)
+{
+  if (chunk.section == CACHE_SECTION_TX_PREFIXES)
+    return;
+  try
+  {
+    std::string compressed;
+    compressed.resize(chunk.size);
+    crypto::chacha8(data + chunk.offset, chunk.size, key, chunk.iv, &compressed[0]);
+    if (crypto::cn_fast_hash(compressed.data(), compressed.size()) != chunk.checksum)
+    {
+      error = "Corrupt cache file chunk at offset " + std::to_string(chunk.offset);
+      return;
+    }
+
+    boost::iostreams::filtering_istream is;
+    is.push(boost::iostreams::zlib_decompressor());
+    is.push(boost::iostreams::array_source(compressed.data(), compressed.size()));
+    if (chunk.section == CACHE_SECTION_MISC)
+    {
+      load_journal_misc(is);
+      return;
+    }
+    if (chunk.section >= CACHE_SECTION_CHAIN_HASHES && chunk.section <= CACHE_SECTION_PAYMENT_COLUMNS)
+    {
+      std::string plaintext;
+      boost::iostreams::copy(is, boost::iostreams::back_inserter(plaintext));
+      switch (chunk.section)
+      {
+        case CACHE_SECTION_CHAIN_HASHES:
+          if (plaintext.size() != chunk.count * sizeof(crypto::hash))
+            throw std::runtime_error("block hash count mismatch");
+          memcpy(&m_blockchain[chunk.start], plaintext.data(), plaintext.size());
+          break;
+        case CACHE_SECTION_TRANSFER_COLUMNS:
+          decode_transfers(plaintext, &m_transfers[chunk.start], chunk.count, prefixes);
+          break;
+        case CACHE_SECTION_PAYMENT_COLUMNS:
+        {
+          std::vector<std::pair<crypto::hash, payment_details>> payments;
+          decode_payments(plaintext, payments);
+          m_payments.clear();
+          m_payments.reserve(payments.size());
+          m_payments.insert(payments.begin(), payments.end());
+          break;
+        }
+      }
+      return;
+    }
+
+    boost::archive::portable_binary_iarchive ar(is);
+    switch (chunk.section)
+    {
+      case CACHE_SECTION_STATE:
+        ar >> m_account_public_address;
+        ar >> m_journal_generation;
+        break;
+      case CACHE_SECTION_CHAIN:
+        ar >> boost::serialization::make_array(&m_blockchain[chunk.start], chunk.count);
+        break;
+      case CACHE_SECTION_TRANSFERS:
+        ar >> boost::serialization::make_array(&m_transfers[chunk.start], chunk.count);
+        break;
+      case CACHE_SECTION_PAYMENTS:
+        ar >> m_payments;
+        break;
+      case CACHE_SECTION_CONFIRMED_TXS:
+        ar >> m_confirmed_txs;
+        break;
+      default:
+        LOG_PRINT_L1("Skipping unknown cache file section " << (unsigned)chunk.section);
+        break;
+    }
+  }
+  catch (const std::exception &e)
+  {
+    error = std::string("Failed to decode cache file chunk: ") + e.what();
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::load_journal_misc(std::istream &is)
+{
+  // tx keys and notes are only ever added, by whatever wrote them whole or by the records after
+  std::unordered_map<crypto::hash, crypto::secret_key> tx_keys;
+  std::unordered_map<crypto::hash, std::string> tx_notes;
+  m_unconfirmed_txs.clear();
+  m_unconfirmed_payments.clear();
+  m_address_book.clear();
+  m_scanned_pool_txs[0].clear();
+  m_scanned_pool_txs[1].clear();
+  boost::archive::portable_binary_iarchive ar(is);
+  ar >> m_unconfirmed_txs;
+  ar >> m_unconfirmed_payments;
+  ar >> tx_keys;
+  ar >> tx_notes;
+  ar >> m_address_book;
+  ar >> m_scanned_pool_txs[0];
+  ar >> m_scanned_pool_txs[1];
+  m_tx_keys.insert(tx_keys.begin(), tx_keys.end());
+  for (const auto &n: tx_notes)
+    m_tx_notes[n.first] = n.second;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::rebuild_transfer_maps()
+{
+  m_key_images.clear();
+  m_pub_keys.clear();
+  for (size_t i = 0; i < m_transfers.size(); ++i)
+  {
+    const transfer_details &td = m_transfers[i];
+    m_key_images[td.m_key_image] = i;
+    if (td.get_public_key() != crypto::null_pkey)
+      m_pub_keys[td.get_public_key()] = i;
+  }
+}
+//----------------------------------------------------------------------------------------------------
+std::string wallet2::journal_misc(bool tx_keys) const
+{
+  // the containers which are neither height ordered nor indexed by transfer, small enough to be
+  // written whole whenever they change; tx keys and notes grow with the history, a journal record
+  // leaves them empty here and carries the ones set since the previous record
+  std::stringstream oss;
+  boost::archive::portable_binary_oarchive ar(oss);
+  ar << m_unconfirmed_txs;
+  ar << m_unconfirmed_payments;
+  if (tx_keys)
+  {
+    ar << m_tx_keys;
+    ar << m_tx_notes;
+  }
+  else
+  {
+    const std::unordered_map<crypto::hash, crypto::secret_key> no_tx_keys;
+    const std::unordered_map<crypto::hash, std::string> no_tx_notes;
+    ar << no_tx_keys;
+    ar << no_tx_notes;
+  }
+  ar << m_address_book;
+  ar << m_scanned_pool_txs[0];
+  ar << m_scanned_pool_txs[1];
+  return oss.str();
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::journal_touch(size_t idx)
+{
+  // transfers past the persisted prefix go to the next record whole anyway
+  if (idx < m_journal_transfers)
+  {
+    m_journal_touched.insert(idx);
+    m_journal_dirty = true;
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::journal_truncate(size_t blocks, size_t transfers)
+{
+  m_journal_blocks = std::min(m_journal_blocks, blocks);
+  m_journal_transfers = std::min(m_journal_transfers, transfers);
+  m_journal_touched.erase(m_journal_touched.lower_bound(m_journal_transfers), m_journal_touched.end());
+  m_journal_dirty = true;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::journal_checkpoint()
+{
+  m_journal_blocks = m_blockchain.size();
+  m_journal_transfers = m_transfers.size();
+  m_journal_touched.clear();
+  m_journal_misc_dirty = false;
+  m_journal_tx_keys.clear();
+  m_journal_tx_notes.clear();
+  m_journal_dirty = false;
+  m_journal_full = false;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::capture_record(journal_record &record) const
+{
+  record = boost::value_initialized<journal_record>();
+  record.m_generation = m_journal_generation;
+  record.m_blocks_start = m_journal_blocks;
+  record.m_blocks.assign(m_blockchain.begin() + m_journal_blocks, m_blockchain.end());
+  record.m_transfers_start = m_journal_transfers;
+  record.m_transfers.assign(m_transfers.begin() + m_journal_transfers, m_transfers.end());
+
+  // payments and outgoing txs only ever appear at the height of the block being processed, so
+  // everything changed since the last record sits at or above the persisted chain
+  std::unordered_set<crypto::hash> seen;
+  for (auto it = m_payments_by_height.lower_bound(m_journal_blocks); it != m_payments_by_height.end(); ++it)
+  {
+    if (!seen.insert(it->second).second)
+      continue;
+    auto range = m_payments.equal_range(it->second);
+    for (auto pit = range.first; pit != range.second; ++pit)
+      if (pit->second.m_block_height >= m_journal_blocks)
+        record.m_payments.push_back(*pit);
+  }
+  seen.clear();
+  for (auto it = m_confirmed_txs_by_height.lower_bound(m_journal_blocks); it != m_confirmed_txs_by_height.end(); ++it)
+  {
+    auto cit = m_confirmed_txs.find(it->second);
+    if (cit != m_confirmed_txs.end() && cit->second.m_block_height >= m_journal_blocks && seen.insert(it->second).second)
+      record.m_confirmed_txs.push_back(*cit);
+  }
+
+  if (m_journal_misc_dirty)
+    record.m_misc = journal_misc(false);
+  for (const crypto::hash &txid: m_journal_tx_keys)
+  {
+    auto it = m_tx_keys.find(txid);
+    if (it != m_tx_keys.end())
+      record.m_tx_keys.push_back(*it);
+  }
+  for (const crypto::hash &txid: m_journal_tx_notes)
+  {
+    auto it = m_tx_notes.find(txid);
+    if (it != m_tx_notes.end())
+      record.m_tx_notes.push_back(*it);
+  }
+}
+//----------------------------------------------------------------------------------------------------
+std::string wallet2::capture_journal()
+{
+  journal_record record;
+  capture_record(record);
+  for (size_t idx: m_journal_touched)
+  {
+    const transfer_details &td = m_transfers[idx];
+    record.m_patches.push_back({idx, td.m_spent, td.m_spent_height, td.m_key_image, td.m_key_image_known});
+  }
+
+  std::stringstream oss;
+  boost::archive::portable_binary_oarchive ar(oss);
+  ar << record;
+
+  LOG_PRINT_L2("Journal record for " << m_wallet_file << ": " << record.m_blocks.size() << " blocks, "
+      << record.m_transfers.size() << " transfers, " << record.m_patches.size() << " patches");
+  std::string plaintext = oss.str();
+  ++m_journal_records;
+  m_journal_bytes += plaintext.size();
+  journal_checkpoint();
+  return plaintext;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::capture_lmdb(store_job &job)
+{
+  // the whole state is one record from the start of the chain, with every tx key and note
+  if (job.m_cache)
+  {
+    m_journal_blocks = 0;
+    m_journal_transfers = 0;
+    m_journal_touched.clear();
+    m_journal_misc_dirty = true;
+    m_journal_tx_keys.clear();
+    for (const auto &k: m_tx_keys)
+      m_journal_tx_keys.push_back(k.first);
+    m_journal_tx_notes.clear();
+    for (const auto &n: m_tx_notes)
+      m_journal_tx_notes.insert(n.first);
+    m_lmdb_tx_deltas = 0;
+  }
+  capture_record(job.m_record);
+  for (size_t idx: m_journal_touched)
+    job.m_touched.push_back(std::make_pair(idx, m_transfers[idx]));
+  // rows past the record's start which a detach cut off are deleted by key
+  job.m_blocks_stored = m_lmdb_blocks;
+  job.m_transfers_stored = m_lmdb_transfers;
+  job.m_tx_deltas_stored = m_lmdb_tx_deltas;
+  m_lmdb_blocks = m_blockchain.size();
+  m_lmdb_transfers = m_transfers.size();
+  if (!job.m_record.m_tx_keys.empty() || !job.m_record.m_tx_notes.empty())
+    ++m_lmdb_tx_deltas;
+
+  LOG_PRINT_L2("LMDB transaction for " << m_wallet_file << ": " << job.m_record.m_blocks.size() << " blocks, "
+      << job.m_record.m_transfers.size() << " transfers, " << job.m_touched.size() << " touched");
+  journal_checkpoint();
+}
+//----------------------------------------------------------------------------------------------------
+std::shared_ptr<wallet_lmdb> wallet2::open_lmdb()
+{
+  if (!m_lmdb)
+    m_lmdb = wallet_lmdb::open(lmdb_file());
+  return m_lmdb;
+}
+//----------------------------------------------------------------------------------------------------
+std::string wallet2::lmdb_prefix() const
+{
+  // wallets are opened by file name, in a container it is hashed into a fixed size prefix
+  if (!lmdb_container())
+    return std::string();
+  const crypto::hash hash = crypto::cn_fast_hash(m_wallet_file.data(), m_wallet_file.size());
+  return std::string((const char*)&hash, sizeof(hash));
+}
+//----------------------------------------------------------------------------------------------------
+std::shared_ptr<wallet_lmdb_batch> wallet2::lmdb_batch(const store_job &job) const
+{
+  const crypto::chacha8_key &key = job.m_key;
+  const lmdb_row_codec codec(key);
+  const journal_record &record = job.m_record;
+
+  std::shared_ptr<wallet_lmdb_batch> batch = std::make_shared<wallet_lmdb_batch>();
+  batch->m_prefix = job.m_prefix;
+  batch->m_replace = job.m_cache || (record.m_blocks_start == 0 && record.m_transfers_start == 0);
+  batch->m_full = job.m_cache;
+  batch->m_fsync = job.m_fsync;
+
+  // deletions go ahead of the rows written again under the same keys
+  if (!batch->m_replace)
+  {
+    for (uint64_t height = record.m_blocks_start; height < job.m_blocks_stored; ++height)
+    {
+      batch->m_blocks.push_back(std::make_pair(codec.key(LMDB_ROW_BLOCK, height), std::string()));
+      batch->m_payments.push_back(std::make_pair(codec.key(LMDB_ROW_PAYMENTS, height), std::string()));
+      batch->m_confirmed_txs.push_back(std::make_pair(codec.key(LMDB_ROW_CONFIRMED_TXS, height), std::string()));
+    }
+    for (uint64_t idx = record.m_transfers_start; idx < job.m_transfers_stored; ++idx)
+      batch->m_transfers.push_back(std::make_pair(codec.key(LMDB_ROW_TRANSFER, idx), std::string()));
+  }
+
+  for (size_t i = 0; i < record.m_blocks.size(); ++i)
+  {
+    const uint64_t height = record.m_blocks_start + i;
+    batch->m_blocks.push_back(std::make_pair(codec.key(LMDB_ROW_BLOCK, height), codec.seal(height, std::string((const char*)&record.m_blocks[i], sizeof(crypto::hash)))));
+  }
+  for (size_t i = 0; i < record.m_transfers.size(); ++i)
+  {
+    const uint64_t idx = record.m_transfers_start + i;
+    batch->m_transfers.push_back(std::make_pair(codec.key(LMDB_ROW_TRANSFER, idx), codec.seal(idx, encode_transfer_row(record.m_transfers[i]))));
+  }
+  for (const auto &t: job.m_touched)
+    batch->m_transfers.push_back(std::make_pair(codec.key(LMDB_ROW_TRANSFER, t.first), codec.seal(t.first, encode_transfer_row(t.second))));
+
+  std::map<uint64_t, std::vector<std::pair<crypto::hash, payment_details>>> payments_by_height;
+  for (const auto &p: record.m_payments)
+    payments_by_height[p.second.m_block_height].push_back(p);
+  for (const auto &p: payments_by_height)
+    batch->m_payments.push_back(std::make_pair(codec.key(LMDB_ROW_PAYMENTS, p.first), codec.seal(p.first, encode_payments(p.second))));
+  std::map<uint64_t, std::vector<std::pair<crypto::hash, confirmed_transfer_details>>> confirmed_txs_by_height;
+  for (const auto &c: record.m_confirmed_txs)
+    confirmed_txs_by_height[c.second.m_block_height].push_back(c);
+  for (const auto &c: confirmed_txs_by_height)
+  {
+    std::stringstream oss;
+    boost::archive::portable_binary_oarchive ar(oss);
+    ar << c.second;
+    batch->m_confirmed_txs.push_back(std::make_pair(codec.key(LMDB_ROW_CONFIRMED_TXS, c.first), codec.seal(c.first, oss.str())));
+  }
+
+  {
+    std::stringstream oss;
+    boost::archive::portable_binary_oarchive ar(oss);
+    ar << job.m_address;
+    batch->m_state.push_back(std::make_pair("address", seal_value(key, oss.str())));
+  }
+  if (!record.m_misc.empty())
+    batch->m_state.push_back(std::make_pair("misc", seal_value(key, record.m_misc)));
+  if (!record.m_tx_keys.empty() || !record.m_tx_notes.empty())
+  {
+    std::stringstream oss;
+    boost::archive::portable_binary_oarchive ar(oss);
+    ar << record.m_tx_keys;
+    ar << record.m_tx_notes;
+    batch->m_state.push_back(std::make_pair(lmdb_tx_delta_name(job.m_tx_deltas_stored), seal_value(key, oss.str())));
+  }
+  // encrypted with the password already
+  if (!job.m_keys.empty())
+    batch->m_state.push_back(std::make_pair("keys", job.m_keys));
+  return batch;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::lmdb_committed(const store_job &job) const
+{
+  if (!job.m_cache)
+    return;
+
+  // moved over from the cache file or the wallet's own environment, if that is where it was
+  boost::system::error_code ec;
+  boost::filesystem::remove(job.m_file, ec);
+  boost::filesystem::remove(job.m_file + ".journal", ec);
+  if (!job.m_prefix.empty())
+  {
+    boost::filesystem::remove(job.m_file + ".mdb", ec);
+    boost::filesystem::remove(job.m_file + ".mdb-lock", ec);
+  }
+  if (!job.m_keys_file.empty())
+    boost::filesystem::remove(job.m_keys_file, ec);
+}
+//----------------------------------------------------------------------------------------------------
+bool wallet2::load_lmdb(const crypto::chacha8_key &key, const std::string &file)
+{
+  LOG_PRINT_L1("Loading wallet state from " << file);
+  journal_record record;
+  uint64_t tx_deltas;
+  const bool legacy = wallet_lmdb::open(file)->read(file == lmdb_file() ? lmdb_prefix() : std::string(), key, m_account_public_address, record, tx_deltas);
+  apply_journal_record(record);
+  rebuild_transfer_maps();
+  m_lmdb_blocks = m_blockchain.size();
+  m_lmdb_transfers = m_transfers.size();
+  m_lmdb_tx_deltas = tx_deltas;
+  if (legacy)
+    LOG_PRINT_L0(file << " has rows keyed by height, they are rewritten by the next store");
+  // tx keys and notes only in "misc" would be lost with the next "misc" written without them
+  const bool misc_tx_keys = tx_deltas == 0 && (!m_tx_keys.empty() || !m_tx_notes.empty());
+  if (misc_tx_keys)
+    LOG_PRINT_L0(file << " has its tx keys along with the other state, they are rewritten by the next store");
+  return legacy || misc_tx_keys;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::storage_backend(StorageBackend backend, const std::string &container)
+{
+  if (backend == m_storage && container == m_container)
+    return;
+  m_storage = backend;
+  m_container = container;
+  m_lmdb.reset();
+  m_journal_full = true;
+}
+//----------------------------------------------------------------------------------------------------
+bool wallet2::lmdb_get(const std::string &name, std::string &value)
+{
+  return open_lmdb()->get(lmdb_prefix(), name, value);
+}
+//----------------------------------------------------------------------------------------------------
+bool wallet2::lmdb_put_keys(const std::string &keys)
+{
+  // kept in the container, next to the state
+  std::shared_ptr<wallet_lmdb_batch> batch = std::make_shared<wallet_lmdb_batch>();
+  batch->m_prefix = lmdb_prefix();
+  batch->m_replace = false;
+  batch->m_state.push_back(std::make_pair("keys", keys));
+  batch->m_full = false;
+  batch->m_fsync = m_fsync_policy == FsyncNever ? FsyncNever : FsyncAlways;
+  try
+  {
+    open_lmdb()->commit(batch);
+  }
+  catch (const std::exception &e)
+  {
+    LOG_ERROR("failed to store wallet keys in " << m_container << ": " << e.what());
+    return false;
+  }
+  return true;
+}
+//----------------------------------------------------------------------------------------------------
+bool wallet2::stored_keys_exist()
+{
+  std::string keys;
+  if (lmdb_container() && lmdb_get("keys", keys))
+    return true;
+  boost::system::error_code e;
+  return boost::filesystem::exists(m_keys_file, e) && !e;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::remove_stored()
+{
+  drain_store();
+  if (lmdb_container() && !m_wallet_file.empty())
+    open_lmdb()->erase(lmdb_prefix());
+  m_lmdb.reset();
+
+  boost::system::error_code e;
+  if (!m_wallet_file.empty())
+  {
+    boost::filesystem::remove(m_wallet_file, e);
+    boost::filesystem::remove(journal_file(), e);
+    boost::filesystem::remove(m_wallet_file + ".mdb", e);
+    boost::filesystem::remove(m_wallet_file + ".mdb-lock", e);
+  }
+  if (!m_keys_file.empty())
+    boost::filesystem::remove(m_keys_file, e);
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::replay_journal(const crypto::chacha8_key &key)
+{
+  m_journal_records = 0;
+  m_journal_bytes = 0;
+
+  const std::string file = journal_file();
+  boost::system::error_code e;
+  if (!boost::filesystem::exists(file, e) || e)
+    return;
+
+  std::string buf;
+  bool r = epee::file_io_utils::load_file_to_string(file, buf);
+  THROW_WALLET_EXCEPTION_IF(!r, error::file_read_error, file);
+
+  index_payments();
+
+  // stop at the first record which is torn, corrupt, or belongs to an older cache file
+  size_t offset = 0;
+  while (buf.size() - offset >= 4)
+  {
+    const size_t size = read_size(&buf[offset]);
+    if (size > buf.size() - offset - 4)
+      break;
+
+    wallet2::journal_file_data journal_file_data;
+    if (!::serialization::parse_binary(buf.substr(offset + 4, size), journal_file_data))
+      break;
+    std::string plaintext;
+    plaintext.resize(journal_file_data.journal_data.size());
+    crypto::chacha8(journal_file_data.journal_data.data(), journal_file_data.journal_data.size(), key, journal_file_data.iv, &plaintext[0]);
+    if (crypto::cn_fast_hash(plaintext.data(), plaintext.size()) != journal_file_data.checksum)
+      break;
+
+    journal_record record;
+    try
+    {
+      std::stringstream iss;
+      iss << plaintext;
+      boost::archive::portable_binary_iarchive ar(iss);
+      ar >> record;
+    }
+    catch (const std::exception &ex)
+    {
+      LOG_PRINT_L0("Failed to deserialize journal record at offset " << offset << ": " << ex.what());
+      break;
+    }
+    if (record.m_generation != m_journal_generation)
+      break;
+
+    apply_journal_record(record);
+    offset += 4 + size;
+    ++m_journal_records;
+  }
+  m_journal_bytes = offset;
+
+  if (offset < buf.size())
+  {
+    LOG_PRINT_L0("Discarding " << buf.size() - offset << " bytes from the end of " << file);
+    if (offset == 0)
+      boost::filesystem::remove(file, e);
+    else
+      boost::filesystem::resize_file(file, offset, e);
+    THROW_WALLET_EXCEPTION_IF(e, error::file_save_error, file);
+  }
+
+  if (m_journal_records > 0)
+  {
+    rebuild_transfer_maps();
+    LOG_PRINT_L1("Replayed " << m_journal_records << " journal records from " << file);
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::apply_journal_record(const journal_record &record)
+{
+  THROW_WALLET_EXCEPTION_IF(record.m_blocks_start > m_blockchain.size() || record.m_transfers_start > m_transfers.size(),
+      error::wallet_internal_error, "Journal record does not extend " + m_wallet_file);
+
+  m_blockchain.resize(record.m_blocks_start);
+  m_blockchain.insert(m_blockchain.end(), record.m_blocks.begin(), record.m_blocks.end());
+  m_local_bc_height = m_blockchain.size();
+
+  m_transfers.resize(record.m_transfers_start);
+  m_transfers.insert(m_transfers.end(), record.m_transfers.begin(), record.m_transfers.end());
+  for (const journal_transfer_patch &patch: record.m_patches)
+  {
+    THROW_WALLET_EXCEPTION_IF(patch.m_index >= m_transfers.size(), error::wallet_internal_error,
+        "Journal record patches unknown transfer " + std::to_string(patch.m_index));
+    transfer_details &td = m_transfers[patch.m_index];
+    td.m_spent = patch.m_spent;
+    td.m_spent_height = patch.m_spent_height;
+    td.m_key_image = patch.m_key_image;
+    td.m_key_image_known = patch.m_key_image_known;
+  }
+
+  // the height indexes are kept up to date from record to record (see replay_journal), so that
+  // replacing what a record starts at costs what it replaces, not the whole history
+  detach_payments(record.m_blocks_start);
+  for (const auto &p: record.m_payments)
+  {
+    auto it = m_payments.insert(p);
+    m_payments_by_height.emplace(p.second.m_block_height, p.first);
+    m_payments_by_txid.emplace(p.second.m_tx_hash, &*it);
+  }
+  for (const auto &c: record.m_confirmed_txs)
+  {
+    if (m_confirmed_txs.insert(c).second)
+      m_confirmed_txs_by_height.emplace(c.second.m_block_height, c.first);
+  }
+
+  if (!record.m_misc.empty())
+  {
+    std::stringstream iss;
+    iss << record.m_misc;
+    load_journal_misc(iss);
+  }
+  m_tx_keys.insert(record.m_tx_keys.begin(), record.m_tx_keys.end());
+  for (const auto &n: record.m_tx_notes)
+    m_tx_notes[n.first] = n.second;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::store_to(const std::string &path, const std::string &password)
+{
+  // if file is the same, we do:
+  // 1. save wallet to the *.new file
+  // 2. remove old wallet file
+  // 3. rename *.new to wallet_name
+
+  drain_store();
+
+  // handle if we want just store wallet state to current files (ex store() replacement);
+  bool same_file = true;
+  if (!path.empty())
+  {
+    // LMDB wallets have no cache file to resolve
+    std::string canonical_path = boost::filesystem::exists(m_wallet_file) ? boost::filesystem::canonical(m_wallet_file).string() : boost::filesystem::absolute(m_wallet_file).string();
+    size_t pos = canonical_path.find(path);
+    same_file = pos != std::string::npos;
+  }
+
+
+  if (!same_file)
+  {
+    // check if we want to store to directory which doesn't exists yet
+    boost::filesystem::path parent_path = boost::filesystem::path(path).parent_path();
+
+    // if path is not exists, try to create it
+    if (!parent_path.empty() &&  !boost::filesystem::exists(parent_path))
+    {
+      boost::system::error_code ec;
+      if (!boost::filesystem::create_directories(parent_path, ec))
+      {
+        throw std::logic_error(ec.message());
+      }
+    }
+  }
+  const std::string old_file = m_wallet_file;
+  const std::string old_keys_file = m_keys_file;
+  const std::string old_address_file = m_wallet_file + ".address.txt";
+  const std::string old_prefix = lmdb_prefix();
+
+  if (m_storage == StorageLmdb)
+  {
+    // LMDB needs no compaction, what changed is committed and, for another path, the environment copied
+    store();
+    if (same_file)
+      return;
+    if (!lmdb_container())
+    {
+      std::string keys_file, wallet_file;
+      do_prepare_file_names(path, keys_file, wallet_file);
+      open_lmdb()->copy(wallet_file + ".mdb");
+    }
+  }
+  else
+  {
+    // preparing wallet data
+    store_job job = boost::value_initialized<store_job>();
+    job.m_cache = true;
+    job.m_file = same_file ? m_wallet_file : path;
+    job.m_fsync = m_fsync_policy;
+    generate_chacha8_key_from_secret_keys(job.m_key);
+    job.m_address = m_account_public_address;
+    capture_cache(job.m_chunks);
+    if (same_file)
+    {
+      run_store(job);
+      return;
+    }
+
+    try
+    {
+      // save to new file
+      write_cache_file(job.m_chunks, job.m_key, job.m_file, job.m_fsync != FsyncNever);
+    }
+    catch (...)
+    {
+      m_journal_full = true;
+      throw;
+    }
+  }
 
   // save keys to the new file
   // if we here, main wallet file is saved and we only need to save keys and address files
-  if (!same_file) {
-    prepare_file_names(path);
-    store_keys(m_keys_file, password, false);
-    // save address to the new file
-    const std::string address_file = m_wallet_file + ".address.txt";
-    bool r = file_io_utils::save_string_to_file(address_file, m_account.get_public_address_str(m_testnet));
-    THROW_WALLET_EXCEPTION_IF(!r, error::file_save_error, m_wallet_file);
-    // remove old wallet file
+  prepare_file_names(path);
+  store_keys(m_keys_file, password, false);
+  // save address to the new file
+  const std::string address_file = m_wallet_file + ".address.txt";
+  bool r = file_io_utils::save_string_to_file(address_file, m_account.get_public_address_str(m_testnet));
+  THROW_WALLET_EXCEPTION_IF(!r, error::file_save_error, m_wallet_file);
+  // remove old wallet file
+  if (lmdb_container())
+  {
+    // written whole under the prefix of the new name, then dropped under the old one
+    m_journal_full = true;
+    store();
+    open_lmdb()->erase(old_prefix);
+  }
+  else if (m_storage == StorageLmdb)
+  {
+    // reopened at the new path by the next store
+    m_lmdb.reset();
+    boost::system::error_code ec;
+    boost::filesystem::remove(old_file + ".mdb", ec);
+    boost::filesystem::remove(old_file + ".mdb-lock", ec);
+  }
+  else
+  {
     r = boost::filesystem::remove(old_file);
     if (!r) {
       LOG_ERROR("error removing file: " << old_file);
     }
-    // remove old keys file
+  }
+  // remove old keys file
+  if (!lmdb_container()) {
     r = boost::filesystem::remove(old_keys_file);
     if (!r) {
       LOG_ERROR("error removing file: " << old_keys_file);
     }
-    // remove old address file
-    r = boost::filesystem::remove(old_address_file);
-    if (!r) {
-      LOG_ERROR("error removing file: " << old_address_file);
-    }
-  } else {
-    // here we have "*.new" file, we need to rename it to be without ".new"
-    std::error_code e = tools::replace_file(new_file, m_wallet_file);
-    THROW_WALLET_EXCEPTION_IF(e, error::file_save_error, m_wallet_file, e);
   }
+  // remove old address file
+  r = boost::filesystem::remove(old_address_file);
+  if (!r) {
+    LOG_ERROR("error removing file: " << old_address_file);
+  }
+  // remove old journal, and any left next to the new file
+  boost::system::error_code ec;
+  boost::filesystem::remove(old_file + ".journal", ec);
+  boost::filesystem::remove(journal_file(), ec);
 }
 //----------------------------------------------------------------------------------------------------
-uint64_t wallet2::unlocked_balance() const
+uint64_t wallet2::unlocked_balance()
 {
-  uint64_t amount = 0;
-  for(const transfer_details& td: m_transfers)
-    if(!td.m_spent && is_transfer_unlocked(td))
-      amount += td.amount();
-
-  return amount;
+  update_unlock_schedule();
+  return m_unlocked_amount;
 }
 //----------------------------------------------------------------------------------------------------
 uint64_t wallet2::balance() const
 {
-  uint64_t amount = 0;
-  for(auto& td: m_transfers)
-    if(!td.m_spent)
-      amount += td.amount();
-
-
-  for(auto& utx: m_unconfirmed_txs)
-    if (utx.second.m_state != wallet2::unconfirmed_transfer_details::failed)
-      amount+= utx.second.m_change;
-
-  return amount;
+  return m_unspent_amount + m_pending_change;
 }
 //----------------------------------------------------------------------------------------------------
 void wallet2::get_transfers(wallet2::transfer_container& incoming_transfers) const
@@ -2771,6 +5704,38 @@ void wallet2::get_unconfirmed_payments(std::list<std::pair<crypto::hash,wallet2:
   }
 }
 //----------------------------------------------------------------------------------------------------
+void wallet2::get_payments_by_txid(const crypto::hash& txid, std::list<std::pair<crypto::hash,wallet2::payment_details>>& payments) const
+{
+  auto range = m_payments_by_txid.equal_range(txid);
+  for (auto i = range.first; i != range.second; ++i) {
+    payments.push_back(*i->second);
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::get_unconfirmed_payments_by_txid(const crypto::hash& txid, std::list<std::pair<crypto::hash,wallet2::payment_details>>& unconfirmed_payments) const
+{
+  auto range = m_unconfirmed_payments_by_txid.equal_range(txid);
+  for (auto i = range.first; i != range.second; ++i) {
+    unconfirmed_payments.push_back(*i->second);
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::get_payments_out_by_txid(const crypto::hash& txid, std::list<std::pair<crypto::hash,wallet2::confirmed_transfer_details>>& confirmed_payments) const
+{
+  auto i = m_confirmed_txs.find(txid);
+  if (i != m_confirmed_txs.end()) {
+    confirmed_payments.push_back(*i);
+  }
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::get_unconfirmed_payments_out_by_txid(const crypto::hash& txid, std::list<std::pair<crypto::hash,wallet2::unconfirmed_transfer_details>>& unconfirmed_payments) const
+{
+  auto i = m_unconfirmed_txs.find(txid);
+  if (i != m_unconfirmed_txs.end()) {
+    unconfirmed_payments.push_back(*i);
+  }
+}
+//----------------------------------------------------------------------------------------------------
 void wallet2::rescan_spent()
 {
   // This is RPC call that can take a long time if there are many outputs,
@@ -2839,7 +5804,7 @@ void wallet2::rescan_blockchain(bool refresh)
 //----------------------------------------------------------------------------------------------------
 bool wallet2::is_transfer_unlocked(const transfer_details& td) const
 {
-  if(!is_tx_spendtime_unlocked(td.m_tx.unlock_time, td.m_block_height))
+  if(!is_tx_spendtime_unlocked(td.m_unlock_time, td.m_block_height))
     return false;
 
   if(td.m_block_height + CRYPTONOTE_DEFAULT_TX_SPENDABLE_AGE > m_blockchain.size())
@@ -2948,7 +5913,7 @@ float wallet2::get_output_relatedness(const transfer_details &td0, const transfe
   // could extract the payment id, and compare them, but this is a bit expensive too
 
   // similar block heights
-  if (dh < 10)
+  if (dh < RELATED_OUTPUTS_HEIGHT_DELTA)
     return 0.2f;
 
   // don't think these are particularly related
@@ -2957,15 +5922,19 @@ float wallet2::get_output_relatedness(const transfer_details &td0, const transfe
 //----------------------------------------------------------------------------------------------------
 size_t wallet2::pop_best_value_from(const transfer_container &transfers, std::vector<size_t> &unused_indices, const std::list<size_t>& selected_transfers, bool smallest) const
 {
-  std::vector<size_t> candidates;
-  float best_relatedness = 1.0f;
-  for (size_t n = 0; n < unused_indices.size(); ++n)
-  {
-    const transfer_details &candidate = transfers[unused_indices[n]];
+  // a candidate can only be related to selected transfers less than
+  // RELATED_OUTPUTS_HEIGHT_DELTA blocks away, so bucket those by height
+  std::multimap<uint64_t, size_t> selected_by_height;
+  for (size_t i: selected_transfers)
+    selected_by_height.emplace(transfers[i].m_block_height, i);
+
+  auto get_relatedness = [&](const transfer_details &candidate) -> float {
     float relatedness = 0.0f;
-    for (std::list<size_t>::const_iterator i = selected_transfers.begin(); i != selected_transfers.end(); ++i)
+    const uint64_t height = candidate.m_block_height;
+    const uint64_t start = height >= RELATED_OUTPUTS_HEIGHT_DELTA ? height - RELATED_OUTPUTS_HEIGHT_DELTA + 1 : 0;
+    for (auto i = selected_by_height.lower_bound(start); i != selected_by_height.end() && i->first < height + RELATED_OUTPUTS_HEIGHT_DELTA; ++i)
     {
-      float r = get_output_relatedness(candidate, transfers[*i]);
+      float r = get_output_relatedness(candidate, transfers[i->second]);
       if (r > relatedness)
       {
         relatedness = r;
@@ -2973,6 +5942,28 @@ size_t wallet2::pop_best_value_from(const transfer_container &transfers, std::ve
           break;
       }
     }
+    return relatedness;
+  };
+
+  // unrelated outputs are always among the best, and usually plentiful, so try a few
+  // random draws first; an accepted draw is uniform over the unrelated outputs, which
+  // is what picking at random from the full ranking below would give
+  if (!smallest && !unused_indices.empty())
+  {
+    for (size_t attempt = 0; attempt < POP_BEST_VALUE_RANDOM_ATTEMPTS; ++attempt)
+    {
+      size_t n = crypto::rand<size_t>() % unused_indices.size();
+      if (get_relatedness(transfers[unused_indices[n]]) == 0.0f)
+        return pop_index (unused_indices, n);
+    }
+  }
+
+  std::vector<size_t> candidates;
+  float best_relatedness = 1.0f;
+  for (size_t n = 0; n < unused_indices.size(); ++n)
+  {
+    const transfer_details &candidate = transfers[unused_indices[n]];
+    float relatedness = get_relatedness(candidate);
 
     if (relatedness < best_relatedness)
     {
@@ -3030,7 +6021,12 @@ uint64_t wallet2::select_transfers(uint64_t needed_money, std::vector<size_t> un
 //----------------------------------------------------------------------------------------------------
 void wallet2::add_unconfirmed_tx(const cryptonote::transaction& tx, uint64_t amount_in, const std::vector<cryptonote::tx_destination_entry> &dests, const crypto::hash &payment_id, uint64_t change_amount)
 {
-  unconfirmed_transfer_details& utd = m_unconfirmed_txs[cryptonote::get_transaction_hash(tx)];
+  const crypto::hash txid = cryptonote::get_transaction_hash(tx);
+  auto it = m_unconfirmed_txs.find(txid);
+  if (it != m_unconfirmed_txs.end() && it->second.m_state != wallet2::unconfirmed_transfer_details::failed)
+    m_pending_change -= it->second.m_change;
+  unconfirmed_transfer_details& utd = m_unconfirmed_txs[txid];
+  m_pending_change += change_amount;
   utd.m_amount_in = amount_in;
   utd.m_amount_out = 0;
   for (const auto &d: dests)
@@ -3043,6 +6039,7 @@ void wallet2::add_unconfirmed_tx(const cryptonote::transaction& tx, uint64_t amo
   utd.m_payment_id = payment_id;
   utd.m_state = wallet2::unconfirmed_transfer_details::pending;
   utd.m_timestamp = time(NULL);
+  m_journal_misc_dirty = true;
 }
 
 //----------------------------------------------------------------------------------------------------
@@ -3190,7 +6187,7 @@ void wallet2::commit_tx(pending_tx& ptx)
   add_unconfirmed_tx(ptx.tx, amount_in, dests, payment_id, ptx.change_dts.amount);
   if (store_tx_info())
   {
-    m_tx_keys.insert(std::make_pair(txid, ptx.tx_key));
+    add_tx_key(txid, ptx.tx_key);
   }
 
   LOG_PRINT_L2("transaction " << txid << " generated ok and sent to daemon, key_images: [" << ptx.key_images << "]");
@@ -3340,7 +6337,7 @@ bool wallet2::sign_tx(unsigned_tx_set &exported_txs, const std::string &signed_f
     if (store_tx_info())
     {
       const crypto::hash txid = get_transaction_hash(ptx.tx);
-      m_tx_keys.insert(std::make_pair(txid, tx_key));
+      add_tx_key(txid, tx_key);
     }
 
     std::string key_images;
@@ -3442,15 +6439,7 @@ bool wallet2::load_tx(const std::string &signed_filename, std::vector<tools::wal
     return false;
   }
   for (size_t i = 0; i < signed_txs.key_images.size(); ++i)
-  {
-    transfer_details &td = m_transfers[i];
-    if (td.m_key_image_known && td.m_key_image != signed_txs.key_images[i])
-      LOG_PRINT_L0("WARNING: imported key image differs from previously known key image at index " << i << ": trusting imported one");
-    td.m_key_image = signed_txs.key_images[i];
-    m_key_images[m_transfers[i].m_key_image] = i;
-    td.m_key_image_known = true;
-    m_pub_keys[m_transfers[i].get_public_key()] = i;
-  }
+    set_key_image(i, signed_txs.key_images[i]);
 
   ptx = signed_txs.ptx;
 
@@ -3587,269 +6576,391 @@ std::vector<wallet2::pending_tx> wallet2::create_transactions(std::vector<crypto
           set_unspent(idx2);
         }
 
-      }
+      }
+
+      // if we made it this far, we're OK to actually send the transactions
+      return ptx_vector;
+
+    }
+    // only catch this here, other exceptions need to pass through to the calling function
+    catch (const tools::error::tx_too_big& e)
+    {
+
+      // unmark pending tx transfers as spent
+      for (auto & ptx : ptx_vector)
+      {
+        // mark transfers to be used as not spent
+        for(size_t idx2: ptx.selected_transfers)
+        {
+          set_unspent(idx2);
+        }
+      }
+
+      if (attempt_count >= MAX_SPLIT_ATTEMPTS)
+      {
+        throw;
+      }
+    }
+    catch (...)
+    {
+      // in case of some other exception, make sure any tx in queue are marked unspent again
+
+      // unmark pending tx transfers as spent
+      for (auto & ptx : ptx_vector)
+      {
+        // mark transfers to be used as not spent
+        for(size_t idx2: ptx.selected_transfers)
+        {
+          set_unspent(idx2);
+        }
+      }
+
+      throw;
+    }
+  }
+}
+
+void wallet2::refresh_decoy_histograms(const std::vector<uint64_t> &amounts)
+{
+  const uint64_t chain_height = m_blockchain.size();
+  const time_t now = time(NULL);
+
+  // get histogram for the amounts we have no fresh one for
+  epee::json_rpc::request<cryptonote::COMMAND_RPC_GET_OUTPUT_HISTOGRAM::request> req_t = AUTO_VAL_INIT(req_t);
+  epee::json_rpc::response<cryptonote::COMMAND_RPC_GET_OUTPUT_HISTOGRAM::response, std::string> resp_t = AUTO_VAL_INIT(resp_t);
+  for (uint64_t amount: amounts)
+  {
+    auto it = m_decoy_pools.find(amount);
+    if (it == m_decoy_pools.end() || it->second.chain_height != chain_height || it->second.fetched + DECOY_HISTOGRAM_TTL < now)
+      req_t.params.amounts.push_back(amount);
+  }
+  std::sort(req_t.params.amounts.begin(), req_t.params.amounts.end());
+  auto end = std::unique(req_t.params.amounts.begin(), req_t.params.amounts.end());
+  req_t.params.amounts.resize(std::distance(req_t.params.amounts.begin(), end));
+  if (req_t.params.amounts.empty())
+    return;
+
+  m_daemon_rpc_mutex.lock();
+  req_t.jsonrpc = "2.0";
+  req_t.id = epee::serialization::storage_entry(0);
+  req_t.method = "get_output_histogram";
+  req_t.params.unlocked = true;
+  req_t.params.recent_cutoff = now - RECENT_OUTPUT_ZONE;
+  bool r = net_utils::invoke_http_json("/json_rpc", req_t, resp_t, m_http_client, rpc_timeout);
+  m_daemon_rpc_mutex.unlock();
+  THROW_WALLET_EXCEPTION_IF(!r, error::no_connection_to_daemon, "transfer_selected");
+  THROW_WALLET_EXCEPTION_IF(resp_t.result.status == CORE_RPC_STATUS_BUSY, error::daemon_busy, "get_output_histogram");
+  THROW_WALLET_EXCEPTION_IF(resp_t.result.status != CORE_RPC_STATUS_OK, error::get_histogram_error, resp_t.result.status);
+
+  // draws made with the previous histogram follow a stale distribution, drop them
+  for (uint64_t amount: req_t.params.amounts)
+  {
+    decoy_pool &pool = m_decoy_pools[amount];
+    pool = decoy_pool();
+    pool.chain_height = chain_height;
+    pool.fetched = now;
+    for (const auto &he: resp_t.result.histogram)
+    {
+      if (he.amount == amount)
+      {
+        LOG_PRINT_L2("Found " << print_money(amount) << ": " << he.total_instances << " total, "
+            << he.unlocked_instances << " unlocked, " << he.recent_instances << " recent");
+        pool.num_outs = he.unlocked_instances;
+        pool.num_recent_outs = he.recent_instances;
+        break;
+      }
+    }
+  }
+}
+//----------------------------------------------------------------------------------------------------
+std::vector<wallet2::decoy_plan> wallet2::plan_decoys(const std::list<size_t> &selected_transfers, size_t fake_outputs_count)
+{
+  std::vector<uint64_t> amounts;
+  for(size_t idx: selected_transfers)
+    amounts.push_back(m_transfers[idx].is_rct() ? 0 : m_transfers[idx].amount());
+  refresh_decoy_histograms(amounts);
+
+  // we ask for more, to have spares if some outputs are still locked
+  size_t base_requested_outputs_count = (size_t)((fake_outputs_count + 1) * 1.5 + 1);
+  LOG_PRINT_L2("base_requested_outputs_count: " << base_requested_outputs_count);
+
+  std::vector<decoy_plan> plans;
+  plans.reserve(selected_transfers.size());
+  for(size_t idx: selected_transfers)
+  {
+    const transfer_details &td = m_transfers[idx];
+    decoy_plan plan;
+    plan.amount = td.is_rct() ? 0 : td.amount();
+    // request more for rct in base recent (locked) coinbases are picked, since they're locked for longer
+    plan.requested_outputs_count = base_requested_outputs_count + (td.is_rct() ? CRYPTONOTE_MINED_MONEY_UNLOCK_WINDOW - CRYPTONOTE_DEFAULT_TX_SPENDABLE_AGE : 0);
+
+    const decoy_pool &pool = m_decoy_pools[plan.amount];
+    const uint64_t num_outs = pool.num_outs, num_recent_outs = pool.num_recent_outs;
+    LOG_PRINT_L1("" << num_outs << " unlocked outputs of size " << print_money(plan.amount));
+    THROW_WALLET_EXCEPTION_IF(num_outs == 0, error::wallet_internal_error,
+        "histogram reports no unlocked outputs for " + boost::lexical_cast<std::string>(plan.amount) + ", not even ours");
+    THROW_WALLET_EXCEPTION_IF(num_recent_outs > num_outs, error::wallet_internal_error,
+        "histogram reports more recent outs than outs for " + boost::lexical_cast<std::string>(plan.amount));
+
+    // X% of those outs are to be taken from recent outputs
+    size_t recent_outputs_count = plan.requested_outputs_count * RECENT_OUTPUT_RATIO;
+    if (recent_outputs_count == 0)
+      recent_outputs_count = 1; // ensure we have at least one, if possible
+    if (recent_outputs_count > num_recent_outs)
+      recent_outputs_count = num_recent_outs;
+    if (td.m_global_output_index >= num_outs - num_recent_outs && recent_outputs_count > 0)
+      --recent_outputs_count; // if the real out is recent, pick one less recent fake out
+    LOG_PRINT_L1("Using " << recent_outputs_count << " recent outputs");
+    plan.recent_outputs_count = recent_outputs_count;
+
+    plans.push_back(plan);
+  }
+  return plans;
+}
+//----------------------------------------------------------------------------------------------------
+void wallet2::fill_decoy_pools(const std::list<size_t> &selected_transfers, const std::vector<decoy_plan> &plans, size_t prefetch_factor,
+    std::unordered_map<uint64_t, std::vector<std::pair<get_outs_entry, bool>>> &all_outs)
+{
+  // draws each amount's pool must hold to serve these inputs
+  std::unordered_map<uint64_t, std::pair<size_t, size_t>> needed; // amount -> (recent, triangular)
+  std::unordered_set<uint64_t> scarce_amounts;
+  for (const decoy_plan &plan: plans)
+  {
+    if (m_decoy_pools[plan.amount].num_outs <= plan.requested_outputs_count)
+    {
+      scarce_amounts.insert(plan.amount);
+      continue;
+    }
+    std::pair<size_t, size_t> &n = needed[plan.amount];
+    n.first += plan.recent_outputs_count;
+    n.second += plan.requested_outputs_count - 1 - plan.recent_outputs_count;
+  }
+
+  // our real outputs the daemon has not sent us yet, with this histogram; they are
+  // never asked for without fresh decoys of the same amount around them
+  std::vector<const transfer_details*> unverified;
+  std::unordered_set<uint64_t> unverified_amounts;
+  for(size_t idx: selected_transfers)
+  {
+    const transfer_details &td = m_transfers[idx];
+    const uint64_t amount = td.is_rct() ? 0 : td.amount();
+    if (m_decoy_pools[amount].real.count(td.m_global_output_index))
+      continue;
+    unverified.push_back(&td);
+    unverified_amounts.insert(amount);
+  }
 
-      // if we made it this far, we're OK to actually send the transactions
-      return ptx_vector;
+  enum { OUT_REAL, OUT_ALL, OUT_RECENT, OUT_TRIANGULAR };
+  struct wanted_out { get_outputs_out out; int kind; const transfer_details *td; };
+  std::vector<wanted_out> wanted;
 
-    }
-    // only catch this here, other exceptions need to pass through to the calling function
-    catch (const tools::error::tx_too_big& e)
+  // pools keep twice what is needed before being topped up, as headroom for
+  // draws dropped as duplicates
+  for (const auto &n: needed)
+  {
+    const uint64_t amount = n.first;
+    const decoy_pool &pool = m_decoy_pools[amount];
+    size_t recent = prefetch_factor * n.second.first > pool.recent.size() ? prefetch_factor * n.second.first - pool.recent.size() : 0;
+    size_t triangular = prefetch_factor * n.second.second > pool.triangular.size() ? prefetch_factor * n.second.second - pool.triangular.size() : 0;
+    if (unverified_amounts.count(amount))
     {
+      recent = std::max(recent, n.second.first);
+      triangular = std::max(triangular, n.second.second);
+    }
+    else if (pool.recent.size() >= 2 * n.second.first && pool.triangular.size() >= 2 * n.second.second)
+      continue;
 
-      // unmark pending tx transfers as spent
-      for (auto & ptx : ptx_vector)
-      {
-        // mark transfers to be used as not spent
-        for(size_t idx2: ptx.selected_transfers)
-        {
-          set_unspent(idx2);
-        }
-      }
-
-      if (attempt_count >= MAX_SPLIT_ATTEMPTS)
-      {
-        throw;
-      }
+    for (size_t i = 0; i < recent; ++i)
+    {
+      // triangular distribution over [a,b) with a=0, mode c=b=up_index_limit
+      uint64_t r = crypto::rand<uint64_t>() % ((uint64_t)1 << 53);
+      double frac = std::sqrt((double)r / ((uint64_t)1 << 53));
+      uint64_t index = (uint64_t)(frac*pool.num_recent_outs) + pool.num_outs - pool.num_recent_outs;
+      // just in case rounding up to 1 occurs after calc
+      if (index == pool.num_outs)
+        --index;
+      LOG_PRINT_L2("picking " << index << " as recent");
+      wanted.push_back({{amount, index}, OUT_RECENT, NULL});
     }
-    catch (...)
+    for (size_t i = 0; i < triangular; ++i)
     {
-      // in case of some other exception, make sure any tx in queue are marked unspent again
+      // triangular distribution over [a,b) with a=0, mode c=b=up_index_limit
+      uint64_t r = crypto::rand<uint64_t>() % ((uint64_t)1 << 53);
+      double frac = std::sqrt((double)r / ((uint64_t)1 << 53));
+      uint64_t index = (uint64_t)(frac*pool.num_outs);
+      // just in case rounding up to 1 occurs after calc
+      if (index == pool.num_outs)
+        --index;
+      LOG_PRINT_L2("picking " << index << " as triangular");
+      wanted.push_back({{amount, index}, OUT_TRIANGULAR, NULL});
+    }
+  }
 
-      // unmark pending tx transfers as spent
-      for (auto & ptx : ptx_vector)
-      {
-        // mark transfers to be used as not spent
-        for(size_t idx2: ptx.selected_transfers)
-        {
-          set_unspent(idx2);
-        }
-      }
+  // if there are just enough outputs to mix with, use all of them.
+  // Eventually this should become impossible.
+  for (uint64_t amount: scarce_amounts)
+  {
+    for (uint64_t i = 0; i < m_decoy_pools[amount].num_outs; ++i)
+      wanted.push_back({{amount, i}, OUT_ALL, NULL});
+  }
 
-      throw;
+  if (wanted.empty())
+    return;
+
+  // our real outputs go in the same request, so the daemon's answer can be checked
+  // against what we know about them
+  for (const transfer_details *td: unverified)
+    wanted.push_back({{td->is_rct() ? 0 : td->amount(), td->m_global_output_index}, OUT_REAL, td});
+
+  // sort the request, to ensure the daemon doesn't know which outputs are ours
+  std::sort(wanted.begin(), wanted.end(), [](const wanted_out &a, const wanted_out &b) {
+    return a.out.amount < b.out.amount || (a.out.amount == b.out.amount && a.out.index < b.out.index); });
+
+  COMMAND_RPC_GET_OUTPUTS_BIN::request req = AUTO_VAL_INIT(req);
+  COMMAND_RPC_GET_OUTPUTS_BIN::response daemon_resp = AUTO_VAL_INIT(daemon_resp);
+  req.outputs.reserve(wanted.size());
+  for (const wanted_out &w: wanted)
+  {
+    LOG_PRINT_L1("asking for output " << w.out.index << " for " << print_money(w.out.amount));
+    req.outputs.push_back(w.out);
+  }
+
+  // get the keys for those
+  m_daemon_rpc_mutex.lock();
+  bool r = epee::net_utils::invoke_http_bin("/get_outs.bin", req, daemon_resp, m_http_client, rpc_timeout);
+  m_daemon_rpc_mutex.unlock();
+  THROW_WALLET_EXCEPTION_IF(!r, error::no_connection_to_daemon, "get_outs.bin");
+  THROW_WALLET_EXCEPTION_IF(daemon_resp.status == CORE_RPC_STATUS_BUSY, error::daemon_busy, "get_outs.bin");
+  THROW_WALLET_EXCEPTION_IF(daemon_resp.status != CORE_RPC_STATUS_OK, error::get_random_outs_error, daemon_resp.status);
+  THROW_WALLET_EXCEPTION_IF(daemon_resp.outs.size() != req.outputs.size(), error::wallet_internal_error,
+    "daemon returned wrong response for get_outs.bin, wrong amounts count = " +
+    std::to_string(daemon_resp.outs.size()) + ", expected " +  std::to_string(req.outputs.size()));
+
+  for (size_t i = 0; i < wanted.size(); ++i)
+  {
+    const wanted_out &w = wanted[i];
+    if (w.kind == OUT_REAL)
+    {
+      // checked by get_outs, for this request and later ones using the same histogram
+      m_decoy_pools[w.out.amount].real[w.out.index] = std::make_pair(daemon_resp.outs[i].key, daemon_resp.outs[i].mask);
+      continue;
     }
+    std::pair<get_outs_entry, bool> e(std::make_tuple(w.out.index, daemon_resp.outs[i].key, daemon_resp.outs[i].mask), daemon_resp.outs[i].unlocked);
+    if (w.kind == OUT_ALL)
+      all_outs[w.out.amount].push_back(e);
+    else if (w.kind == OUT_RECENT)
+      m_decoy_pools[w.out.amount].recent.push_back(e);
+    else
+      m_decoy_pools[w.out.amount].triangular.push_back(e);
+  }
+  // pool order must not follow the sorted request order
+  for (const auto &n: needed)
+  {
+    decoy_pool &pool = m_decoy_pools[n.first];
+    std::shuffle(pool.recent.begin(), pool.recent.end(), std::default_random_engine(crypto::rand<unsigned>()));
+    std::shuffle(pool.triangular.begin(), pool.triangular.end(), std::default_random_engine(crypto::rand<unsigned>()));
   }
 }
-
+//----------------------------------------------------------------------------------------------------
 void wallet2::get_outs(std::vector<std::vector<tools::wallet2::get_outs_entry>> &outs, const std::list<size_t> &selected_transfers, size_t fake_outputs_count)
 {
   LOG_PRINT_L2("fake_outputs_count: " << fake_outputs_count);
   outs.clear();
   if (fake_outputs_count > 0)
   {
-    // get histogram for the amounts we need
-    epee::json_rpc::request<cryptonote::COMMAND_RPC_GET_OUTPUT_HISTOGRAM::request> req_t = AUTO_VAL_INIT(req_t);
-    epee::json_rpc::response<cryptonote::COMMAND_RPC_GET_OUTPUT_HISTOGRAM::response, std::string> resp_t = AUTO_VAL_INIT(resp_t);
-    m_daemon_rpc_mutex.lock();
-    req_t.jsonrpc = "2.0";
-    req_t.id = epee::serialization::storage_entry(0);
-    req_t.method = "get_output_histogram";
-    for(size_t idx: selected_transfers)
-      req_t.params.amounts.push_back(m_transfers[idx].is_rct() ? 0 : m_transfers[idx].amount());
-    std::sort(req_t.params.amounts.begin(), req_t.params.amounts.end());
-    auto end = std::unique(req_t.params.amounts.begin(), req_t.params.amounts.end());
-    req_t.params.amounts.resize(std::distance(req_t.params.amounts.begin(), end));
-    req_t.params.unlocked = true;
-    req_t.params.recent_cutoff = time(NULL) - RECENT_OUTPUT_ZONE;
-    bool r = net_utils::invoke_http_json("/json_rpc", req_t, resp_t, m_http_client, rpc_timeout);
-    m_daemon_rpc_mutex.unlock();
-    THROW_WALLET_EXCEPTION_IF(!r, error::no_connection_to_daemon, "transfer_selected");
-    THROW_WALLET_EXCEPTION_IF(resp_t.result.status == CORE_RPC_STATUS_BUSY, error::daemon_busy, "get_output_histogram");
-    THROW_WALLET_EXCEPTION_IF(resp_t.result.status != CORE_RPC_STATUS_OK, error::get_histogram_error, resp_t.result.status);
-
-    // we ask for more, to have spares if some outputs are still locked
-    size_t base_requested_outputs_count = (size_t)((fake_outputs_count + 1) * 1.5 + 1);
-    LOG_PRINT_L2("base_requested_outputs_count: " << base_requested_outputs_count);
+    std::vector<decoy_plan> plans = plan_decoys(selected_transfers, fake_outputs_count);
+    std::unordered_map<uint64_t, std::vector<std::pair<get_outs_entry, bool>>> all_outs;
+    fill_decoy_pools(selected_transfers, plans, DECOY_POOL_PREFETCH_FACTOR, all_outs);
 
-    // generate output indices to request
-    COMMAND_RPC_GET_OUTPUTS_BIN::request req = AUTO_VAL_INIT(req);
-    COMMAND_RPC_GET_OUTPUTS_BIN::response daemon_resp = AUTO_VAL_INIT(daemon_resp);
-
-    size_t num_selected_transfers = 0;
+    std::unordered_map<uint64_t, uint64_t> scanty_outs;
+    size_t n_plan = 0;
+    outs.reserve(plans.size());
     for(size_t idx: selected_transfers)
     {
-      ++num_selected_transfers;
       const transfer_details &td = m_transfers[idx];
-      const uint64_t amount = td.is_rct() ? 0 : td.amount();
-      std::unordered_set<uint64_t> seen_indices;
-      // request more for rct in base recent (locked) coinbases are picked, since they're locked for longer
-      size_t requested_outputs_count = base_requested_outputs_count + (td.is_rct() ? CRYPTONOTE_MINED_MONEY_UNLOCK_WINDOW - CRYPTONOTE_DEFAULT_TX_SPENDABLE_AGE : 0);
-      size_t start = req.outputs.size();
-
-      // if there are just enough outputs to mix with, use all of them.
-      // Eventually this should become impossible.
-      uint64_t num_outs = 0, num_recent_outs = 0;
-      for (auto he: resp_t.result.histogram)
-      {
-        if (he.amount == amount)
-        {
-          LOG_PRINT_L2("Found " << print_money(amount) << ": " << he.total_instances << " total, "
-              << he.unlocked_instances << " unlocked, " << he.recent_instances << " recent");
-          num_outs = he.unlocked_instances;
-          num_recent_outs = he.recent_instances;
-          break;
-        }
-      }
-      LOG_PRINT_L1("" << num_outs << " unlocked outputs of size " << print_money(amount));
-      THROW_WALLET_EXCEPTION_IF(num_outs == 0, error::wallet_internal_error,
-          "histogram reports no unlocked outputs for " + boost::lexical_cast<std::string>(amount) + ", not even ours");
-      THROW_WALLET_EXCEPTION_IF(num_recent_outs > num_outs, error::wallet_internal_error,
-          "histogram reports more recent outs than outs for " + boost::lexical_cast<std::string>(amount));
-
-      // X% of those outs are to be taken from recent outputs
-      size_t recent_outputs_count = requested_outputs_count * RECENT_OUTPUT_RATIO;
-      if (recent_outputs_count == 0)
-        recent_outputs_count = 1; // ensure we have at least one, if possible
-      if (recent_outputs_count > num_recent_outs)
-        recent_outputs_count = num_recent_outs;
-      if (td.m_global_output_index >= num_outs - num_recent_outs && recent_outputs_count > 0)
-        --recent_outputs_count; // if the real out is recent, pick one less recent fake out
-      LOG_PRINT_L1("Using " << recent_outputs_count << " recent outputs");
-
-      if (num_outs <= requested_outputs_count)
+      const decoy_plan &plan = plans[n_plan++];
+      decoy_pool &pool = m_decoy_pools[plan.amount];
+      outs.push_back(std::vector<get_outs_entry>());
+      outs.back().reserve(fake_outputs_count + 1);
+      const rct::key mask = td.is_rct() ? rct::commit(td.amount(), td.m_mask) : rct::zeroCommit(td.amount());
+      const crypto::public_key &key = td.get_public_key();
+
+      // make sure the real outputs we asked for are really included, along
+      // with the correct key and mask: this guards against an active attack
+      // where the node sends dummy data for all outputs, and we then send
+      // the real one, which the node can then tell from the fake outputs,
+      // as it has different data than the dummy data it had sent earlier
+      auto real = pool.real.find(td.m_global_output_index);
+      THROW_WALLET_EXCEPTION_IF(real == pool.real.end() || real->second.first != key || real->second.second != mask,
+          error::wallet_internal_error, "Daemon response did not include the requested real output");
+
+      // candidates are what a request for this input alone would have returned, minus the real one
+      std::vector<std::pair<get_outs_entry, bool>> candidates;
+      if (pool.num_outs <= plan.requested_outputs_count)
       {
-        for (uint64_t i = 0; i < num_outs; i++)
-          req.outputs.push_back({amount, i});
-        // duplicate to make up shortfall: this will be caught after the RPC call,
-        // so we can also output the amounts for which we can't reach the required
-        // mixin after checking the actual unlockedness
-        for (uint64_t i = num_outs; i < requested_outputs_count; ++i)
-          req.outputs.push_back({amount, num_outs - 1});
+        for (const auto &e: all_outs[plan.amount])
+          if (std::get<0>(e.first) != td.m_global_output_index)
+            candidates.push_back(e);
       }
       else
       {
-        // start with real one
-        uint64_t num_found = 1;
+        std::unordered_set<uint64_t> seen_indices;
         seen_indices.emplace(td.m_global_output_index);
-        req.outputs.push_back({amount, td.m_global_output_index});
-        LOG_PRINT_L1("Selecting real output: " << td.m_global_output_index << " for " << print_money(amount));
+        uint64_t num_found = 1;
 
         // while we still need more mixins
-        while (num_found < requested_outputs_count)
+        while (num_found < plan.requested_outputs_count)
         {
           // if we've gone through every possible output, we've gotten all we can
-          if (seen_indices.size() == num_outs)
+          if (seen_indices.size() == pool.num_outs)
             break;
 
-          // get a random output index from the DB.  If we've already seen it,
-          // return to the top of the loop and try again, otherwise add it to the
-          // list of output indices we've seen.
-
-          uint64_t i;
-          if (num_found - 1 < recent_outputs_count) // -1 to account for the real one we seeded with
+          // draws are consumed in order; if we've already seen one, drop it and take the next
+          auto &draws = num_found - 1 < plan.recent_outputs_count ? pool.recent : pool.triangular; // -1 to account for the real one we seeded with
+          if (draws.empty())
           {
-            // triangular distribution over [a,b) with a=0, mode c=b=up_index_limit
-            uint64_t r = crypto::rand<uint64_t>() % ((uint64_t)1 << 53);
-            double frac = std::sqrt((double)r / ((uint64_t)1 << 53));
-            i = (uint64_t)(frac*num_recent_outs) + num_outs - num_recent_outs;
-            // just in case rounding up to 1 occurs after calc
-            if (i == num_outs)
-              --i;
-            LOG_PRINT_L2("picking " << i << " as recent");
-          }
-          else
-          {
-            // triangular distribution over [a,b) with a=0, mode c=b=up_index_limit
-            uint64_t r = crypto::rand<uint64_t>() % ((uint64_t)1 << 53);
-            double frac = std::sqrt((double)r / ((uint64_t)1 << 53));
-            i = (uint64_t)(frac*num_outs);
-            // just in case rounding up to 1 occurs after calc
-            if (i == num_outs)
-              --i;
-            LOG_PRINT_L2("picking " << i << " as triangular");
+            // too many draws were dropped as duplicates, fetch more decoys (only decoys) for this input
+            LOG_PRINT_L1("Decoy pool for " << print_money(plan.amount) << " ran out after " << num_found << " outputs, refilling");
+            fill_decoy_pools(std::list<size_t>(), std::vector<decoy_plan>(1, plan), DECOY_POOL_PREFETCH_FACTOR, all_outs);
+            continue;
           }
-
-          if (seen_indices.count(i))
+          std::pair<get_outs_entry, bool> e = draws.front();
+          draws.pop_front();
+          if (!seen_indices.emplace(std::get<0>(e.first)).second)
             continue;
-          seen_indices.emplace(i);
 
-          req.outputs.push_back({amount, i});
+          candidates.push_back(e);
           ++num_found;
         }
       }
 
-      // sort the subsection, to ensure the daemon doesn't know wich output is ours
-      std::sort(req.outputs.begin() + start, req.outputs.end(),
-          [](const get_outputs_out &a, const get_outputs_out &b) { return a.index < b.index; });
-    }
-
-    for (auto i: req.outputs)
-      LOG_PRINT_L1("asking for output " << i.index << " for " << print_money(i.amount));
-
-    // get the keys for those
-    m_daemon_rpc_mutex.lock();
-    r = epee::net_utils::invoke_http_bin("/get_outs.bin", req, daemon_resp, m_http_client, rpc_timeout);
-    m_daemon_rpc_mutex.unlock();
-    THROW_WALLET_EXCEPTION_IF(!r, error::no_connection_to_daemon, "get_outs.bin");
-    THROW_WALLET_EXCEPTION_IF(daemon_resp.status == CORE_RPC_STATUS_BUSY, error::daemon_busy, "get_outs.bin");
-    THROW_WALLET_EXCEPTION_IF(daemon_resp.status != CORE_RPC_STATUS_OK, error::get_random_outs_error, daemon_resp.status);
-    THROW_WALLET_EXCEPTION_IF(daemon_resp.outs.size() != req.outputs.size(), error::wallet_internal_error,
-      "daemon returned wrong response for get_outs.bin, wrong amounts count = " +
-      std::to_string(daemon_resp.outs.size()) + ", expected " +  std::to_string(req.outputs.size()));
-
-    std::unordered_map<uint64_t, uint64_t> scanty_outs;
-    size_t base = 0;
-    outs.reserve(num_selected_transfers);
-    for(size_t idx: selected_transfers)
-    {
-      const transfer_details &td = m_transfers[idx];
-      size_t requested_outputs_count = base_requested_outputs_count + (td.is_rct() ? CRYPTONOTE_MINED_MONEY_UNLOCK_WINDOW - CRYPTONOTE_DEFAULT_TX_SPENDABLE_AGE : 0);
-      outs.push_back(std::vector<get_outs_entry>());
-      outs.back().reserve(fake_outputs_count + 1);
-      const rct::key mask = td.is_rct() ? rct::commit(td.amount(), td.m_mask) : rct::zeroCommit(td.amount());
-
-      // make sure the real outputs we asked for are really included, along
-      // with the correct key and mask: this guards against an active attack
-      // where the node sends dummy data for all outputs, and we then send
-      // the real one, which the node can then tell from the fake outputs,
-      // as it has different data than the dummy data it had sent earlier
-      bool real_out_found = false;
-      for (size_t n = 0; n < requested_outputs_count; ++n)
-      {
-        size_t i = base + n;
-        if (req.outputs[i].index == td.m_global_output_index)
-          if (daemon_resp.outs[i].key == boost::get<txout_to_key>(td.m_tx.vout[td.m_internal_output_index].target).key)
-            if (daemon_resp.outs[i].mask == mask)
-              real_out_found = true;
-      }
-      THROW_WALLET_EXCEPTION_IF(!real_out_found, error::wallet_internal_error,
-          "Daemon response did not include the requested real output");
-
       // pick real out first (it will be sorted when done)
-      outs.back().push_back(std::make_tuple(td.m_global_output_index, boost::get<txout_to_key>(td.m_tx.vout[td.m_internal_output_index].target).key, mask));
+      outs.back().push_back(std::make_tuple(td.m_global_output_index, key, mask));
 
       // then pick others in random order till we reach the required number
       // since we use an equiprobable pick here, we don't upset the triangular distribution
-      std::vector<size_t> order;
-      order.resize(requested_outputs_count);
-      for (size_t n = 0; n < order.size(); ++n)
-        order[n] = n;
-      std::shuffle(order.begin(), order.end(), std::default_random_engine(crypto::rand<unsigned>()));
-
-      LOG_PRINT_L2("Looking for " << (fake_outputs_count+1) << " outputs of size " << print_money(td.is_rct() ? 0 : td.amount()));
-      for (size_t o = 0; o < requested_outputs_count && outs.back().size() < fake_outputs_count + 1; ++o)
+      std::shuffle(candidates.begin(), candidates.end(), std::default_random_engine(crypto::rand<unsigned>()));
+
+      LOG_PRINT_L2("Looking for " << (fake_outputs_count+1) << " outputs of size " << print_money(plan.amount));
+      for (size_t o = 0; o < candidates.size() && outs.back().size() < fake_outputs_count + 1; ++o)
       {
-        size_t i = base + order[o];
-        LOG_PRINT_L2("Index " << i << "/" << requested_outputs_count << ": idx " << req.outputs[i].index << " (real " << td.m_global_output_index << "), unlocked " << daemon_resp.outs[i].unlocked << ", key " << daemon_resp.outs[i].key);
-        if (req.outputs[i].index == td.m_global_output_index) // don't re-add real one
+        const get_outs_entry &item = candidates[o].first;
+        LOG_PRINT_L2("Index " << o << "/" << candidates.size() << ": idx " << std::get<0>(item) << " (real " << td.m_global_output_index << "), unlocked " << candidates[o].second << ", key " << std::get<1>(item));
+        if (!candidates[o].second) // don't add locked outs
           continue;
-        if (!daemon_resp.outs[i].unlocked) // don't add locked outs
-          continue;
-        auto item = std::make_tuple(req.outputs[i].index, daemon_resp.outs[i].key, daemon_resp.outs[i].mask);
         if (std::find(outs.back().begin(), outs.back().end(), item) != outs.back().end()) // don't add duplicates
           continue;
         outs.back().push_back(item);
       }
       if (outs.back().size() < fake_outputs_count + 1)
       {
-        scanty_outs[td.is_rct() ? 0 : td.amount()] = outs.back().size();
+        scanty_outs[plan.amount] = outs.back().size();
       }
       else
       {
         // sort the subsection, so any spares are reset in order
         std::sort(outs.back().begin(), outs.back().end(), [](const get_outs_entry &a, const get_outs_entry &b) { return std::get<0>(a) < std::get<0>(b); });
       }
-      base += requested_outputs_count;
     }
     THROW_WALLET_EXCEPTION_IF(!scanty_outs.empty(), error::not_enough_outs_to_mix, scanty_outs, fake_outputs_count);
   }
@@ -3860,7 +6971,7 @@ void wallet2::get_outs(std::vector<std::vector<tools::wallet2::get_outs_entry>>
       const transfer_details &td = m_transfers[idx];
       std::vector<get_outs_entry> v;
       const rct::key mask = td.is_rct() ? rct::commit(td.amount(), td.m_mask) : rct::zeroCommit(td.amount());
-      v.push_back(std::make_tuple(td.m_global_output_index, boost::get<txout_to_key>(td.m_tx.vout[td.m_internal_output_index].target).key, mask));
+      v.push_back(std::make_tuple(td.m_global_output_index, td.get_public_key(), mask));
       outs.push_back(v);
     }
   }
@@ -3936,10 +7047,10 @@ void wallet2::transfer_selected(const std::vector<cryptonote::tx_destination_ent
 
     tx_output_entry real_oe;
     real_oe.first = td.m_global_output_index;
-    real_oe.second.dest = rct::pk2rct(boost::get<txout_to_key>(td.m_tx.vout[td.m_internal_output_index].target).key);
+    real_oe.second.dest = rct::pk2rct(td.get_public_key());
     real_oe.second.mask = rct::commit(td.amount(), td.m_mask);
     *it_to_replace = real_oe;
-    src.real_out_tx_key = get_tx_pub_key_from_extra(td.m_tx, td.m_pk_index);
+    src.real_out_tx_key = get_tx_pub_key_from_extra(*td.m_tx, td.m_pk_index);
     src.real_output = it_to_replace - src.outputs.begin();
     src.real_output_in_tx_index = td.m_internal_output_index;
     detail::print_source_entry(src);
@@ -4080,10 +7191,10 @@ void wallet2::transfer_selected_rct(std::vector<cryptonote::tx_destination_entry
 
     tx_output_entry real_oe;
     real_oe.first = td.m_global_output_index;
-    real_oe.second.dest = rct::pk2rct(boost::get<txout_to_key>(td.m_tx.vout[td.m_internal_output_index].target).key);
+    real_oe.second.dest = rct::pk2rct(td.get_public_key());
     real_oe.second.mask = rct::commit(td.amount(), td.m_mask);
     *it_to_replace = real_oe;
-    src.real_out_tx_key = get_tx_pub_key_from_extra(td.m_tx, td.m_pk_index);
+    src.real_out_tx_key = get_tx_pub_key_from_extra(*td.m_tx, td.m_pk_index);
     src.real_output = it_to_replace - src.outputs.begin();
     src.real_output_in_tx_index = td.m_internal_output_index;
     src.mask = td.m_mask;
@@ -4205,59 +7316,121 @@ static size_t estimate_tx_size(bool use_rct, int n_inputs, int mixin, int n_outp
     return n_inputs * (mixin+1) * APPROXIMATE_INPUT_BYTES;
 }
 
-std::vector<size_t> wallet2::pick_preferred_rct_inputs(uint64_t needed_money) const
+amount_tree::amount_tree(const std::vector<uint64_t> &amounts): m_leaves(1)
 {
-  std::vector<size_t> picks;
-  float current_output_relatdness = 1.0f;
-
-  LOG_PRINT_L2("pick_preferred_rct_inputs: needed_money " << print_money(needed_money));
+  while (m_leaves < amounts.size())
+    m_leaves <<= 1;
+  m_max.assign(2 * m_leaves, 0);
+  std::copy(amounts.begin(), amounts.end(), m_max.begin() + m_leaves);
+  for (size_t n = m_leaves - 1; n > 0; --n)
+    m_max[n] = std::max(m_max[2 * n], m_max[2 * n + 1]);
+}
 
-  // try to find a rct input of enough size
-  for (size_t i = 0; i < m_transfers.size(); ++i)
+void amount_tree::set(size_t pos, uint64_t amount)
+{
+  if (pos >= m_leaves)
   {
-    const transfer_details& td = m_transfers[i];
-    if (!td.m_spent && td.is_rct() && td.amount() >= needed_money && is_transfer_unlocked(td))
-    {
-      LOG_PRINT_L2("We can use " << i << " alone: " << print_money(td.amount()));
-      picks.push_back(i);
-      return picks;
-    }
+    if (amount == 0)
+      return;
+    std::vector<uint64_t> amounts(m_max.begin() + m_leaves, m_max.end());
+    amounts.resize(pos + 1, 0);
+    *this = amount_tree(amounts);
   }
+  size_t n = m_leaves + pos;
+  m_max[n] = amount;
+  for (n /= 2; n > 0; n /= 2)
+    m_max[n] = std::max(m_max[2 * n], m_max[2 * n + 1]);
+}
+
+size_t amount_tree::first_at_least(size_t lo, size_t hi, uint64_t amount) const
+{
+  if (m_leaves == 0)
+    return npos;
+  return find(1, 0, m_leaves, lo, hi, amount);
+}
+
+size_t amount_tree::find(size_t node, size_t begin, size_t end, size_t lo, size_t hi, uint64_t amount) const
+{
+  if (end <= lo || hi <= begin || m_max[node] < amount)
+    return npos;
+  if (end - begin == 1)
+    return begin;
+  const size_t mid = (begin + end) / 2;
+  const size_t res = find(2 * node, begin, mid, lo, hi, amount);
+  return res != npos ? res : find(2 * node + 1, mid, end, lo, hi, amount);
+}
+
+std::vector<size_t> wallet2::pick_preferred_rct_inputs(uint64_t needed_money, const std::unordered_set<size_t> &excluded)
+{
+  std::vector<size_t> picks;
 
-  // then try to find two outputs
+  LOG_PRINT_L2("pick_preferred_rct_inputs: needed_money " << print_money(needed_money));
+
+  update_unlock_schedule();
+
+  // try to find a rct input of enough size, oldest first
+  const uint64_t needed_key = std::max(needed_money + 1, needed_money);
+  size_t alone = m_spendable_rct_by_index.first_at_least(0, m_transfers.size(), needed_key);
+  while (alone != amount_tree::npos && excluded.count(alone))
+    alone = m_spendable_rct_by_index.first_at_least(alone + 1, m_transfers.size(), needed_key);
+  if (alone != amount_tree::npos)
+  {
+    LOG_PRINT_L2("We can use " << alone << " alone: " << print_money(m_transfers[alone].amount()));
+    picks.push_back(alone);
+    return picks;
+  }
+
+  // no pair can make it if the two largest outputs can't
+  uint64_t largest[2] = {0, 0};
+  size_t found = 0;
+  for (auto it = m_spendable_rct.rbegin(); it != m_spendable_rct.rend() && found < 2; ++it)
+    if (!excluded.count(it->second))
+      largest[found++] = it->first;
+  if (found < 2 || largest[0] + largest[1] < needed_money)
+    return picks;
+
+  // candidates by (height, index): relatedness only depends on the height difference (and the txid within
+  // a block), so each relatedness level is a window of later positions, searched with a max-amount tree
+  std::vector<std::pair<uint64_t, size_t>> candidates;
+  candidates.reserve(m_spendable_rct.size());
+  for (const auto &e: m_spendable_rct)
+    if (!excluded.count(e.second))
+      candidates.push_back(std::make_pair(m_transfers[e.second].m_block_height, e.second));
+  std::sort(candidates.begin(), candidates.end());
+  std::vector<uint64_t> amounts;
+  amounts.reserve(candidates.size());
+  for (const auto &c: candidates)
+    amounts.push_back(m_transfers[c.second].amount());
+  const amount_tree tree(amounts);
+
+  // then try to find two outputs, least related level first, oldest first within a level
   // this could be made better by picking one of the outputs to be a small one, since those
   // are less useful since often below the needed money, so if one can be used in a pair,
   // it gets rid of it for the future
-  for (size_t i = 0; i < m_transfers.size(); ++i)
+  const uint64_t windows[][2] = {{RELATED_OUTPUTS_HEIGHT_DELTA, 0}, {2, RELATED_OUTPUTS_HEIGHT_DELTA}, {1, 2}, {0, 1}};
+  for (const auto &window: windows)
   {
-    const transfer_details& td = m_transfers[i];
-    if (!td.m_spent && td.is_rct() && is_transfer_unlocked(td))
+    for (size_t ci = 0; ci + 1 < candidates.size(); ++ci)
     {
-      LOG_PRINT_L2("Considering input " << i << ", " << print_money(td.amount()));
-      for (size_t j = i + 1; j < m_transfers.size(); ++j)
+      const uint64_t height = candidates[ci].first;
+      auto first = std::lower_bound(candidates.begin() + ci + 1, candidates.end(), std::make_pair(height + window[0], (size_t)0));
+      auto last = window[1] ? std::lower_bound(first, candidates.end(), std::make_pair(height + window[1], (size_t)0)) : candidates.end();
+      const size_t lo = first - candidates.begin(), hi = last - candidates.begin();
+      const size_t i = candidates[ci].second;
+      const transfer_details& td = m_transfers[i];
+      for (size_t cj = tree.first_at_least(lo, hi, needed_money - td.amount()); cj != amount_tree::npos; cj = tree.first_at_least(cj + 1, hi, needed_money - td.amount()))
       {
+        const size_t j = candidates[cj].second;
         const transfer_details& td2 = m_transfers[j];
-        if (!td2.m_spent && td2.is_rct() && td.amount() + td2.amount() >= needed_money && is_transfer_unlocked(td2))
-        {
-          // update our picks if those outputs are less related than any we
-          // already found. If the same, don't update, and oldest suitable outputs
-          // will be used in preference.
-          float relatedness = get_output_relatedness(td, td2);
-          LOG_PRINT_L2("  with input " << j << ", " << print_money(td2.amount()) << ", relatedness " << relatedness);
-          if (relatedness < current_output_relatdness)
-          {
-            // reset the current picks with those, and return them directly
-            // if they're unrelated. If they are related, we'll end up returning
-            // them if we find nothing better
-            picks.clear();
-            picks.push_back(i);
-            picks.push_back(j);
-            LOG_PRINT_L0("we could use " << i << " and " << j);
-            if (relatedness == 0.0f)
-              return picks;
-            current_output_relatdness = relatedness;
-          }
-        }
+        // outputs of the same tx are never picked together
+        float relatedness = get_output_relatedness(td, td2);
+        LOG_PRINT_L2("Considering input " << i << ", " << print_money(td.amount()) << " with input " << j << ", " << print_money(td2.amount()) << ", relatedness " << relatedness);
+        if (relatedness == 1.0f)
+          continue;
+        picks.push_back(i);
+        picks.push_back(j);
+        LOG_PRINT_L0("we could use " << i << " and " << j);
+        return picks;
       }
     }
   }
@@ -4334,7 +7507,7 @@ static uint32_t get_count_above(const std::vector<wallet2::transfer_details> &tr
 // This system allows for sending (almost) the entire balance, since it does
 // not generate spurious change in all txes, thus decreasing the instantaneous
 // usable balance.
-std::vector<wallet2::pending_tx> wallet2::create_transactions_2(std::vector<cryptonote::tx_destination_entry> dsts, const size_t fake_outs_count, const uint64_t unlock_time, uint32_t priority, const std::vector<uint8_t> extra, bool trusted_daemon)
+std::vector<wallet2::pending_tx> wallet2::create_transactions_2(std::vector<cryptonote::tx_destination_entry> dsts, const size_t fake_outs_count, const uint64_t unlock_time, uint32_t priority, const std::vector<uint8_t> extra, bool trusted_daemon, const std::unordered_set<size_t> &excluded_transfers)
 {
   std::vector<size_t> unused_transfers_indices;
   std::vector<size_t> unused_dust_indices;
@@ -4396,24 +7569,26 @@ std::vector<wallet2::pending_tx> wallet2::create_transactions_2(std::vector<cryp
   THROW_WALLET_EXCEPTION_IF(needed_money == 0, error::zero_destination);
 
   // gather all our dust and non dust outputs
-  for (size_t i = 0; i < m_transfers.size(); ++i)
+  get_spendable_transfers(use_rct, 0, unused_transfers_indices, unused_dust_indices, excluded_transfers);
+  LOG_PRINT_L2("Starting with " << unused_transfers_indices.size() << " non-dust outputs and " << unused_dust_indices.size() << " dust outputs");
+
+  // outputs excluded by the caller (e.g. already used by other transactions of
+  // the same batch) don't count towards what we can spend
+  uint64_t available = unlocked_balance();
+  if (!excluded_transfers.empty())
   {
-    const transfer_details& td = m_transfers[i];
-    if (!td.m_spent && (use_rct ? true : !td.is_rct()) && is_transfer_unlocked(td))
-    {
-      if ((td.is_rct()) || is_valid_decomposed_amount(td.amount()))
-        unused_transfers_indices.push_back(i);
-      else
-        unused_dust_indices.push_back(i);
-    }
+    available = 0;
+    for (size_t idx: unused_transfers_indices)
+      available += m_transfers[idx].amount();
+    for (size_t idx: unused_dust_indices)
+      available += m_transfers[idx].amount();
   }
-  LOG_PRINT_L2("Starting with " << unused_transfers_indices.size() << " non-dust outputs and " << unused_dust_indices.size() << " dust outputs");
 
   // early out if we know we can't make it anyway
   // we could also check for being within FEE_PER_KB, but if the fee calculation
   // ever changes, this might be missed, so let this go through
-  THROW_WALLET_EXCEPTION_IF(needed_money > unlocked_balance(), error::not_enough_money,
-      unlocked_balance(), needed_money, 0);
+  THROW_WALLET_EXCEPTION_IF(needed_money > available, error::not_enough_money,
+      available, needed_money, 0);
 
   if (unused_dust_indices.empty() && unused_transfers_indices.empty())
     return std::vector<wallet2::pending_tx>();
@@ -4441,7 +7616,7 @@ std::vector<wallet2::pending_tx> wallet2::create_transactions_2(std::vector<cryp
     // this is used to build a tx that's 1 or 2 inputs, and 2 outputs, which
     // will get us a known fee.
     uint64_t estimated_fee = calculate_fee(fee_per_kb, estimate_rct_tx_size(2, fake_outs_count + 1, 2), fee_multiplier);
-    preferred_inputs = pick_preferred_rct_inputs(needed_money + estimated_fee);
+    preferred_inputs = pick_preferred_rct_inputs(needed_money + estimated_fee, excluded_transfers);
     if (!preferred_inputs.empty())
     {
       string s;
@@ -4678,20 +7853,7 @@ std::vector<wallet2::pending_tx> wallet2::create_transactions_all(uint64_t below
   const bool use_rct = use_fork_rules(4, 0);
 
   // gather all our dust and non dust outputs
-  for (size_t i = 0; i < m_transfers.size(); ++i)
-  {
-    const transfer_details& td = m_transfers[i];
-    if (!td.m_spent && (use_rct ? true : !td.is_rct()) && is_transfer_unlocked(td))
-    {
-      if (below == 0 || td.amount() < below)
-      {
-        if (td.is_rct() || is_valid_decomposed_amount(td.amount()))
-          unused_transfers_indices.push_back(i);
-        else
-          unused_dust_indices.push_back(i);
-      }
-    }
-  }
+  get_spendable_transfers(use_rct, below, unused_transfers_indices, unused_dust_indices);
 
   return create_transactions_from(address, unused_transfers_indices, unused_dust_indices, fake_outs_count, unlock_time, priority, extra, trusted_daemon);
 }
@@ -5020,6 +8182,13 @@ std::vector<wallet2::pending_tx> wallet2::create_unmixable_sweep_transactions(bo
   return create_transactions_from(m_account_public_address, unmixable_transfer_outputs, unmixable_dust_outputs, 0 /*fake_outs_count */, 0 /* unlock_time */, 1 /*priority */, std::vector<uint8_t>(), trusted_daemon);
 }
 
+void wallet2::add_tx_key(const crypto::hash &txid, const crypto::secret_key &tx_key)
+{
+  // keys are never replaced, the next journal record takes only the new ones
+  if (m_tx_keys.insert(std::make_pair(txid, tx_key)).second)
+    m_journal_tx_keys.push_back(txid);
+}
+
 bool wallet2::get_tx_key(const crypto::hash &txid, crypto::secret_key &tx_key) const
 {
   const std::unordered_map<crypto::hash, crypto::secret_key>::const_iterator i = m_tx_keys.find(txid);
@@ -5108,6 +8277,7 @@ uint64_t wallet2::get_approximate_blockchain_height() const
 void wallet2::set_tx_note(const crypto::hash &txid, const std::string &note)
 {
   m_tx_notes[txid] = note;
+  m_journal_tx_notes.insert(txid);
 }
 
 std::string wallet2::get_tx_note(const crypto::hash &txid) const
@@ -5154,7 +8324,7 @@ bool wallet2::verify(const std::string &data, const cryptonote::account_public_a
 crypto::public_key wallet2::get_tx_pub_key_from_received_outs(const tools::wallet2::transfer_details &td) const
 {
   std::vector<tx_extra_field> tx_extra_fields;
-  if(!parse_tx_extra(td.m_tx.extra, tx_extra_fields))
+  if(!parse_tx_extra(td.m_tx->extra, tx_extra_fields))
   {
     // Extra may only be partially parsed, it's OK if tx_extra_fields contains public key
   }
@@ -5182,11 +8352,11 @@ crypto::public_key wallet2::get_tx_pub_key_from_received_outs(const tools::walle
     crypto::key_derivation derivation;
     generate_key_derivation(tx_pub_key, keys.m_view_secret_key, derivation);
 
-    for (size_t i = 0; i < td.m_tx.vout.size(); ++i)
+    for (size_t i = 0; i < td.m_tx->vout.size(); ++i)
     {
       uint64_t money_transfered = 0;
       bool error = false, received = false;
-      check_acc_out_precomp(keys.m_account_address.m_spend_public_key, td.m_tx.vout[i], derivation, i, received, money_transfered, error);
+      check_acc_out_precomp(keys.m_account_address.m_spend_public_key, td.m_tx->vout[i], derivation, i, received, money_transfered, error);
       if (!error && received)
         return tx_pub_key;
     }
@@ -5219,52 +8389,87 @@ bool wallet2::export_key_images(const std::string filename)
 }
 
 //----------------------------------------------------------------------------------------------------
-std::vector<std::pair<crypto::key_image, crypto::signature>> wallet2::export_key_images() const
+void wallet2::export_key_images_range(size_t begin, size_t end, size_t start, std::vector<std::pair<crypto::key_image, crypto::signature>> &ski, std::string &error) const
 {
-  std::vector<std::pair<crypto::key_image, crypto::signature>> ski;
-
-  ski.reserve(m_transfers.size());
-  for (size_t n = 0; n < m_transfers.size(); ++n)
+  try
   {
-    const transfer_details &td = m_transfers[n];
+    for (size_t n = begin; n < end; ++n)
+    {
+      const transfer_details &td = m_transfers[n];
 
-    crypto::hash hash;
-    crypto::cn_fast_hash(&td.m_key_image, sizeof(td.m_key_image), hash);
+      // get ephemeral public key
+      const cryptonote::tx_out &out = td.m_tx->vout[td.m_internal_output_index];
+      THROW_WALLET_EXCEPTION_IF(out.target.type() != typeid(txout_to_key), error::wallet_internal_error,
+          "Output is not txout_to_key");
+      const cryptonote::txout_to_key &o = boost::get<const cryptonote::txout_to_key>(out.target);
+      const crypto::public_key pkey = o.key;
 
-    // get ephemeral public key
-    const cryptonote::tx_out &out = td.m_tx.vout[td.m_internal_output_index];
-    THROW_WALLET_EXCEPTION_IF(out.target.type() != typeid(txout_to_key), error::wallet_internal_error,
-        "Output is not txout_to_key");
-    const cryptonote::txout_to_key &o = boost::get<const cryptonote::txout_to_key>(out.target);
-    const crypto::public_key pkey = o.key;
+      // get tx pub key
+      crypto::public_key tx_pub_key = get_tx_pub_key_from_received_outs(td);
 
-    // get tx pub key
-    std::vector<tx_extra_field> tx_extra_fields;
-    if(!parse_tx_extra(td.m_tx.extra, tx_extra_fields))
-    {
-      // Extra may only be partially parsed, it's OK if tx_extra_fields contains public key
-    }
+      // generate ephemeral secret key
+      crypto::key_image ki;
+      cryptonote::keypair in_ephemeral;
+      cryptonote::generate_key_image_helper(m_account.get_keys(), tx_pub_key, td.m_internal_output_index, in_ephemeral, ki);
 
-    crypto::public_key tx_pub_key = get_tx_pub_key_from_received_outs(td);
+      THROW_WALLET_EXCEPTION_IF(td.m_key_image_known && ki != td.m_key_image,
+          error::wallet_internal_error, "key_image generated not matched with cached key image");
+      THROW_WALLET_EXCEPTION_IF(in_ephemeral.pub != pkey,
+          error::wallet_internal_error, "key_image generated ephemeral public key not matched with output_key");
 
-    // generate ephemeral secret key
-    crypto::key_image ki;
-    cryptonote::keypair in_ephemeral;
-    cryptonote::generate_key_image_helper(m_account.get_keys(), tx_pub_key, td.m_internal_output_index, in_ephemeral, ki);
+      // sign the key image with the output secret key
+      crypto::signature signature;
+      std::vector<const crypto::public_key*> key_ptrs;
+      key_ptrs.push_back(&pkey);
+
+      crypto::generate_ring_signature((const crypto::hash&)td.m_key_image, td.m_key_image, key_ptrs, in_ephemeral.sec, 0, &signature);
 
-    THROW_WALLET_EXCEPTION_IF(td.m_key_image_known && ki != td.m_key_image,
-        error::wallet_internal_error, "key_image generated not matched with cached key image");
-    THROW_WALLET_EXCEPTION_IF(in_ephemeral.pub != pkey,
-        error::wallet_internal_error, "key_image generated ephemeral public key not matched with output_key");
+      ski[n - start] = std::make_pair(td.m_key_image, signature);
+    }
+  }
+  catch (const std::exception &e)
+  {
+    error = e.what();
+  }
+}
+//----------------------------------------------------------------------------------------------------
+std::vector<std::pair<crypto::key_image, crypto::signature>> wallet2::export_key_images(size_t start) const
+{
+  THROW_WALLET_EXCEPTION_IF(start > m_transfers.size(), error::wallet_internal_error, "Key images requested past the last known output");
+  size_t count = m_transfers.size() - start;
+  std::vector<std::pair<crypto::key_image, crypto::signature>> ski(count);
 
-    // sign the key image with the output secret key
-    crypto::signature signature;
-    std::vector<const crypto::public_key*> key_ptrs;
-    key_ptrs.push_back(&pkey);
+  // every output is independent: split them into one contiguous range per thread, each range
+  // writes its own slots of ski so the result stays in m_transfers order;
+  // a non zero start only signs outputs from that index on, for incremental sync
+  size_t threads = std::min<size_t>(std::max(tools::get_max_concurrency(), 1u), (count + KEY_IMAGES_PER_THREAD_MIN - 1) / KEY_IMAGES_PER_THREAD_MIN);
+  if (threads > 1)
+  {
+    size_t chunk = (count + threads - 1) / threads;
+    std::vector<std::string> errors(threads);
 
-    crypto::generate_ring_signature((const crypto::hash&)td.m_key_image, td.m_key_image, key_ptrs, in_ephemeral.sec, 0, &signature);
+    boost::asio::io_service ioservice;
+    boost::thread_group threadpool;
+    std::unique_ptr < boost::asio::io_service::work > work(new boost::asio::io_service::work(ioservice));
+    for (size_t i = 0; i < threads; i++)
+    {
+      threadpool.create_thread(boost::bind(&boost::asio::io_service::run, &ioservice));
+    }
+    for (size_t i = 0; i < threads; i++)
+    {
+      ioservice.dispatch(boost::bind(&wallet2::export_key_images_range, this, start + i * chunk, start + std::min(count, (i + 1) * chunk), start,
+        std::ref(ski), std::ref(errors[i])));
+    }
+    KILL_IOSERVICE();
 
-    ski.push_back(std::make_pair(td.m_key_image, signature));
+    for (const std::string &error: errors)
+      THROW_WALLET_EXCEPTION_IF(!error.empty(), error::wallet_internal_error, error);
+  }
+  else
+  {
+    std::string error;
+    export_key_images_range(start, m_transfers.size(), start, ski, error);
+    THROW_WALLET_EXCEPTION_IF(!error.empty(), error::wallet_internal_error, error);
   }
   return ski;
 }
@@ -5333,12 +8538,49 @@ uint64_t wallet2::import_key_images(const std::string &filename, uint64_t &spent
 }
 
 //----------------------------------------------------------------------------------------------------
-uint64_t wallet2::import_key_images(const std::vector<std::pair<crypto::key_image, crypto::signature>> &signed_key_images, uint64_t &spent, uint64_t &unspent)
+void wallet2::verify_key_images_range(size_t begin, size_t end, size_t start, const std::vector<std::pair<crypto::key_image, crypto::signature>> &signed_key_images,
+  std::atomic<size_t> &first_failed, std::string &error) const
 {
-  COMMAND_RPC_IS_KEY_IMAGE_SPENT::request req = AUTO_VAL_INIT(req);
-  COMMAND_RPC_IS_KEY_IMAGE_SPENT::response daemon_resp = AUTO_VAL_INIT(daemon_resp);
-
-  THROW_WALLET_EXCEPTION_IF(signed_key_images.size() > m_transfers.size(), error::wallet_internal_error,
+  // ranges stop at their first failure, or once a lower index failed in another range
+  size_t n = begin;
+  try
+  {
+    for (; n < end && n < first_failed; ++n)
+    {
+      const transfer_details &td = m_transfers[start + n];
+      const crypto::key_image &key_image = signed_key_images[n].first;
+      const crypto::signature &signature = signed_key_images[n].second;
+
+      // get ephemeral public key
+      const cryptonote::tx_out &out = td.m_tx->vout[td.m_internal_output_index];
+      THROW_WALLET_EXCEPTION_IF(out.target.type() != typeid(txout_to_key), error::wallet_internal_error,
+        "Non txout_to_key output found");
+      const cryptonote::txout_to_key &o = boost::get<cryptonote::txout_to_key>(out.target);
+      const crypto::public_key pkey = o.key;
+
+      std::vector<const crypto::public_key*> pkeys;
+      pkeys.push_back(&pkey);
+      THROW_WALLET_EXCEPTION_IF(!(rct::scalarmultKey(rct::ki2rct(key_image), rct::curveOrder()) == rct::identity()),
+          error::wallet_internal_error, "Key image out of validity domain: input " + boost::lexical_cast<std::string>(n) + "/"
+          + boost::lexical_cast<std::string>(signed_key_images.size()) + ", key image " + epee::string_tools::pod_to_hex(key_image));
+
+      THROW_WALLET_EXCEPTION_IF(!crypto::check_ring_signature((const crypto::hash&)key_image, key_image, pkeys, &signature),
+          error::wallet_internal_error, "Signature check failed: input " + boost::lexical_cast<std::string>(n) + "/"
+          + boost::lexical_cast<std::string>(signed_key_images.size()) + ", key image " + epee::string_tools::pod_to_hex(key_image)
+          + ", signature " + epee::string_tools::pod_to_hex(signature) + ", pubkey " + epee::string_tools::pod_to_hex(*pkeys[0]));
+    }
+  }
+  catch (const std::exception &e)
+  {
+    error = e.what();
+    size_t failed = first_failed;
+    while (n < failed && !first_failed.compare_exchange_weak(failed, n));
+  }
+}
+//----------------------------------------------------------------------------------------------------
+uint64_t wallet2::import_key_images(const std::vector<std::pair<crypto::key_image, crypto::signature>> &signed_key_images, uint64_t &spent, uint64_t &unspent, size_t start)
+{
+  THROW_WALLET_EXCEPTION_IF(start + signed_key_images.size() > m_transfers.size(), error::wallet_internal_error,
       "The blockchain is out of date compared to the signed key images");
 
   if (signed_key_images.empty())
@@ -5348,75 +8590,100 @@ uint64_t wallet2::import_key_images(const std::vector<std::pair<crypto::key_imag
     return 0;
   }
 
-  for (size_t n = 0; n < signed_key_images.size(); ++n)
+  // verify signatures in contiguous ranges, one per thread; the lowest failing index is reported,
+  // as a sequential loop would, and ranges above it stop early
+  std::atomic<size_t> first_failed(signed_key_images.size());
+  size_t threads = std::min<size_t>(std::max(tools::get_max_concurrency(), 1u), (signed_key_images.size() + KEY_IMAGES_PER_THREAD_MIN - 1) / KEY_IMAGES_PER_THREAD_MIN);
+  if (threads > 1)
   {
-    const transfer_details &td = m_transfers[n];
-    const crypto::key_image &key_image = signed_key_images[n].first;
-    const crypto::signature &signature = signed_key_images[n].second;
-
-    // get ephemeral public key
-    const cryptonote::tx_out &out = td.m_tx.vout[td.m_internal_output_index];
-    THROW_WALLET_EXCEPTION_IF(out.target.type() != typeid(txout_to_key), error::wallet_internal_error,
-      "Non txout_to_key output found");
-    const cryptonote::txout_to_key &o = boost::get<cryptonote::txout_to_key>(out.target);
-    const crypto::public_key pkey = o.key;
-
-    std::vector<const crypto::public_key*> pkeys;
-    pkeys.push_back(&pkey);
-    THROW_WALLET_EXCEPTION_IF(!(rct::scalarmultKey(rct::ki2rct(key_image), rct::curveOrder()) == rct::identity()),
-        error::wallet_internal_error, "Key image out of validity domain: input " + boost::lexical_cast<std::string>(n) + "/"
-        + boost::lexical_cast<std::string>(signed_key_images.size()) + ", key image " + epee::string_tools::pod_to_hex(key_image));
+    size_t chunk = (signed_key_images.size() + threads - 1) / threads;
+    std::vector<std::string> errors(threads);
 
-    THROW_WALLET_EXCEPTION_IF(!crypto::check_ring_signature((const crypto::hash&)key_image, key_image, pkeys, &signature),
-        error::wallet_internal_error, "Signature check failed: input " + boost::lexical_cast<std::string>(n) + "/"
-        + boost::lexical_cast<std::string>(signed_key_images.size()) + ", key image " + epee::string_tools::pod_to_hex(key_image)
-        + ", signature " + epee::string_tools::pod_to_hex(signature) + ", pubkey " + epee::string_tools::pod_to_hex(*pkeys[0]));
+    boost::asio::io_service ioservice;
+    boost::thread_group threadpool;
+    std::unique_ptr < boost::asio::io_service::work > work(new boost::asio::io_service::work(ioservice));
+    for (size_t i = 0; i < threads; i++)
+    {
+      threadpool.create_thread(boost::bind(&boost::asio::io_service::run, &ioservice));
+    }
+    for (size_t i = 0; i < threads; i++)
+    {
+      ioservice.dispatch(boost::bind(&wallet2::verify_key_images_range, this, i * chunk, std::min(signed_key_images.size(), (i + 1) * chunk), start,
+        std::cref(signed_key_images), std::ref(first_failed), std::ref(errors[i])));
+    }
+    KILL_IOSERVICE();
 
-    req.key_images.push_back(epee::string_tools::pod_to_hex(key_image));
+    THROW_WALLET_EXCEPTION_IF(first_failed < signed_key_images.size(), error::wallet_internal_error, errors[first_failed / chunk]);
+  }
+  else
+  {
+    std::string error;
+    verify_key_images_range(0, signed_key_images.size(), start, signed_key_images, first_failed, error);
+    THROW_WALLET_EXCEPTION_IF(!error.empty(), error::wallet_internal_error, error);
   }
 
   for (size_t n = 0; n < signed_key_images.size(); ++n)
   {
-    m_transfers[n].m_key_image = signed_key_images[n].first;
-    m_key_images[m_transfers[n].m_key_image] = n;
-    m_transfers[n].m_key_image_known = true;
+    m_transfers[start + n].m_key_image = signed_key_images[n].first;
+    m_key_images[m_transfers[start + n].m_key_image] = start + n;
+    m_transfers[start + n].m_key_image_known = true;
+    journal_touch(start + n);
   }
 
-  m_daemon_rpc_mutex.lock();
-  bool r = epee::net_utils::invoke_http_json("/is_key_image_spent", req, daemon_resp, m_http_client, rpc_timeout);
-  m_daemon_rpc_mutex.unlock();
-  THROW_WALLET_EXCEPTION_IF(!r, error::no_connection_to_daemon, "is_key_image_spent");
-  THROW_WALLET_EXCEPTION_IF(daemon_resp.status == CORE_RPC_STATUS_BUSY, error::daemon_busy, "is_key_image_spent");
-  THROW_WALLET_EXCEPTION_IF(daemon_resp.status != CORE_RPC_STATUS_OK, error::is_key_image_spent_error, daemon_resp.status);
-  THROW_WALLET_EXCEPTION_IF(daemon_resp.spent_status.size() != signed_key_images.size(), error::wallet_internal_error,
-    "daemon returned wrong response for is_key_image_spent, wrong amounts count = " +
-    std::to_string(daemon_resp.spent_status.size()) + ", expected " +  std::to_string(signed_key_images.size()));
+  // This is RPC call that can take a long time if there are many key images,
+  // so we call it several times, in stripes, so we don't time out spuriously
+  std::vector<int> spent_status;
+  spent_status.reserve(signed_key_images.size());
+  const size_t chunk_size = 1000;
+  for (size_t start_offset = 0; start_offset < signed_key_images.size(); start_offset += chunk_size)
+  {
+    const size_t n_outputs = std::min<size_t>(chunk_size, signed_key_images.size() - start_offset);
+    MDEBUG("Calling is_key_image_spent on " << start_offset << " - " << (start_offset + n_outputs - 1) << ", out of " << signed_key_images.size());
+    COMMAND_RPC_IS_KEY_IMAGE_SPENT::request req = AUTO_VAL_INIT(req);
+    COMMAND_RPC_IS_KEY_IMAGE_SPENT::response daemon_resp = AUTO_VAL_INIT(daemon_resp);
+    for (size_t n = start_offset; n < start_offset + n_outputs; ++n)
+      req.key_images.push_back(epee::string_tools::pod_to_hex(signed_key_images[n].first));
+    m_daemon_rpc_mutex.lock();
+    bool r = epee::net_utils::invoke_http_json("/is_key_image_spent", req, daemon_resp, m_http_client, rpc_timeout);
+    m_daemon_rpc_mutex.unlock();
+    THROW_WALLET_EXCEPTION_IF(!r, error::no_connection_to_daemon, "is_key_image_spent");
+    THROW_WALLET_EXCEPTION_IF(daemon_resp.status == CORE_RPC_STATUS_BUSY, error::daemon_busy, "is_key_image_spent");
+    THROW_WALLET_EXCEPTION_IF(daemon_resp.status != CORE_RPC_STATUS_OK, error::is_key_image_spent_error, daemon_resp.status);
+    THROW_WALLET_EXCEPTION_IF(daemon_resp.spent_status.size() != n_outputs, error::wallet_internal_error,
+      "daemon returned wrong response for is_key_image_spent, wrong amounts count = " +
+      std::to_string(daemon_resp.spent_status.size()) + ", expected " +  std::to_string(n_outputs));
+    std::copy(daemon_resp.spent_status.begin(), daemon_resp.spent_status.end(), std::back_inserter(spent_status));
+  }
 
   spent = 0;
   unspent = 0;
-  for (size_t n = 0; n < daemon_resp.spent_status.size(); ++n)
+  for (size_t n = 0; n < spent_status.size(); ++n)
   {
-    transfer_details &td = m_transfers[n];
+    transfer_details &td = m_transfers[start + n];
     uint64_t amount = td.amount();
-    td.m_spent = daemon_resp.spent_status[n] != COMMAND_RPC_IS_KEY_IMAGE_SPENT::UNSPENT;
+    if (spent_status[n] != COMMAND_RPC_IS_KEY_IMAGE_SPENT::UNSPENT)
+      set_spent(start + n, td.m_spent_height);
+    else
+      set_unspent(start + n);
     if (td.m_spent)
       spent += amount;
     else
       unspent += amount;
-    LOG_PRINT_L2("Transfer " << n << ": " << print_money(amount) << " (" << td.m_global_output_index << "): "
-        << (td.m_spent ? "spent" : "unspent") << " (key image " << req.key_images[n] << ")");
+    LOG_PRINT_L2("Transfer " << start + n << ": " << print_money(amount) << " (" << td.m_global_output_index << "): "
+        << (td.m_spent ? "spent" : "unspent") << " (key image " << td.m_key_image << ")");
   }
   LOG_PRINT_L1("Total: " << print_money(spent) << " spent, " << print_money(unspent) << " unspent");
 
-  return m_transfers[signed_key_images.size() - 1].m_block_height;
+  return m_transfers[start + signed_key_images.size() - 1].m_block_height;
 }
 //----------------------------------------------------------------------------------------------------
-std::vector<tools::wallet2::transfer_details> wallet2::export_outputs() const
+std::vector<tools::wallet2::transfer_details> wallet2::export_outputs(size_t start) const
 {
   std::vector<tools::wallet2::transfer_details> outs;
 
-  outs.reserve(m_transfers.size());
-  for (size_t n = 0; n < m_transfers.size(); ++n)
+  THROW_WALLET_EXCEPTION_IF(start > m_transfers.size(), error::wallet_internal_error, "Outputs requested past the last known output");
+  outs.reserve(m_transfers.size() - start);
+  for (size_t n = start; n < m_transfers.size(); ++n)
   {
     const transfer_details &td = m_transfers[n];
 
@@ -5426,10 +8693,33 @@ std::vector<tools::wallet2::transfer_details> wallet2::export_outputs() const
   return outs;
 }
 //----------------------------------------------------------------------------------------------------
-size_t wallet2::import_outputs(const std::vector<tools::wallet2::transfer_details> &outputs)
+size_t wallet2::import_outputs(const std::vector<tools::wallet2::transfer_details> &outputs, size_t start, const std::unordered_map<crypto::public_key, crypto::key_image> *known_key_images)
 {
-  m_transfers.clear();
-  m_transfers.reserve(outputs.size());
+  THROW_WALLET_EXCEPTION_IF(start > m_transfers.size(), error::wallet_internal_error,
+      "Outputs delta starts at " + std::to_string(start) + ", but only " + std::to_string(m_transfers.size()) + " outputs are known");
+
+  // keep the acknowledged prefix, anything past it is replaced by the imported outputs
+  if (start == 0)
+  {
+    m_transfers.clear();
+    m_key_images.clear();
+    m_pub_keys.clear();
+  }
+  else
+  {
+    for (size_t i = start; i < m_transfers.size(); ++i)
+    {
+      const transfer_details &td = m_transfers[i];
+      if (td.m_key_image_known)
+        m_key_images.erase(td.m_key_image);
+      if (td.get_public_key() != crypto::null_pkey)
+        m_pub_keys.erase(td.get_public_key());
+    }
+    m_transfers.resize(start);
+  }
+  journal_truncate(m_blockchain.size(), start);
+
+  m_transfers.reserve(start + outputs.size());
   for (size_t i = 0; i < outputs.size(); ++i)
   {
     transfer_details td = outputs[i];
@@ -5439,28 +8729,44 @@ size_t wallet2::import_outputs(const std::vector<tools::wallet2::transfer_detail
     std::vector<tx_extra_field> tx_extra_fields;
     tx_extra_pub_key pub_key_field;
 
-    THROW_WALLET_EXCEPTION_IF(td.m_tx.vout.empty(), error::wallet_internal_error, "tx with no outputs at index " + boost::lexical_cast<std::string>(i));
-    THROW_WALLET_EXCEPTION_IF(!parse_tx_extra(td.m_tx.extra, tx_extra_fields), error::wallet_internal_error,
-        "Transaction extra has unsupported format at index " + boost::lexical_cast<std::string>(i));
-    crypto::public_key tx_pub_key = get_tx_pub_key_from_received_outs(td);
+    THROW_WALLET_EXCEPTION_IF(td.m_tx->vout.size() <= td.m_internal_output_index, error::wallet_internal_error, "tx with no outputs at index " + boost::lexical_cast<std::string>(start + i));
 
-    cryptonote::generate_key_image_helper(m_account.get_keys(), tx_pub_key, td.m_internal_output_index, in_ephemeral, td.m_key_image);
-    td.m_key_image_known = true;
-    THROW_WALLET_EXCEPTION_IF(in_ephemeral.pub != boost::get<cryptonote::txout_to_key>(td.m_tx.vout[td.m_internal_output_index].target).key,
-        error::wallet_internal_error, "key_image generated ephemeral public key not matched with output_key at index " + boost::lexical_cast<std::string>(i));
+    // key images the caller derived before for the same output key are taken as is
+    bool known = false;
+    if (known_key_images)
+    {
+      auto kit = known_key_images->find(td.get_public_key());
+      if (kit != known_key_images->end())
+      {
+        td.m_key_image = kit->second;
+        td.m_key_image_known = known = true;
+      }
+    }
+    if (!known)
+    {
+      THROW_WALLET_EXCEPTION_IF(!parse_tx_extra(td.m_tx->extra, tx_extra_fields), error::wallet_internal_error,
+          "Transaction extra has unsupported format at index " + boost::lexical_cast<std::string>(start + i));
+      crypto::public_key tx_pub_key = get_tx_pub_key_from_received_outs(td);
+
+      cryptonote::generate_key_image_helper(m_account.get_keys(), tx_pub_key, td.m_internal_output_index, in_ephemeral, td.m_key_image);
+      td.m_key_image_known = true;
+      THROW_WALLET_EXCEPTION_IF(in_ephemeral.pub != td.get_public_key(),
+          error::wallet_internal_error, "key_image generated ephemeral public key not matched with output_key at index " + boost::lexical_cast<std::string>(start + i));
+    }
 
     m_key_images[td.m_key_image] = m_transfers.size();
     m_pub_keys[td.get_public_key()] = m_transfers.size();
     m_transfers.push_back(td);
   }
 
+  rebuild_indexes();
   return m_transfers.size();
 }
 //----------------------------------------------------------------------------------------------------
 std::string wallet2::encrypt(const std::string &plaintext, const crypto::secret_key &skey, bool authenticated) const
 {
   crypto::chacha8_key key;
-  crypto::generate_chacha8_key(&skey, sizeof(skey), key);
+  derive_chacha8_key(&skey, sizeof(skey), key);
   std::string ciphertext;
   crypto::chacha8_iv iv = crypto::rand<crypto::chacha8_iv>();
   ciphertext.resize(plaintext.size() + sizeof(iv) + (authenticated ? sizeof(crypto::signature) : 0));
@@ -5490,7 +8796,7 @@ std::string wallet2::decrypt(const std::string &ciphertext, const crypto::secret
     error::wallet_internal_error, "Unexpected ciphertext size");
 
   crypto::chacha8_key key;
-  crypto::generate_chacha8_key(&skey, sizeof(skey), key);
+  derive_chacha8_key(&skey, sizeof(skey), key);
   const crypto::chacha8_iv &iv = *(const crypto::chacha8_iv*)&ciphertext[0];
   std::string plaintext;
   plaintext.resize(ciphertext.size() - prefix_size);
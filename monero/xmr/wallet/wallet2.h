@@ -31,11 +31,18 @@
 #pragma once
 
 #include <memory>
+#include <map>
+#include <set>
+#include <deque>
 
 #include <boost/program_options/options_description.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include <boost/serialization/list.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/utility.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <exception>
 #include <atomic>
 
 #include "include_base_utils.h"
@@ -62,8 +69,97 @@
 #undef MONERO_DEFAULT_LOG_CATEGORY
 #define MONERO_DEFAULT_LOG_CATEGORY "wallet.wallet2"
 
+#define KEY_IMAGES_PER_THREAD_MIN 256 // below this many outputs per thread key images are derived on the calling thread
+
 class Serialization_portability_wallet_Test;
 
+namespace boost { namespace iostreams { class mapped_file_source; } }
+
+namespace tools
+{
+  namespace error
+  {
+    // stored wallet state which was read, but can't be decoded: corrupt or some other wallet's, as opposed
+    // to storage failing, which leaves it as it is
+    struct wallet_state_corrupt: public wallet_internal_error
+    {
+      explicit wallet_state_corrupt(std::string&& loc, const std::string& message): wallet_internal_error(std::move(loc), message) {}
+    };
+  }
+
+  class tx_prefix_ref;
+
+  // where the tx prefixes of a loaded wallet stay encoded until a transfer needs one, see tx_prefix_ref
+  class tx_prefix_source: public std::enable_shared_from_this<tx_prefix_source>
+  {
+  public:
+    virtual ~tx_prefix_source() {}
+    // serialized prefix stored under id, ids are below size()
+    virtual std::string blob(uint64_t id) = 0;
+    virtual uint64_t size() const = 0;
+    // the same ref for every transfer asking for id while loading
+    tx_prefix_ref ref(uint64_t id);
+    // once loaded, refs are shared through the transfers holding them
+    void release_refs();
+
+  private:
+    boost::mutex m_refs_mutex;
+    std::unordered_map<uint64_t, std::weak_ptr<void>> m_refs;
+  };
+
+  /*!
+   * A transfer's tx prefix, shared with the other outputs received in the same tx. It is either in memory,
+   * or cold: left in a tx_prefix_source and decoded on first use, once for all the refs sharing it. Only
+   * signing and exports need it; what the hot paths read is kept in transfer_details itself.
+   */
+  class tx_prefix_ref
+  {
+  public:
+    struct cell;
+
+    tx_prefix_ref() {}
+    tx_prefix_ref(std::shared_ptr<const cryptonote::transaction_prefix> tx);
+    template <typename T> tx_prefix_ref(const std::shared_ptr<T> &tx): tx_prefix_ref(std::shared_ptr<const cryptonote::transaction_prefix>(tx)) {}
+
+    // decodes a cold prefix, throws if its source can't
+    const cryptonote::transaction_prefix *get() const;
+    const cryptonote::transaction_prefix &operator*() const { return *get(); }
+    const cryptonote::transaction_prefix *operator->() const { return get(); }
+    explicit operator bool() const { return (bool)m_cell; }
+    bool operator==(const tx_prefix_ref &other) const { return m_cell == other.m_cell; }
+    bool operator!=(const tx_prefix_ref &other) const { return m_cell != other.m_cell; }
+    // same for all the refs sharing one prefix
+    const void *id() const { return m_cell.get(); }
+    bool loaded() const;
+    // serialized prefix, cold ones are copied from their source without being decoded
+    std::string blob() const;
+
+  private:
+    friend class tx_prefix_source;
+    explicit tx_prefix_ref(const std::shared_ptr<cell> &c): m_cell(c) {}
+
+    std::shared_ptr<cell> m_cell;
+  };
+}
+
+// a transfer's tx prefix is serialized in full
+template <template <bool> class Archive>
+inline bool do_serialize(Archive<false> &ar, tools::tx_prefix_ref &tx)
+{
+  std::shared_ptr<cryptonote::transaction_prefix> prefix = std::make_shared<cryptonote::transaction_prefix>();
+  if (!::do_serialize(ar, *prefix))
+    return false;
+  tx = prefix;
+  return true;
+}
+
+template <template <bool> class Archive>
+inline bool do_serialize(Archive<true> &ar, tools::tx_prefix_ref &tx)
+{
+  cryptonote::transaction_prefix empty;
+  return ::do_serialize(ar, tx ? const_cast<cryptonote::transaction_prefix&>(*tx) : empty);
+}
+
 namespace tools
 {
   class i_wallet2_callback
@@ -74,9 +170,37 @@ namespace tools
     virtual void on_unconfirmed_money_received(uint64_t height, const crypto::hash &txid, const cryptonote::transaction& tx, uint64_t amount) {}
     virtual void on_money_spent(uint64_t height, const crypto::hash &txid, const cryptonote::transaction& in_tx, uint64_t amount, const cryptonote::transaction& spend_tx) {}
     virtual void on_skip_transaction(uint64_t height, const crypto::hash &txid, const cryptonote::transaction& tx) {}
+    // a store_async job was written or failed, store_status tells which; called on the store thread
+    // with the store lock held, so it must not call back into the wallet
+    virtual void on_store_finished() {}
     virtual ~i_wallet2_callback() {}
   };
 
+  class wallet_lmdb;
+  struct wallet_lmdb_batch;
+  struct wallet_derived_key;
+
+  // max amount over ranges of positions, to find the first position in [lo, hi) holding at least some amount
+  class amount_tree
+  {
+  public:
+    static const size_t npos = (size_t)-1;
+
+    amount_tree(): m_leaves(0) {}
+    explicit amount_tree(const std::vector<uint64_t> &amounts);
+
+    // grows to hold pos, positions never set hold 0
+    void set(size_t pos, uint64_t amount);
+    void clear() { m_leaves = 0; m_max.clear(); }
+    size_t first_at_least(size_t lo, size_t hi, uint64_t amount) const;
+
+  private:
+    size_t find(size_t node, size_t begin, size_t end, size_t lo, size_t hi, uint64_t amount) const;
+
+    size_t m_leaves;
+    std::vector<uint64_t> m_max;
+  };
+
   struct tx_dust_policy
   {
     uint64_t dust_threshold;
@@ -104,8 +228,21 @@ namespace tools
       RefreshDefault = RefreshOptimizeCoinbase,
     };
 
+    enum FsyncPolicy {
+      FsyncNever,
+      FsyncCache,    // rewritten cache files only, not journal records
+      FsyncAlways,
+      FsyncDefault = FsyncCache,
+    };
+
+    enum StorageBackend {
+      StorageCacheFile,   // cache file plus its journal
+      StorageLmdb,        // <wallet>.mdb, or a container shared with other wallets, one LMDB transaction per store
+      StorageDefault = StorageCacheFile,
+    };
+
   protected:
-    wallet2(const wallet2&) : m_run(true), m_callback(0), m_testnet(false), m_always_confirm_transfers(true), m_print_ring_members(false), m_store_tx_info(true), m_default_mixin(0), m_default_priority(0), m_refresh_type(RefreshOptimizeCoinbase), m_auto_refresh(true), m_refresh_from_block_height(0), m_confirm_missing_payment_id(true), m_ask_password(true), m_min_output_count(0), m_min_output_value(0), m_merge_destinations(false), m_confirm_backlog(true), m_is_initialized(false),m_node_rpc_proxy(m_http_client, m_daemon_rpc_mutex) {}
+    wallet2(const wallet2&) : m_run(true), m_callback(0), m_testnet(false), m_always_confirm_transfers(true), m_print_ring_members(false), m_store_tx_info(true), m_default_mixin(0), m_default_priority(0), m_refresh_type(RefreshOptimizeCoinbase), m_auto_refresh(true), m_refresh_from_block_height(0), m_confirm_missing_payment_id(true), m_ask_password(true), m_min_output_count(0), m_min_output_value(0), m_merge_destinations(false), m_confirm_backlog(true), m_is_initialized(false), m_fsync_policy(FsyncDefault), m_storage(StorageDefault), m_store_pending(false), m_derived_keys(NULL), m_derived_keys_clock(0), m_key_derivations(0), m_node_rpc_proxy(m_http_client, m_daemon_rpc_mutex) {}
 
   public:
     static const char* tr(const char* str);
@@ -131,12 +268,13 @@ namespace tools
 
     static bool verify_password(const std::string& keys_file_name, const std::string& password, bool watch_only);
 
-    wallet2(bool testnet = false, bool restricted = false) : m_run(true), m_callback(0), m_testnet(testnet), m_always_confirm_transfers(true), m_print_ring_members(false), m_store_tx_info(true), m_default_mixin(0), m_default_priority(0), m_refresh_type(RefreshOptimizeCoinbase), m_auto_refresh(true), m_refresh_from_block_height(0), m_confirm_missing_payment_id(true), m_ask_password(true), m_min_output_count(0), m_min_output_value(0), m_merge_destinations(false), m_confirm_backlog(true), m_is_initialized(false), m_restricted(restricted), is_old_file_format(false), m_node_rpc_proxy(m_http_client, m_daemon_rpc_mutex) {}
+    wallet2(bool testnet = false, bool restricted = false) : m_run(true), m_callback(0), m_testnet(testnet), m_always_confirm_transfers(true), m_print_ring_members(false), m_store_tx_info(true), m_default_mixin(0), m_default_priority(0), m_refresh_type(RefreshOptimizeCoinbase), m_auto_refresh(true), m_refresh_from_block_height(0), m_confirm_missing_payment_id(true), m_ask_password(true), m_min_output_count(0), m_min_output_value(0), m_merge_destinations(false), m_confirm_backlog(true), m_is_initialized(false), m_restricted(restricted), is_old_file_format(false), m_unspent_amount(0), m_pending_change(0), m_unlocked_amount(0), m_journal_generation(0), m_journal_blocks(0), m_journal_transfers(0), m_lmdb_blocks(0), m_lmdb_transfers(0), m_lmdb_tx_deltas(0), m_journal_misc_dirty(false), m_journal_dirty(false), m_journal_full(true), m_journal_records(0), m_journal_bytes(0), m_journal_base_bytes(0), m_fsync_policy(FsyncDefault), m_storage(StorageDefault), m_store_pending(false), m_derived_keys(NULL), m_derived_keys_clock(0), m_key_derivations(0), m_node_rpc_proxy(m_http_client, m_daemon_rpc_mutex) {}
+    ~wallet2();
 
     struct transfer_details
     {
       uint64_t m_block_height;
-      cryptonote::transaction_prefix m_tx;
+      tx_prefix_ref m_tx;  // shared by the outputs received in one tx, cold once loaded
       crypto::hash m_txid;
       size_t m_internal_output_index;
       uint64_t m_global_output_index;
@@ -148,10 +286,26 @@ namespace tools
       bool m_rct;
       bool m_key_image_known;
       size_t m_pk_index;
+      // out of m_tx, for unlock checks and key lookups; not serialized, set_tx sets them
+      uint64_t m_unlock_time;
+      crypto::public_key m_public_key;
 
       bool is_rct() const { return m_rct; }
       uint64_t amount() const { return m_amount; }
-      const crypto::public_key &get_public_key() const { return boost::get<const cryptonote::txout_to_key>(m_tx.vout[m_internal_output_index].target).key; }
+      const crypto::public_key &get_public_key() const { return m_public_key; }
+
+      // m_internal_output_index goes first
+      void set_tx(const tx_prefix_ref &tx)
+      {
+        m_tx = tx;
+        m_unlock_time = 0;
+        m_public_key = crypto::null_pkey;
+        if (!tx)
+          return;
+        m_unlock_time = tx->unlock_time;
+        if (m_internal_output_index < tx->vout.size() && tx->vout[m_internal_output_index].target.type() == typeid(cryptonote::txout_to_key))
+          m_public_key = boost::get<cryptonote::txout_to_key>(tx->vout[m_internal_output_index].target).key;
+      }
 
       BEGIN_SERIALIZE_OBJECT()
         FIELD(m_block_height)
@@ -167,6 +321,8 @@ namespace tools
         FIELD(m_rct)
         FIELD(m_key_image_known)
         FIELD(m_pk_index)
+        if (!typename Archive<W>::is_saving())
+          set_tx(m_tx);
       END_SERIALIZE()
     };
 
@@ -222,6 +378,8 @@ namespace tools
 
     typedef std::vector<transfer_details> transfer_container;
     typedef std::unordered_multimap<crypto::hash, payment_details> payment_container;
+    // txid -> element of a payment_container; element addresses survive rehashing
+    typedef std::unordered_multimap<crypto::hash, const payment_container::value_type*> payment_txid_index;
 
     // The convention for destinations is:
     // dests does not include change
@@ -275,6 +433,93 @@ namespace tools
         FIELD(cache_data)
       END_SERIALIZE()
     };
+
+    // cache files start with CACHE_FILE_MAGIC, followed by the size prefixed cache_index_data and the
+    // chunks it lists, each compressed and encrypted on its own; older cache files are a bare cache_file_data
+    struct cache_chunk
+    {
+      uint8_t section;
+      uint64_t start;     // index of the first element of the section held by the chunk
+      uint64_t count;
+      uint64_t offset;    // from the end of the index
+      uint64_t size;
+      crypto::chacha8_iv iv;
+      crypto::hash checksum;
+
+      BEGIN_SERIALIZE_OBJECT()
+        VARINT_FIELD(section)
+        VARINT_FIELD(start)
+        VARINT_FIELD(count)
+        VARINT_FIELD(offset)
+        VARINT_FIELD(size)
+        FIELD(iv)
+        FIELD(checksum)
+      END_SERIALIZE()
+    };
+
+    struct cache_index
+    {
+      std::vector<cache_chunk> chunks;
+
+      BEGIN_SERIALIZE_OBJECT()
+        FIELD(chunks)
+      END_SERIALIZE()
+    };
+
+    struct cache_index_data
+    {
+      crypto::chacha8_iv iv;
+      crypto::hash checksum;
+      std::string index_data;
+
+      BEGIN_SERIALIZE_OBJECT()
+        FIELD(iv)
+        FIELD(checksum)
+        FIELD(index_data)
+      END_SERIALIZE()
+    };
+
+    // one record of the cache journal (see store()), each is prefixed by its size in the .journal file
+    struct journal_file_data
+    {
+      crypto::chacha8_iv iv;
+      crypto::hash checksum;
+      std::string journal_data;
+
+      BEGIN_SERIALIZE_OBJECT()
+        FIELD(iv)
+        FIELD(checksum)
+        FIELD(journal_data)
+      END_SERIALIZE()
+    };
+
+    struct journal_transfer_patch
+    {
+      uint64_t m_index;
+      bool m_spent;
+      uint64_t m_spent_height;
+      crypto::key_image m_key_image;
+      bool m_key_image_known;
+    };
+
+    // what changed since the previous record: the chain and transfers are cut back to the given
+    // sizes and extended, payments and confirmed txs at or above m_blocks_start are replaced,
+    // older transfers are patched, the small containers are replaced when m_misc is not empty,
+    // and the tx keys and notes set since the previous record are added
+    struct journal_record
+    {
+      uint64_t m_generation;
+      uint64_t m_blocks_start;
+      std::vector<crypto::hash> m_blocks;
+      uint64_t m_transfers_start;
+      std::vector<transfer_details> m_transfers;
+      std::vector<journal_transfer_patch> m_patches;
+      std::vector<std::pair<crypto::hash, payment_details>> m_payments;
+      std::vector<std::pair<crypto::hash, confirmed_transfer_details>> m_confirmed_txs;
+      std::string m_misc;
+      std::vector<std::pair<crypto::hash, crypto::secret_key>> m_tx_keys;
+      std::vector<std::pair<crypto::hash, std::string>> m_tx_notes;
+    };
     
     // GUI Address book
     struct address_book_row
@@ -286,6 +531,26 @@ namespace tools
 
     typedef std::tuple<uint64_t, crypto::public_key, rct::key> get_outs_entry;
 
+    // ring member candidates for one amount, drawn ahead of time with the histogram they
+    // were fetched with, and consumed once each across the transactions of a payout run
+    struct decoy_pool
+    {
+      uint64_t num_outs;
+      uint64_t num_recent_outs;
+      uint64_t chain_height;
+      time_t fetched;
+      std::deque<std::pair<get_outs_entry, bool>> recent;      // (output, unlocked), drawn from the recent zone
+      std::deque<std::pair<get_outs_entry, bool>> triangular;  // (output, unlocked), drawn over all outputs
+      std::unordered_map<uint64_t, std::pair<crypto::public_key, rct::key>> real;  // global index -> key and mask the daemon sent for our own outputs
+    };
+
+    struct decoy_plan
+    {
+      uint64_t amount;
+      size_t requested_outputs_count;
+      size_t recent_outputs_count;
+    };
+
     /*!
      * \brief Generates a wallet or restores one.
      * \param  wallet_        Name of wallet file
@@ -325,7 +590,53 @@ namespace tools
     void rewrite(const std::string& wallet_name, const std::string& password);
     void write_watch_only_wallet(const std::string& wallet_name, const std::string& password);
     void load(const std::string& wallet, const std::string& password);
+    /*!
+     * \brief store - persists what changed since the last store, does nothing if nothing did
+     *
+     * Changes are appended to an encrypted journal next to the cache file, which is only
+     * rewritten (compacted) once the journal grows too large, see store_to.
+     */
     void store();
+    /*!
+     * \brief store_async - like store, but only the snapshot is taken on the calling thread, encryption
+     *                      and file I/O happen on a background thread shared by all wallets
+     * \return false if this wallet's previous background store is still being written, what changed
+     *         since then goes with the next store; i_wallet2_callback::on_store_finished is called once
+     *         a job it queued is done
+     */
+    bool store_async();
+    // waits for the background store to finish, rethrows what it failed with
+    void wait_store();
+    // true while a background store is being written, otherwise error is what the last one failed with, if it did
+    bool store_status(std::string &error);
+    FsyncPolicy fsync_policy() const { return m_fsync_policy; }
+    void fsync_policy(FsyncPolicy policy) { m_fsync_policy = policy; }
+    /*!
+     * \brief storage_backend - where store() writes to; load() reads whichever one is there, and the next
+     *                          store after a change or after loading the other one moves the whole state over
+     * \param container       - for StorageLmdb, LMDB file shared by many wallets to keep keys and state in,
+     *                          instead of files of their own; stores of all of them are committed together
+     *
+     * With either backend, m_transfers, m_payments and m_confirmed_txs are loaded whole and stay in
+     * memory. Only the tx prefixes of the transfers stay cold, read back from the cache file or, with
+     * StorageLmdb, from the transfer rows through the page cache when signing or exporting needs them.
+     */
+    void storage_backend(StorageBackend backend, const std::string &container = std::string());
+    StorageBackend storage_backend() const { return m_storage; }
+    const std::string &storage_container() const { return m_container; }
+    // whether there are keys to load(), in the container or as the keys file
+    bool stored_keys_exist();
+    // removes the keys and state of this wallet from wherever they are stored
+    void remove_stored();
+    /*!
+     * \brief wipe_derived_keys - forgets the keys derived from the password and the secret keys, which are
+     *                            otherwise kept in locked memory for the life of the wallet and derived again
+     *                            only when what they are derived from changes
+     */
+    void wipe_derived_keys();
+    // slow hash key derivations run by this wallet, and by all wallets of the process
+    uint64_t key_derivations() const;
+    static uint64_t total_key_derivations();
     /*!
      * \brief store_to - stores wallet to another file(s), deleting old ones
      * \param path     - path to the wallet file (keys and address filenames will be generated based on this filename)
@@ -389,7 +700,7 @@ namespace tools
     bool watch_only() const { return m_watch_only; }
 
     uint64_t balance() const;
-    uint64_t unlocked_balance() const;
+    uint64_t unlocked_balance();
     uint64_t unlocked_dust_balance(const tx_dust_policy &dust_policy) const;
     template<typename T>
     void transfer(const std::vector<cryptonote::tx_destination_entry>& dsts, const size_t fake_outputs_count, const std::vector<size_t> &unused_transfers_indices, uint64_t unlock_time, uint64_t fee, const std::vector<uint8_t>& extra, T destination_split_strategy, const tx_dust_policy& dust_policy, bool trusted_daemon);
@@ -416,7 +727,7 @@ namespace tools
     bool load_unsigned_tx(const std::string &unsigned_filename, unsigned_tx_set &exported_txs);
     bool load_tx(const std::string &signed_filename, std::vector<tools::wallet2::pending_tx> &ptx, std::function<bool(const signed_tx_set&)> accept_func = NULL);
     std::vector<pending_tx> create_transactions(std::vector<cryptonote::tx_destination_entry> dsts, const size_t fake_outs_count, const uint64_t unlock_time, uint32_t priority, const std::vector<uint8_t> extra, bool trusted_daemon);
-    std::vector<wallet2::pending_tx> create_transactions_2(std::vector<cryptonote::tx_destination_entry> dsts, const size_t fake_outs_count, const uint64_t unlock_time, uint32_t priority, const std::vector<uint8_t> extra, bool trusted_daemon);
+    std::vector<wallet2::pending_tx> create_transactions_2(std::vector<cryptonote::tx_destination_entry> dsts, const size_t fake_outs_count, const uint64_t unlock_time, uint32_t priority, const std::vector<uint8_t> extra, bool trusted_daemon, const std::unordered_set<size_t> &excluded_transfers = std::unordered_set<size_t>());
     std::vector<wallet2::pending_tx> create_transactions_all(uint64_t below, const cryptonote::account_public_address &address, const size_t fake_outs_count, const uint64_t unlock_time, uint32_t priority, const std::vector<uint8_t> extra, bool trusted_daemon);
     std::vector<wallet2::pending_tx> create_transactions_from(const cryptonote::account_public_address &address, std::vector<size_t> unused_transfers_indices, std::vector<size_t> unused_dust_indices, const size_t fake_outs_count, const uint64_t unlock_time, uint32_t priority, const std::vector<uint8_t> extra, bool trusted_daemon);
     std::vector<pending_tx> create_unmixable_sweep_transactions(bool trusted_daemon);
@@ -428,6 +739,10 @@ namespace tools
       uint64_t min_height, uint64_t max_height = (uint64_t)-1) const;
     void get_unconfirmed_payments_out(std::list<std::pair<crypto::hash,wallet2::unconfirmed_transfer_details>>& unconfirmed_payments) const;
     void get_unconfirmed_payments(std::list<std::pair<crypto::hash,wallet2::payment_details>>& unconfirmed_payments) const;
+    void get_payments_by_txid(const crypto::hash& txid, std::list<std::pair<crypto::hash,wallet2::payment_details>>& payments) const;
+    void get_unconfirmed_payments_by_txid(const crypto::hash& txid, std::list<std::pair<crypto::hash,wallet2::payment_details>>& unconfirmed_payments) const;
+    void get_payments_out_by_txid(const crypto::hash& txid, std::list<std::pair<crypto::hash,wallet2::confirmed_transfer_details>>& confirmed_payments) const;
+    void get_unconfirmed_payments_out_by_txid(const crypto::hash& txid, std::list<std::pair<crypto::hash,wallet2::unconfirmed_transfer_details>>& unconfirmed_payments) const;
 
     uint64_t get_blockchain_current_height() const { return m_local_bc_height; }
     void rescan_spent();
@@ -479,7 +794,7 @@ namespace tools
         for (size_t i = 0; i < m_transfers.size(); ++i)
         {
           const transfer_details &td = m_transfers[i];
-          const cryptonote::tx_out &out = td.m_tx.vout[td.m_internal_output_index];
+          const cryptonote::tx_out &out = td.m_tx->vout[td.m_internal_output_index];
           const cryptonote::txout_to_key &o = boost::get<const cryptonote::txout_to_key>(out.target);
           m_pub_keys.emplace(o.key, i);
         }
@@ -496,6 +811,9 @@ namespace tools
         return;
       a & m_scanned_pool_txs[0];
       a & m_scanned_pool_txs[1];
+      if(ver < 19)
+        return;
+      a & m_journal_generation;
     }
 
     /*!
@@ -582,12 +900,12 @@ namespace tools
     std::string sign(const std::string &data) const;
     bool verify(const std::string &data, const cryptonote::account_public_address &address, const std::string &signature) const;
 
-    std::vector<tools::wallet2::transfer_details> export_outputs() const;
-    size_t import_outputs(const std::vector<tools::wallet2::transfer_details> &outputs);
+    std::vector<tools::wallet2::transfer_details> export_outputs(size_t start = 0) const;
+    size_t import_outputs(const std::vector<tools::wallet2::transfer_details> &outputs, size_t start = 0, const std::unordered_map<crypto::public_key, crypto::key_image> *known_key_images = NULL);
 
     bool export_key_images(const std::string filename);
-    std::vector<std::pair<crypto::key_image, crypto::signature>> export_key_images() const;
-    uint64_t import_key_images(const std::vector<std::pair<crypto::key_image, crypto::signature>> &signed_key_images, uint64_t &spent, uint64_t &unspent);
+    std::vector<std::pair<crypto::key_image, crypto::signature>> export_key_images(size_t start = 0) const;
+    uint64_t import_key_images(const std::vector<std::pair<crypto::key_image, crypto::signature>> &signed_key_images, uint64_t &spent, uint64_t &unspent, size_t start = 0);
     uint64_t import_key_images(const std::string &filename, uint64_t &spent, uint64_t &unspent);
 
     void update_pool_state(bool refreshed = false);
@@ -629,7 +947,7 @@ namespace tools
     void detach_blockchain(uint64_t height);
     void get_short_chain_history(std::list<crypto::hash>& ids) const;
     bool is_tx_spendtime_unlocked(uint64_t unlock_time, uint64_t block_height) const;
-    bool clear();
+    virtual bool clear();
     void pull_blocks(uint64_t start_height, uint64_t& blocks_start_height, const std::list<crypto::hash> &short_chain_history, std::list<cryptonote::block_complete_entry> &blocks, std::vector<cryptonote::COMMAND_RPC_GET_BLOCKS_FAST::block_output_indices> &o_indices);
     void pull_hashes(uint64_t start_height, uint64_t& blocks_start_height, const std::list<crypto::hash> &short_chain_history, std::list<crypto::hash> &hashes);
     void fast_refresh(uint64_t stop_height, uint64_t &blocks_start_height, std::list<crypto::hash> &short_chain_history);
@@ -643,6 +961,7 @@ namespace tools
     void generate_genesis(cryptonote::block& b);
     void check_genesis(const crypto::hash& genesis_hash) const; //throws
     bool generate_chacha8_key_from_secret_keys(crypto::chacha8_key &key) const;
+    void derive_chacha8_key(const void *data, size_t size, crypto::chacha8_key &key) const;
     crypto::hash get_payment_id(const pending_tx &ptx) const;
     crypto::hash8 get_short_payment_id(const pending_tx &ptx) const;
     void check_acc_out_precomp(const crypto::public_key &spend_public_key, const cryptonote::tx_out &o, const crypto::key_derivation &derivation, size_t i, bool &received, uint64_t &money_transfered, bool &error) const;
@@ -651,12 +970,84 @@ namespace tools
     std::vector<uint64_t> get_unspent_amounts_vector();
     uint64_t get_dynamic_per_kb_fee_estimate();
     float get_output_relatedness(const transfer_details &td0, const transfer_details &td1) const;
-    std::vector<size_t> pick_preferred_rct_inputs(uint64_t needed_money) const;
+    std::vector<size_t> pick_preferred_rct_inputs(uint64_t needed_money, const std::unordered_set<size_t> &excluded = std::unordered_set<size_t>());
     void set_spent(size_t idx, uint64_t height);
     void set_unspent(size_t idx);
+    void set_key_image(size_t idx, const crypto::key_image &key_image);
+    void unindex_spent(size_t idx);
+    void unindex_payment(payment_txid_index &index, const payment_container::value_type *payment);
+    void index_payments();
+    void detach_payments(uint64_t height);
+    void account_transfer(size_t idx);
+    void unaccount_transfer(size_t idx);
+    void transfer_unlock_requirements(const transfer_details& td, uint64_t &height, uint64_t &unlock_ts) const;
+    void update_unlock_schedule();
+    void index_spendable(size_t idx, bool spendable);
+    void mark_unlocked(uint64_t height, size_t idx);
+    void get_spendable_transfers(bool use_rct, uint64_t below, std::vector<size_t> &transfers, std::vector<size_t> &dust, const std::unordered_set<size_t> &excluded = std::unordered_set<size_t>());
+    void rebuild_indexes();
+    void share_tx_prefixes();
+    void add_tx_key(const crypto::hash &txid, const crypto::secret_key &tx_key);
+    // a serialized cache file or journal record, or an LMDB transaction, waiting to be encrypted and written
+    struct store_job
+    {
+      bool m_cache;                                                   // whole state, not only what changed
+      std::string m_file;
+      std::string m_plaintext;                                        // journal record
+      std::vector<std::pair<cache_chunk, std::string>> m_chunks;     // cache file
+      std::shared_ptr<wallet_lmdb> m_lmdb;                            // set for StorageLmdb
+      std::string m_prefix;                                           // of the wallet's keys in m_lmdb
+      journal_record m_record;                                        // LMDB transaction, without patches
+      std::vector<std::pair<uint64_t, transfer_details>> m_touched;   // and the transfers they would patch
+      uint64_t m_blocks_stored;                                       // chain and transfer rows in m_lmdb before
+      uint64_t m_transfers_stored;
+      uint64_t m_tx_deltas_stored;                                    // tx key and note rows, the next one's sequence number
+      std::string m_keys_file;                                        // moving into a container along with the state
+      std::string m_keys;
+      FsyncPolicy m_fsync;
+      crypto::chacha8_key m_key;                                      // of the account the state was captured from
+      cryptonote::account_public_address m_address;
+    };
+    std::string journal_file() const { return m_wallet_file + ".journal"; }
+    bool lmdb_container() const { return m_storage == StorageLmdb && !m_container.empty(); }
+    std::string lmdb_file() const { return lmdb_container() ? m_container : m_wallet_file + ".mdb"; }
+    std::string lmdb_prefix() const;
+    std::string journal_misc(bool tx_keys) const;
+    void journal_touch(size_t idx);
+    void journal_truncate(size_t blocks, size_t transfers);
+    void journal_checkpoint();
+    std::shared_ptr<store_job> prepare_store();
+    void capture_cache(std::vector<std::pair<cache_chunk, std::string>> &chunks);
+    void capture_record(journal_record &record) const;
+    std::string capture_journal();
+    void capture_lmdb(store_job &job);
+    std::shared_ptr<wallet_lmdb> open_lmdb();
+    std::shared_ptr<wallet_lmdb_batch> lmdb_batch(const store_job &job) const;
+    void lmdb_committed(const store_job &job) const;
+    bool load_lmdb(const crypto::chacha8_key &key, const std::string &file);
+    bool lmdb_get(const std::string &name, std::string &value);
+    bool lmdb_put_keys(const std::string &keys);
+    void run_store(const store_job &job);
+    void finish_store(std::exception_ptr error);
+    void drain_store();
+    void write_store(const store_job &job) const;
+    void write_cache_file(const std::vector<std::pair<cache_chunk, std::string>> &chunks, const crypto::chacha8_key &key, const std::string &file, bool sync) const;
+    void load_cache_file(const std::shared_ptr<boost::iostreams::mapped_file_source> &file, const crypto::chacha8_key &key);
+    void load_cache_chunk(const cache_chunk &chunk, const char *data, const crypto::chacha8_key &key, const std::shared_ptr<tx_prefix_source> &prefixes, std::string &error);
+    void load_journal_misc(std::istream &is);
+    void rebuild_transfer_maps();
+    void replay_journal(const crypto::chacha8_key &key);
+    void apply_journal_record(const journal_record &record);
     void get_outs(std::vector<std::vector<get_outs_entry>> &outs, const std::list<size_t> &selected_transfers, size_t fake_outputs_count);
+    void refresh_decoy_histograms(const std::vector<uint64_t> &amounts);
+    std::vector<decoy_plan> plan_decoys(const std::list<size_t> &selected_transfers, size_t fake_outputs_count);
+    void fill_decoy_pools(const std::list<size_t> &selected_transfers, const std::vector<decoy_plan> &plans, size_t prefetch_factor,
+      std::unordered_map<uint64_t, std::vector<std::pair<get_outs_entry, bool>>> &all_outs);
     bool wallet_generate_key_image_helper(const cryptonote::account_keys& ack, const crypto::public_key& tx_public_key, size_t real_output_index, cryptonote::keypair& in_ephemeral, crypto::key_image& ki);
     crypto::public_key get_tx_pub_key_from_received_outs(const tools::wallet2::transfer_details &td) const;
+    void export_key_images_range(size_t begin, size_t end, size_t start, std::vector<std::pair<crypto::key_image, crypto::signature>> &ski, std::string &error) const;
+    void verify_key_images_range(size_t begin, size_t end, size_t start, const std::vector<std::pair<crypto::key_image, crypto::signature>> &signed_key_images,
+      std::atomic<size_t> &first_failed, std::string &error) const;
     bool should_pick_a_second_output(bool use_rct, size_t n_transfers, const std::vector<size_t> &unused_transfers_indices, const std::vector<size_t> &unused_dust_indices) const;
     std::vector<size_t> get_only_rct(const std::vector<size_t> &unused_dust_indices, const std::vector<size_t> &unused_transfers_indices) const;
 
@@ -677,6 +1068,55 @@ namespace tools
     payment_container m_payments;
     std::unordered_map<crypto::key_image, size_t> m_key_images;
     std::unordered_map<crypto::public_key, size_t> m_pub_keys;
+    // height ordered secondary indexes, not serialized (see rebuild_indexes), so that detach_blockchain
+    // only touches records at or above the split height
+    std::map<uint64_t, std::set<size_t>> m_spent_by_height;              // spent height -> m_transfers indexes
+    std::multimap<uint64_t, crypto::hash> m_payments_by_height;          // block height -> m_payments key
+    std::multimap<uint64_t, crypto::hash> m_confirmed_txs_by_height;     // block height -> m_confirmed_txs key, may be stale
+    payment_txid_index m_payments_by_txid;                               // txid -> m_payments element
+    payment_txid_index m_unconfirmed_payments_by_txid;                   // txid -> m_unconfirmed_payments element
+    // running totals behind balance()/unlocked_balance(); unspent transfers sit in exactly one of the
+    // unlock schedule sets, keyed by the chain height or time they wait for (see update_unlock_schedule)
+    uint64_t m_unspent_amount;
+    uint64_t m_pending_change;
+    uint64_t m_unlocked_amount;
+    std::set<std::pair<uint64_t, size_t>> m_locked_by_height;
+    std::set<std::pair<uint64_t, size_t>> m_locked_by_time;
+    std::set<std::pair<uint64_t, size_t>> m_unlocked_by_height;
+    // the unlocked part of the schedule split the way create_transactions_* partition inputs, keyed by (amount, index)
+    std::set<std::pair<uint64_t, size_t>> m_spendable_rct;
+    std::set<std::pair<uint64_t, size_t>> m_spendable_plain;
+    std::set<std::pair<uint64_t, size_t>> m_spendable_dust;
+    amount_tree m_spendable_rct_by_index;                                // m_spendable_rct by transfer index, amount + 1 (0 if not in it)
+    // what the cache file plus its journal already hold, so that store() only appends what changed since
+    uint64_t m_journal_generation;                                       // cache file the journal records extend
+    size_t m_journal_blocks;                                             // persisted m_blockchain prefix
+    size_t m_journal_transfers;                                          // persisted m_transfers prefix
+    size_t m_lmdb_blocks;                                                // m_blockchain rows in the LMDB store, deleted by key past a detach
+    size_t m_lmdb_transfers;                                             // m_transfers rows in the LMDB store
+    size_t m_lmdb_tx_deltas;                                             // tx key and note rows in the LMDB store
+    std::set<size_t> m_journal_touched;                                  // persisted transfers whose spent or key image state changed
+    bool m_journal_misc_dirty;                                           // the small containers of journal_misc() changed
+    std::vector<crypto::hash> m_journal_tx_keys;                         // m_tx_keys added since, in order
+    std::unordered_set<crypto::hash> m_journal_tx_notes;                 // m_tx_notes set since
+    bool m_journal_dirty;                                                // something was detached or touched
+    bool m_journal_full;                                                 // next store() rewrites the cache file
+    size_t m_journal_records;
+    uint64_t m_journal_bytes;
+    uint64_t m_journal_base_bytes;                                       // size of the cache file the journal extends
+    FsyncPolicy m_fsync_policy;
+    StorageBackend m_storage;
+    std::string m_container;
+    std::shared_ptr<wallet_lmdb> m_lmdb;                                 // open environment of lmdb_file(), if any
+    boost::mutex m_store_mutex;
+    boost::condition_variable m_store_cond;
+    bool m_store_pending;                                                // a store_async job is queued or being written
+    std::exception_ptr m_store_error;                                    // what the last finished one failed with
+    mutable boost::mutex m_derived_keys_mutex;
+    mutable wallet_derived_key *m_derived_keys;                          // WALLET_DERIVED_KEYS of them, in locked memory
+    mutable uint64_t m_derived_keys_clock;
+    mutable uint64_t m_key_derivations;
+    std::unordered_map<uint64_t, decoy_pool> m_decoy_pools;              // amount (0 for rct) -> decoy pool
     cryptonote::account_public_address m_account_public_address;
     std::unordered_map<crypto::hash, std::string> m_tx_notes;
     std::vector<tools::wallet2::address_book_row> m_address_book;
@@ -711,7 +1151,7 @@ namespace tools
     std::unordered_set<crypto::hash> m_scanned_pool_txs[2];
   };
 }
-BOOST_CLASS_VERSION(tools::wallet2, 18)
+BOOST_CLASS_VERSION(tools::wallet2, 19)
 BOOST_CLASS_VERSION(tools::wallet2::transfer_details, 7)
 BOOST_CLASS_VERSION(tools::wallet2::payment_details, 1)
 BOOST_CLASS_VERSION(tools::wallet2::unconfirmed_transfer_details, 6)
@@ -721,6 +1161,8 @@ BOOST_CLASS_VERSION(tools::wallet2::unsigned_tx_set, 0)
 BOOST_CLASS_VERSION(tools::wallet2::signed_tx_set, 0)
 BOOST_CLASS_VERSION(tools::wallet2::tx_construction_data, 0)
 BOOST_CLASS_VERSION(tools::wallet2::pending_tx, 0)
+BOOST_CLASS_VERSION(tools::wallet2::journal_transfer_patch, 0)
+BOOST_CLASS_VERSION(tools::wallet2::journal_record, 1)
 
 namespace boost
 {
@@ -736,7 +1178,7 @@ namespace boost
         if (ver < 1)
         {
           x.m_mask = rct::identity();
-          x.m_amount = x.m_tx.vout[x.m_internal_output_index].amount;
+          x.m_amount = x.m_tx->vout[x.m_internal_output_index].amount;
         }
         if (ver < 2)
         {
@@ -744,7 +1186,7 @@ namespace boost
         }
         if (ver < 4)
         {
-          x.m_rct = x.m_tx.vout[x.m_internal_output_index].amount == 0;
+          x.m_rct = x.m_tx->vout[x.m_internal_output_index].amount == 0;
         }
         if (ver < 6)
         {
@@ -756,6 +1198,20 @@ namespace boost
         }
     }
 
+    template <class Archive>
+    inline typename std::enable_if<!Archive::is_loading::value, void>::type serialize_tx_prefix(Archive &a, tools::wallet2::transfer_details &x)
+    {
+        const cryptonote::transaction_prefix empty;
+        a & (x.m_tx ? *x.m_tx : empty);
+    }
+    template <class Archive>
+    inline typename std::enable_if<Archive::is_loading::value, void>::type serialize_tx_prefix(Archive &a, tools::wallet2::transfer_details &x)
+    {
+        std::shared_ptr<cryptonote::transaction_prefix> prefix = std::make_shared<cryptonote::transaction_prefix>();
+        a & *prefix;
+        x.set_tx(prefix);
+    }
+
     template <class Archive>
     inline void serialize(Archive &a, tools::wallet2::transfer_details &x, const boost::serialization::version_type ver)
     {
@@ -766,12 +1222,12 @@ namespace boost
       {
         cryptonote::transaction tx;
         a & tx;
-        x.m_tx = (const cryptonote::transaction_prefix&)tx;
+        x.set_tx(std::make_shared<const cryptonote::transaction_prefix>((const cryptonote::transaction_prefix&)tx));
         x.m_txid = cryptonote::get_transaction_hash(tx);
       }
       else
       {
-        a & x.m_tx;
+        serialize_tx_prefix(a, x);
       }
       a & x.m_spent;
       a & x.m_key_image;
@@ -926,6 +1382,34 @@ namespace boost
       a & x.m_description;
     }
 
+    template <class Archive>
+    inline void serialize(Archive &a, tools::wallet2::journal_transfer_patch &x, const boost::serialization::version_type ver)
+    {
+      a & x.m_index;
+      a & x.m_spent;
+      a & x.m_spent_height;
+      a & x.m_key_image;
+      a & x.m_key_image_known;
+    }
+
+    template <class Archive>
+    inline void serialize(Archive &a, tools::wallet2::journal_record &x, const boost::serialization::version_type ver)
+    {
+      a & x.m_generation;
+      a & x.m_blocks_start;
+      a & x.m_blocks;
+      a & x.m_transfers_start;
+      a & x.m_transfers;
+      a & x.m_patches;
+      a & x.m_payments;
+      a & x.m_confirmed_txs;
+      a & x.m_misc;
+      if (ver < 1)
+        return;
+      a & x.m_tx_keys;
+      a & x.m_tx_notes;
+    }
+
     template <class Archive>
     inline void serialize(Archive &a, tools::wallet2::unsigned_tx_set &x, const boost::serialization::version_type ver)
     {
@@ -1070,9 +1554,9 @@ namespace tools
       for(size_t idx: selected_transfers)
       {
         const transfer_container::const_iterator it = m_transfers.begin() + idx;
-        THROW_WALLET_EXCEPTION_IF(it->m_tx.vout.size() <= it->m_internal_output_index, error::wallet_internal_error,
+        THROW_WALLET_EXCEPTION_IF(it->m_tx->vout.size() <= it->m_internal_output_index, error::wallet_internal_error,
           "m_internal_output_index = " + std::to_string(it->m_internal_output_index) +
-          " is greater or equal to outputs count = " + std::to_string(it->m_tx.vout.size()));
+          " is greater or equal to outputs count = " + std::to_string(it->m_tx->vout.size()));
         req.amounts.push_back(it->amount());
       }
 
@@ -1133,10 +1617,10 @@ namespace tools
       //size_t real_index = src.outputs.size() ? (rand() % src.outputs.size() ):0;
       tx_output_entry real_oe;
       real_oe.first = td.m_global_output_index;
-      real_oe.second.dest = rct::pk2rct(boost::get<txout_to_key>(td.m_tx.vout[td.m_internal_output_index].target).key);
+      real_oe.second.dest = rct::pk2rct(boost::get<txout_to_key>(td.m_tx->vout[td.m_internal_output_index].target).key);
       real_oe.second.mask = rct::identity();
       auto interted_it = src.outputs.insert(it_to_insert, real_oe);
-      src.real_out_tx_key = get_tx_pub_key_from_extra(td.m_tx);
+      src.real_out_tx_key = get_tx_pub_key_from_extra(*td.m_tx);
       src.real_output = interted_it - src.outputs.begin();
       src.real_output_in_tx_index = td.m_internal_output_index;
       detail::print_source_entry(src);
@@ -35,6 +35,7 @@ namespace tools {
 	using v8::Handle;
 
 	Persistent<Function> XMR::constructor;
+	Persistent<FunctionTemplate> XMR::tmpl;
 
 	/**
 	 * Class wich transforms data from v8 to monero and back. 
@@ -44,11 +45,21 @@ namespace tools {
 		this->wallet = new tools::XMRWallet(testnet);
 		this->daemon = daemon;
 		this->ssl = ssl;
+		this->storeAsync = NULL;
 	}
 
 	XMR::~XMR() {
+		// no store thread call comes after this
+		try {
+			this->wallet->wait_store();
+		} catch (...) {}
+		this->wallet->callback(NULL);
+		if (this->storeAsync) {
+			uv_close((uv_handle_t*)this->storeAsync, [](uv_handle_t *handle) { delete (uv_async_t*)handle; });
+		}
 		this->onTx.Reset();
 		this->onBlock.Reset();
+		this->onStore.Reset();
 	}
 
 
@@ -71,25 +82,36 @@ namespace tools {
 		NODE_SET_PROTOTYPE_METHOD(tpl, "connected", connected);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "refresh", refresh);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "refresh_and_store", refresh_and_store);
+		NODE_SET_PROTOTYPE_METHOD(tpl, "refreshStats", refreshStats);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "close", close);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "store", store);
+		NODE_SET_PROTOTYPE_METHOD(tpl, "storeStatus", storeStatus);
+		NODE_SET_PROTOTYPE_METHOD(tpl, "keyStats", keyStats);
+		NODE_SET_PROTOTYPE_METHOD(tpl, "wipeDerivedKeys", wipeDerivedKeys);
+		NODE_SET_PROTOTYPE_METHOD(tpl, "setStorage", setStorage);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "rescan", rescan);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "balances", balances);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "height", height);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "cleanup", cleanup);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "createIntegratedAddress", createIntegratedAddress);
 		NODE_SET_METHOD((Local<v8::Template>)tpl, "createPaperWallet", createPaperWallet);
+		NODE_SET_METHOD((Local<v8::Template>)tpl, "wipeSignerCache", wipeSignerCache);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "openPaperWallet", openPaperWallet);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "openViewWallet", openViewWallet);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "openViewWalletOffline", openViewWalletOffline);
+		NODE_SET_METHOD((Local<v8::Template>)tpl, "openViewWallets", openViewWallets);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "setCallbacks", setCallbacks);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "createUnsignedTransaction", createUnsignedTransaction);
+		NODE_SET_PROTOTYPE_METHOD(tpl, "createUnsignedTransactions", createUnsignedTransactions);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "signTransaction", signTransaction);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "submitSignedTransaction", submitSignedTransaction);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "exportOutputs", exportOutputs);
+		NODE_SET_PROTOTYPE_METHOD(tpl, "convertBlob", convertBlob);
+		NODE_SET_PROTOTYPE_METHOD(tpl, "fabricateOutputs", fabricateOutputs);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "transactions", transactions);
 		NODE_SET_PROTOTYPE_METHOD(tpl, "testIt", testIt);
 
+		tmpl.Reset(isolate, tpl);
 		constructor.Reset(isolate, tpl->GetFunction());
 		exports->Set(String::NewFromUtf8(isolate, "XMR"), tpl->GetFunction());
 	}
@@ -161,6 +183,13 @@ namespace tools {
 		}
 	}
 
+	/**
+	 * Forget all signer sessions: derived keys are wiped, remembered key images dropped
+	 */
+	void XMR::wipeSignerCache(const FunctionCallbackInfo<Value>& args) {
+		XMRSignerCache::wipe();
+	}
+
 	void XMR::openPaperWallet(const FunctionCallbackInfo<Value>& args) {
 		Isolate* isolate = args.GetIsolate();
 		XMR* xmr = ObjectWrap::Unwrap<XMR>(args.Holder());
@@ -191,14 +220,71 @@ namespace tools {
 		std::string viewKey(*v8::String::Utf8Value(args[1]->ToString()));
 
 		int code = xmr->wallet->openViewWallet(address, viewKey);
-		if (code == 0) {
+		if (code != 0) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, openViewWalletError(code))));
+		}
+	}
+
+	/**
+	 * Open many view wallets at once, loading them in parallel
+	 * 
+	 * @param {Array} wallets objects of {wallet: XMR instance, address: String, viewKey: String}, each instance once
+	 * @return {Array} null for every wallet opened, error message otherwise, in the same order
+	 */
+	void XMR::openViewWallets(const FunctionCallbackInfo<Value>& args) {
+		Isolate* isolate = args.GetIsolate();
+		Local<FunctionTemplate> tpl = Local<FunctionTemplate>::New(isolate, tmpl);
+		const char *usage = "Required arguments: array of {wallet: XMR, address: string, viewKey: string}";
+
+		if (args.Length() != 1 || !args[0]->IsArray()) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, usage)));
 			return;
-		} else if (code == -1) {
-			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Invalid address")));
-		} else if (code == -2) {
-			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Invalid viewKey")));
-		} else if (code == -3) {
-			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Failed to store wallet files")));
+		}
+
+		Local<Array> arr = Local<Array>::Cast(args[0]);
+		std::vector<std::tuple<XMRWallet*, std::string, std::string>> wallets;
+		std::set<XMRWallet*> seen;
+		for (uint32_t i = 0; i < arr->Length(); i++) {
+			if (!arr->Get(i)->IsObject()) {
+				isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, usage)));
+				return;
+			}
+			Local<Object> obj = arr->Get(i)->ToObject();
+			Local<Value> wallet = obj->Get(String::NewFromUtf8(isolate, "wallet"));
+			Local<Value> address = obj->Get(String::NewFromUtf8(isolate, "address"));
+			Local<Value> viewKey = obj->Get(String::NewFromUtf8(isolate, "viewKey"));
+			if (!wallet->IsObject() || !tpl->HasInstance(wallet) || !address->IsString() || !viewKey->IsString()) {
+				isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, usage)));
+				return;
+			}
+
+			XMR* xmr = ObjectWrap::Unwrap<XMR>(wallet->ToObject());
+			if (!seen.insert(xmr->wallet).second) {
+				isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Same wallet instance given twice")));
+				return;
+			}
+			wallets.emplace_back(xmr->wallet, *v8::String::Utf8Value(address->ToString()), *v8::String::Utf8Value(viewKey->ToString()));
+		}
+
+		std::vector<int> codes = XMRWallet::openViewWallets(wallets);
+
+		Local<Array> ret = Array::New(isolate);
+		for (size_t i = 0; i < codes.size(); i++) {
+			if (codes[i] == 0) {
+				ret->Set(i, v8::Null(isolate));
+			} else {
+				ret->Set(i, String::NewFromUtf8(isolate, openViewWalletError(codes[i])));
+			}
+		}
+		args.GetReturnValue().Set(ret);
+	}
+
+	const char *XMR::openViewWalletError(int code) {
+		switch (code) {
+			case -1: return "Invalid address";
+			case -2: return "Invalid viewKey";
+			case -3: return "Failed to store wallet files";
+			default: return "Failed to load wallet files";
 		}
 	}
 
@@ -216,26 +302,41 @@ namespace tools {
 		std::string viewKey(*v8::String::Utf8Value(args[1]->ToString()));
 
 		int code = xmr->wallet->openViewWalletOffline(address, viewKey);
-		if (code == 0) {
-			return;
-		} else if (code == -1) {
-			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Invalid address")));
-		} else if (code == -2) {
-			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Invalid viewKey")));
+		if (code != 0) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, openViewWalletError(code))));
 		}
 	}
 
+	/**
+	 * Sets wallet event handlers.
+	 * 
+	 * @param {Function} onTx (in: Boolean, txid: String)
+	 * @param {Function} onBlock (height: String)
+	 * @param {Function} onStore [optional] (error: String|undefined), once a background store (see store) is written or failed
+	 */
 	void XMR::setCallbacks(const FunctionCallbackInfo<Value>& args) {
 		Isolate* isolate = args.GetIsolate();
 		XMR* xmr = ObjectWrap::Unwrap<XMR>(args.Holder());
 
-		if (args.Length() != 2 || !args[0]->IsFunction() || !args[1]->IsFunction()) {
-			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Required arguments: function onTx, function onBlock")));
+		if (args.Length() < 2 || args.Length() > 3 || !args[0]->IsFunction() || !args[1]->IsFunction() || (args.Length() == 3 && !args[2]->IsFunction())) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Required arguments: function onTx, function onBlock, optional function onStore")));
 			return;
 		}
 
 		xmr->onTx.Reset(isolate, Local<Function>::Cast(args[0]));
 		xmr->onBlock.Reset(isolate, Local<Function>::Cast(args[1]));
+		if (args.Length() == 3) {
+			xmr->onStore.Reset(isolate, Local<Function>::Cast(args[2]));
+			if (!xmr->storeAsync) {
+				xmr->storeAsync = new uv_async_t;
+				uv_async_init(uv_default_loop(), xmr->storeAsync, storeFinished);
+				xmr->storeAsync->data = xmr;
+				// a store in flight does not keep the process alive
+				uv_unref((uv_handle_t*)xmr->storeAsync);
+			}
+		} else {
+			xmr->onStore.Reset();
+		}
 		xmr->wallet->callback(xmr);
 	}
 
@@ -342,23 +443,130 @@ namespace tools {
 		args.GetReturnValue().Set(Boolean::New(isolate, obj->wallet->refresh_and_store()));
 	}
 
+	/**
+	 * Refresh counters: total refresh() calls and those which were skipped because daemon tip & pool didn't change
+	 * 
+	 * @return {Object} {refreshes: String, noop: String}
+	 */
+	void XMR::refreshStats(const FunctionCallbackInfo<Value>& args) {
+		Isolate* isolate = args.GetIsolate();
+		XMR* obj = ObjectWrap::Unwrap<XMR>(args.Holder());
+
+		uint64_t refreshes = 0, noop = 0;
+		obj->wallet->refreshStats(refreshes, noop);
+
+		Local<Object> ret = Object::New(isolate);
+		ret->Set(String::NewFromUtf8(isolate, "refreshes"), String::NewFromUtf8(isolate, int64ToStr(refreshes).c_str()));
+		ret->Set(String::NewFromUtf8(isolate, "noop"), String::NewFromUtf8(isolate, int64ToStr(noop).c_str()));
+		args.GetReturnValue().Set(ret);
+	}
+
 	void XMR::close(const FunctionCallbackInfo<Value>& args) {
 		Isolate* isolate = args.GetIsolate();
 		XMR* obj = ObjectWrap::Unwrap<XMR>(args.Holder());
 		args.GetReturnValue().Set(Boolean::New(isolate, obj->wallet->close()));
 	}
 
+	/**
+	 * Persists wallet state changed since last store, if any.
+	 * 
+	 * @param {Boolean} background [optional] leave encryption & disk I/O to a background thread, see storeStatus
+	 * @return {Boolean} false if state couldn't be stored (or snapshotted when in background), or if previous
+	 *                   background store is still being written, in which case changes go with the next store
+	 */
 	void XMR::store(const FunctionCallbackInfo<Value>& args) {
 		Isolate* isolate = args.GetIsolate();
 		XMR* obj = ObjectWrap::Unwrap<XMR>(args.Holder());
+		bool background = args.Length() > 0 && args[0]->IsBoolean() && args[0]->BooleanValue();
 		try {
-			obj->wallet->store();
-			args.GetReturnValue().Set(Boolean::New(isolate, true));
+			bool stored = true;
+			if (background) {
+				stored = obj->wallet->store_async();
+			} else {
+				obj->wallet->store();
+			}
+			args.GetReturnValue().Set(Boolean::New(isolate, stored));
 		} catch (...) {
 			args.GetReturnValue().Set(Boolean::New(isolate, false));
 		}
 	}
 
+	/**
+	 * State of background store: whether it's still being written and the error it failed with (reported once,
+	 * here or to onStore, see setCallbacks)
+	 * 
+	 * @return {Object} {pending: Boolean, error: String|undefined}
+	 */
+	void XMR::storeStatus(const FunctionCallbackInfo<Value>& args) {
+		Isolate* isolate = args.GetIsolate();
+		XMR* obj = ObjectWrap::Unwrap<XMR>(args.Holder());
+
+		std::string error;
+		bool pending = obj->wallet->store_status(error);
+
+		Local<Object> ret = Object::New(isolate);
+		ret->Set(String::NewFromUtf8(isolate, "pending"), Boolean::New(isolate, pending));
+		if (!error.empty()) {
+			ret->Set(String::NewFromUtf8(isolate, "error"), String::NewFromUtf8(isolate, error.c_str()));
+		}
+		args.GetReturnValue().Set(ret);
+	}
+
+	/**
+	 * Slow hash key derivations run by this wallet and by all wallets of the process
+	 * 
+	 * @return {Object} {derivations: String, total: String}
+	 */
+	void XMR::keyStats(const FunctionCallbackInfo<Value>& args) {
+		Isolate* isolate = args.GetIsolate();
+		XMR* obj = ObjectWrap::Unwrap<XMR>(args.Holder());
+
+		Local<Object> ret = Object::New(isolate);
+		ret->Set(String::NewFromUtf8(isolate, "derivations"), String::NewFromUtf8(isolate, int64ToStr(obj->wallet->key_derivations()).c_str()));
+		ret->Set(String::NewFromUtf8(isolate, "total"), String::NewFromUtf8(isolate, int64ToStr(tools::wallet2::total_key_derivations()).c_str()));
+		args.GetReturnValue().Set(ret);
+	}
+
+	/**
+	 * Forget keys derived for this wallet's stores, next store derives them again
+	 */
+	void XMR::wipeDerivedKeys(const FunctionCallbackInfo<Value>& args) {
+		XMR* obj = ObjectWrap::Unwrap<XMR>(args.Holder());
+		obj->wallet->wipe_derived_keys();
+	}
+
+	/**
+	 * Where wallet state is stored from now on. Wallet opened from the other one is moved over on next store.
+	 * 
+	 * @param {String} backend "file" for cache file plus journal (default), "lmdb" for LMDB environment next to it
+	 * @param {String} container optional, with "lmdb": path of LMDB environment shared by many wallets, keys included
+	 * @return {Boolean} false if backend is unknown
+	 */
+	void XMR::setStorage(const FunctionCallbackInfo<Value>& args) {
+		Isolate* isolate = args.GetIsolate();
+		XMR* obj = ObjectWrap::Unwrap<XMR>(args.Holder());
+
+		if (args.Length() < 1 || args.Length() > 2 || !args[0]->IsString() || (args.Length() == 2 && !args[1]->IsString())) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Required arguments: string backend, optional string container")));
+			return;
+		}
+
+		std::string backend(*v8::String::Utf8Value(args[0]->ToString()));
+		std::string container;
+		if (args.Length() == 2) {
+			container = std::string(*v8::String::Utf8Value(args[1]->ToString()));
+		}
+		if (backend == "file" && container.empty()) {
+			obj->wallet->storage_backend(tools::wallet2::StorageCacheFile);
+		} else if (backend == "lmdb") {
+			obj->wallet->storage_backend(tools::wallet2::StorageLmdb, container);
+		} else {
+			args.GetReturnValue().Set(Boolean::New(isolate, false));
+			return;
+		}
+		args.GetReturnValue().Set(Boolean::New(isolate, true));
+	}
+
 	void XMR::rescan(const FunctionCallbackInfo<Value>& args) {
 		Isolate* isolate = args.GetIsolate();
 		XMR* obj = ObjectWrap::Unwrap<XMR>(args.Holder());
@@ -393,55 +601,62 @@ namespace tools {
 	
 		Local<Object> ret = Object::New(isolate);
 
+		bool incremental = args.Length() > 0 && args[0]->IsBoolean() && args[0]->BooleanValue();
+
 		std::string outputs;
-		std::string error = xmr->wallet->exportOutputs(outputs);
+		std::string error = xmr->wallet->exportOutputs(outputs, incremental);
 
 		if (isError(error)) {
 			ret->Set(String::NewFromUtf8(isolate, "error"), String::NewFromUtf8(isolate, error.c_str()));
 		} else {
-			ret->Set(String::NewFromUtf8(isolate, "outputs"), String::NewFromUtf8(isolate, encodeBase64(outputs).c_str()));
+			ret->Set(String::NewFromUtf8(isolate, "outputs"), String::NewFromUtf8(isolate, outputs.c_str()));
 		}
 
 		args.GetReturnValue().Set(ret);
 	}
 
-	void XMR::createUnsignedTransaction(const FunctionCallbackInfo<Value>& args) {
+	/**
+	 * Convert legacy unsigned tx / outputs blob into compact outputs format, or compact outputs
+	 * back into legacy outputs blob (tx prefixes then only hold the output itself, see expandOutput)
+	 * 
+	 * @param {String} blob legacy blob
+	 * @return {Object} {data: converted blob} or {error: string}
+	 */
+	void XMR::convertBlob(const FunctionCallbackInfo<Value>& args) {
 		Isolate* isolate = args.GetIsolate();
 		XMR* xmr = ObjectWrap::Unwrap<XMR>(args.Holder());
 
-		if (args.Length() != 2 || !args[0]->IsObject() || !args[1]->IsBoolean()) {
-			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Required argument: Tx instance, bool optimized")));
+		if (args.Length() != 1 || !args[0]->IsString()) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Required argument: string blob")));
 			return;
 		}
 
-		XMRTx tx;
+		Local<Object> ret = Object::New(isolate);
 
-		Local<Context> context = isolate->GetCurrentContext();
-		Local<Object> obj = args[0]->ToObject(context).ToLocalChecked();
-		bool optimized = args[1]->BooleanValue();
-		tx.priority = obj->Get(String::NewFromUtf8(isolate, "priority"))->Int32Value();
-		tx.mixins = obj->Get(String::NewFromUtf8(isolate, "mixins"))->Int32Value();
-		tx.unlock_time = obj->Get(String::NewFromUtf8(isolate, "unlock"))->Int32Value();
+		std::string data(*v8::String::Utf8Value(args[0]->ToString()));
+		std::string error = xmr->wallet->convertBlob(data);
 
-		if (!obj->Get(String::NewFromUtf8(isolate, "paymentId"))->IsNullOrUndefined()) {
-			tx.payment_id = std::string(*v8::String::Utf8Value(obj->Get(String::NewFromUtf8(isolate, "paymentId"))->ToString()));
+		if (isError(error)) {
+			ret->Set(String::NewFromUtf8(isolate, "error"), String::NewFromUtf8(isolate, error.c_str()));
+		} else {
+			ret->Set(String::NewFromUtf8(isolate, "data"), String::NewFromUtf8(isolate, data.c_str()));
 		}
 
-		// logstream << "priority " << tx.priority << ", mixins " << tx.mixins << ", unlock_time " << tx.unlock_time << EOL;
+		args.GetReturnValue().Set(ret);
+	}
 
-		Handle<Array> array = Handle<Array>::Cast(obj->Get(String::NewFromUtf8(isolate, "destinations")));
-		for (uint32_t i = 0; i < array->Length(); i++) {
-			Handle<Array> destination = Handle<Array>::Cast(array->Get(i));
-			std::string amount(*v8::String::Utf8Value(destination->Get(0)->ToString()));
-			std::string address(*v8::String::Utf8Value(destination->Get(1)->ToString()));
-			XMRDest dest;
-			dest.address = address;
-			dest.amount = strToInt64(amount);
-			tx.destinations.push_back(dest);
-			// logstream << "destination" << i << ": amount " << dest.amount << ", address " << dest.address << EOL;
-			// logstream << "destination" << i << ": " << amount << EOL;
-			// logstream << "destination" << i << ": " << strToInt64(amount) << EOL;
+	void XMR::createUnsignedTransaction(const FunctionCallbackInfo<Value>& args) {
+		Isolate* isolate = args.GetIsolate();
+		XMR* xmr = ObjectWrap::Unwrap<XMR>(args.Holder());
+
+		if (args.Length() != 2 || !args[0]->IsObject() || !args[1]->IsBoolean()) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Required argument: Tx instance, bool optimized")));
+			return;
 		}
+
+		Local<Context> context = isolate->GetCurrentContext();
+		XMRTx tx = txFromObj(isolate, args[0]->ToObject(context).ToLocalChecked());
+		bool optimized = args[1]->BooleanValue();
  	
 		Local<Object> ret = Object::New(isolate);
 
@@ -475,6 +690,67 @@ namespace tools {
 		args.GetReturnValue().Set(ret);
 	}
 
+	/**
+	 * Plan a batch of payouts into one unsigned bundle. Payouts sharing a payment id (or having none)
+	 * and tx parameters are merged, XMR_PAYOUTS_PER_GROUP at a time, into as few transactions as possible,
+	 * inputs never repeat across them. Payouts of a group that cannot be created are retried one by one.
+	 * 
+	 * @param {Array} txs array of Tx instances, one per payout
+	 * @param {Boolean} optimized same as in createUnsignedTransaction
+	 * @return {Object} {unsigned, errors}, errors has one entry per payout: null if it made it into the bundle, error string otherwise; 
+	 *                  {error} if no transaction could be created
+	 */
+	void XMR::createUnsignedTransactions(const FunctionCallbackInfo<Value>& args) {
+		Isolate* isolate = args.GetIsolate();
+		XMR* xmr = ObjectWrap::Unwrap<XMR>(args.Holder());
+
+		if (args.Length() != 2 || !args[0]->IsArray() || !args[1]->IsBoolean()) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Required argument: array of Tx instances, bool optimized")));
+			return;
+		}
+
+		Local<Context> context = isolate->GetCurrentContext();
+		Handle<Array> array = Handle<Array>::Cast(args[0]);
+		bool optimized = args[1]->BooleanValue();
+
+		std::vector<XMRTx> txs;
+		for (uint32_t i = 0; i < array->Length(); i++) {
+			txs.push_back(txFromObj(isolate, array->Get(i)->ToObject(context).ToLocalChecked()));
+		}
+
+		Local<Object> ret = Object::New(isolate);
+
+		std::string data;
+		std::vector<std::string> errors;
+		std::string error = xmr->wallet->createUnsignedTransactions(data, txs, optimized, errors);
+
+		if (isError(error)) {
+			ret->Set(String::NewFromUtf8(isolate, "error"), String::NewFromUtf8(isolate, error.c_str()));
+		} else {
+			ret->Set(String::NewFromUtf8(isolate, "unsigned"), String::NewFromUtf8(isolate, data.c_str()));
+		}
+
+		Local<Array> errs = Array::New(isolate);
+		for (size_t i = 0; i < errors.size(); i++) {
+			if (isError(errors[i])) {
+				errs->Set(i, String::NewFromUtf8(isolate, errors[i].c_str()));
+			} else {
+				errs->Set(i, v8::Null(isolate));
+			}
+		}
+		ret->Set(String::NewFromUtf8(isolate, "errors"), errs);
+
+		args.GetReturnValue().Set(ret);
+	}
+
+	/**
+	 * Sign an unsigned bundle, or export key images for outputs of a view wallet.
+	 * 
+	 * @param {String} blob unsigned transactions or outputs
+	 * @return {Object} {signed} or {keyImages} on success; {error} otherwise, where error of a bundle is
+	 *                  the first failing transaction's and errors has one entry per transaction: null if
+	 *                  it was signed, error string otherwise
+	 */
 	void XMR::signTransaction(const FunctionCallbackInfo<Value>& args) {
 		Isolate* isolate = args.GetIsolate();
 		XMR* xmr = ObjectWrap::Unwrap<XMR>(args.Holder());
@@ -494,18 +770,33 @@ namespace tools {
 			error = std::string("Invalid data type ") + std::to_string(typ);
 			ret->Set(String::NewFromUtf8(isolate, "error"), String::NewFromUtf8(isolate, error.c_str()));
 		} else if (typ == XMR_DATA_TX_UNSIGNED || typ == XMR_DATA_TX_UNSIGNED_OPTIMIZED) {
-			error = xmr->wallet->signTransaction(data);
+			std::vector<std::string> errors;
+			error = xmr->wallet->signTransaction(data, errors);
 			if (isError(error)) {
 				ret->Set(String::NewFromUtf8(isolate, "error"), String::NewFromUtf8(isolate, error.c_str()));
+
+				// only once the bundle was parsed and signing started
+				if (!errors.empty()) {
+					Local<Array> errs = Array::New(isolate);
+					for (size_t i = 0; i < errors.size(); i++) {
+						if (isError(errors[i])) {
+							errs->Set(i, String::NewFromUtf8(isolate, errors[i].c_str()));
+						} else {
+							errs->Set(i, v8::Null(isolate));
+						}
+					}
+					ret->Set(String::NewFromUtf8(isolate, "errors"), errs);
+				}
 			} else {
 				ret->Set(String::NewFromUtf8(isolate, "signed"), String::NewFromUtf8(isolate, data.c_str()));
 			}
-		} else if (typ == XMR_DATA_OUTPUTS) {
-			error = xmr->wallet->importOutputs(data);
+		} else if (typ == XMR_DATA_OUTPUTS || typ == XMR_DATA_OUTPUTS_COMPACT || typ == XMR_DATA_OUTPUTS_DELTA) {
+			uint64_t start;
+			error = xmr->wallet->importOutputs(data, start);
 			if (isError(error)) {
 				ret->Set(String::NewFromUtf8(isolate, "error"), String::NewFromUtf8(isolate, error.c_str()));
 			} else {
-				error = xmr->wallet->exportKeyImages(data);
+				error = xmr->wallet->exportKeyImages(data, start);
 				if (isError(error)) {
 					ret->Set(String::NewFromUtf8(isolate, "error"), String::NewFromUtf8(isolate, error.c_str()));
 				} else {
@@ -556,7 +847,7 @@ namespace tools {
 			} else {
 				ret->Set(String::NewFromUtf8(isolate, "info"), txInfoToObj(isolate, info));
 			}
-		} else if (typ == XMR_DATA_KEY_IMAGES) {
+		} else if (typ == XMR_DATA_KEY_IMAGES || typ == XMR_DATA_KEY_IMAGES_DELTA) {
 			uint64_t spent, unspent;
 			error = xmr->wallet->importKeyImages(data, spent, unspent);
 			if (isError(error)) {
@@ -573,6 +864,29 @@ namespace tools {
 		args.GetReturnValue().Set(ret);
 	}
 
+	/**
+	 * Tests only: append outputs paying this wallet in fabricated txs, one per new block, the way refresh would
+	 * have found them. Key images are unknown, as for any view wallet output.
+	 * 
+	 * @param {Number} count number of outputs
+	 * @param {String} amount amount of each output
+	 */
+	void XMR::fabricateOutputs(const FunctionCallbackInfo<Value>& args) {
+		Isolate* isolate = args.GetIsolate();
+		XMR* xmr = ObjectWrap::Unwrap<XMR>(args.Holder());
+
+		if (args.Length() != 2 || !args[0]->IsNumber() || !args[1]->IsString()) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Required arguments: number count, string amount")));
+			return;
+		}
+
+		try {
+			xmr->wallet->fabricateOutputs(args[0]->Uint32Value(), strToInt64(std::string(*v8::String::Utf8Value(args[1]->ToString()))));
+		} catch (const std::exception &e) {
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, e.what())));
+		}
+	}
+
 	void XMR::transactions(const FunctionCallbackInfo<Value>& args) {
 		Isolate* isolate = args.GetIsolate();
 		XMR* xmr = ObjectWrap::Unwrap<XMR>(args.Holder());
@@ -726,6 +1040,32 @@ namespace tools {
 		return epee::string_encoding::base64_decode(data);
 	}
 
+	XMRTx XMR::txFromObj(Isolate* isolate, Local<Object> obj) {
+		XMRTx tx;
+		tx.priority = obj->Get(String::NewFromUtf8(isolate, "priority"))->Int32Value();
+		tx.mixins = obj->Get(String::NewFromUtf8(isolate, "mixins"))->Int32Value();
+		tx.unlock_time = obj->Get(String::NewFromUtf8(isolate, "unlock"))->Int32Value();
+
+		if (!obj->Get(String::NewFromUtf8(isolate, "paymentId"))->IsNullOrUndefined()) {
+			tx.payment_id = std::string(*v8::String::Utf8Value(obj->Get(String::NewFromUtf8(isolate, "paymentId"))->ToString()));
+		}
+
+		// logstream << "priority " << tx.priority << ", mixins " << tx.mixins << ", unlock_time " << tx.unlock_time << EOL;
+
+		Handle<Array> array = Handle<Array>::Cast(obj->Get(String::NewFromUtf8(isolate, "destinations")));
+		for (uint32_t i = 0; i < array->Length(); i++) {
+			Handle<Array> destination = Handle<Array>::Cast(array->Get(i));
+			std::string amount(*v8::String::Utf8Value(destination->Get(0)->ToString()));
+			std::string address(*v8::String::Utf8Value(destination->Get(1)->ToString()));
+			XMRDest dest;
+			dest.address = address;
+			dest.amount = strToInt64(amount);
+			tx.destinations.push_back(dest);
+		}
+
+		return tx;
+	}
+
 	bool XMR::isError(std::string &str) {
 		return str.size() > 0;
 		// return str.size() > 0 && memcmp(str.data(), "-", 1) == 0;
@@ -762,6 +1102,32 @@ namespace tools {
 		on_tx(false, txid);
 	}
 
+	void XMR::on_store_finished() {
+		// sends coalesce, storeFinished picks up however many jobs finished
+		if (storeAsync) {
+			uv_async_send(storeAsync);
+		}
+	}
+
+	void XMR::storeFinished(uv_async_t *handle) {
+		XMR* xmr = (XMR*)handle->data;
+		Isolate * isolate = Isolate::GetCurrent();
+		v8::HandleScope scope(isolate);
+
+		std::string error;
+		if (xmr->onStore.IsEmpty() || xmr->wallet->store_status(error)) {
+			// the next job is queued already, its own completion follows
+			return;
+		}
+
+		auto local = Local<Function>::New(isolate, xmr->onStore);
+		const unsigned argc = 1;
+		Local<Value> argv[argc] = { error.empty() ? (Local<Value>)v8::Undefined(isolate) : (Local<Value>)String::NewFromUtf8(isolate, error.c_str()) };
+
+		// no JS frame below a libuv callback, MakeCallback enters the wallet object's context
+		node::MakeCallback(isolate, xmr->handle(), local, argc, argv);
+	}
+
 	void XMR::on_tx(bool in, const crypto::hash &txid) {
 		Isolate * isolate = Isolate::GetCurrent();
 		auto local = Local<Function>::New(isolate, onTx);
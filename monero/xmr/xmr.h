@@ -1,5 +1,7 @@
 #include <node.h>
 #include <node_object_wrap.h>
+#include <uv.h>
+#include <set>
 #include <string>
 
 #include "xmrwallet.h"
@@ -25,9 +27,12 @@ namespace tools {
 		~XMR();
 
 		static void createIntegratedAddress(const FunctionCallbackInfo<Value>& args);
+		static void wipeSignerCache(const FunctionCallbackInfo<Value>& args);
 		static void openPaperWallet(const FunctionCallbackInfo<Value>& args);
 		static void openViewWallet(const FunctionCallbackInfo<Value>& args);
 		static void openViewWalletOffline(const FunctionCallbackInfo<Value>& args);
+		static void openViewWallets(const FunctionCallbackInfo<Value>& args);
+		static const char *openViewWalletError(int code);
 		static void setCallbacks(const FunctionCallbackInfo<Value>& args);
 		static void address(const FunctionCallbackInfo<Value>& args);
 		static void viewkey(const FunctionCallbackInfo<Value>& args);
@@ -35,8 +40,13 @@ namespace tools {
 		static void connect(const FunctionCallbackInfo<Value>& args);
 		static void refresh(const FunctionCallbackInfo<Value>& args);
 		static void refresh_and_store(const FunctionCallbackInfo<Value>& args);
+		static void refreshStats(const FunctionCallbackInfo<Value>& args);
 		static void close(const FunctionCallbackInfo<Value>& args);
 		static void store(const FunctionCallbackInfo<Value>& args);
+		static void storeStatus(const FunctionCallbackInfo<Value>& args);
+		static void keyStats(const FunctionCallbackInfo<Value>& args);
+		static void wipeDerivedKeys(const FunctionCallbackInfo<Value>& args);
+		static void setStorage(const FunctionCallbackInfo<Value>& args);
 		static void rescan(const FunctionCallbackInfo<Value>& args);
 		static void balances(const FunctionCallbackInfo<Value>& args);
 		static void height(const FunctionCallbackInfo<Value>& args);
@@ -46,21 +56,26 @@ namespace tools {
 
 		static void dataType(const FunctionCallbackInfo<Value>& args);
 		static void createUnsignedTransaction(const FunctionCallbackInfo<Value>& args);
+		static void createUnsignedTransactions(const FunctionCallbackInfo<Value>& args);
 		static void signTransaction(const FunctionCallbackInfo<Value>& args);
 		static void submitSignedTransaction(const FunctionCallbackInfo<Value>& args);
 		static void exportOutputs(const FunctionCallbackInfo<Value>& args);
 		static void importOutputs(const FunctionCallbackInfo<Value>& args);
 		static void exportKeyImages(const FunctionCallbackInfo<Value>& args);
 		static void importKeyImages(const FunctionCallbackInfo<Value>& args);
+		static void convertBlob(const FunctionCallbackInfo<Value>& args);
+		static void fabricateOutputs(const FunctionCallbackInfo<Value>& args);
 
 		static void transactions(const FunctionCallbackInfo<Value>& args);
 
 		static void New(const v8::FunctionCallbackInfo<v8::Value>& args);
 		static v8::Persistent<v8::Function> constructor;
+		static v8::Persistent<v8::FunctionTemplate> tmpl;
 		
 		static void testIt(const FunctionCallbackInfo<Value>& args);
 
 		static Local<Object> txInfoToObj(Isolate* isolate, XMRTxInfo tx);
+		static XMRTx txFromObj(Isolate* isolate, Local<Object> obj);
 
 		static uint64_t strToInt64(std::string str);
 		static std::string int64ToStr(uint64_t n);
@@ -73,8 +88,10 @@ namespace tools {
 
 		XMRWallet *wallet;
 
-		Persistent<Function> onTx, onBlock;
+		Persistent<Function> onTx, onBlock, onStore;
 		void on_tx(bool in, const crypto::hash &txid);
+		uv_async_t *storeAsync;			// on_store_finished comes from the store thread, onStore is called from the loop
+		static void storeFinished(uv_async_t *handle);
 
 		//----------------- i_wallet2_callback ---------------------
 		virtual void on_new_block(uint64_t height, const cryptonote::block& block);
@@ -82,5 +99,6 @@ namespace tools {
 		virtual void on_unconfirmed_money_received(uint64_t height, const crypto::hash &txid, const cryptonote::transaction& tx, uint64_t amount);
 		virtual void on_money_spent(uint64_t height, const crypto::hash &txid, const cryptonote::transaction& in_tx, uint64_t amount, const cryptonote::transaction& spend_tx);
 		virtual void on_skip_transaction(uint64_t height, const crypto::hash &txid, const cryptonote::transaction& tx);
+		virtual void on_store_finished();
 	};
 }
@@ -9,12 +9,105 @@
 #include "string_tools.h"
 #include "misc_log_ex.h"
 #include <boost/format.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include "common/util.h"
 
 using namespace cryptonote;
 
 namespace tools {
 
-	XMRWallet::XMRWallet(bool testnet) : wallet2(testnet) {
+	boost::mutex XMRTipWatcher::mutex;
+	std::map<std::string, std::pair<std::chrono::steady_clock::time_point, XMRChainTip>> XMRTipWatcher::tips;
+
+	bool XMRTipWatcher::get(const std::string &daemon, XMRChainTip &tip) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		auto it = tips.find(daemon);
+		if (it == tips.end() || std::chrono::steady_clock::now() - it->second.first > std::chrono::milliseconds(XMR_TIP_TTL_MS)) {
+			return false;
+		}
+		tip = it->second.second;
+		return true;
+	}
+
+	void XMRTipWatcher::put(const std::string &daemon, const XMRChainTip &tip) {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		tips[daemon] = std::make_pair(std::chrono::steady_clock::now(), tip);
+	}
+
+	static void wipeSecret(crypto::secret_key &key) {
+		volatile unsigned char *p = (volatile unsigned char *)&key;
+		for (size_t i = 0; i < sizeof(key); i++) {
+			p[i] = 0;
+		}
+	}
+
+	XMRSignerSession::~XMRSignerSession() {
+		wipeSecret(keys.m_spend_secret_key);
+		wipeSecret(keys.m_view_secret_key);
+	}
+
+	boost::mutex XMRSignerCache::mutex;
+	std::map<crypto::hash, std::shared_ptr<XMRSignerSession>> XMRSignerCache::sessions;
+
+	crypto::hash XMRSignerCache::id(const crypto::secret_key &spendkey, bool testnet) {
+		// sessions are looked up by a hash, raw spend keys never become map keys
+		char buf[sizeof(crypto::secret_key) + 1];
+		memcpy(buf, &spendkey, sizeof(crypto::secret_key));
+		buf[sizeof(crypto::secret_key)] = testnet ? 1 : 0;
+		crypto::hash hash;
+		crypto::cn_fast_hash(buf, sizeof(buf), hash);
+		wipeSecret(*reinterpret_cast<crypto::secret_key *>(buf));
+		return hash;
+	}
+
+	std::shared_ptr<XMRSignerSession> XMRSignerCache::get(const crypto::secret_key &spendkey, bool testnet) {
+		crypto::hash key = id(spendkey, testnet);
+		boost::lock_guard<boost::mutex> lock(mutex);
+		auto it = sessions.find(key);
+		if (it == sessions.end()) {
+			return std::shared_ptr<XMRSignerSession>();
+		}
+		it->second->used = std::chrono::steady_clock::now();
+		return it->second;
+	}
+
+	std::shared_ptr<XMRSignerSession> XMRSignerCache::put(const crypto::secret_key &spendkey, bool testnet, const cryptonote::account_keys &keys) {
+		crypto::hash key = id(spendkey, testnet);
+		std::shared_ptr<XMRSignerSession> session = std::make_shared<XMRSignerSession>();
+		session->keys = keys;
+		session->used = std::chrono::steady_clock::now();
+
+		boost::lock_guard<boost::mutex> lock(mutex);
+		sessions[key] = session;
+
+		// evict least recently used sessions, their keys are wiped once no wallet holds them anymore
+		while (sessions.size() > XMR_SIGNER_SESSIONS) {
+			auto oldest = sessions.begin();
+			for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+				if (it->second->used < oldest->second->used) {
+					oldest = it;
+				}
+			}
+			sessions.erase(oldest);
+		}
+		return session;
+	}
+
+	void XMRSignerCache::wipe() {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		for (auto &it: sessions) {
+			boost::lock_guard<boost::mutex> sessionLock(it.second->mutex);
+			wipeSecret(it.second->keys.m_spend_secret_key);
+			wipeSecret(it.second->keys.m_view_secret_key);
+			it.second->key_images.clear();
+			it.second->transfers.clear();
+		}
+		sessions.clear();
+	}
+
+	XMRWallet::XMRWallet(bool testnet) : wallet2(testnet), m_tip_known(false), m_refreshes(0), m_noop_refreshes(0), m_synced_outputs(0) {
 		std::string log_path = "wallet.log";
 		mlog_configure(log_path, false);
 		mlog_set_log_level(0);
@@ -40,6 +133,7 @@ namespace tools {
 
 	bool XMRWallet::openPaperWallet(const std::string &spendkey_str) {
 		clear();
+		m_session.reset();
 
 		crypto::secret_key spendkey;
 		cryptonote::blobdata spendkey_data;
@@ -47,8 +141,18 @@ namespace tools {
 			return false;
 		}
 		spendkey = *reinterpret_cast<const crypto::secret_key*>(spendkey_data.data());
+		wipeSecret(*reinterpret_cast<crypto::secret_key*>(&spendkey_data[0]));
 
-		crypto::secret_key retval = m_account.generate(spendkey, true, false);
+		// reuse keys derived by an earlier request for the same spend key
+		m_session = XMRSignerCache::get(spendkey, testnet());
+		if (m_session) {
+			boost::lock_guard<boost::mutex> lock(m_session->mutex);
+			m_account.create_from_keys(m_session->keys.m_account_address, m_session->keys.m_spend_secret_key, m_session->keys.m_view_secret_key);
+		} else {
+			m_account.generate(spendkey, true, false);
+			m_session = XMRSignerCache::put(spendkey, testnet(), m_account.get_keys());
+		}
+		wipeSecret(spendkey);
 		m_account_public_address = m_account.get_keys().m_account_address;
 		m_watch_only = false;
 
@@ -61,6 +165,7 @@ namespace tools {
 
 	int XMRWallet::openViewWallet(const std::string &address_string, const std::string &view_key_string) {
 		clear();
+		m_session.reset();
 		m_keys_file = address_string + ".keys";
 		m_wallet_file = address_string;
 
@@ -82,16 +187,34 @@ namespace tools {
 		m_watch_only = true;
 
 		boost::system::error_code ignored_ec;
-		if (boost::filesystem::exists(m_wallet_file, ignored_ec) || boost::filesystem::exists(m_keys_file, ignored_ec)) {
+		if (stored_keys_exist() || boost::filesystem::exists(m_wallet_file, ignored_ec)) {
+			// only what is definitely gone or unusable is started over, a failing disk or LMDB environment
+			// leaves the wallet as it is stored
 			try {
+				THROW_WALLET_EXCEPTION_IF(!stored_keys_exist(), error::file_not_found, m_keys_file);
 				if (load_keys(m_keys_file, "")) {
 					load(m_wallet_file, "");
 					return 0;
 				}
-			} catch (...) {
-				boost::filesystem::remove(m_wallet_file);
-				boost::filesystem::remove(m_keys_file);
+				LOG_ERROR("Keys of " << m_wallet_file << " don't decrypt, starting over");
+			} catch (const error::file_not_found &e) {
+				LOG_PRINT_L0("Stored " << m_wallet_file << " is incomplete, starting over: " << e.what());
+				remove_stored();
+			} catch (const error::wallet_files_doesnt_correspond &e) {
+				LOG_ERROR("Stored " << m_wallet_file << " is another wallet's, starting over: " << e.what());
+				remove_stored();
+			} catch (const error::wallet_state_corrupt &e) {
+				LOG_ERROR("Stored " << m_wallet_file << " is corrupt, starting over: " << e.what());
+				remove_stored();
+			} catch (const std::exception &e) {
+				LOG_ERROR("Failed to load " << m_wallet_file << ": " << e.what());
+				clear();
+				return -4;
 			}
+			clear();
+			m_account.create_from_viewkey(address, viewkey);
+			m_account_public_address = address;
+			m_watch_only = true;
 		}
 
 		if (!store_keys(m_keys_file, "", true)) {
@@ -108,8 +231,46 @@ namespace tools {
 		return 0;
 	}
 
+	std::vector<int> XMRWallet::openViewWallets(const std::vector<std::tuple<XMRWallet*, std::string, std::string>> &wallets) {
+		std::vector<int> codes(wallets.size());
+		auto open = [&wallets, &codes](size_t n) {
+			try {
+				codes[n] = std::get<0>(wallets[n])->openViewWallet(std::get<1>(wallets[n]), std::get<2>(wallets[n]));
+			} catch (const std::exception &e) {
+				LOG_ERROR("Failed to open " << std::get<1>(wallets[n]) << ": " << e.what());
+				codes[n] = -4;
+			}
+		};
+
+		// loading is mostly decryption and decoding, wallets in one LMDB container are read in parallel
+		size_t threads = std::min<size_t>(wallets.size(), tools::get_max_concurrency());
+		if (threads > 1) {
+			boost::asio::io_service ioservice;
+			boost::thread_group threadpool;
+			std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ioservice));
+			for (size_t i = 0; i < threads; i++) {
+				threadpool.create_thread(boost::bind(&boost::asio::io_service::run, &ioservice));
+			}
+
+			for (size_t n = 0; n < wallets.size(); ++n) {
+				ioservice.dispatch(std::bind(open, n));
+			}
+
+			work.reset();
+			while (!ioservice.stopped()) ioservice.poll();
+			threadpool.join_all();
+			ioservice.stop();
+		} else {
+			for (size_t n = 0; n < wallets.size(); ++n) {
+				open(n);
+			}
+		}
+		return codes;
+	}
+
 	int XMRWallet::openViewWalletOffline(const std::string &address_string, const std::string &view_key_string) {
 		clear();
+		m_session.reset();
 
 		bool has_payment_id;
 		cryptonote::account_public_address address;
@@ -159,14 +320,16 @@ namespace tools {
 		return this->deinit();
 	}
 
+	bool XMRWallet::clear() {
+		m_tip_known = false;
+		m_synced_outputs = 0;
+		m_synced_anchor = crypto::null_pkey;
+		return wallet2::clear();
+	}
+
 	bool XMRWallet::cleanup() {
 		disconnect();
-		if (!m_wallet_file.empty()) {
-			boost::filesystem::remove(m_wallet_file);
-		}
-		if (!m_keys_file.empty()) {
-			boost::filesystem::remove(m_keys_file);
-		}
+		remove_stored();
 		clear();
 		return true;
 	}
@@ -183,25 +346,14 @@ namespace tools {
 
 		try {
 			uint32_t type;
-			loadGZBase64StringType(type, data);
+			loadBlobStringType(type, data);
 			return type;
 		} catch (...) {
 			return -1;
 		}
 	}
 
-	std::string XMRWallet::createUnsignedTransaction(std::string &data, XMRTx& tx, bool optimized) {
-		try {
-			LOG_PRINT_L1("===== rescanning spent");
-			rescan_spent();
-			LOG_PRINT_L1("===== rescanning spent done");
-		} catch (...) {
-			LOG_PRINT_L1("===== rescanning spent ERROR");
-		}
-
-		std::vector<cryptonote::tx_destination_entry> dsts;
-		std::vector<uint8_t> extra;
-
+	std::string XMRWallet::parseTransaction(XMRTx &tx, std::vector<cryptonote::tx_destination_entry> &dsts, std::vector<uint8_t> &extra, std::string &payment_id_str) {
 		for (auto& dst: tx.destinations) {
 			
 			bool has_payment_id;
@@ -220,6 +372,7 @@ namespace tools {
 				if (!add_extra_nonce_to_tx_extra(extra, extra_nonce)) {
 					return "Failed to add short payment id to transaction: " + epee::string_tools::pod_to_hex(payment_id);
 				}
+				payment_id_str = epee::string_tools::pod_to_hex(payment_id);
 			}
 
 			cryptonote::tx_destination_entry de;
@@ -241,15 +394,19 @@ namespace tools {
 				if (!add_extra_nonce_to_tx_extra(extra, extra_nonce)) {
 					return "Failed to add short payment id to transaction: " + epee::string_tools::pod_to_hex(payment_id);
 				}
+				payment_id_str = epee::string_tools::pod_to_hex(payment_id);
 				// std::cout << "================ put payment_id in extras: " << epee::string_tools::pod_to_hex(payment_id) << " (" << tx.payment_id << ")\n";
 			} else {
 				return "Invalid payment_id";
 			}
 		}
 
-		std::vector<wallet2::pending_tx> ptx;
+		return "";
+	}
+
+	std::string XMRWallet::buildTransactions(XMRTx &tx, std::vector<cryptonote::tx_destination_entry> &dsts, std::vector<uint8_t> &extra, const std::unordered_set<size_t> &excluded, std::vector<wallet2::pending_tx> &ptx) {
 		try {
-			ptx = create_transactions_2(dsts, tx.mixins, tx.unlock_time, tx.priority, extra, true);
+			ptx = create_transactions_2(dsts, tx.mixins, tx.unlock_time, tx.priority, extra, true, excluded);
 		} catch (const tools::error::not_enough_money&) {
 			return "NOT_ENOUGH_FUNDS";
 		} catch (const tools::error::zero_destination&) {
@@ -284,6 +441,10 @@ namespace tools {
 			}
 		}
 
+		return "";
+	}
+
+	std::string XMRWallet::serializeUnsigned(std::vector<wallet2::pending_tx> &ptx, bool optimized, std::string &data) {
 		if (optimized) {
 			tools::xmr_from_view arch;
 
@@ -314,12 +475,12 @@ namespace tools {
 			for (size_t idx : indexes) {
 				const transfer_details& td = m_transfers[idx];
 				arch.idxs.push_back(idx);
-				arch.transfers.push_back(td);
+				arch.outputs.push_back(compactOutput(td));
 			}
 
 			// serialize
 			try {
-				data = saveGZBase64String(XMR_DATA_TX_UNSIGNED_OPTIMIZED, arch);
+				data = saveBlobString(XMR_DATA_TX_UNSIGNED_OPTIMIZED, arch);
 			} catch(...) {
 				return "Cannot serialize optimized unsigned tx";
 			}
@@ -328,7 +489,7 @@ namespace tools {
 			unsigned_tx_set txs;
 
 			try {
-				data = saveGZBase64String(XMR_DATA_TX_UNSIGNED, txs);
+				data = saveBlobString(XMR_DATA_TX_UNSIGNED, txs);
 			} catch(...) {
 				return "Cannot serialize unsigned tx";
 			}
@@ -337,6 +498,128 @@ namespace tools {
 		return "";
 	}
 
+	std::string XMRWallet::createUnsignedTransaction(std::string &data, XMRTx& tx, bool optimized) {
+		try {
+			LOG_PRINT_L1("===== rescanning spent");
+			rescan_spent();
+			LOG_PRINT_L1("===== rescanning spent done");
+		} catch (...) {
+			LOG_PRINT_L1("===== rescanning spent ERROR");
+		}
+
+		std::vector<cryptonote::tx_destination_entry> dsts;
+		std::vector<uint8_t> extra;
+		std::string payment_id;
+
+		std::string error = parseTransaction(tx, dsts, extra, payment_id);
+		if (!error.empty()) {
+			return error;
+		}
+
+		std::vector<wallet2::pending_tx> ptx;
+		error = buildTransactions(tx, dsts, extra, std::unordered_set<size_t>(), ptx);
+		if (!error.empty()) {
+			return error;
+		}
+
+		return serializeUnsigned(ptx, optimized, data);
+	}
+
+	std::string XMRWallet::createUnsignedTransactions(std::string &data, std::vector<XMRTx> &txs, bool optimized, std::vector<std::string> &errors) {
+		try {
+			LOG_PRINT_L1("===== rescanning spent");
+			rescan_spent();
+			LOG_PRINT_L1("===== rescanning spent done");
+		} catch (...) {
+			LOG_PRINT_L1("===== rescanning spent ERROR");
+		}
+
+		errors.assign(txs.size(), "");
+
+		// payouts with the same payment id (or none) and tx parameters are planned together, XMR_PAYOUTS_PER_GROUP
+		// at most: create_transactions_2 packs their destinations into as few transactions as size allows
+		struct PayoutGroup {
+			XMRTx params;
+			std::vector<cryptonote::tx_destination_entry> dsts;
+			std::vector<uint8_t> extra;
+			std::vector<size_t> members;
+		};
+		std::vector<PayoutGroup> groups;
+		std::map<std::string, size_t> groupIndexes;
+
+		for (size_t i = 0; i < txs.size(); i++) {
+			std::vector<cryptonote::tx_destination_entry> dsts;
+			std::vector<uint8_t> extra;
+			std::string payment_id;
+
+			std::string error = parseTransaction(txs[i], dsts, extra, payment_id);
+			if (!error.empty()) {
+				errors[i] = error;
+				continue;
+			}
+
+			std::string key = payment_id + ":" + std::to_string(txs[i].priority) + ":" + std::to_string(txs[i].mixins) + ":" + std::to_string(txs[i].unlock_time);
+			auto it = groupIndexes.find(key);
+			if (it == groupIndexes.end() || groups[it->second].members.size() >= XMR_PAYOUTS_PER_GROUP) {
+				groupIndexes[key] = groups.size();
+				groups.push_back(PayoutGroup());
+				groups.back().params = txs[i];
+				groups.back().extra = extra;
+			}
+
+			PayoutGroup &group = groups[groupIndexes[key]];
+			group.dsts.insert(group.dsts.end(), dsts.begin(), dsts.end());
+			group.members.push_back(i);
+		}
+
+		// groups are planned in queue order, each one only picking inputs no earlier one took
+		std::unordered_set<size_t> reserved;
+		std::vector<wallet2::pending_tx> ptx;
+		auto plan = [&](XMRTx &params, std::vector<cryptonote::tx_destination_entry> &dsts, std::vector<uint8_t> &extra) {
+			std::vector<wallet2::pending_tx> planned;
+			std::string error = buildTransactions(params, dsts, extra, reserved, planned);
+			for (wallet2::pending_tx &pend: planned) {
+				reserved.insert(pend.selected_transfers.begin(), pend.selected_transfers.end());
+				ptx.push_back(pend);
+			}
+			return error;
+		};
+
+		for (PayoutGroup &group: groups) {
+			std::string error = plan(group.params, group.dsts, group.extra);
+			if (error.empty()) {
+				continue;
+			}
+			if (group.members.size() == 1) {
+				errors[group.members.front()] = error;
+				continue;
+			}
+
+			// one payout failing the group (bad amount, not enough money left) must not fail the others
+			LOG_PRINT_L1("Payout group of " << group.members.size() << " failed, planning payouts one by one: " << error);
+			for (size_t i: group.members) {
+				std::vector<cryptonote::tx_destination_entry> dsts;
+				std::vector<uint8_t> extra;
+				std::string payment_id;
+				parseTransaction(txs[i], dsts, extra, payment_id);
+				errors[i] = plan(txs[i], dsts, extra);
+			}
+		}
+
+		LOG_PRINT_L1("Planned " << txs.size() << " payouts into " << ptx.size() << " transactions");
+
+		if (ptx.empty()) {
+			for (const std::string &error: errors) {
+				if (!error.empty()) {
+					return error;
+				}
+			}
+			return "No payouts to create transactions for";
+		}
+
+		return serializeUnsigned(ptx, optimized, data);
+	}
+
 	void XMRWallet::print_pid(std::string msg, std::vector<uint8_t> &extra) {
 		std::vector<tx_extra_field> tx_extra_fields;
 		if (parse_tx_extra(extra, tx_extra_fields))
@@ -375,7 +658,7 @@ namespace tools {
 	}
 
 	
-	std::string XMRWallet::signTransaction(std::string &data) {
+	std::string XMRWallet::signTransaction(std::string &data, std::vector<std::string> &errors) {
 		unsigned_tx_set exported_txs;
 		std::vector<size_t> keyIdxs;
 		std::vector<uint8_t> archextra;
@@ -389,71 +672,103 @@ namespace tools {
 			xmr_from_view arch;
 
 			try {
-				loadGZBase64String(type, arch, data);
+				loadBlobString(type, arch, data);
 			} catch (...) {
 				return "Failed to parse optimized unsigned tx data";
 			}
 
+			// current blobs carry compact outputs, legacy ones full transfers
+			try {
+				for (const xmr_output &out: arch.outputs) {
+					arch.transfers.push_back(expandOutput(out));
+				}
+			} catch (const std::exception &e) {
+				return e.what();
+			}
+
 			// import outputs
 			if (arch.transfers.size() > 0) {
-				size_t max_idx = arch.idxs.back();
-
-				// placeholder transfer
-				transfer_details tmp;
+				if (arch.idxs.size() != arch.transfers.size()) {
+					return "Optimized unsigned tx data has " + std::to_string(arch.idxs.size()) + " indexes for " + std::to_string(arch.transfers.size()) + " outputs";
+				}
 
-				// fill m_transfers up to biggest element
-				m_transfers.clear();
-				for (size_t i = 0; i <= max_idx; i++) {
-					m_transfers.push_back(tmp);
+				// calculate key images for imported outputs, one contiguous range of outputs per worker;
+				// workers only read the session memo, it's held locked until new key images are added to it
+				boost::unique_lock<boost::mutex> sessionLock;
+				if (m_session) {
+					sessionLock = boost::unique_lock<boost::mutex>(m_session->mutex);
 				}
 
-				for (size_t i = 0; i < arch.idxs.size(); i++) {
-					size_t idx = arch.idxs[i];
-					transfer_details &td = arch.transfers[i];
+				size_t count = arch.transfers.size();
+				size_t threads = std::min<size_t>((count + KEY_IMAGES_PER_THREAD_MIN - 1) / KEY_IMAGES_PER_THREAD_MIN, tools::get_max_concurrency());
+				if (threads > 1) {
+					size_t chunk = (count + threads - 1) / threads;
+					std::vector<std::string> errors(threads);
+
+					boost::asio::io_service ioservice;
+					boost::thread_group threadpool;
+					std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ioservice));
+					for (size_t i = 0; i < threads; i++) {
+						threadpool.create_thread(boost::bind(&boost::asio::io_service::run, &ioservice));
+					}
 
-					// reset placeholder transfer with actual one
-					m_transfers[idx] = td;
+					for (size_t i = 0; i < threads; i++) {
+						ioservice.dispatch(boost::bind(&XMRWallet::keyImagesRound, this, i * chunk, std::min(count, (i + 1) * chunk), std::ref(arch.transfers), std::ref(errors[i])));
+					}
 
-					// calculate key images for imported output
-					try {
-						cryptonote::keypair in_ephemeral;
-						std::vector<tx_extra_field> tx_extra_fields;
-						tx_extra_pub_key pub_key_field;
+					work.reset();
+					while (!ioservice.stopped()) ioservice.poll();
+					threadpool.join_all();
+					ioservice.stop();
 
-						THROW_WALLET_EXCEPTION_IF(td.m_tx.vout.empty(), error::wallet_internal_error, "tx with no outputs at index " + boost::lexical_cast<std::string>(i));
-						THROW_WALLET_EXCEPTION_IF(!parse_tx_extra(td.m_tx.extra, tx_extra_fields), error::wallet_internal_error,
-						"Transaction extra has unsupported format at index " + boost::lexical_cast<std::string>(i));
-						crypto::public_key tx_pub_key = get_tx_pub_key_from_received_outs(td);
+					for (const std::string &error: errors) {
+						if (!error.empty()) {
+							return error;
+						}
+					}
+				} else {
+					std::string error;
+					keyImagesRound(0, count, arch.transfers, error);
+					if (!error.empty()) {
+						return error;
+					}
+				}
 
-						cryptonote::generate_key_image_helper(m_account.get_keys(), tx_pub_key, td.m_internal_output_index, in_ephemeral, td.m_key_image);
-						td.m_key_image_known = true;
-						THROW_WALLET_EXCEPTION_IF(in_ephemeral.pub != boost::get<cryptonote::txout_to_key>(td.m_tx.vout[td.m_internal_output_index].target).key,
-						error::wallet_internal_error, "key_image generated ephemeral public key not matched with output_key at index " + boost::lexical_cast<std::string>(i));
+				if (m_session) {
+					rememberKeyImages(arch.transfers);
+					sessionLock.unlock();
+				}
 
-						m_key_images[td.m_key_image] = idx;
-						m_pub_keys[td.get_public_key()] = idx;
+				// signer only keeps the imported transfers, densely and in export order: position i holds
+				// view wallet index arch.idxs[i], so memory scales with exported outputs, not with the highest index
+				m_transfers.swap(arch.transfers);
+				m_key_images.clear();
+				m_pub_keys.clear();
+				for (size_t i = 0; i < m_transfers.size(); i++) {
+					const transfer_details &td = m_transfers[i];
 
-						// save it to return later
-						keyImages.push_back(td.m_key_image);
+					m_key_images[td.m_key_image] = i;
+					m_pub_keys[td.get_public_key()] = i;
 
-					} catch (error::wallet_internal_error &e) {
-						return e.what();
-					}
+					// save it to return later
+					keyImages.push_back(td.m_key_image);
 				}
 
+				// m_transfers was replaced above, resync indexes and balance totals
+				rebuild_indexes();
+
 				LOG_ERROR(std::string("=======<<<<<<< going to import ") + std::to_string(arch.idxs.size()) + " outputs & export " + std::to_string(keyImages.size()) + " key images");
 
 				keyIdxs = arch.idxs;
 			}
 
-			// just to keep standard implementation of sign_tx in place
+			// selected_transfers keep view wallet indexes, signing itself only needs the sources
 			exported_txs.txes = arch.txs;
-			exported_txs.transfers = m_transfers; 
 
 		} else if (type == XMR_DATA_TX_UNSIGNED) {
 
 			try {
-				loadGZBase64String(type, exported_txs, data);
+				loadBlobString(type, exported_txs, data);
 			} catch (...) {
 				return "Failed to parse unsigned tx data";
 			}
@@ -463,68 +778,51 @@ namespace tools {
 		}
 
 
-		// sign (sign_tx)
-		std::vector<pending_tx> ptxs;
-		try {
-			for (size_t n = 0; n < exported_txs.txes.size(); ++n) {
-				const tools::wallet2::tx_construction_data &sd = exported_txs.txes[n];
-				LOG_PRINT_L1(" " << (n+1) << ": " << sd.sources.size() << " inputs, ring size " << sd.sources[0].outputs.size());
-				ptxs.push_back(pending_tx());
-				tools::wallet2::pending_tx &ptx = ptxs.back();
-				crypto::secret_key tx_key;
-				bool r = cryptonote::construct_tx_and_get_tx_key(m_account.get_keys(), sd.sources, sd.splitted_dsts, sd.extra, ptx.tx, sd.unlock_time, tx_key, sd.use_rct);
-				THROW_WALLET_EXCEPTION_IF(!r, error::tx_not_constructed, sd.sources, sd.splitted_dsts, sd.unlock_time, m_testnet);
-				// we don't test tx size, because we don't know the current limit, due to not having a blockchain,
-				// and it's a bit pointless to fail there anyway, since it'd be a (good) guess only. We sign anyway,
-				// and if we really go over limit, the daemon will reject when it gets submitted. Chances are it's
-				// OK anyway since it was generated in the first place, and rerolling should be within a few bytes.
-
-				// normally, the tx keys are saved in commit_tx, when the tx is actually sent to the daemon.
-				// we can't do that here since the tx will be sent from the compromised wallet, which we don't want
-				// to see that info, so we save it here
-				if (store_tx_info()) {
-					const crypto::hash txid = get_transaction_hash(ptx.tx);
-					m_tx_keys.insert(std::make_pair(txid, tx_key));
-				}
+		// sign (sign_tx), each tx is constructed on its own worker, results keep input order
+		size_t count = exported_txs.txes.size();
+		std::vector<pending_tx> ptxs(count);
+		errors.assign(count, "");
 
-				std::string key_images;
-				bool all_are_txin_to_key = std::all_of(ptx.tx.vin.begin(), ptx.tx.vin.end(), [&](const txin_v& s_e) -> bool {
-					CHECKED_GET_SPECIFIC_VARIANT(s_e, const txin_to_key, in, false);
-					key_images += boost::to_string(in.k_image) + " ";
-					return true;
-				});
-				THROW_WALLET_EXCEPTION_IF(!all_are_txin_to_key, error::unexpected_txin_type, ptx.tx);
-
-				ptx.key_images = key_images;
-				ptx.fee = 0;
-				for (const auto &i: sd.sources) ptx.fee += i.amount;
-				for (const auto &i: sd.splitted_dsts) ptx.fee -= i.amount;
-				ptx.dust = 0;
-				ptx.dust_added_to_fee = false;
-				ptx.change_dts = sd.change_dts;
-				ptx.selected_transfers = sd.selected_transfers;
-				ptx.tx_key = tx_key;
-				// std::cout << "================ tx_key: " << epee::string_tools::pod_to_hex(tx_key) << "\n";
-				// ptx.tx_key = rct::rct2sk(rct::identity()); // don't send it back to the untrusted view wallet
-				ptx.dests = sd.dests;
-				ptx.construction_data = sd;
-
-				// crypto::hash8 payment_id = get_short_payment_id(ptx);
-				// if (payment_id != null_hash8) {
-					// std::cout << "================ payment_id in signing: " << epee::string_tools::pod_to_hex(payment_id) << "\n";
-				// }
+		size_t threads = std::min<size_t>(count, tools::get_max_concurrency());
+		if (threads > 1) {
+			boost::asio::io_service ioservice;
+			boost::thread_group threadpool;
+			std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ioservice));
+			for (size_t i = 0; i < threads; i++) {
+				threadpool.create_thread(boost::bind(&boost::asio::io_service::run, &ioservice));
+			}
+
+			for (size_t n = 0; n < count; ++n) {
+				ioservice.dispatch(boost::bind(&XMRWallet::signTransactionRound, this, n, std::cref(exported_txs.txes[n]), std::ref(ptxs[n]), std::ref(errors[n])));
+			}
+
+			work.reset();
+			while (!ioservice.stopped()) ioservice.poll();
+			threadpool.join_all();
+			ioservice.stop();
+		} else {
+			for (size_t n = 0; n < count; ++n) {
+				signTransactionRound(n, exported_txs.txes[n], ptxs[n], errors[n]);
+			}
+		}
+
+		// errors of every tx are in errors, the one a sequential signing loop would have stopped at is returned
+		for (size_t n = 0; n < count; ++n) {
+			if (!errors[n].empty()) {
+				return errors[n];
+			}
+		}
+
+		// normally, the tx keys are saved in commit_tx, when the tx is actually sent to the daemon.
+		// we can't do that here since the tx will be sent from the compromised wallet, which we don't want
+		// to see that info, so we save it here
+		if (store_tx_info()) {
+			for (const pending_tx &ptx: ptxs) {
+				add_tx_key(get_transaction_hash(ptx.tx), ptx.tx_key);
 			}
-		} catch (const error::tx_not_constructed&) {
-			return "Failed to construct tx in cryptonote";
-		} catch(const std::runtime_error &e) {
-			return std::string("Runtime error when signing transaction: ") + e.what();
-		} catch(const std::exception &e) {
-			return std::string("Exception when signing transaction: ") + e.what();
-		} catch (...) {
-			return "Unhandled exception"; 
 		}
 
-		if (keyImages.size() > 0) {
+		if (type == XMR_DATA_TX_UNSIGNED_OPTIMIZED) {
 			xmr_from_spend arch;
 
 			arch.txs = ptxs;
@@ -532,7 +830,7 @@ namespace tools {
 			arch.key_images = keyImages;
 
 			try {
-				data = saveGZBase64String(XMR_DATA_TX_SIGNED_OPTIMIZED, arch);
+				data = saveBlobString(XMR_DATA_TX_SIGNED_OPTIMIZED, arch);
 				return "";
 			} catch(...) {
 				return "Failed to serialize optimized signed tx";
@@ -551,7 +849,7 @@ namespace tools {
 			}
 
 			try {
-				data = saveGZBase64String(XMR_DATA_TX_SIGNED, signed_txes);
+				data = saveBlobString(XMR_DATA_TX_SIGNED, signed_txes);
 				return "";
 			} catch(...) {
 				return "Failed to serialize signed tx";
@@ -559,6 +857,92 @@ namespace tools {
 		}
 	}
 	
+	void XMRWallet::rememberKeyImages(const std::vector<transfer_details> &transfers, size_t start) {
+		if (m_session->key_images.size() + transfers.size() - start > XMR_SIGNER_KEY_IMAGES) {
+			m_session->key_images.clear();
+		}
+		for (size_t i = start; i < transfers.size(); i++) {
+			const transfer_details &td = transfers[i];
+			if (td.m_key_image_known) {
+				m_session->key_images[td.get_public_key()] = td.m_key_image;
+			}
+		}
+	}
+
+	void XMRWallet::keyImagesRound(size_t begin, size_t end, std::vector<transfer_details> &transfers, std::string &error) {
+		try {
+			for (size_t i = begin; i < end; i++) {
+				transfer_details &td = transfers[i];
+
+				cryptonote::keypair in_ephemeral;
+				std::vector<tx_extra_field> tx_extra_fields;
+
+				THROW_WALLET_EXCEPTION_IF(td.m_tx->vout.size() <= td.m_internal_output_index, error::wallet_internal_error, "tx with no outputs at index " + boost::lexical_cast<std::string>(i));
+
+				if (m_session) {
+					auto it = m_session->key_images.find(td.get_public_key());
+					if (it != m_session->key_images.end()) {
+						td.m_key_image = it->second;
+						td.m_key_image_known = true;
+						continue;
+					}
+				}
+
+				THROW_WALLET_EXCEPTION_IF(!parse_tx_extra(td.m_tx->extra, tx_extra_fields), error::wallet_internal_error,
+				"Transaction extra has unsupported format at index " + boost::lexical_cast<std::string>(i));
+				crypto::public_key tx_pub_key = get_tx_pub_key_from_received_outs(td);
+
+				cryptonote::generate_key_image_helper(m_account.get_keys(), tx_pub_key, td.m_internal_output_index, in_ephemeral, td.m_key_image);
+				td.m_key_image_known = true;
+				THROW_WALLET_EXCEPTION_IF(in_ephemeral.pub != boost::get<cryptonote::txout_to_key>(td.m_tx->vout[td.m_internal_output_index].target).key,
+				error::wallet_internal_error, "key_image generated ephemeral public key not matched with output_key at index " + boost::lexical_cast<std::string>(i));
+			}
+		} catch (const std::exception &e) {
+			error = e.what();
+		}
+	}
+
+	void XMRWallet::signTransactionRound(size_t n, const tools::wallet2::tx_construction_data &sd, pending_tx &ptx, std::string &error) {
+		try {
+			LOG_PRINT_L1(" " << (n+1) << ": " << sd.sources.size() << " inputs, ring size " << sd.sources[0].outputs.size());
+			crypto::secret_key tx_key;
+			bool r = cryptonote::construct_tx_and_get_tx_key(m_account.get_keys(), sd.sources, sd.splitted_dsts, sd.extra, ptx.tx, sd.unlock_time, tx_key, sd.use_rct);
+			THROW_WALLET_EXCEPTION_IF(!r, error::tx_not_constructed, sd.sources, sd.splitted_dsts, sd.unlock_time, m_testnet);
+			// we don't test tx size, because we don't know the current limit, due to not having a blockchain,
+			// and it's a bit pointless to fail there anyway, since it'd be a (good) guess only. We sign anyway,
+			// and if we really go over limit, the daemon will reject when it gets submitted. Chances are it's
+			// OK anyway since it was generated in the first place, and rerolling should be within a few bytes.
+
+			std::string key_images;
+			bool all_are_txin_to_key = std::all_of(ptx.tx.vin.begin(), ptx.tx.vin.end(), [&](const txin_v& s_e) -> bool {
+				CHECKED_GET_SPECIFIC_VARIANT(s_e, const txin_to_key, in, false);
+				key_images += boost::to_string(in.k_image) + " ";
+				return true;
+			});
+			THROW_WALLET_EXCEPTION_IF(!all_are_txin_to_key, error::unexpected_txin_type, ptx.tx);
+
+			ptx.key_images = key_images;
+			ptx.fee = 0;
+			for (const auto &i: sd.sources) ptx.fee += i.amount;
+			for (const auto &i: sd.splitted_dsts) ptx.fee -= i.amount;
+			ptx.dust = 0;
+			ptx.dust_added_to_fee = false;
+			ptx.change_dts = sd.change_dts;
+			ptx.selected_transfers = sd.selected_transfers;
+			ptx.tx_key = tx_key;
+			ptx.dests = sd.dests;
+			ptx.construction_data = sd;
+		} catch (const error::tx_not_constructed&) {
+			error = "Failed to construct tx in cryptonote";
+		} catch(const std::runtime_error &e) {
+			error = std::string("Runtime error when signing transaction: ") + e.what();
+		} catch(const std::exception &e) {
+			error = std::string("Exception when signing transaction: ") + e.what();
+		} catch (...) {
+			error = "Unhandled exception"; 
+		}
+	}
+
 	std::string XMRWallet::submitSignedTransaction(std::string &data, XMRTxInfo &info) {
 		std::vector<tools::wallet2::pending_tx> ptx;
 
@@ -569,23 +953,22 @@ namespace tools {
 			xmr_from_spend arch;
 
 			try {
-				loadGZBase64String(type, arch, data);
+				loadBlobString(type, arch, data);
 			} catch (...) {
 				return "Failed to parse optimized signed tx data";
 			}
 			
-			for (size_t i = 0; i < arch.idxs.size(); ++i) {
-				size_t idx = arch.idxs[i];
-				crypto::key_image key_image = arch.key_images[i];
-
-				transfer_details &td = m_transfers[idx];
-				if (td.m_key_image_known && td.m_key_image != key_image) {
-					LOG_PRINT_L0("WARNING: imported key image differs from previously known key image at index " << i << ": trusting imported one");
+			if (arch.key_images.size() != arch.idxs.size()) {
+				return "Optimized signed tx data has " + std::to_string(arch.key_images.size()) + " key images for " + std::to_string(arch.idxs.size()) + " indexes";
+			}
+			for (size_t idx: arch.idxs) {
+				if (idx >= m_transfers.size()) {
+					return "Key image returned for unknown output " + std::to_string(idx);
 				}
-				td.m_key_image = key_image;
-				m_key_images[key_image] = idx;
-				td.m_key_image_known = true;
-				m_pub_keys[td.get_public_key()] = idx;
+			}
+
+			for (size_t i = 0; i < arch.idxs.size(); ++i) {
+				set_key_image(arch.idxs[i], arch.key_images[i]);
 			}
 
 			ptx = arch.txs;
@@ -594,7 +977,7 @@ namespace tools {
 
 			signed_tx_set signed_txs;
 			try {
-				loadGZBase64String(type, signed_txs, data);
+				loadBlobString(type, signed_txs, data);
 			} catch (...) {
 				return "Failed to parse optimized signed tx data";
 			}
@@ -605,14 +988,7 @@ namespace tools {
 			}
 
 			for (size_t i = 0; i < signed_txs.key_images.size(); ++i) {
-				transfer_details &td = m_transfers[i];
-				if (td.m_key_image_known && td.m_key_image != signed_txs.key_images[i]) {
-					LOG_PRINT_L0("WARNING: imported key image differs from previously known key image at index " << i << ": trusting imported one");
-				}
-				td.m_key_image = signed_txs.key_images[i];
-				m_key_images[m_transfers[i].m_key_image] = i;
-				td.m_key_image_known = true;
-				m_pub_keys[m_transfers[i].get_public_key()] = i;
+				set_key_image(i, signed_txs.key_images[i]);
 			}
 
 			ptx = signed_txs.ptx;
@@ -660,10 +1036,32 @@ namespace tools {
 		return "";
 	}
 
-	std::string XMRWallet::exportOutputs(std::string &outputs) {
+	std::string XMRWallet::exportOutputs(std::string &outputs, bool incremental) {
 		try {
-			std::vector<tools::wallet2::transfer_details> outs = export_outputs();
-			outputs = saveGZBase64String(XMR_DATA_OUTPUTS, outs);
+			// incremental export only ships outputs past the last key image import, unless a reorg
+			// replaced any of the already synced ones: then everything goes again
+			uint64_t start = 0;
+			if (incremental && m_synced_outputs > 0 && m_synced_outputs <= m_transfers.size() && m_transfers[m_synced_outputs - 1].get_public_key() == m_synced_anchor) {
+				start = m_synced_outputs;
+			}
+
+			if (start == 0) {
+				xmr_outputs outs;
+				for (const transfer_details &td: m_transfers) {
+					outs.outputs.push_back(compactOutput(td));
+				}
+				outputs = saveBlobString(XMR_DATA_OUTPUTS_COMPACT, outs);
+				return "";
+			}
+
+			// nothing new since the last import is still a delta, just an empty one
+			xmr_outputs_delta delta;
+			delta.start = start;
+			delta.anchor = m_synced_anchor;
+			for (size_t i = start; i < m_transfers.size(); i++) {
+				delta.outputs.push_back(compactOutput(m_transfers[i]));
+			}
+			outputs = saveBlobString(XMR_DATA_OUTPUTS_DELTA, delta);
 			return "";
 		
 		} catch (const std::exception &e) {
@@ -673,14 +1071,54 @@ namespace tools {
 		}
 	}
 
-	std::string XMRWallet::importOutputs(std::string &data) {
+	std::string XMRWallet::importOutputs(std::string &data, uint64_t &start) {
 		try {
-			uint32_t type;
+			uint32_t type = dataType(data);
 			std::vector<tools::wallet2::transfer_details> outputs;
+			start = 0;
 			try {
-				loadGZBase64String(type, outputs, data);
+				if (type == XMR_DATA_OUTPUTS) {
+					loadBlobString(type, outputs, data);
+				} else if (type == XMR_DATA_OUTPUTS_COMPACT) {
+					xmr_outputs outs;
+					loadBlobString(type, outs, data);
+					for (const xmr_output &out: outs.outputs) {
+						outputs.push_back(expandOutput(out));
+					}
+				} else if (type == XMR_DATA_OUTPUTS_DELTA) {
+					xmr_outputs_delta delta;
+					loadBlobString(type, delta, data);
+
+					// a signer reopened for this request starts empty, outputs it synced before are in its session
+					if (m_session && delta.start > m_transfers.size()) {
+						{
+							boost::lock_guard<boost::mutex> lock(m_session->mutex);
+							m_transfers = m_session->transfers;
+						}
+						m_key_images.clear();
+						m_pub_keys.clear();
+						for (size_t i = 0; i < m_transfers.size(); i++) {
+							m_key_images[m_transfers[i].m_key_image] = i;
+							m_pub_keys[m_transfers[i].get_public_key()] = i;
+						}
+						rebuild_indexes();
+					}
 
-				if (type != XMR_DATA_OUTPUTS) {
+					// signer must have exactly the outputs the view wallet synced before, otherwise a full export is needed
+					if (delta.start == 0 || delta.start > m_transfers.size()) {
+						return "Outputs delta starts at " + std::to_string(delta.start) + ", but signer only has " + std::to_string(m_transfers.size()) + " outputs, full export required";
+					}
+					const transfer_details &td = m_transfers[delta.start - 1];
+					if (td.get_public_key() != delta.anchor) {
+						return "Outputs delta doesn't match signer outputs, full export required";
+					}
+
+					start = delta.start;
+					outputs = delta.transfers;
+					for (const xmr_output &out: delta.outputs) {
+						outputs.push_back(expandOutput(out));
+					}
+				} else {
 					throw std::logic_error("Bad data type in importOutputs");
 				}
 			} catch (const std::exception &e) {
@@ -689,7 +1127,15 @@ namespace tools {
 				return "Failed to import outputs";
 			}
 			
-			import_outputs(outputs);
+			if (m_session) {
+				boost::lock_guard<boost::mutex> lock(m_session->mutex);
+				import_outputs(outputs, start, &m_session->key_images);
+				rememberKeyImages(m_transfers, start);
+				m_session->transfers.resize(std::min<size_t>(start, m_session->transfers.size()));
+				m_session->transfers.insert(m_session->transfers.end(), m_transfers.begin() + m_session->transfers.size(), m_transfers.end());
+			} else {
+				import_outputs(outputs, start);
+			}
 			return "";
 	
 		} catch (const std::exception &e) {
@@ -699,11 +1145,22 @@ namespace tools {
 		}
 	}
 
-	std::string XMRWallet::exportKeyImages(std::string &images) {
+	std::string XMRWallet::exportKeyImages(std::string &images, uint64_t start) {
 
 		try {
-			std::vector<std::pair<crypto::key_image, crypto::signature>> ski = export_key_images();
-			images = saveGZBase64String(XMR_DATA_KEY_IMAGES, ski);
+			std::vector<std::pair<crypto::key_image, crypto::signature>> ski = export_key_images(start);
+			if (start == 0) {
+				images = saveBlobString(XMR_DATA_KEY_IMAGES, ski);
+				return "";
+			}
+
+			xmr_kis_delta delta;
+			delta.start = start;
+			for (const auto &i: ski) {
+				delta.key_images.push_back(i.first);
+				delta.signatures.push_back(i.second);
+			}
+			images = saveBlobString(XMR_DATA_KEY_IMAGES_DELTA, delta);
 			return "";
 		
 		} catch (const std::exception &e) {
@@ -715,19 +1172,42 @@ namespace tools {
 
 	std::string XMRWallet::importKeyImages(std::string &data, uint64_t &spent, uint64_t &unspent) {
 		try {
-			uint32_t type;
+			uint32_t type = dataType(data);
+			uint64_t start = 0;
 			std::vector<std::pair<crypto::key_image, crypto::signature>> ski;
 			try {
-				loadGZBase64String(type, ski, data);
+				if (type == XMR_DATA_KEY_IMAGES) {
+					loadBlobString(type, ski, data);
+				} else if (type == XMR_DATA_KEY_IMAGES_DELTA) {
+					xmr_kis_delta delta;
+					loadBlobString(type, delta, data);
+
+					if (delta.key_images.size() != delta.signatures.size()) {
+						return "Key images delta is malformed";
+					}
+					start = delta.start;
+					for (size_t i = 0; i < delta.key_images.size(); i++) {
+						ski.push_back(std::make_pair(delta.key_images[i], delta.signatures[i]));
+					}
+				} else {
+					throw std::logic_error("Bad data type in importKeyImages");
+				}
 
-				if (type != XMR_DATA_KEY_IMAGES) {
-					throw std::logic_error("Bad data type in importOutputs");
+				// nothing new since the last sync, the watermark stays where it is
+				if (type == XMR_DATA_KEY_IMAGES_DELTA && ski.empty()) {
+					spent = 0;
+					unspent = 0;
+					return "";
 				}
 
-				if (import_key_images(ski, spent, unspent) == 0) {
+				if (import_key_images(ski, spent, unspent, start) == 0) {
 					return "Failed to import key images";
 				}
 
+				// acknowledge outputs the signer has seen, next incremental export starts after them
+				m_synced_outputs = start + ski.size();
+				m_synced_anchor = m_transfers[m_synced_outputs - 1].get_public_key();
+
 				return "";
 
 			} catch (const std::exception &e) {
@@ -743,6 +1223,146 @@ namespace tools {
 		}
 	}
 
+	void XMRWallet::fabricateOutputs(size_t count, uint64_t amount) {
+		const cryptonote::account_public_address &address = m_account.get_keys().m_account_address;
+		if (m_blockchain.empty()) {
+			cryptonote::block b;
+			generate_genesis(b);
+			m_blockchain.push_back(get_block_hash(b));
+		}
+		for (size_t i = 0; i < count; i++) {
+			// output 0 of a tx to this wallet, its key derived the way a sender would
+			cryptonote::keypair txkey = cryptonote::keypair::generate();
+			crypto::key_derivation derivation;
+			crypto::public_key key;
+			THROW_WALLET_EXCEPTION_IF(!crypto::generate_key_derivation(address.m_view_public_key, txkey.sec, derivation), error::wallet_internal_error, "Failed to generate key derivation");
+			THROW_WALLET_EXCEPTION_IF(!crypto::derive_public_key(derivation, 0, address.m_spend_public_key, key), error::wallet_internal_error, "Failed to derive output key");
+
+			std::shared_ptr<cryptonote::transaction_prefix> tx = std::make_shared<cryptonote::transaction_prefix>();
+			add_tx_pub_key_to_extra(tx->extra, txkey.pub);
+			tx->vout.resize(1);
+			tx->vout[0].target = txout_to_key(key);
+
+			m_blockchain.push_back(crypto::rand<crypto::hash>());
+
+			transfer_details td = AUTO_VAL_INIT(td);
+			td.m_block_height = m_blockchain.size() - 1;
+			td.m_txid = crypto::rand<crypto::hash>();
+			td.m_internal_output_index = 0;
+			td.m_global_output_index = m_transfers.size();
+			td.set_tx(tx);
+			td.m_mask = rct::identity();
+			td.m_amount = amount;
+			td.m_rct = true;
+
+			m_pub_keys[key] = m_transfers.size();
+			m_transfers.push_back(td);
+		}
+		m_local_bc_height = m_blockchain.size();
+		rebuild_indexes();
+	}
+
+	xmr_output XMRWallet::compactOutput(const transfer_details &td) const {
+		xmr_output out;
+		out.block_height = td.m_block_height;
+		out.txid = td.m_txid;
+		out.tx_pub_key = get_tx_pub_key_from_received_outs(td);
+		out.internal_output_index = td.m_internal_output_index;
+		out.global_output_index = td.m_global_output_index;
+		out.key = td.get_public_key();
+		out.unlock_time = td.m_unlock_time;
+		out.mask = td.m_mask;
+		out.amount = td.m_amount;
+		out.rct = td.m_rct;
+		out.spent = td.m_spent;
+		out.spent_height = td.m_spent_height;
+		out.key_image = td.m_key_image;
+		out.key_image_known = td.m_key_image_known;
+		return out;
+	}
+
+	wallet2::transfer_details XMRWallet::expandOutput(const xmr_output &out) {
+		if (out.internal_output_index > XMR_MAX_OUTPUT_INDEX) {
+			throw std::logic_error("Output index out of range: " + std::to_string(out.internal_output_index));
+		}
+
+		transfer_details td;
+		td.m_block_height = out.block_height;
+		td.m_txid = out.txid;
+		td.m_internal_output_index = out.internal_output_index;
+		td.m_global_output_index = out.global_output_index;
+		td.m_mask = out.mask;
+		td.m_amount = out.amount;
+		td.m_rct = out.rct;
+		td.m_spent = out.spent;
+		td.m_spent_height = out.spent_height;
+		td.m_key_image = out.key_image;
+		td.m_key_image_known = out.key_image_known;
+		td.m_pk_index = 0;
+
+		// minimal tx prefix: unlock time, tx public key and our output at its original position,
+		// enough for get_public_key(), get_tx_pub_key_from_received_outs() and unlock checks.
+		// vout entries before ours are default constructed placeholders (not txout_to_key), and
+		// vin is empty, so the prefix hash is not the tx's: nothing may rely on other outputs or inputs
+		std::shared_ptr<cryptonote::transaction_prefix> tx = std::make_shared<cryptonote::transaction_prefix>();
+		tx->unlock_time = out.unlock_time;
+		add_tx_pub_key_to_extra(tx->extra, out.tx_pub_key);
+		tx->vout.resize(out.internal_output_index + 1);
+		tx->vout.back().amount = out.rct ? 0 : out.amount;
+		tx->vout.back().target = txout_to_key(out.key);
+		td.set_tx(tx);
+		return td;
+	}
+
+	std::string XMRWallet::convertBlob(std::string &data) {
+		uint32_t type = dataType(data);
+
+		try {
+			if (type == XMR_DATA_TX_UNSIGNED_OPTIMIZED) {
+				xmr_from_view arch;
+				loadBlobString(type, arch, data);
+				for (const transfer_details &td: arch.transfers) {
+					arch.outputs.push_back(compactOutput(td));
+				}
+				arch.transfers.clear();
+				data = saveBlobString(XMR_DATA_TX_UNSIGNED_OPTIMIZED, arch);
+			} else if (type == XMR_DATA_OUTPUTS) {
+				std::vector<tools::wallet2::transfer_details> transfers;
+				loadBlobString(type, transfers, data);
+				xmr_outputs outs;
+				for (const transfer_details &td: transfers) {
+					outs.outputs.push_back(compactOutput(td));
+				}
+				data = saveBlobString(XMR_DATA_OUTPUTS_COMPACT, outs);
+			} else if (type == XMR_DATA_OUTPUTS_COMPACT) {
+				// back to full transfers for signers taking XMR_DATA_OUTPUTS only, tx prefixes are expandOutput ones
+				xmr_outputs outs;
+				loadBlobString(type, outs, data);
+				std::vector<tools::wallet2::transfer_details> transfers;
+				for (const xmr_output &out: outs.outputs) {
+					transfers.push_back(expandOutput(out));
+				}
+				data = saveBlobString(XMR_DATA_OUTPUTS, transfers);
+			} else if (type == XMR_DATA_OUTPUTS_DELTA) {
+				xmr_outputs_delta delta;
+				loadBlobString(type, delta, data);
+				for (const transfer_details &td: delta.transfers) {
+					delta.outputs.push_back(compactOutput(td));
+				}
+				delta.transfers.clear();
+				data = saveBlobString(XMR_DATA_OUTPUTS_DELTA, delta);
+			} else {
+				return "Nothing to convert in data type " + std::to_string(type);
+			}
+			return "";
+
+		} catch (const std::exception &e) {
+			return std::string("Failed to convert blob: ") + e.what();
+		} catch (...) {
+			return "Failed to convert blob";
+		}
+	}
+
 	std::string XMRWallet::address() {
 		return m_account.get_public_address_str(testnet());
 	}
@@ -787,7 +1407,7 @@ namespace tools {
 		try {
 			tools::wallet2::refresh();
 			rescan_spent();
-			store();
+			store_async();
 		} catch (...) {
 			return false;
 		}
@@ -818,33 +1438,89 @@ namespace tools {
 		}
 	}
 
-	std::string XMRWallet::refresh(bool &refreshed) {
-		try {
-			uint64_t current = get_blockchain_current_height();
+	std::string XMRWallet::chainTip(XMRChainTip &tip) {
+		if (XMRTipWatcher::get(m_daemon_address, tip)) {
+			return "";
+		}
 
-			std::string error;
-			uint64_t daemon = get_daemon_blockchain_height(error);
+		epee::json_rpc::request<cryptonote::COMMAND_RPC_GET_LAST_BLOCK_HEADER::request> req_t = AUTO_VAL_INIT(req_t);
+		epee::json_rpc::response<cryptonote::COMMAND_RPC_GET_LAST_BLOCK_HEADER::response, std::string> resp_t = AUTO_VAL_INIT(resp_t);
+		req_t.jsonrpc = "2.0";
+		req_t.id = epee::serialization::storage_entry(0);
+		req_t.method = "getlastblockheader";
 
+		cryptonote::COMMAND_RPC_GET_TRANSACTION_POOL_HASHES::request req;
+		cryptonote::COMMAND_RPC_GET_TRANSACTION_POOL_HASHES::response res;
+
+		m_daemon_rpc_mutex.lock();
+		bool r = epee::net_utils::invoke_http_json("/json_rpc", req_t, resp_t, m_http_client, rpc_timeout);
+		if (r) {
+			r = epee::net_utils::invoke_http_json("/get_transaction_pool_hashes.bin", req, res, m_http_client, rpc_timeout);
+		}
+		m_daemon_rpc_mutex.unlock();
+
+		if (!r) {
+			return "possibly lost connection to daemon";
+		}
+		if (resp_t.result.status != CORE_RPC_STATUS_OK) {
+			return resp_t.result.status;
+		}
+		if (res.status != CORE_RPC_STATUS_OK) {
+			return res.status;
+		}
+		if (!epee::string_tools::hex_to_pod(resp_t.result.block_header.hash, tip.top)) {
+			return "Invalid top block hash from daemon";
+		}
+
+		tip.height = resp_t.result.block_header.height + 1;
+		tip.pool_size = res.tx_hashes.size();
+		tip.pool_digest = null_hash;
+		if (!res.tx_hashes.empty()) {
+			// daemon doesn't guarantee pool order
+			std::sort(res.tx_hashes.begin(), res.tx_hashes.end(), [](const crypto::hash &a, const crypto::hash &b) {
+				return memcmp(a.data, b.data, sizeof(a.data)) < 0;
+			});
+			crypto::cn_fast_hash(res.tx_hashes.data(), res.tx_hashes.size() * sizeof(crypto::hash), tip.pool_digest);
+		}
+
+		XMRTipWatcher::put(m_daemon_address, tip);
+		return "";
+	}
+
+	void XMRWallet::refreshStats(uint64_t &refreshes, uint64_t &noop) {
+		refreshes = m_refreshes;
+		noop = m_noop_refreshes;
+	}
+
+	std::string XMRWallet::refresh(bool &refreshed) {
+		try {
 			refreshed = false;
 
-			if (error.empty()) {
-				// if (daemon > current) {
-					// LOG_ERROR("XMRWallet::refresh current " << current << " daemon " << daemon);
-					uint64_t pulled = 0;
-					tools::wallet2::refresh(0, pulled);
-					// tools::wallet2::refresh(daemon, pulled);
-					rescan_spent();
-					refreshed = true;
-					return "";
-				// } else {
-				// 	// LOG_ERROR("XMRWallet::refresh won't refresh");
-				// 	return "";
-				// }
-			} else {
-				// LOG_ERROR("XMRWallet::refresh error: " << error);
+			XMRChainTip tip;
+			std::string error = chainTip(tip);
+			if (!error.empty()) {
 				return error;
 			}
+
+			m_refreshes++;
+
+			// neither chain nor pool moved since last full refresh: nothing to pull, rescan or update
+			if (m_tip_known && tip == m_tip && m_blockchain.size() == tip.height && m_blockchain.back() == tip.top) {
+				m_noop_refreshes++;
+				LOG_PRINT_L2("XMRWallet::refresh no-op at " << tip.height << ", " << m_noop_refreshes << " out of " << m_refreshes);
+				return "";
+			}
+
+			uint64_t pulled = 0;
+			tools::wallet2::refresh(0, pulled);
+			rescan_spent();
+
+			m_tip = tip;
+			m_tip_known = true;
+			refreshed = true;
+			return "";
 		} catch (...) {
+			m_tip_known = false;
 			return "Exception raised when refreshing";
 		}
 	}
@@ -871,7 +1547,11 @@ namespace tools {
 			const uint64_t bc_height = get_blockchain_current_height();
 
 			std::list<std::pair<crypto::hash, tools::wallet2::payment_details>> payments;
-			get_payments(payments, min_height, max_height);
+			if (txid_str.empty()) {
+				get_payments(payments, min_height, max_height);
+			} else {
+				get_payments_by_txid(txid, payments);
+			}
 
 			// std::cout << "&&&&&&&&&&&&& payments " << payments.size() << ", have " << txs.size() << "\n";
 		
@@ -918,7 +1598,11 @@ namespace tools {
 			try {
 				
 				std::list<std::pair<crypto::hash, tools::wallet2::payment_details>> payments;
-				get_unconfirmed_payments(payments);
+				if (txid_str.empty()) {
+					get_unconfirmed_payments(payments);
+				} else {
+					get_unconfirmed_payments_by_txid(txid, payments);
+				}
 				
 				// std::cout << "&&&&&&&&&&&&& unconfirmed " << payments.size() << ", have " << txs.size() << "\n";
 
@@ -964,7 +1648,11 @@ namespace tools {
 		if (out) {
 			// successfully processed
 			std::list<std::pair<crypto::hash, tools::wallet2::confirmed_transfer_details>> payments;
-			get_payments_out(payments, min_height, max_height);
+			if (txid_str.empty()) {
+				get_payments_out(payments, min_height, max_height);
+			} else {
+				get_payments_out_by_txid(txid, payments);
+			}
 			
 			for (std::list<std::pair<crypto::hash, tools::wallet2::confirmed_transfer_details>>::const_iterator i = payments.begin(); i != payments.end(); ++i) {
 				const tools::wallet2::confirmed_transfer_details &pd = i->second;
@@ -1008,7 +1696,11 @@ namespace tools {
 
 			// not yet sent or failed
 			std::list<std::pair<crypto::hash, tools::wallet2::unconfirmed_transfer_details>> upayments;
-			get_unconfirmed_payments_out(upayments);
+			if (txid_str.empty()) {
+				get_unconfirmed_payments_out(upayments);
+			} else {
+				get_unconfirmed_payments_out_by_txid(txid, upayments);
+			}
 		
 			for (std::list<std::pair<crypto::hash, tools::wallet2::unconfirmed_transfer_details>>::const_iterator i = upayments.begin(); i != upayments.end(); ++i) {
 				
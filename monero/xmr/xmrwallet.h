@@ -2,6 +2,9 @@
 
 #include "wallet/wallet2.h"
 #include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/copy.hpp>
 #include <boost/serialization/map.hpp>
@@ -9,6 +12,12 @@
 #include <boost/serialization/vector.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
+#include <boost/thread/mutex.hpp>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <unordered_set>
 #include "string_coding.h"
 
 struct XMRKeys {
@@ -53,6 +62,18 @@ struct XMRTxInfo {
 	std::vector<XMRDest> destinations;
 };
 
+struct XMRChainTip {
+	uint64_t height;
+	crypto::hash top;
+	uint64_t pool_size;
+	crypto::hash pool_digest;
+
+	bool operator==(const XMRChainTip &other) const {
+		return height == other.height && top == other.top && pool_size == other.pool_size && pool_digest == other.pool_digest;
+	}
+	bool operator!=(const XMRChainTip &other) const { return !(*this == other); }
+};
+
 #define XMR_PREFIX 						"XMR"
 #define XMR_DATA_TX_UNSIGNED 			1
 #define XMR_DATA_TX_UNSIGNED_OPTIMIZED 	2
@@ -60,17 +81,89 @@ struct XMRTxInfo {
 #define XMR_DATA_TX_SIGNED_OPTIMIZED    4
 #define XMR_DATA_OUTPUTS 				5
 #define XMR_DATA_KEY_IMAGES				6
+#define XMR_DATA_OUTPUTS_DELTA			7
+#define XMR_DATA_KEY_IMAGES_DELTA		8
+#define XMR_DATA_OUTPUTS_COMPACT		9
+
+// compact outputs are expanded into a tx prefix with this many outputs at most
+#define XMR_MAX_OUTPUT_INDEX			65535
+
+#define XMR_BLOB_VERSION				1
+#define XMR_BLOB_HEADER_SIZE			12
+#define XMR_BLOB_MAGIC_BASE64			"WE1S"	// base64 of XMR_PREFIX
+
+#define XMR_CODEC_NONE					0
+#define XMR_CODEC_ZLIB_FAST				1
+#define XMR_CODEC_GZIP_BEST				2		// legacy blobs codec
+#define XMR_CODEC_DEFAULT				XMR_CODEC_ZLIB_FAST
+
+#define XMR_BASE64_CHUNK				4096	// base64 characters processed per block by stream filters, multiple of 4
+
+// payouts planned into transactions together at most, payouts of a failed group are retried one by one
+#define XMR_PAYOUTS_PER_GROUP			16
+
+// signer sessions kept hot per process, and key images remembered per session
+#define XMR_SIGNER_SESSIONS				16
+#define XMR_SIGNER_KEY_IMAGES			500000
+
+// how long (ms) a daemon tip fetched by one wallet is reused by other wallets of the same daemon
+#define XMR_TIP_TTL_MS					1000
 
 namespace tools {
+	// what a signer needs to know about an output instead of the whole transfer_details with its tx prefix
+	struct xmr_output {
+		uint64_t block_height;
+		crypto::hash txid;
+		crypto::public_key tx_pub_key;
+		uint64_t internal_output_index;
+		uint64_t global_output_index;
+		crypto::public_key key;
+		uint64_t unlock_time;
+		rct::key mask;
+		uint64_t amount;
+		bool rct;
+		bool spent;
+		uint64_t spent_height;
+		crypto::key_image key_image;
+		bool key_image_known;
+
+		BEGIN_SERIALIZE_OBJECT()
+		FIELD(block_height)
+		FIELD(txid)
+		FIELD(tx_pub_key)
+		VARINT_FIELD(internal_output_index)
+		VARINT_FIELD(global_output_index)
+		FIELD(key)
+		VARINT_FIELD(unlock_time)
+		FIELD(mask)
+		VARINT_FIELD(amount)
+		FIELD(rct)
+		FIELD(spent)
+		VARINT_FIELD(spent_height)
+		FIELD(key_image)
+		FIELD(key_image_known)
+		END_SERIALIZE()
+	};
+
+	// transfers is only filled by legacy (version 0) blobs, current ones carry compact outputs
 	struct xmr_from_view {
 		std::vector<wallet2::tx_construction_data> txs;
 		std::vector<size_t> idxs;
 		std::vector<wallet2::transfer_details> transfers;
+		std::vector<xmr_output> outputs;
 
 		BEGIN_SERIALIZE_OBJECT()
 		FIELD(txs)
 		FIELD(idxs)
-		FIELD(transfers)
+		FIELD(outputs)
+		END_SERIALIZE()
+	};
+
+	struct xmr_outputs {
+		std::vector<xmr_output> outputs;
+
+		BEGIN_SERIALIZE_OBJECT()
+		FIELD(outputs)
 		END_SERIALIZE()
 	};
 
@@ -96,6 +189,75 @@ namespace tools {
 		END_SERIALIZE()
 	};
 
+	// outputs the view wallet got after the watermark (start), anchor is the public key of output start - 1
+	struct xmr_outputs_delta {
+		uint64_t start;
+		crypto::public_key anchor;
+		std::vector<wallet2::transfer_details> transfers;
+		std::vector<xmr_output> outputs;
+
+		BEGIN_SERIALIZE_OBJECT()
+		FIELD(start)
+		FIELD(anchor)
+		FIELD(outputs)
+		END_SERIALIZE()
+	};
+
+	// signed key images for outputs start, start + 1, ... of a delta
+	struct xmr_kis_delta {
+		uint64_t start;
+		std::vector<crypto::key_image> key_images;
+		std::vector<crypto::signature> signatures;
+
+		BEGIN_SERIALIZE_OBJECT()
+		FIELD(start)
+		FIELD(key_images)
+		FIELD(signatures)
+		END_SERIALIZE()
+	};
+
+	/**
+	 * Daemon tip (height, top block hash & pool digest) cache shared by all wallets of a process,
+	 * so that a polling round across many wallets costs a single pair of RPC calls per daemon.
+	 */
+	class XMRTipWatcher {
+		public:
+			static bool get(const std::string &daemon, XMRChainTip &tip);
+			static void put(const std::string &daemon, const XMRChainTip &tip);
+
+		private:
+			static boost::mutex mutex;
+			static std::map<std::string, std::pair<std::chrono::steady_clock::time_point, XMRChainTip>> tips;
+	};
+
+	/**
+	 * Derived keys of a signing wallet and key images it already computed (by output public key),
+	 * shared by all wallets opened with the same spend key. Secret keys are wiped when the session goes away.
+	 * Outputs imported last are kept too, so that a signer reopened for every request takes output deltas.
+	 */
+	struct XMRSignerSession {
+		boost::mutex mutex;
+		cryptonote::account_keys keys;
+		std::unordered_map<crypto::public_key, crypto::key_image> key_images;
+		std::vector<wallet2::transfer_details> transfers;
+		std::chrono::steady_clock::time_point used;
+
+		~XMRSignerSession();
+	};
+
+	class XMRSignerCache {
+		public:
+			static std::shared_ptr<XMRSignerSession> get(const crypto::secret_key &spendkey, bool testnet);
+			static std::shared_ptr<XMRSignerSession> put(const crypto::secret_key &spendkey, bool testnet, const cryptonote::account_keys &keys);
+			static void wipe();
+
+		private:
+			static crypto::hash id(const crypto::secret_key &spendkey, bool testnet);
+
+			static boost::mutex mutex;
+			static std::map<crypto::hash, std::shared_ptr<XMRSignerSession>> sessions;
+	};
+
 	class XMRWallet : public wallet2 {
 		public:
 			XMRWallet(bool testnet = false);
@@ -111,10 +273,13 @@ namespace tools {
 
 			bool openPaperWallet(const std::string &spendKey);
 			int openViewWallet(const std::string &address_string, const std::string &view_key_string);
+			// (wallet, address, view key) each on a worker thread, codes of openViewWallet in the same order
+			static std::vector<int> openViewWallets(const std::vector<std::tuple<XMRWallet*, std::string, std::string>> &wallets);
 			int openViewWalletOffline(const std::string &address_string, const std::string &view_key_string);
 			std::string createIntegratedAddress(const std::string &payment_id);
 			std::string createUnsignedTransaction(std::string &data, XMRTx& tx, bool optimized);
-			std::string signTransaction(std::string &data);
+			std::string createUnsignedTransactions(std::string &data, std::vector<XMRTx> &txs, bool optimized, std::vector<std::string> &errors);
+			std::string signTransaction(std::string &data, std::vector<std::string> &errors);
 			std::string submitSignedTransaction(std::string &data, XMRTxInfo &info);
 			std::string address();
 			void balances(uint64_t &balance, uint64_t &unlocked);
@@ -122,6 +287,8 @@ namespace tools {
 			bool refresh_and_store();
 			bool close();
 			std::string refresh(bool &refreshed);
+			std::string chainTip(XMRChainTip &tip);
+			void refreshStats(uint64_t &refreshes, uint64_t &noop);
 			
 			std::string transactions(std::string payment_id_str, bool in, bool out, std::vector<XMRTxInfo> &txs);
 
@@ -132,13 +299,43 @@ namespace tools {
 			void wallet_idle_thread();
 
 			uint32_t dataType(std::string &data);
-			std::string exportOutputs(std::string &outputs);
-			std::string importOutputs(std::string &data);
-			std::string exportKeyImages(std::string &images);
+			std::string exportOutputs(std::string &outputs, bool incremental = false);
+			std::string importOutputs(std::string &data, uint64_t &start);
+			std::string exportKeyImages(std::string &images, uint64_t start = 0);
 			std::string importKeyImages(std::string &data, uint64_t &spent, uint64_t &unspent);
+			std::string convertBlob(std::string &data);
+			// tests only: count outputs of amount paying this wallet in fabricated txs, one per new block
+			void fabricateOutputs(size_t count, uint64_t amount);
+
+			xmr_output compactOutput(const transfer_details &td) const;
+			// rebuilds only the parts of transfer_details signing needs, other outputs of its tx are placeholders
+			static transfer_details expandOutput(const xmr_output &out);
 
 			void print_pid(std::string msg, std::vector<uint8_t> &extra);
 			crypto::hash8 get_short_pid(const pending_tx &ptx);
+
+		private:
+			// wallet2::clear, plus the tip seen by the last refresh and the key image sync watermark
+			bool clear();
+			std::string parseTransaction(XMRTx &tx, std::vector<cryptonote::tx_destination_entry> &dsts, std::vector<uint8_t> &extra, std::string &payment_id);
+			std::string buildTransactions(XMRTx &tx, std::vector<cryptonote::tx_destination_entry> &dsts, std::vector<uint8_t> &extra, const std::unordered_set<size_t> &excluded, std::vector<wallet2::pending_tx> &ptx);
+			std::string serializeUnsigned(std::vector<wallet2::pending_tx> &ptx, bool optimized, std::string &data);
+			void rememberKeyImages(const std::vector<wallet2::transfer_details> &transfers, size_t start = 0);
+			void keyImagesRound(size_t begin, size_t end, std::vector<wallet2::transfer_details> &transfers, std::string &error);
+			void signTransactionRound(size_t n, const wallet2::tx_construction_data &sd, wallet2::pending_tx &ptx, std::string &error);
+
+			// tip seen by the last full refresh, refresh() is a no-op while daemon reports the same one
+			XMRChainTip m_tip;
+			bool m_tip_known;
+			uint64_t m_refreshes;
+			uint64_t m_noop_refreshes;
+
+			// outputs [0, m_synced_outputs) have key images imported from the signer, m_synced_anchor is the public key of the last one
+			uint64_t m_synced_outputs;
+			crypto::public_key m_synced_anchor;
+
+			// signer session of the paper wallet opened last, if any
+			std::shared_ptr<XMRSignerSession> m_session;
 	};
 
 	template <typename T> inline std::string saveGZBase64String(uint32_t type, const T & o) {
@@ -170,62 +367,317 @@ namespace tools {
 		// return std::to_string(type) + "|" + epee::string_encoding::base64_encode(data.str());
 	}
 
-	template <typename T> inline void loadGZBase64String(uint32_t &type, T & o, const std::string& s) {
-		// size_t pos = s.find("|");
-		// type = std::stoi(s.substr(0, pos));
-		std::string data = epee::string_encoding::base64_decode(s);
+	/**
+	 * Streaming base64: encoder is an output filter, decoder an input filter, both work on
+	 * XMR_BASE64_CHUNK sized blocks with table lookups and keep at most one partial group between calls.
+	 */
+	class base64_encoder : public boost::iostreams::multichar_output_filter {
+		public:
+			base64_encoder() : m_tail_size(0) {}
+
+			template <typename Sink> std::streamsize write(Sink &snk, const char *s, std::streamsize n) {
+				char out[XMR_BASE64_CHUNK];
+				size_t o = 0;
+				std::streamsize i = 0;
+
+				while (m_tail_size > 0 && m_tail_size < 3 && i < n) {
+					m_tail[m_tail_size++] = s[i++];
+				}
+				if (m_tail_size == 3) {
+					encode(m_tail, out);
+					o += 4;
+					m_tail_size = 0;
+				}
+
+				for (; i + 3 <= n; i += 3) {
+					encode(s + i, out + o);
+					o += 4;
+					if (o == sizeof(out)) {
+						boost::iostreams::write(snk, out, o);
+						o = 0;
+					}
+				}
+
+				while (i < n) {
+					m_tail[m_tail_size++] = s[i++];
+				}
+				if (o > 0) {
+					boost::iostreams::write(snk, out, o);
+				}
+				return n;
+			}
+
+			template <typename Sink> void close(Sink &snk) {
+				if (m_tail_size > 0) {
+					char in[3] = {0, 0, 0}, out[4];
+					memcpy(in, m_tail, m_tail_size);
+					encode(in, out);
+					for (size_t k = m_tail_size + 1; k < 4; k++) {
+						out[k] = '=';
+					}
+					boost::iostreams::write(snk, out, 4);
+					m_tail_size = 0;
+				}
+			}
+
+		private:
+			static void encode(const char *in, char *out) {
+				static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+				const uint8_t *b = (const uint8_t *)in;
+				uint32_t v = (uint32_t)b[0] << 16 | (uint32_t)b[1] << 8 | b[2];
+				out[0] = alphabet[(v >> 18) & 0x3f];
+				out[1] = alphabet[(v >> 12) & 0x3f];
+				out[2] = alphabet[(v >> 6) & 0x3f];
+				out[3] = alphabet[v & 0x3f];
+			}
+
+			char m_tail[3];
+			size_t m_tail_size;
+	};
 
-		std::stringstream compressed(data);
-		std::stringstream decompressed;
+	class base64_decoder : public boost::iostreams::multichar_input_filter {
+		public:
+			base64_decoder() : m_carry_size(0), m_out_pos(0) {}
+
+			template <typename Source> std::streamsize read(Source &src, char *s, std::streamsize n) {
+				std::streamsize total = 0;
+				while (total < n) {
+					if (m_out_pos == m_out.size() && !refill(src)) {
+						break;
+					}
+					size_t k = std::min<size_t>(n - total, m_out.size() - m_out_pos);
+					memcpy(s + total, m_out.data() + m_out_pos, k);
+					total += k;
+					m_out_pos += k;
+				}
+				return total == 0 ? -1 : total;
+			}
+
+		private:
+			template <typename Source> bool refill(Source &src) {
+				char in[XMR_BASE64_CHUNK];
+				memcpy(in, m_carry, m_carry_size);
+				std::streamsize r = boost::iostreams::read(src, in + m_carry_size, sizeof(in) - m_carry_size);
+				if (r <= 0) {
+					if (m_carry_size > 0) {
+						throw std::logic_error("Truncated base64 data");
+					}
+					return false;
+				}
+
+				size_t avail = m_carry_size + r, full = avail / 4 * 4;
+				m_out.resize(full / 4 * 3);
+				size_t o = 0;
+				for (size_t k = 0; k < full; k += 4) {
+					int a = value(in[k]), b = value(in[k + 1]);
+					if (in[k + 2] == '=') {
+						m_out[o++] = (char)(a << 2 | b >> 4);
+						break;
+					}
+					int c = value(in[k + 2]);
+					if (in[k + 3] == '=') {
+						m_out[o++] = (char)(a << 2 | b >> 4);
+						m_out[o++] = (char)((b & 0xf) << 4 | c >> 2);
+						break;
+					}
+					int d = value(in[k + 3]);
+					m_out[o++] = (char)(a << 2 | b >> 4);
+					m_out[o++] = (char)((b & 0xf) << 4 | c >> 2);
+					m_out[o++] = (char)((c & 0x3) << 6 | d);
+				}
+				m_out.resize(o);
+				m_out_pos = 0;
+
+				m_carry_size = avail - full;
+				memcpy(m_carry, in + full, m_carry_size);
+				return true;
+			}
+
+			static int value(char ch) {
+				static const struct table {
+					int8_t v[256];
+					table() {
+						static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+						memset(v, -1, sizeof(v));
+						for (int i = 0; i < 64; i++) v[(uint8_t)alphabet[i]] = i;
+					}
+				} t;
+				int x = t.v[(uint8_t)ch];
+				if (x < 0) {
+					throw std::logic_error("Invalid base64 character");
+				}
+				return x;
+			}
+
+			char m_carry[3];
+			size_t m_carry_size;
+			std::string m_out;
+			size_t m_out_pos;
+	};
 
-		boost::iostreams::filtering_streambuf<boost::iostreams::input> out;
-		out.push(boost::iostreams::gzip_decompressor());
-		out.push(compressed);
-		boost::iostreams::copy(out, decompressed);
+	// legacy blobs: base64 of gzip of text type followed by the archive, decoded as one streaming chain
+	template <typename T> inline void loadGZBase64String(uint32_t &type, T & o, const char *s, size_t size) {
+		boost::iostreams::filtering_istream in;
+		in.push(boost::iostreams::gzip_decompressor());
+		in.push(base64_decoder());
+		in.push(boost::iostreams::array_source(s, size));
 
-		decompressed >> type;
-		boost::archive::portable_binary_iarchive ar(decompressed);
+		in >> type;
+		boost::archive::portable_binary_iarchive ar(in);
 		ar >> o;
+	}
 
-		// type = std::stoi(s.substr(0, 1));
-		// std::string data = s.substr(1);
+	template <typename T> inline void loadGZBase64String(uint32_t &type, T & o, const std::string& s) {
+		loadGZBase64String(type, o, s.data(), s.size());
+	}
 
-		// std::istringstream compressed(epee::string_encoding::base64_decode(data));
-		// std::istringstream decompressed;
+	inline void loadGZBase64StringType(uint32_t &type, const std::string& s) {
+		// only the first decompressed block is ever produced
+		boost::iostreams::filtering_istream in;
+		in.push(boost::iostreams::gzip_decompressor());
+		in.push(base64_decoder());
+		in.push(boost::iostreams::array_source(s.data(), s.size()));
 
-		// boost::iostreams::filtering_streambuf<boost::iostreams::input> in;
-		// in.push(boost::iostreams::zlib_decompressor());
-		// in.push(compressed);
-		// boost::iostreams::copy(in, decompressed);
+		in >> type;
+	}
 
-		// boost::archive::portable_binary_iarchive ia(decompressed);
-		// ia >> o;
+	/**
+	 * Framed blobs: base64 of a plain XMR_BLOB_HEADER_SIZE header followed by the (optionally compressed) archive.
+	 * Header is magic "XMR", version byte, type (2 bytes LE), codec (2 bytes LE), payload length (4 bytes LE),
+	 * so type is known from the first 16 base64 characters. Blobs without the magic are legacy gzip ones.
+	 *
+	 * Both directions are a single streaming chain (archive, codec, base64) over the caller's buffer,
+	 * so no intermediate copy of the serialized or compressed payload is ever held.
+	 */
+	template <typename Chain> inline void pushBlobCodec(Chain &chain, uint16_t codec, bool compress) {
+		if (codec == XMR_CODEC_ZLIB_FAST) {
+			if (compress) {
+				chain.push(boost::iostreams::zlib_compressor(boost::iostreams::zlib_params(boost::iostreams::zlib::best_speed)));
+			} else {
+				chain.push(boost::iostreams::zlib_decompressor());
+			}
+		} else if (codec == XMR_CODEC_GZIP_BEST) {
+			if (compress) {
+				chain.push(boost::iostreams::gzip_compressor(boost::iostreams::gzip_params(boost::iostreams::gzip::best_compression)));
+			} else {
+				chain.push(boost::iostreams::gzip_decompressor());
+			}
+		} else if (codec != XMR_CODEC_NONE) {
+			throw std::logic_error("Unknown blob codec " + std::to_string(codec));
+		}
+	}
 
-		// return decompressed;
+	inline bool isBlobString(const char *s, size_t size) {
+		return size >= XMR_BLOB_HEADER_SIZE / 3 * 4 && memcmp(s, XMR_BLOB_MAGIC_BASE64, strlen(XMR_BLOB_MAGIC_BASE64)) == 0;
+	}
 
+	inline void parseBlobHeader(const std::string &header, uint32_t &type, uint16_t &codec, uint32_t &length) {
+		if (header.size() < XMR_BLOB_HEADER_SIZE || header.compare(0, 3, XMR_PREFIX) != 0) {
+			throw std::logic_error("Bad blob header");
+		}
+		if ((uint8_t)header[3] != XMR_BLOB_VERSION) {
+			throw std::logic_error("Unsupported blob version " + std::to_string((uint8_t)header[3]));
+		}
+
+		const uint8_t *h = (const uint8_t *)header.data();
+		type = h[4] | h[5] << 8;
+		codec = h[6] | h[7] << 8;
+		length = (uint32_t)h[8] | (uint32_t)h[9] << 8 | (uint32_t)h[10] << 16 | (uint32_t)h[11] << 24;
+	}
 
-		// iss >> type;
-		// bio::filtering_stream<bio::input> f;
-		// // f.push(bio::gzip_decompressor());
-		// f.push(iss);
-		// bar::binary_iarchive ia(f);
-		// ia >> o;
+	template <typename T> inline void saveBlobString(std::string &blob, uint32_t type, const T & o, uint16_t codec = XMR_CODEC_DEFAULT) {
+		// header goes first but needs payload length, so its 16 characters are reserved and written last
+		const size_t header_chars = XMR_BLOB_HEADER_SIZE / 3 * 4;
+		blob.assign(header_chars, 'A');
+
+		{
+			boost::iostreams::filtering_ostream out;
+			pushBlobCodec(out, codec, true);
+			out.push(base64_encoder());
+			out.push(boost::iostreams::back_inserter(blob));
+			{
+				boost::archive::portable_binary_oarchive arch(out);
+				arch << o;
+			}
+			out.reset();
+		}
+
+		size_t chars = blob.size() - header_chars, padding = 0;
+		while (padding < 2 && padding < chars && blob[blob.size() - 1 - padding] == '=') {
+			padding++;
+		}
+		uint64_t length = chars / 4 * 3 - padding;
+		if (length > 0xffffffff) {
+			throw std::logic_error("Blob payload too big");
+		}
+
+		std::string header(XMR_PREFIX);
+		header.push_back((char)XMR_BLOB_VERSION);
+		header.push_back((char)(type & 0xff));
+		header.push_back((char)((type >> 8) & 0xff));
+		header.push_back((char)(codec & 0xff));
+		header.push_back((char)((codec >> 8) & 0xff));
+		for (int i = 0; i < 4; i++) {
+			header.push_back((char)((length >> (8 * i)) & 0xff));
+		}
+		blob.replace(0, header_chars, epee::string_encoding::base64_encode(header));
 	}
 
-	inline void loadGZBase64StringType(uint32_t &type, const std::string& s) {
-		std::string data = epee::string_encoding::base64_decode(s);
-		std::stringstream compressed(data);
-		std::stringstream decompressed;
+	template <typename T> inline std::string saveBlobString(uint32_t type, const T & o, uint16_t codec = XMR_CODEC_DEFAULT) {
+		std::string blob;
+		saveBlobString(blob, type, o, codec);
+		return blob;
+	}
 
-		boost::iostreams::filtering_streambuf<boost::iostreams::input> out;
-		out.push(boost::iostreams::gzip_decompressor());
-		out.push(compressed);
-		boost::iostreams::copy(out, decompressed);
+	template <typename T> inline void loadBlobString(uint32_t &type, T & o, const char *s, size_t size) {
+		if (!isBlobString(s, size)) {
+			loadGZBase64String(type, o, s, size);
+			return;
+		}
+
+		const size_t header_chars = XMR_BLOB_HEADER_SIZE / 3 * 4;
+		uint16_t codec;
+		uint32_t length;
+		parseBlobHeader(epee::string_encoding::base64_decode(std::string(s, header_chars)), type, codec, length);
+
+		size_t chars = size - header_chars, padding = 0;
+		while (padding < 2 && padding < chars && s[size - 1 - padding] == '=') {
+			padding++;
+		}
+		if (chars % 4 != 0 || chars / 4 * 3 - padding != length) {
+			throw std::logic_error("Blob length mismatch");
+		}
+
+		boost::iostreams::filtering_istream in;
+		pushBlobCodec(in, codec, false);
+		in.push(base64_decoder());
+		in.push(boost::iostreams::array_source(s + header_chars, chars));
+		boost::archive::portable_binary_iarchive ar(in);
+		ar >> o;
+	}
+
+	template <typename T> inline void loadBlobString(uint32_t &type, T & o, const std::string& s) {
+		loadBlobString(type, o, s.data(), s.size());
+	}
 
-		decompressed >> type;
+	inline void loadBlobStringType(uint32_t &type, const std::string& s) {
+		if (!isBlobString(s.data(), s.size())) {
+			loadGZBase64StringType(type, s);
+			return;
+		}
+
+		// XMR_BLOB_HEADER_SIZE bytes are exactly 16 base64 characters
+		uint16_t codec;
+		uint32_t length;
+		parseBlobHeader(epee::string_encoding::base64_decode(s.substr(0, XMR_BLOB_HEADER_SIZE / 3 * 4)), type, codec, length);
 	}
 }
 
+BOOST_CLASS_VERSION(tools::xmr_output, 0)
+BOOST_CLASS_VERSION(tools::xmr_from_view, 1)
+BOOST_CLASS_VERSION(tools::xmr_outputs, 0)
+BOOST_CLASS_VERSION(tools::xmr_outputs_delta, 1)
+
 namespace boost
 {
   namespace serialization
@@ -240,12 +692,42 @@ namespace boost
     {
     }
 
+    template <class Archive>
+    inline void serialize(Archive &a, tools::xmr_output &x, const boost::serialization::version_type ver)
+    {
+      a & x.block_height;
+      a & x.txid;
+      a & x.tx_pub_key;
+      a & x.internal_output_index;
+      a & x.global_output_index;
+      a & x.key;
+      a & x.unlock_time;
+      a & x.mask;
+      a & x.amount;
+      a & x.rct;
+      a & x.spent;
+      a & x.spent_height;
+      a & x.key_image;
+      a & x.key_image_known;
+    }
+
     template <class Archive>
     inline void serialize(Archive &a, tools::xmr_from_view &x, const boost::serialization::version_type ver)
     {
       a & x.txs;
       a & x.idxs;
-      a & x.transfers;
+      if (ver < 1)
+      {
+        a & x.transfers;
+        return;
+      }
+      a & x.outputs;
+    }
+
+    template <class Archive>
+    inline void serialize(Archive &a, tools::xmr_outputs &x, const boost::serialization::version_type ver)
+    {
+      a & x.outputs;
     }
 
 
@@ -283,6 +765,27 @@ namespace boost
       a & x.idxs;
       a & x.key_images;
     }
+
+    template <class Archive>
+    inline void serialize(Archive &a, tools::xmr_outputs_delta &x, const boost::serialization::version_type ver)
+    {
+      a & x.start;
+      a & x.anchor;
+      if (ver < 1)
+      {
+        a & x.transfers;
+        return;
+      }
+      a & x.outputs;
+    }
+
+    template <class Archive>
+    inline void serialize(Archive &a, tools::xmr_kis_delta &x, const boost::serialization::version_type ver)
+    {
+      a & x.start;
+      a & x.key_images;
+      a & x.signatures;
+    }
   }
 }
 